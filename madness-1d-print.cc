@@ -3,11 +3,59 @@
 #include <cassert>
 #include <cmath> // pow
 #include "legion.h"
+#include "default_mapper.h"
 #include <vector>
+#include <algorithm> // sort
+#include <ctime> // clock_gettime
+#include <string>
+#include <map>
+#include <set>
+#include <cstring> // memcpy
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+#include <fcntl.h> // open
+#include <sys/mman.h> // mmap
+#include <sys/stat.h> // fstat
+#include <unistd.h> // close
+// The vector two-scale filter kernels are opt-in (USE_SIMD=1 in the Makefile builds them for the host), so the
+// default binary stays portable
+#if defined(MADNESS_SIMD) && defined(__AVX512F__)
+#define SIMD_AVX512
+#elif defined(MADNESS_SIMD) && defined(__AVX2__) && defined(__FMA__)
+#define SIMD_AVX2
+#endif
+#if defined(SIMD_AVX512) || defined(SIMD_AVX2)
+#include <immintrin.h> // two-scale filter kernels
+#endif
 
 using namespace Legion;
 using namespace std;
 
+// Operations the tree op engine runs, each a compile-time functor (see TreeOp)
+enum TreeOpIDs {
+    NORM_OP,
+    MAX_ABS_OP,
+    INNER_PRODUCT_OP,
+    GAXPY_OP,
+    MULTIPLY_OP,
+    SCALE_OP,
+    ABS_OP,
+    GAXPY_NORM_OP,
+    GAXPY_COMPRESS_OP,
+    GAXPY_COMPRESS_NORM_OP,
+    NUM_TREE_OPS,
+};
+
+// Every op is registered as three tasks: the recursive walk, the batched leaf and the dense whole-region pass
+enum TreeOpStage {
+    TREE_OP_WALK,
+    TREE_OP_LEAF,
+    TREE_OP_DENSE,
+    NUM_TREE_OP_STAGES,
+};
+
 enum TASK_IDs {
     TOP_LEVEL_TASK_ID,
     REFINE_TASK_ID,
@@ -20,19 +68,849 @@ enum TASK_IDs {
     DIFF_TASK_ID,
     DIFF_SET_TASK_ID,
     GET_COEF_UTIL_TASK_ID,
-    INNER_PRODUCT_TASK_ID,
-    PRODUCT_TASK_ID,
-    NORM_TASK_ID,
-    GAXPY_TASK_ID,
-    GAXPY_SET_TASK_ID,
     RECONSTRUCT_SET_TASK_ID,
     RECONSTRUCT_TASK_ID,
+    COMPRESS_SWEEP_TASK_ID,
+    RECONSTRUCT_SWEEP_TASK_ID,
+    REFINE_SWEEP_TASK_ID,
+    REFINE_COMPRESS_TASK_ID,
+    REFINE_COMPRESS_SWEEP_TASK_ID,
+    COMPRESS_PATH_TASK_ID,
+    PRINT_SWEEP_TASK_ID,
+    EVAL_TASK_ID,
+    EVAL_LEAF_TASK_ID,
+    INTEGRATE_TASK_ID,
+    PROJECT_TASK_ID,
+    INGEST_TASK_ID,
+    QUANTIZE_TASK_ID,
+    WAVELET_COMPRESS_TASK_ID,
+    WAVELET_RECONSTRUCT_TASK_ID,
+    WAVELET_GAXPY_TASK_ID,
+    WAVELET_INNER_PRODUCT_TASK_ID,
+    CALIBRATION_TASK_ID,
+    TREE_OP_TASK_ID, // first of the NUM_TREE_OPS * NUM_TREE_OP_STAGES ids of the tree op engine
+    NUM_TASK_IDS = TREE_OP_TASK_ID + NUM_TREE_OPS * NUM_TREE_OP_STAGES,
 };
 
+// In SOA_STORAGE coefficient j of a node lives in field FID_X + j, in AOS_STORAGE all of them live in FID_X
 enum FieldIDs {
     FID_X,
+    FID_INPUT = 100, // the entries of an attached input file, past the coefficient fields (see tree_ingest)
+    FID_QUANT,       // the quantized coefficients of a node, with -quant_rel_error (see tree_quantize)
+};
+
+// Compile-time coefficient types. Every task that touches coefficients is registered once per type,
+// under its base id shifted by NUM_TASK_IDS * type, so the int variants keep the ids above.
+enum CoefType {
+    INT_COEF,
+    FLOAT_COEF,
+    DOUBLE_COEF,
+    NUM_COEF_TYPES,
+};
+
+// accum_t is what reductions (norm, inner product) sum into, wide enough not to overflow on large trees
+template<typename T> struct CoefTraits;
+
+template<> struct CoefTraits<int> {
+    typedef long long accum_t;
+    static const CoefType type = INT_COEF;
+    static const char *name() { return "int"; }
+};
+
+template<> struct CoefTraits<float> {
+    typedef double accum_t;
+    static const CoefType type = FLOAT_COEF;
+    static const char *name() { return "float"; }
+};
+
+template<> struct CoefTraits<double> {
+    typedef double accum_t;
+    static const CoefType type = DOUBLE_COEF;
+    static const char *name() { return "double"; }
+};
+
+template<typename T>
+TaskID task_id(TASK_IDs base) {
+    return base + NUM_TASK_IDS * CoefTraits<T>::type;
+}
+
+// Value handed to both children when a coefficient is pushed one level down
+inline int half_coefficient(int value) { return ceil(value / float(2)); }
+inline float half_coefficient(float value) { return value / 2; }
+inline double half_coefficient(double value) { return value / 2; }
+
+// Upper bound on the multiwavelet order k, it sizes the coefficient vectors passed by value in futures and task arguments
+#define MAX_ORDER 16
+
+// Serial cutoff of the recursive walks: a subtree with at most sweep_levels levels below its root, or, when
+// the subtree costs of the tree are known, with at most sweep_nodes nodes, goes to a single leaf task (see
+// sweep_subtree). The -sweep_levels and -sweep_nodes flags fix them in main, on every process; otherwise
+// top_level_task calibrates them for this machine. Sweep task arguments describe up to MAX_SWEEP_LEVELS levels.
+#define MAX_SWEEP_LEVELS 16
+int sweep_levels = 6;
+size_t sweep_nodes = 0;
+bool sweep_cutoff_fixed = false;
+
+// Under control replication, refine and compress expand the first shard_levels levels of a tree in the
+// replicated top level task and launch the subtrees below them in one index launch, which
+// SubtreeShardingFunctor splits between the shards. Set by -shard_levels in main, on every process;
+// 0 keeps the single root task. Several shards run on one machine with a networked build (USE_GASNET=1),
+// e.g. mpirun -np 2 ./madness-1d-print -shard_levels 2.
+#define MAX_SHARD_LEVELS 8
+int shard_levels = 0;
+
+// With OpenMP processors (USE_OPENMP=1 and -ll:ocpu), CostMapper sends the leaf blocks of at least
+// omp_block_nodes nodes to the OMP_PROC variants of their tasks, which split the block over the threads of
+// the processor (-ll:othr). Smaller blocks stay on single CPUs. Set by -omp_block_nodes in main.
+size_t omp_block_nodes = 4096;
+
+// Task tracer. With -trace <file> in main, every task records one TraceEvent, without taking a lock, into
+// a ring buffer of the thread running it. The rings keep the last TRACE_RING_EVENTS events of each thread
+// and go to the file, in binary, when the runtime shuts down; -trace_report <file> reads them back.
+#define TRACE_RING_EVENTS (1 << 16)
+
+struct TraceEvent {
+    /* unique ids of the task and of the task that launched it, 0 for the top level task */
+    unsigned long long uid, parent_uid;
+    unsigned long long proc;
+    unsigned task_id;
+    /* node the task is at, -1 for tasks over a block of nodes */
+    int n, l;
+    long long start_ns, end_ns;
+};
+
+// Only the thread a ring belongs to writes it
+struct TraceRing {
+    std::atomic<unsigned long long> head; // events recorded so far
+    TraceEvent events[TRACE_RING_EVENTS];
+    TraceRing() : head(0) {}
+};
+
+const char *trace_path = NULL;
+vector<TraceRing *> trace_rings;
+std::mutex trace_rings_lock; // taken once per thread, when its ring is created
+thread_local TraceRing *trace_ring = NULL;
+
+inline long long trace_now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+// Records the task it is created in, from there to the end of the task
+class TaskTrace {
+public:
+    TaskTrace(const Task *task, int n = -1, int l = -1) : active(trace_path != NULL) {
+        if (!active)
+            return;
+        const Task *parent = task->get_parent_task();
+        event.uid = task->get_unique_id();
+        event.parent_uid = parent != NULL ? parent->get_unique_id() : 0;
+        event.proc = task->current_proc.id;
+        event.task_id = task->task_id;
+        event.n = n;
+        event.l = l;
+        event.start_ns = trace_now_ns();
+    }
+
+    ~TaskTrace() {
+        if (!active)
+            return;
+        event.end_ns = trace_now_ns();
+        if (trace_ring == NULL) {
+            trace_ring = new TraceRing();
+            std::lock_guard<std::mutex> guard(trace_rings_lock);
+            trace_rings.push_back(trace_ring);
+        }
+        unsigned long long head = trace_ring->head.load(std::memory_order_relaxed);
+        trace_ring->events[head % TRACE_RING_EVENTS] = event;
+        trace_ring->head.store(head + 1, std::memory_order_release);
+    }
+
+private:
+    bool active;
+    TraceEvent event;
+};
+
+// Writes what the rings hold, oldest event first, once the runtime has shut down
+void flush_trace() {
+    FILE *file = fopen(trace_path, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "Cannot write the trace to %s\n", trace_path);
+        return;
+    }
+    size_t written = 0;
+    unsigned long long dropped = 0;
+    for (size_t r = 0; r < trace_rings.size(); r++) {
+        TraceRing *ring = trace_rings[r];
+        unsigned long long head = ring->head.load(std::memory_order_acquire);
+        unsigned long long first = head > TRACE_RING_EVENTS ? head - TRACE_RING_EVENTS : 0;
+        for (unsigned long long i = first; i < head; i++)
+            written += fwrite(&ring->events[i % TRACE_RING_EVENTS], sizeof(TraceEvent), 1, file);
+        dropped += first;
+        delete ring;
+    }
+    trace_rings.clear();
+    fclose(file);
+    fprintf(stderr, "trace: %zu events written to %s, %llu overwritten\n", written, trace_path, dropped);
+}
+
+enum CoefStorage {
+    SOA_STORAGE, // k fields of one coefficient each
+    AOS_STORAGE, // one field holding all k coefficients of a node
+};
+
+struct CoefFormat {
+    int order;
+    CoefStorage storage;
+    int quant_bits; // mantissa bits of FID_QUANT, 0 when float and double trees have no quantized field
+
+    CoefFormat(int _order, CoefStorage _storage) : order(_order), storage(_storage), quant_bits(0) {}
+};
+
+// Chosen in main from -order, -coef_storage and -quant_rel_error, before the runtime starts, so every process agrees on it
+CoefFormat coef_format(1, SOA_STORAGE);
+
+// The k coefficients of one node
+template<typename T>
+struct Coefs {
+    T c[MAX_ORDER];
+};
+
+template<typename T>
+Coefs<T> make_coefs(T value) {
+    Coefs<T> coefs;
+    for (int j = 0; j < MAX_ORDER; j++)
+        coefs.c[j] = value;
+    return coefs;
+}
+
+// Per-node kernels over the k coefficients. Callers pass the same vector as output and input (coef_add(r, r,
+// s0, k)) or as both inputs (coef_dot(x, x, k)), so none of them is restrict-qualified; the compiler still
+// vectorizes the k-loop behind a runtime overlap check.
+template<typename T>
+inline void coef_add(T *out, const T *a, const T *b, int k) {
+    for (int j = 0; j < k; j++)
+        out[j] = a[j] + b[j];
+}
+
+template<typename T>
+inline void coef_average(T *out, const T *a, const T *b, int k) {
+    for (int j = 0; j < k; j++)
+        out[j] = (a[j] + b[j]) / 2;
+}
+
+template<typename T>
+inline void coef_shift(T *out, const T *a, T shift, int k) {
+    for (int j = 0; j < k; j++)
+        out[j] = a[j] + shift;
+}
+
+template<typename T>
+inline void coef_half(T *out, const T *a, int k) {
+    for (int j = 0; j < k; j++)
+        out[j] = half_coefficient(a[j]);
+}
+
+template<typename T>
+inline typename CoefTraits<T>::accum_t coef_dot(const T *a, const T *b, int k) {
+    typename CoefTraits<T>::accum_t sum = 0;
+    for (int j = 0; j < k; j++)
+        sum += static_cast<typename CoefTraits<T>::accum_t>(a[j]) * b[j];
+    return sum;
+}
+
+// Quantized coefficients, for trees that are read far more often than written. FID_QUANT holds a node as
+// one power of two scale for the node, as a signed byte, then its k coefficients as signed mantissas of
+// quant_bits bits, rounded to the nearest multiple of the scale. The scale is the smallest that keeps the
+// largest mantissa in range, so every coefficient is within max |c| / (2^(bits-1) - 1) of its value, max |c|
+// the largest of the node: 1/127 of it with 8 bits, 1/32767 with 16. The byte holds scales of 2^-128 to
+// 2^127. A node too small for 2^-128, such as the tails of a Gaussian, takes that scale and comes out within
+// 2^-129 of its values, its mantissas 0 below max |c| < 2^-129; a double node too large for 2^127 saturates.
+// quant_bits_for_error picks the mantissa bits for a bound, 0 when 16 bits cannot meet it.
+int quant_bits_for_error(double bound) {
+    if (bound >= 1.0 / 127)
+        return 8;
+    if (bound >= 1.0 / 32767)
+        return 16;
+    return 0;
+}
+
+size_t quant_field_size() {
+    return 1 + coef_format.order * coef_format.quant_bits / 8;
+}
+
+template<typename T>
+void quantize_coefs(const T *c, char *out) {
+    int k = coef_format.order, bits = coef_format.quant_bits;
+    long limit = (1L << (bits - 1)) - 1;
+    double max_abs = 0;
+    for (int j = 0; j < k; j++) {
+        if (std::isfinite(double(c[j])))
+            max_abs = max(max_abs, fabs(double(c[j])));
+    }
+    // max_abs / limit < 2^exponent <= 2 max_abs / limit
+    int exponent = 0;
+    if (max_abs > 0)
+        frexp(max_abs / limit, &exponent);
+    exponent = min(max(exponent, -128), 127);
+    out[0] = static_cast<signed char>(exponent);
+    for (int j = 0; j < k; j++) {
+        long m = std::isfinite(double(c[j])) ? lrint(ldexp(double(c[j]), -exponent)) : 0;
+        m = min(max(m, -limit), limit);
+        if (bits == 8) {
+            out[1 + j] = static_cast<signed char>(m);
+        } else {
+            int16_t m16 = static_cast<int16_t>(m);
+            memcpy(out + 1 + 2 * j, &m16, sizeof(m16));
+        }
+    }
+}
+
+template<typename T>
+void dequantize_coefs(const char *in, T *c) {
+    int k = coef_format.order;
+    double scale = ldexp(1.0, static_cast<signed char>(in[0]));
+    for (int j = 0; j < k; j++) {
+        int m;
+        if (coef_format.quant_bits == 8) {
+            m = static_cast<signed char>(in[1 + j]);
+        } else {
+            int16_t m16;
+            memcpy(&m16, in + 1 + 2 * j, sizeof(m16));
+            m = m16;
+        }
+        c[j] = static_cast<T>(m * scale);
+    }
+}
+
+// Whether a task reads its region through FID_QUANT rather than the coefficient fields
+inline bool reads_quantized(const RegionRequirement &req) {
+    return req.privilege_fields.count(FID_QUANT) > 0;
+}
+
+// Reads and writes the coefficients of a node in either storage, always through a dense Coefs buffer.
+// A quantized accessor reads FID_QUANT instead and decodes every node it loads.
+template<PrivilegeMode PRIV, typename T>
+class CoefAccessor {
+public:
+    CoefAccessor(const PhysicalRegion &region, bool _quantized = false)
+        : order(coef_format.order), storage(coef_format.storage), quantized(_quantized)
+    {
+        if (quantized) {
+            quant_field = FieldAccessor<PRIV, char, 1>(region, FID_QUANT, quant_field_size());
+        } else if (storage == AOS_STORAGE) {
+            fields[0] = FieldAccessor<PRIV, T, 1>(region, FID_X, sizeof(T) * order);
+        } else {
+            for (int j = 0; j < order; j++)
+                fields[j] = FieldAccessor<PRIV, T, 1>(region, FID_X + j);
+        }
+    }
+
+    void load(coord_t idx, Coefs<T> &coefs) const {
+        if (quantized) {
+            dequantize_coefs(quant_field.ptr(idx), coefs.c);
+        } else if (storage == AOS_STORAGE) {
+            const T *node = fields[0].ptr(idx);
+            for (int j = 0; j < order; j++)
+                coefs.c[j] = node[j];
+        } else {
+            for (int j = 0; j < order; j++)
+                coefs.c[j] = fields[j][idx];
+        }
+    }
+
+    void store(coord_t idx, const Coefs<T> &coefs) const {
+        assert(!quantized);
+        if (storage == AOS_STORAGE) {
+            T *node = fields[0].ptr(idx);
+            for (int j = 0; j < order; j++)
+                node[j] = coefs.c[j];
+        } else {
+            for (int j = 0; j < order; j++)
+                fields[j][idx] = coefs.c[j];
+        }
+    }
+
+    // Coefficient j of nodes lo, lo + 1, ... lives at run[0], run[stride], ... in a dense instance
+    const T *read_run(coord_t lo, int j, size_t &stride) const {
+        assert(!quantized);
+        stride = storage == AOS_STORAGE ? order : 1;
+        return storage == AOS_STORAGE ? fields[0].ptr(lo) + j : fields[j].ptr(lo);
+    }
+
+    T *write_run(coord_t lo, int j, size_t &stride) const {
+        assert(!quantized);
+        stride = storage == AOS_STORAGE ? order : 1;
+        return storage == AOS_STORAGE ? fields[0].ptr(lo) + j : fields[j].ptr(lo);
+    }
+
+private:
+    int order;
+    CoefStorage storage;
+    bool quantized;
+    FieldAccessor<PRIV, T, 1> fields[MAX_ORDER];
+    FieldAccessor<PRIV, char, 1> quant_field;
+};
+
+template<typename T>
+void allocate_coef_fields(FieldAllocator &allocator) {
+    if (coef_format.storage == AOS_STORAGE) {
+        allocator.allocate_field(sizeof(T) * coef_format.order, FID_X);
+    } else {
+        for (int j = 0; j < coef_format.order; j++)
+            allocator.allocate_field(sizeof(T), FID_X + j);
+    }
+    // int coefficients are exact, they are never quantized
+    if (coef_format.quant_bits > 0 && CoefTraits<T>::type != INT_COEF)
+        allocator.allocate_field(quant_field_size(), FID_QUANT);
+}
+
+int num_coef_fields() {
+    return coef_format.storage == AOS_STORAGE ? 1 : coef_format.order;
+}
+
+// The coefficient fields, or FID_QUANT alone for a read of the quantized tree
+void add_coef_fields(RegionRequirement &req, bool quantized = false) {
+    if (quantized) {
+        req.add_field(FID_QUANT);
+        return;
+    }
+    for (int j = 0; j < num_coef_fields(); j++)
+        req.add_field(FID_X + j);
+}
+
+void add_coef_fields(TaskLauncher &launcher, unsigned region_idx, bool quantized = false) {
+    if (quantized) {
+        launcher.add_field(region_idx, FID_QUANT);
+        return;
+    }
+    for (int j = 0; j < num_coef_fields(); j++)
+        launcher.add_field(region_idx, FID_X + j);
+}
+
+void add_coef_fields(IndexTaskLauncher &launcher, unsigned region_idx, bool quantized = false) {
+    if (quantized) {
+        launcher.add_field(region_idx, FID_QUANT);
+        return;
+    }
+    for (int j = 0; j < num_coef_fields(); j++)
+        launcher.add_field(region_idx, FID_X + j);
+}
+
+// Two-scale relation of the order-k Legendre scaling functions phi_i(x) = sqrt(2i+1) P_i(2x-1) on [0, 1].
+// Compressing a sibling pair gives the parent s = H0 s_left + H1 s_right, and a parent hands s down as
+// H0^T s to its left child and H1^T s to its right child. The matrices are scaled so that for k = 1 they
+// are all 1, which keeps the order-1 sums and averages the tree has always used.
+// G0 and G1 give the difference coefficients d = G0 s_left + G1 s_right of the pair, the part of the children
+// the parent does not predict; the rows of [H0 H1] and [G0 G1] are orthogonal with squared norm 2, so a
+// sibling pair comes back as s_left = (H0^T s + G0^T d) / 2, s_right = (H1^T s + G1^T d) / 2. For k = 1,
+// d = s_left - s_right.
+struct TwoScaleFilter {
+    int order;
+    double h0[MAX_ORDER][MAX_ORDER];
+    double h1[MAX_ORDER][MAX_ORDER];
+    double g0[MAX_ORDER][MAX_ORDER];
+    double g1[MAX_ORDER][MAX_ORDER];
+};
+
+// Built in main from the order in coef_format, before the runtime starts
+TwoScaleFilter two_scale_filter_matrices;
+
+double scaling_function(int i, double x) {
+    // P_i(2x-1) by the three-term recurrence
+    double t = 2 * x - 1, p0 = 1, p1 = t;
+    if (i == 0)
+        p1 = p0;
+    for (int m = 2; m <= i; m++) {
+        double p2 = ((2 * m - 1) * t * p1 - (m - 1) * p0) / m;
+        p0 = p1;
+        p1 = p2;
+    }
+    return sqrt(2.0 * i + 1) * p1;
+}
+
+// out[i] = integral of phi_i over [0, u], i < order. For i > 0 that is (P_{i+1}(t) - P_{i-1}(t)) / (2 sqrt(2i+1))
+// at t = 2u-1, as both Legendre polynomials are 1 or both -1 at t = -1.
+void scaling_primitives(int order, double u, double *out) {
+    double t = 2 * u - 1, p[MAX_ORDER + 1];
+    p[0] = 1;
+    p[1] = t;
+    for (int m = 2; m <= order; m++)
+        p[m] = ((2 * m - 1) * t * p[m - 1] - (m - 1) * p[m - 2]) / m;
+    out[0] = u;
+    for (int i = 1; i < order; i++)
+        out[i] = (p[i + 1] - p[i - 1]) / (2 * sqrt(2.0 * i + 1));
+}
+
+// Gauss-Legendre rule with npts points on [0, 1], exact for polynomials up to degree 2*npts-1
+void gauss_legendre(int npts, double *x, double *w) {
+    for (int i = 0; i < npts; i++) {
+        double z = cos(M_PI * (i + 0.75) / (npts + 0.5)), dp = 0;
+        for (int iter = 0; iter < 100; iter++) {
+            double p0 = 1, p1 = z;
+            for (int m = 2; m <= npts; m++) {
+                double p2 = ((2 * m - 1) * z * p1 - (m - 1) * p0) / m;
+                p0 = p1;
+                p1 = p2;
+            }
+            if (npts == 1)
+                p0 = 1;
+            dp = npts * (z * p1 - p0) / (z * z - 1);
+            double dz = p1 / dp;
+            z -= dz;
+            if (fabs(dz) < 1e-15)
+                break;
+        }
+        x[i] = (1 - z) / 2;
+        w[i] = 1 / ((1 - z * z) * dp * dp);
+    }
+}
+
+void build_two_scale_filter(int order, TwoScaleFilter &filter) {
+    assert(order >= 1 && order <= MAX_ORDER);
+    double x[MAX_ORDER], w[MAX_ORDER];
+    gauss_legendre(order, x, w);
+
+    filter.order = order;
+    for (int i = 0; i < order; i++) {
+        for (int j = 0; j < order; j++) {
+            // integrands are polynomials of degree at most 2k-2, so k points are exact
+            double s0 = 0, s1 = 0;
+            for (int q = 0; q < order; q++) {
+                s0 += w[q] * scaling_function(i, x[q] / 2) * scaling_function(j, x[q]);
+                s1 += w[q] * scaling_function(i, (x[q] + 1) / 2) * scaling_function(j, x[q]);
+            }
+            filter.h0[i][j] = s0;
+            filter.h1[i][j] = s1;
+        }
+    }
+
+    // [G0 G1] completes the orthonormal rows [H0 H1] / sqrt(2) by Gram-Schmidt over the unit vectors,
+    // each time the one with the largest part outside the rows so far
+    double basis[2 * MAX_ORDER][2 * MAX_ORDER];
+    int width = 2 * order;
+    for (int i = 0; i < order; i++) {
+        for (int j = 0; j < order; j++) {
+            basis[i][j] = filter.h0[i][j] / sqrt(2.0);
+            basis[i][order + j] = filter.h1[i][j] / sqrt(2.0);
+        }
+    }
+    for (int row = order; row < width; row++) {
+        double best[2 * MAX_ORDER], best_norm = 0;
+        for (int e = 0; e < width; e++) {
+            double v[2 * MAX_ORDER];
+            for (int j = 0; j < width; j++)
+                v[j] = j == e;
+            // twice, for the orthogonality a single pass loses
+            for (int pass = 0; pass < 2; pass++) {
+                for (int r = 0; r < row; r++) {
+                    double dot = 0;
+                    for (int j = 0; j < width; j++)
+                        dot += basis[r][j] * v[j];
+                    for (int j = 0; j < width; j++)
+                        v[j] -= dot * basis[r][j];
+                }
+            }
+            double norm = 0;
+            for (int j = 0; j < width; j++)
+                norm += v[j] * v[j];
+            if (norm > best_norm) {
+                best_norm = norm;
+                copy(v, v + width, best);
+            }
+        }
+        for (int j = 0; j < width; j++)
+            basis[row][j] = best[j] / sqrt(best_norm);
+    }
+    for (int i = 0; i < order; i++) {
+        for (int j = 0; j < order; j++) {
+            filter.g0[i][j] = basis[order + i][j] * sqrt(2.0);
+            filter.g1[i][j] = basis[order + i][order + j] * sqrt(2.0);
+        }
+    }
+}
+
+// Vector width and the handful of operations the batched filter kernels need, per coefficient type.
+// Only float and double get vector units; int coefficients always take the scalar path, with the
+// filter kept in double since its entries are not integers for k > 1.
+template<typename T> struct SimdOps {
+    typedef double filter_t;
+    static const int width = 1;
+};
+
+#if defined(SIMD_AVX512)
+template<> struct SimdOps<double> {
+    typedef double filter_t;
+    typedef __m512d vec;
+    static const int width = 8;
+    static vec zero() { return _mm512_setzero_pd(); }
+    static vec load(const double *p) { return _mm512_loadu_pd(p); }
+    static vec broadcast(double v) { return _mm512_set1_pd(v); }
+    static vec fmadd(vec a, vec b, vec c) { return _mm512_fmadd_pd(a, b, c); }
+    static void store(double *p, vec v) { _mm512_storeu_pd(p, v); }
+};
+
+template<> struct SimdOps<float> {
+    typedef float filter_t;
+    typedef __m512 vec;
+    static const int width = 16;
+    static vec zero() { return _mm512_setzero_ps(); }
+    static vec load(const float *p) { return _mm512_loadu_ps(p); }
+    static vec broadcast(float v) { return _mm512_set1_ps(v); }
+    static vec fmadd(vec a, vec b, vec c) { return _mm512_fmadd_ps(a, b, c); }
+    static void store(float *p, vec v) { _mm512_storeu_ps(p, v); }
+};
+#elif defined(SIMD_AVX2)
+template<> struct SimdOps<double> {
+    typedef double filter_t;
+    typedef __m256d vec;
+    static const int width = 4;
+    static vec zero() { return _mm256_setzero_pd(); }
+    static vec load(const double *p) { return _mm256_loadu_pd(p); }
+    static vec broadcast(double v) { return _mm256_set1_pd(v); }
+    static vec fmadd(vec a, vec b, vec c) { return _mm256_fmadd_pd(a, b, c); }
+    static void store(double *p, vec v) { _mm256_storeu_pd(p, v); }
+};
+
+template<> struct SimdOps<float> {
+    typedef float filter_t;
+    typedef __m256 vec;
+    static const int width = 8;
+    static vec zero() { return _mm256_setzero_ps(); }
+    static vec load(const float *p) { return _mm256_loadu_ps(p); }
+    static vec broadcast(float v) { return _mm256_set1_ps(v); }
+    static vec fmadd(vec a, vec b, vec c) { return _mm256_fmadd_ps(a, b, c); }
+    static void store(float *p, vec v) { _mm256_storeu_ps(p, v); }
+};
+#endif
+
+// The filter matrices in the layout the kernels stream through: column j of each matrix is a run of
+// padded_order values, zero padded up to the vector width. a0/a1 hold H0/H1 for compress and
+// H0^T/H1^T for reconstruct, so both directions are the same out = A x (+ B y) product.
+template<typename T>
+struct FilterColumns {
+    typedef typename SimdOps<T>::filter_t filter_t;
+    int order, padded_order;
+    vector<filter_t> h0, h1, h0t, h1t;
+
+    FilterColumns(const TwoScaleFilter &filter)
+        : order(filter.order)
+    {
+        int width = SimdOps<T>::width;
+        padded_order = (order + width - 1) / width * width;
+        h0.assign(order * padded_order, 0);
+        h1.assign(order * padded_order, 0);
+        h0t.assign(order * padded_order, 0);
+        h1t.assign(order * padded_order, 0);
+        for (int i = 0; i < order; i++) {
+            for (int j = 0; j < order; j++) {
+                h0[j * padded_order + i] = filter_t(filter.h0[i][j]);
+                h1[j * padded_order + i] = filter_t(filter.h1[i][j]);
+                h0t[j * padded_order + i] = filter_t(filter.h0[j][i]);
+                h1t[j * padded_order + i] = filter_t(filter.h1[j][i]);
+            }
+        }
+    }
+};
+
+template<typename T>
+const FilterColumns<T> &filter_columns() {
+    static const FilterColumns<T> columns(two_scale_filter_matrices);
+    return columns;
+}
+
+// out[p] = A x[p] + B y[p] for npairs packed k-vectors (B and y may be NULL), one scalar dot product per output
+template<typename T>
+void apply_filter_pairs_scalar(const FilterColumns<T> &cols, const typename FilterColumns<T>::filter_t *A, const T *x,
+                               const typename FilterColumns<T>::filter_t *B, const T *y, T *out, size_t npairs) {
+    int k = cols.order, kp = cols.padded_order;
+    for (size_t p = 0; p < npairs; p++) {
+        const T *xp = x + p * k;
+        const T *yp = y ? y + p * k : NULL;
+        T *op = out + p * k;
+        for (int i = 0; i < k; i++) {
+            double sum = 0;
+            for (int j = 0; j < k; j++)
+                sum += double(A[j * kp + i]) * xp[j];
+            if (yp) {
+                for (int j = 0; j < k; j++)
+                    sum += double(B[j * kp + i]) * yp[j];
+            }
+            op[i] = T(sum);
+        }
+    }
+}
+
+#if defined(SIMD_AVX512) || defined(SIMD_AVX2)
+// Same product vectorized over the rows of A: every x[p][j] is broadcast against column j, so one pass
+// over the columns yields a whole output vector
+template<typename T>
+void apply_filter_pairs_simd(const FilterColumns<T> &cols, const T *A, const T *x, const T *B, const T *y,
+                             T *out, size_t npairs) {
+    typedef SimdOps<T> ops;
+    int k = cols.order, kp = cols.padded_order;
+    T tail[ops::width];
+    for (size_t p = 0; p < npairs; p++) {
+        const T *xp = x + p * k;
+        const T *yp = y ? y + p * k : NULL;
+        T *op = out + p * k;
+        for (int ib = 0; ib < kp; ib += ops::width) {
+            typename ops::vec acc = ops::zero();
+            for (int j = 0; j < k; j++)
+                acc = ops::fmadd(ops::load(A + j * kp + ib), ops::broadcast(xp[j]), acc);
+            if (yp) {
+                for (int j = 0; j < k; j++)
+                    acc = ops::fmadd(ops::load(B + j * kp + ib), ops::broadcast(yp[j]), acc);
+            }
+            if (ib + ops::width <= k) {
+                ops::store(op + ib, acc);
+            } else {
+                ops::store(tail, acc);
+                for (int i = ib; i < k; i++)
+                    op[i] = tail[i - ib];
+            }
+        }
+    }
+}
+
+inline void apply_filter_pairs(const FilterColumns<float> &cols, const float *A, const float *x, const float *B,
+                               const float *y, float *out, size_t npairs) {
+    apply_filter_pairs_simd(cols, A, x, B, y, out, npairs);
+}
+
+inline void apply_filter_pairs(const FilterColumns<double> &cols, const double *A, const double *x, const double *B,
+                               const double *y, double *out, size_t npairs) {
+    apply_filter_pairs_simd(cols, A, x, B, y, out, npairs);
+}
+#endif
+
+template<typename T>
+void apply_filter_pairs(const FilterColumns<T> &cols, const typename FilterColumns<T>::filter_t *A, const T *x,
+                        const typename FilterColumns<T>::filter_t *B, const T *y, T *out, size_t npairs) {
+    apply_filter_pairs_scalar(cols, A, x, B, y, out, npairs);
+}
+
+// parent[p] = H0 left[p] + H1 right[p] over npairs sibling pairs, each vector k = coef_format.order long
+template<typename T>
+void two_scale_filter(const T *__restrict left, const T *__restrict right, T *__restrict parent, size_t npairs) {
+    const FilterColumns<T> &cols = filter_columns<T>();
+    if (cols.order == 1) {
+        // one coefficient per node: a plain weighted sum across the pairs
+        typename FilterColumns<T>::filter_t a = cols.h0[0], b = cols.h1[0];
+        for (size_t p = 0; p < npairs; p++)
+            parent[p] = T(a * left[p] + b * right[p]);
+        return;
+    }
+    apply_filter_pairs(cols, &cols.h0[0], left, &cols.h1[0], right, parent, npairs);
+}
+
+// left[p] = H0^T parent[p], right[p] = H1^T parent[p] over npairs parents. Only reconstruct of order 1 calls
+// it (see reconstruct_averages): past order 1 the compressed tree keeps sums, not differences, so reconstruct
+// has nothing to unfilter and the order-k matrix path here is not exercised by any operation; the one of
+// two_scale_filter is, by compress.
+template<typename T>
+void two_scale_unfilter(const T *__restrict parent, T *__restrict left, T *__restrict right, size_t npairs) {
+    const FilterColumns<T> &cols = filter_columns<T>();
+    if (cols.order == 1) {
+        typename FilterColumns<T>::filter_t a = cols.h0t[0], b = cols.h1t[0];
+        for (size_t p = 0; p < npairs; p++) {
+            left[p] = T(a * parent[p]);
+            right[p] = T(b * parent[p]);
+        }
+        return;
+    }
+    apply_filter_pairs(cols, &cols.h0t[0], parent, NULL, (const T *) NULL, left, npairs);
+    apply_filter_pairs(cols, &cols.h1t[0], parent, NULL, (const T *) NULL, right, npairs);
+}
+
+// Reconstruct of order 1 keeps the rule of the original tree: a node takes the average of what its parent
+// handed down and its own value, and hands H0^T / H1^T of that on to its children. From order 2 on it is the
+// inverse of compress. The compressed tree still holds the sums of both children of every node, and those
+// are (H0^T s + G0^T d) / 2 and (H1^T s + G1^T d) / 2 of the parent's sum s and differences d (see
+// TwoScaleFilter), so the leaves keep what they hold and only the internal nodes are cleared, no unfilter
+// involved. The wavelet form, which does keep differences, unfilters in wavelet_unfilter.
+inline bool reconstruct_averages() {
+    return coef_format.order == 1;
+}
+
+// OpenMP directives of the block kernels. Their OMP_PROC variants split the loops over the team of the
+// processor, the LOC_PROC variants run the same code with false in the if clauses, and without OpenMP
+// the loops are plain loops.
+#define PRAGMA(x) _Pragma(#x)
+#ifdef _OPENMP
+#define OMP(directive) PRAGMA(omp directive)
+#else
+#define OMP(directive)
+#endif
+
+// Sibling pairs one kernel call filters when a level is split over a team
+#define FILTER_CHUNK 256
+
+// Whether a task runs as the OMP_PROC variant of its kernel
+inline bool omp_variant(const Task *task) {
+    return task->target_proc.kind() == Processor::OMP_PROC;
+}
+
+template<typename T>
+void two_scale_filter_chunks(const T *left, const T *right, T *parent, size_t npairs, bool parallel) {
+    int k = coef_format.order;
+    long num_chunks = (npairs + FILTER_CHUNK - 1) / FILTER_CHUNK;
+    OMP(parallel for schedule(static) if (parallel))
+    for (long c = 0; c < num_chunks; c++) {
+        size_t first = c * FILTER_CHUNK;
+        two_scale_filter(left + first * k, right + first * k, parent + first * k, min<size_t>(FILTER_CHUNK, npairs - first));
+    }
+}
+
+template<typename T>
+void two_scale_unfilter_chunks(const T *parent, T *left, T *right, size_t npairs, bool parallel) {
+    int k = coef_format.order;
+    long num_chunks = (npairs + FILTER_CHUNK - 1) / FILTER_CHUNK;
+    OMP(parallel for schedule(static) if (parallel))
+    for (long c = 0; c < num_chunks; c++) {
+        size_t first = c * FILTER_CHUNK;
+        two_scale_unfilter(parent + first * k, left + first * k, right + first * k, min<size_t>(FILTER_CHUNK, npairs - first));
+    }
+}
+
+// Order in which the nodes of a tree are laid out in its index space
+enum TreeLayout {
+    PRE_ORDER_LAYOUT,   // depth first, every subtree is one contiguous range
+    LEVEL_ORDER_LAYOUT, // breadth first, every level is one contiguous range
+    VEB_LAYOUT,         // van Emde Boas, cache oblivious for root-to-leaf paths
 };
 
+// Counter-based generator: the draw for node (n, l) is a SplitMix64 hash of (seed, n, l). It does not depend
+// on the order the tree is visited in, so any node, level or block of nodes can be generated on its own.
+inline unsigned long long splitmix64(unsigned long long z) {
+    z += 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// Uniform in [0, 2^31), the range lrand48 draws from
+inline long int node_random(long int seed, int n, int l) {
+    unsigned long long key = ((unsigned long long) (unsigned) n << 32) | (unsigned) l;
+    return (long int) (splitmix64(splitmix64((unsigned long long) seed) ^ key) >> 33);
+}
+
+// Value refine draws for node (n, l). The node is refined further when it is above 3.
+inline int refine_draw(long int seed, int n, int l) {
+    return node_random(seed, n, l) % 10 + 1;
+}
+
+// Coefficients refine stores at a node of level n that drew node_value
+template<typename T>
+void set_node_coefs(int node_value, int n, int max_depth, Coefs<T> &coefs) {
+    coefs = make_coefs(T(0));
+    if (node_value <= 3 || n == max_depth - 1) {
+        for (int j = 0; j < coef_format.order; j++)
+            coefs.c[j] = static_cast<T>((node_value + j) % 3 + 1);
+    }
+}
+
 struct Arguments {
     /* level of the node in the binary tree. Root is at level 0 */
     int n;
@@ -44,16 +922,19 @@ struct Arguments {
 
     int max_depth;
 
+    TreeLayout layout;
+
     coord_t idx;
 
-    drand48_data gen;
+    /* key of the counter-based generator refine draws node values from, see node_random */
+    long int seed;
 
     Color partition_color;
 
     int actual_max_depth;
 
-    Arguments(int _n, int _l, int _max_depth, coord_t _idx, Color _partition_color, int _actual_max_depth=0)
-        : n(_n), l(_l), max_depth(_max_depth), idx(_idx), partition_color(_partition_color), actual_max_depth(_actual_max_depth)
+    Arguments(int _n, int _l, int _max_depth, TreeLayout _layout, coord_t _idx, Color _partition_color, int _actual_max_depth=0, long int _seed=0)
+        : n(_n), l(_l), max_depth(_max_depth), layout(_layout), idx(_idx), seed(_seed), partition_color(_partition_color), actual_max_depth(_actual_max_depth)
     {
         if (_actual_max_depth == 0) {
             actual_max_depth = _max_depth;
@@ -61,23 +942,6 @@ struct Arguments {
     }
 };
 
-struct GaxpyArguments {
-    int n;
-    int l;
-    int max_depth;
-    coord_t idx;
-    drand48_data gen;
-    Color partition_color1, partition_color2, partition_color3;
-    int actual_max_depth, left_tree_depth, right_tree_depth;
-
-    GaxpyArguments(int _n, int _l, int _max_depth, coord_t _idx, Color _partition_color1, Color _partition_color2, Color _partition_color3, int _actual_max_depth, int _left_tree_depth, int _right_tree_depth)
-        : n(_n), l(_l), max_depth(_max_depth), idx(_idx), partition_color1(_partition_color1),
-        partition_color2(_partition_color2), partition_color3(_partition_color3),
-        actual_max_depth(_actual_max_depth), left_tree_depth(_left_tree_depth), 
-        right_tree_depth(_right_tree_depth)
-    {}
-};
-
 struct SetTaskArgs {
     int node_value;
     coord_t idx;
@@ -86,12 +950,6 @@ struct SetTaskArgs {
     SetTaskArgs(int _node_value, coord_t _idx, int _n, int _max_depth) : node_value(_node_value), idx(_idx), n(_n), max_depth(_max_depth) {}
 };
 
-struct GaxpySetTaskArgs {
-    coord_t idx;
-    bool is_left, is_right;
-    GaxpySetTaskArgs(coord_t _idx, bool _is_left, bool _is_right) : idx(_idx), is_left(_is_left), is_right(_is_right) {}
-};
-
 struct ReadTaskArgs {
     coord_t idx;
     ReadTaskArgs(coord_t _idx) : idx(_idx) {}
@@ -103,36 +961,48 @@ struct CompressSetTaskArgs {
         idx(_idx), left_idx(_left_idx), right_idx(_right_idx){}
 };
 
+// One parent compress_path_task recomputes, at level n of the tree
+struct CompressPathNode {
+    coord_t idx, left_idx, right_idx;
+    int n;
+    CompressPathNode(coord_t _idx, coord_t _left_idx, coord_t _right_idx, int _n) :
+        idx(_idx), left_idx(_left_idx), right_idx(_right_idx), n(_n) {}
+};
+
+template<typename T>
 struct DiffArguments {
     int n, l, max_depth;
+    TreeLayout layout;
     coord_t idx;
     Color partition_color1;
     Color partition_color2;
     int actual_max_depth;
-    int s0;
+    Coefs<T> s0;
     bool is_s0_valid;
     
-    DiffArguments(int _n, int _l, int _max_depth, coord_t _idx, Color _partition_color1, Color _partition_color2, int _actual_max_depth, int _s0, bool _is_s0_valid)
-        : n(_n), l(_l), max_depth(_max_depth), idx(_idx), partition_color1(_partition_color1), partition_color2(_partition_color2),
+    DiffArguments(int _n, int _l, int _max_depth, TreeLayout _layout, coord_t _idx, Color _partition_color1, Color _partition_color2, int _actual_max_depth, const Coefs<T> &_s0, bool _is_s0_valid)
+        : n(_n), l(_l), max_depth(_max_depth), layout(_layout), idx(_idx), partition_color1(_partition_color1), partition_color2(_partition_color2),
         actual_max_depth(_actual_max_depth), s0(_s0), is_s0_valid(_is_s0_valid)
     {}
 };
 
+template<typename T>
 struct DiffSetTaskArgs {
     coord_t idx;
-    int node_value;
-    DiffSetTaskArgs(coord_t _idx, int _node_value) : 
+    Coefs<T> node_value;
+    DiffSetTaskArgs(coord_t _idx, const Coefs<T> &_node_value) : 
         idx(_idx), node_value(_node_value) {}
 };
 
 struct GetCoefArguments {
     int n, l, max_depth;
+    TreeLayout layout;
     coord_t idx;
     Color partition_color;
     int questioned_n, questioned_l;
 
-    GetCoefArguments(int _n, int _l, int _max_depth, coord_t _idx, Color _partition_color, int _questioned_n, int _questioned_l)
-        : n(_n), l(_l), max_depth(_max_depth), idx(_idx), partition_color(_partition_color),
+    GetCoefArguments(int _n, int _l, int _max_depth, TreeLayout _layout, coord_t _idx, Color _partition_color, int _questioned_n, int _questioned_l)
+        : n(_n), l(_l), max_depth(_max_depth), layout(_layout), idx(_idx), partition_color(_partition_color),
         questioned_n(_questioned_n), questioned_l(_questioned_l)
     {}
 };
@@ -150,60 +1020,50 @@ struct ReturnGetCoefArguments {
 
 struct GetCoefUtilArguments {
     int n, l, max_depth;
+    TreeLayout layout;
     coord_t idx;
     Color partition_color;
     int questioned_n, questioned_l;
 
-    GetCoefUtilArguments(int _n, int _l, int _max_depth, coord_t _idx, Color _partition_color, int _questioned_n, int _questioned_l)
-        : n(_n), l(_l), max_depth(_max_depth), idx(_idx), partition_color(_partition_color),
+    GetCoefUtilArguments(int _n, int _l, int _max_depth, TreeLayout _layout, coord_t _idx, Color _partition_color, int _questioned_n, int _questioned_l)
+        : n(_n), l(_l), max_depth(_max_depth), layout(_layout), idx(_idx), partition_color(_partition_color),
         questioned_n(_questioned_n), questioned_l(_questioned_l)
 
     {}
 };
 
-struct InnerProductArguments {
-    int n;
-    int l;
-    int max_depth;
-    coord_t idx;
-    drand48_data gen;
-    Color partition_color1, partition_color2;
-    int actual_max_depth;
-
-    InnerProductArguments(int _n, int _l, int _max_depth, coord_t _idx, Color _partition_color1, Color _partition_color2, int _actual_max_depth)
-        : n(_n), l(_l), max_depth(_max_depth), idx(_idx), partition_color1(_partition_color1),
-        partition_color2(_partition_color2), actual_max_depth(_actual_max_depth)
-    {}
-};
-
+template<typename T>
 struct ReConstructArguments {
     int n, l, max_depth;
+    TreeLayout layout;
     coord_t idx;
-    drand48_data gen;
     Color partition_color;
-    int parent_value;
-    ReConstructArguments(int _n, int _l, int _max_depth, coord_t _idx, Color _partition_color, int _parent_value)
-        : n(_n), l(_l), max_depth(_max_depth), idx(_idx), partition_color(_partition_color),
+    Coefs<T> parent_value;
+    ReConstructArguments(int _n, int _l, int _max_depth, TreeLayout _layout, coord_t _idx, Color _partition_color, const Coefs<T> &_parent_value)
+        : n(_n), l(_l), max_depth(_max_depth), layout(_layout), idx(_idx), partition_color(_partition_color),
         parent_value(_parent_value)
     {}
 };
 
+template<typename T>
 struct ReConstructSetTaskArgs {
     coord_t idx;
-    int node_value;
-    ReConstructSetTaskArgs(coord_t _idx, int _node_value) : 
+    Coefs<T> node_value;
+    ReConstructSetTaskArgs(coord_t _idx, const Coefs<T> &_node_value) : 
         idx(_idx), node_value(_node_value){}
 };
 
+template<typename T>
 void reconstruct_set_task(const Task *task,
                           const std::vector<PhysicalRegion> &regions,
                           Context ctx, HighLevelRuntime *runtime) {
+    TaskTrace trace(task);
 
-    ReConstructSetTaskArgs args = *(const ReConstructSetTaskArgs *) task->args;
+    ReConstructSetTaskArgs<T> args = *(const ReConstructSetTaskArgs<T> *) task->args;
     assert(regions.size() == 1);
-    const FieldAccessor<READ_WRITE, int, 1> write_acc(regions[0], FID_X);
+    const CoefAccessor<READ_WRITE, T> write_acc(regions[0]);
 
-    write_acc[args.idx] = args.node_value;
+    write_acc.store(args.idx, args.node_value);
 }
 
 //   k=1 (1 subregion per node)
@@ -222,286 +1082,2496 @@ void reconstruct_set_task(const Task *task,
 //    [i .. i+(2^k-1)-1]
 //    0 <= j <= 2^k-1 => [i+(2^k-1)-1 + 1 +  j      * (2^(max_level - (l + k) +1) - 1) ..
 //                        i+(2^k-1)-1 + 1 + (j + 1) * (2^(max_level - (l + k) +1) - 1) - 1]
+//
+//   The pre-order layout above is PRE_ORDER_LAYOUT. The other layouts of the same tree are
+//
+//   LEVEL_ORDER_LAYOUT          i = 2^n - 1 + l
+//                0
+//         1             2
+//     3      4      5      6
+//   7   8  9   10 11  12 13   14
+//
+//   VEB_LAYOUT (top half of the levels first, then every bottom subtree, recursively)
+//                0
+//         1             2
+//     3      6      9      12
+//   4   5  7   8  10  11  13   14
+//
+//   Only in pre-order is a subtree one contiguous range, so the other layouts partition a
+//   node's region into a set of rectangles per child instead of a single one.
 
-void top_level_task(const Task *task, const std::vector<PhysicalRegion> &regions, Context ctx, HighLevelRuntime *runtime) {
+// Position of node (n, l) inside a van Emde Boas ordered tree with `height` levels
+coord_t veb_index(int n, coord_t l, int height) {
+    if (height == 1)
+        return 0;
 
-    int overall_max_depth = 4;
-    int actual_left_depth = 4;
+    int top_height = height / 2;
+    int bottom_height = height - top_height;
 
-    long int seed = 12345;
-    {
-        const InputArgs &command_args = HighLevelRuntime::get_input_args();
-        for (int idx = 1; idx < command_args.argc; ++idx)
-        {
-            if (strcmp(command_args.argv[idx], "-max_depth") == 0)
-                overall_max_depth = atoi(command_args.argv[++idx]);
-            else if (strcmp(command_args.argv[idx], "-seed") == 0)
-                seed = atol(command_args.argv[++idx]);
-        }
-    }
+    if (n < top_height)
+        return veb_index(n, l, top_height);
 
-    Rect<1> tree_rect(0LL, static_cast<coord_t>(pow(2, overall_max_depth + 1)) - 2);
-    IndexSpace is = runtime->create_index_space(ctx, tree_rect);
-    FieldSpace fs = runtime->create_field_space(ctx);
-    {
-        FieldAllocator allocator = runtime->create_field_allocator(ctx, fs);
-        allocator.allocate_field(sizeof(int), FID_X);
-    }
+    int bottom_n = n - top_height;
+    coord_t bottom_tree = l >> bottom_n;
+    coord_t bottom_l = l & ((static_cast<coord_t>(1) << bottom_n) - 1);
 
-    // For 1st logical region
-    LogicalRegion lr1 = runtime->create_logical_region(ctx, is, fs);
-    // Any random value will work
-    Color partition_color1 = 10;
+    return ((static_cast<coord_t>(1) << top_height) - 1)
+        + bottom_tree * ((static_cast<coord_t>(1) << bottom_height) - 1)
+        + veb_index(bottom_n, bottom_l, bottom_height);
+}
 
-    Arguments args1(0, 0, overall_max_depth, 0, partition_color1, actual_left_depth);
-    srand48_r(seed, &args1.gen);
+// Position of node (n, l) in a tree region holding the levels 0 .. max_depth
+coord_t node_index(TreeLayout layout, int n, int l, int max_depth) {
+    switch (layout) {
+        case PRE_ORDER_LAYOUT: {
+            coord_t idx = 0;
+            for (int i = 1; i <= n; i++) {
+                if ((l >> (n - i)) & 1)
+                    idx += static_cast<coord_t>(1) << (max_depth - i + 1);
+                else
+                    idx += 1;
+            }
+            return idx;
+        }
+        case LEVEL_ORDER_LAYOUT:
+            return ((static_cast<coord_t>(1) << n) - 1) + l;
+        case VEB_LAYOUT:
+            return veb_index(n, l, max_depth + 1);
+    }
+    assert(false);
+    return -1;
+}
 
-    // Launching the refine task
-    TaskLauncher refine_launcher(REFINE_TASK_ID, TaskArgument(&args1, sizeof(Arguments)));
-    refine_launcher.add_region_requirement(RegionRequirement(lr1, WRITE_DISCARD, EXCLUSIVE, lr1));
-    refine_launcher.add_field(0, FID_X);
-    runtime->execute_task(ctx, refine_launcher);
+coord_t left_child_index(TreeLayout layout, coord_t idx, int n, int l, int max_depth) {
+    if (layout == PRE_ORDER_LAYOUT)
+        return idx + 1;
+    return node_index(layout, n + 1, 2 * l, max_depth);
+}
+
+coord_t right_child_index(TreeLayout layout, coord_t idx, int n, int l, int max_depth) {
+    if (layout == PRE_ORDER_LAYOUT)
+        return idx + static_cast<coord_t>(pow(2, max_depth - n));
+    return node_index(layout, n + 1, 2 * l + 1, max_depth);
+}
+
+inline bool rect_lo_less(const Rect<1> &a, const Rect<1> &b) {
+    return a.lo[0] < b.lo[0];
+}
+
+// Sorts disjoint ranges and merges the ones that touch
+void merge_rects(vector<Rect<1> > &rects) {
+    if (rects.empty())
+        return;
+    sort(rects.begin(), rects.end(), rect_lo_less);
+    size_t merged = 0;
+    for (size_t i = 1; i < rects.size(); i++) {
+        if (rects[i].lo[0] == rects[merged].hi[0] + 1)
+            rects[merged].hi = rects[i].hi;
+        else
+            rects[++merged] = rects[i];
+    }
+    rects.resize(merged + 1);
+}
+
+// Index ranges of the subtree of (n, l) in a van Emde Boas ordered tree with `height` levels that starts at
+// offset, following the split of veb_index: a subtree below the top half lies in one bottom tree, and one
+// rooted in the top half is its part of the top tree plus the bottom trees under it, which are consecutive.
+// O(log height) ranges, unsorted.
+void veb_subtree_rects(int n, coord_t l, int height, coord_t offset, vector<Rect<1> > &rects) {
+    if (n == 0) {
+        rects.push_back(Rect<1>(offset, offset + (static_cast<coord_t>(1) << height) - 2));
+        return;
+    }
+    int top_height = height / 2;
+    int bottom_height = height - top_height;
+    coord_t bottom_size = (static_cast<coord_t>(1) << bottom_height) - 1;
+    coord_t bottom_offset = offset + (static_cast<coord_t>(1) << top_height) - 1;
+
+    if (n >= top_height) {
+        int bottom_n = n - top_height;
+        coord_t bottom_tree = l >> bottom_n;
+        coord_t bottom_l = l & ((static_cast<coord_t>(1) << bottom_n) - 1);
+        veb_subtree_rects(bottom_n, bottom_l, bottom_height, bottom_offset + bottom_tree * bottom_size, rects);
+        return;
+    }
+    veb_subtree_rects(n, l, top_height, offset, rects);
+    coord_t first = l << (top_height - n), count = static_cast<coord_t>(1) << (top_height - n);
+    rects.push_back(Rect<1>(bottom_offset + first * bottom_size, bottom_offset + (first + count) * bottom_size - 1));
+}
+
+// Index ranges covered by the subtree rooted at (n, l), in increasing order
+void subtree_rects(TreeLayout layout, int n, int l, int max_depth, vector<Rect<1> > &rects) {
+    switch (layout) {
+        case PRE_ORDER_LAYOUT: {
+            coord_t idx = node_index(layout, n, l, max_depth);
+            rects.push_back(Rect<1>(idx, idx + (static_cast<coord_t>(1) << (max_depth - n + 1)) - 2));
+            break;
+        }
+        case LEVEL_ORDER_LAYOUT: {
+            for (int m = n; m <= max_depth; m++) {
+                coord_t width = static_cast<coord_t>(1) << (m - n);
+                coord_t lo = ((static_cast<coord_t>(1) << m) - 1) + l * width;
+                rects.push_back(Rect<1>(lo, lo + width - 1));
+            }
+            break;
+        }
+        case VEB_LAYOUT: {
+            // one run per recursive block the subtree overlaps, merged where they touch
+            veb_subtree_rects(n, l, max_depth + 1, 0, rects);
+            merge_rects(rects);
+            break;
+        }
+    }
+}
+
+// Whether subspace color of ip holds exactly the ranges rects, which are sorted and merged
+bool subspace_matches(Context ctx, HighLevelRuntime *runtime, IndexPartition ip, coord_t color, const vector<Rect<1> > &rects) {
+    Domain domain = runtime->get_index_space_domain(ctx, runtime->get_index_subspace(ctx, ip, DomainPoint(Point<1>(color))));
+    vector<Rect<1> > held;
+    for (RectInDomainIterator<1> it(domain); it(); it++)
+        held.push_back(*it);
+    merge_rects(held);
+    return held.size() == rects.size() && equal(held.begin(), held.end(), rects.begin());
+}
+
+// Splits the region of node (n, l) into the node itself (color 0) and its two subtrees (colors 1, 2). A
+// partition of that color the node already has is handed back when it splits the region the same way, so a
+// tree recycled by TreePool keeps the partitions an earlier tree of the same shape built in it; one left by a
+// tree of another layout or depth is destroyed, with everything below it, and built again.
+IndexPartition create_subtree_partition(Context ctx, HighLevelRuntime *runtime, IndexSpace is, TreeLayout layout,
+                                        int n, int l, int max_depth, Color partition_color) {
+    DomainPoint my_sub_tree_color(Point<1>(0LL));
+    DomainPoint left_sub_tree_color(Point<1>(1LL));
+    DomainPoint right_sub_tree_color(Point<1>(2LL));
+
+    coord_t idx = node_index(layout, n, l, max_depth);
+    vector<Rect<1> > self_rects(1, Rect<1>(idx, idx)), left_rects, right_rects;
+    subtree_rects(layout, n + 1, 2 * l, max_depth, left_rects);
+    subtree_rects(layout, n + 1, 2 * l + 1, max_depth, right_rects);
+    merge_rects(left_rects);
+    merge_rects(right_rects);
+
+    if (runtime->has_index_partition(ctx, is, partition_color)) {
+        IndexPartition ip = runtime->get_index_partition(ctx, is, partition_color);
+        if (subspace_matches(ctx, runtime, ip, 0, self_rects) && subspace_matches(ctx, runtime, ip, 1, left_rects) &&
+            subspace_matches(ctx, runtime, ip, 2, right_rects))
+            return ip;
+        runtime->destroy_index_partition(ctx, ip);
+    }
+
+    MultiDomainPointColoring coloring;
+    coloring[my_sub_tree_color].insert(Rect<1>(idx, idx));
+    for (size_t i = 0; i < left_rects.size(); i++)
+        coloring[left_sub_tree_color].insert(left_rects[i]);
+    for (size_t i = 0; i < right_rects.size(); i++)
+        coloring[right_sub_tree_color].insert(right_rects[i]);
+
+    Rect<1> color_space = Rect<1>(my_sub_tree_color, right_sub_tree_color);
+
+    return runtime->create_index_partition(ctx, is, color_space, coloring, DISJOINT_KIND, partition_color);
+}
+
+// Bits of a refinement bitmap entry
+enum RefinementBits {
+    BITMAP_NODE = 1,
+    BITMAP_LEAF = 2,
+};
+
+// Refinement bitmap of the tree refine grows from seed down to depth: entry idx has BITMAP_NODE for every
+// node above depth that refine reached and partitioned, and BITMAP_LEAF as well when its children were not.
+// The draws only depend on (seed, n, l), so the bitmap can be rebuilt anywhere without touching the tree.
+void refinement_bitmap(long int seed, int depth, int max_depth, TreeLayout layout, int n, int l,
+                       vector<unsigned char> &bitmap) {
+    if (n >= depth)
+        return;
+    bool refined = refine_draw(seed, n, l) > 3;
+    bitmap[node_index(layout, n, l, max_depth)] = BITMAP_NODE | (refined && n + 1 < depth ? 0 : BITMAP_LEAF);
+    if (refined) {
+        refinement_bitmap(seed, depth, max_depth, layout, n + 1, 2 * l, bitmap);
+        refinement_bitmap(seed, depth, max_depth, layout, n + 1, 2 * l + 1, bitmap);
+    }
+}
+
+void refinement_bitmap(long int seed, int depth, int max_depth, TreeLayout layout, vector<unsigned char> &bitmap) {
+    bitmap.assign(static_cast<size_t>(pow(2, max_depth + 1)) - 1, 0);
+    refinement_bitmap(seed, depth, max_depth, layout, 0, 0, bitmap);
+}
+
+// What the driver records about a tree when it refines it. Two trees with the same signature have the
+// same nodes at the same indices, so binary operations on them need no traversal.
+struct TreeShape {
+    long int seed;
+    int depth, max_depth;
+    TreeLayout layout;
+    unsigned long long signature;
+
+    TreeShape(long int _seed, int _depth, int _max_depth, TreeLayout _layout)
+        : seed(_seed), depth(_depth), max_depth(_max_depth), layout(_layout)
+    {
+        vector<unsigned char> bitmap;
+        refinement_bitmap(seed, depth, max_depth, layout, bitmap);
+        signature = splitmix64(bitmap.size());
+        for (size_t i = 0; i < bitmap.size(); i += 64) {
+            unsigned long long word = 0;
+            for (size_t b = 0; b < 64 && i + b < bitmap.size(); b++)
+                word |= static_cast<unsigned long long>(bitmap[i + b]) << b;
+            signature = splitmix64(signature ^ word);
+        }
+    }
+};
+
+// Gives the tree in dst (colored dst_color) the partitions the tree in src has, as gaxpy would have created
+// them for a result with the same structure
+void mirror_tree_partitions(Context ctx, HighLevelRuntime *runtime, IndexSpace src, Color src_color,
+                            IndexSpace dst, Color dst_color, TreeLayout layout, int n, int l, int max_depth) {
+    if (!runtime->has_index_partition(ctx, src, src_color))
+        return;
+    IndexPartition src_ip = runtime->get_index_partition(ctx, src, src_color);
+    IndexPartition dst_ip = create_subtree_partition(ctx, runtime, dst, layout, n, l, max_depth, dst_color);
+    for (coord_t child = 1; child <= 2; child++) {
+        IndexSpace src_child = runtime->get_index_subspace(ctx, src_ip, DomainPoint(Point<1>(child)));
+        IndexSpace dst_child = runtime->get_index_subspace(ctx, dst_ip, DomainPoint(Point<1>(child)));
+        mirror_tree_partitions(ctx, runtime, src_child, src_color, dst_child, dst_color, layout, n + 1, 2 * l + child - 1, max_depth);
+    }
+}
+
+// Node count of the subtree under every node of a tree, by index. Refine reaches the same nodes from
+// (seed, depth), so this is the work every pass over the subtree has ahead of it.
+unsigned subtree_node_counts(long int seed, int depth, int max_depth, TreeLayout layout, int n, int l, vector<unsigned> &counts) {
+    unsigned count = 1;
+    if (n < depth && refine_draw(seed, n, l) > 3) {
+        count += subtree_node_counts(seed, depth, max_depth, layout, n + 1, 2 * l, counts);
+        count += subtree_node_counts(seed, depth, max_depth, layout, n + 1, 2 * l + 1, counts);
+    }
+    counts[node_index(layout, n, l, max_depth)] = count;
+    return count;
+}
+
+// Subtree node counts of the trees refined in this process, keyed by their partition color. The driver
+// records them when it refines a tree, and the launchers put them into the mapping tags of their tasks.
+map<Color, vector<unsigned> > subtree_cost_table;
+std::mutex subtree_cost_lock;
+
+void record_subtree_costs(Color partition_color, const TreeShape &shape) {
+    vector<unsigned> counts(static_cast<size_t>(pow(2, shape.max_depth + 1)) - 1, 0);
+    subtree_node_counts(shape.seed, shape.depth, shape.max_depth, shape.layout, 0, 0, counts);
+    std::lock_guard<std::mutex> guard(subtree_cost_lock);
+    subtree_cost_table[partition_color].swap(counts);
+}
+
+// For a tree of that color whose shape does not come from refine, the node counts refine recorded for an
+// earlier tree of the color do not describe it
+void forget_subtree_costs(Color partition_color) {
+    std::lock_guard<std::mutex> guard(subtree_cost_lock);
+    subtree_cost_table.erase(partition_color);
+}
+
+// 0 when the tree was not refined here
+size_t subtree_cost(Color partition_color, coord_t idx) {
+    std::lock_guard<std::mutex> guard(subtree_cost_lock);
+    map<Color, vector<unsigned> >::const_iterator it = subtree_cost_table.find(partition_color);
+    if (it == subtree_cost_table.end() || idx < 0 || idx >= (coord_t) it->second.size())
+        return 0;
+    return it->second[idx];
+}
+
+// A mapping tag carries up to two costs of COST_TAG_BITS bits each, the left child of an index launch
+// first. The low COST_TAG_SHIFT bits stay clear for the default mapper's own tags.
+#define COST_TAG_SHIFT 8
+#define COST_TAG_BITS 28
+
+// Whether a subtree with levels_left levels below its root and cost nodes, 0 when that is not known, is
+// swept by one leaf task
+bool sweep_subtree_cost(int levels_left, size_t cost) {
+    if (levels_left <= sweep_levels)
+        return true;
+    if (levels_left > MAX_SWEEP_LEVELS)
+        return false;
+    return cost != 0 && cost <= sweep_nodes;
+}
+
+// Whether a walk at node idx, with levels_left levels of the tree below it, runs the rest of the subtree in
+// one leaf task
+bool sweep_subtree(int levels_left, Color partition_color, coord_t idx) {
+    bool costed = levels_left > sweep_levels && levels_left <= MAX_SWEEP_LEVELS;
+    return sweep_subtree_cost(levels_left, costed ? subtree_cost(partition_color, idx) : 0);
+}
+
+inline MappingTagID cost_tag(size_t cost0, size_t cost1 = 0) {
+    const size_t cost_mask = (static_cast<size_t>(1) << COST_TAG_BITS) - 1;
+    return (static_cast<MappingTagID>(min(cost0, cost_mask)) << COST_TAG_SHIFT) |
+           (static_cast<MappingTagID>(min(cost1, cost_mask)) << (COST_TAG_SHIFT + COST_TAG_BITS));
+}
+
+inline size_t tag_cost(MappingTagID tag, int which) {
+    return (tag >> (COST_TAG_SHIFT + which * COST_TAG_BITS)) & ((static_cast<MappingTagID>(1) << COST_TAG_BITS) - 1);
+}
+
+// Shape of a subtree as seen by compress and reconstruct, one entry per level starting at its root
+struct SubtreeLevels {
+    vector<vector<coord_t> > internal; // idx, left child idx, right child idx of every internal node
+    vector<vector<coord_t> > leaves;   // idx of every leaf
+};
+
+// A node (n, l) at index idx that a sweep task visits
+struct SweepNode {
+    coord_t idx;
+    int n, l;
+    SweepNode(coord_t _idx, int _n, int _l) : idx(_idx), n(_n), l(_l) {}
+};
+
+// The depth where the shape walks below stop: the nodes they reach there are recorded here, neither as
+// internal nodes nor as leaves, and left to a task of their own
+struct ShapeFrontier {
+    int depth;
+    vector<SweepNode> nodes;
+    ShapeFrontier(int _depth) : depth(_depth) {}
+};
+
+// Walks the partitions below node (n, l), whose subtree region is lr, with the test compress_task and
+// reconstruct_task use: a node is internal when refine went on to partition its left child.
+// With frontier, it stops at the frontier depth. Only metadata is touched, so inner tasks can call it.
+void collect_subtree_levels(Context ctx, HighLevelRuntime *runtime, LogicalRegion lr, Color partition_color,
+                            TreeLayout layout, int n, int l, coord_t idx, int max_depth, int level, SubtreeLevels &levels,
+                            ShapeFrontier *frontier = NULL) {
+    if (frontier != NULL && n == frontier->depth) {
+        frontier->nodes.push_back(SweepNode(idx, n, l));
+        return;
+    }
+    if ((int) levels.internal.size() <= level) {
+        levels.internal.resize(level + 1);
+        levels.leaves.resize(level + 1);
+    }
+
+    LogicalPartition lp = runtime->get_logical_partition_by_color(ctx, lr, partition_color);
+    LogicalRegion left_sub_tree_lr = runtime->get_logical_subregion_by_color(ctx, lp, DomainPoint(Point<1>(1LL)));
+    if (!runtime->has_index_partition(ctx, left_sub_tree_lr.get_index_space(), partition_color)) {
+        levels.leaves[level].push_back(idx);
+        return;
+    }
+    LogicalRegion right_sub_tree_lr = runtime->get_logical_subregion_by_color(ctx, lp, DomainPoint(Point<1>(2LL)));
+
+    coord_t idx_left_sub_tree = left_child_index(layout, idx, n, l, max_depth);
+    coord_t idx_right_sub_tree = right_child_index(layout, idx, n, l, max_depth);
+    levels.internal[level].push_back(idx);
+    levels.internal[level].push_back(idx_left_sub_tree);
+    levels.internal[level].push_back(idx_right_sub_tree);
+
+    collect_subtree_levels(ctx, runtime, left_sub_tree_lr, partition_color, layout, n + 1, 2 * l, idx_left_sub_tree, max_depth, level + 1, levels, frontier);
+    collect_subtree_levels(ctx, runtime, right_sub_tree_lr, partition_color, layout, n + 1, 2 * l + 1, idx_right_sub_tree, max_depth, level + 1, levels, frontier);
+}
+
+// Task argument of the sweep tasks: this header followed, level by level, by the 3 * internal_count[v]
+// indices of the internal nodes and then the leaf_count[v] indices of the leaves
+template<typename T>
+struct SweepTaskArgs {
+    Coefs<T> parent_value; // handed to the subtree root, reconstruct only
+    int num_levels;
+    int internal_count[MAX_SWEEP_LEVELS + 1];
+    int leaf_count[MAX_SWEEP_LEVELS + 1];
+};
+
+template<typename T>
+vector<char> pack_sweep_args(const SubtreeLevels &levels, const Coefs<T> &parent_value) {
+    SweepTaskArgs<T> header;
+    header.parent_value = parent_value;
+    header.num_levels = levels.internal.size();
+    assert(header.num_levels <= MAX_SWEEP_LEVELS + 1);
+
+    vector<coord_t> nodes;
+    for (int v = 0; v < header.num_levels; v++) {
+        header.internal_count[v] = levels.internal[v].size() / 3;
+        header.leaf_count[v] = levels.leaves[v].size();
+        nodes.insert(nodes.end(), levels.internal[v].begin(), levels.internal[v].end());
+        nodes.insert(nodes.end(), levels.leaves[v].begin(), levels.leaves[v].end());
+    }
+
+    vector<char> buffer(sizeof(header) + nodes.size() * sizeof(coord_t));
+    memcpy(&buffer[0], &header, sizeof(header));
+    if (!nodes.empty())
+        memcpy(&buffer[sizeof(header)], &nodes[0], nodes.size() * sizeof(coord_t));
+    return buffer;
+}
+
+// Refines the subtree of node (n, l), whose index space is is, without a task per node. The draws only
+// depend on (seed, n, l), so the shape is known up front: this creates the partitions the recursive
+// refine_task would have created and records every node that refine_sweep_task has to set. With levels,
+// it also records the subtree the way collect_subtree_levels would find it once refine is done.
+// With frontier, it stops at the frontier depth.
+void refine_subtree_shape(Context ctx, HighLevelRuntime *runtime, IndexSpace is, const Arguments &args,
+                          int n, int l, coord_t idx, vector<SweepNode> &nodes,
+                          SubtreeLevels *levels = NULL, int level = 0, ShapeFrontier *frontier = NULL) {
+    if (frontier != NULL && n == frontier->depth) {
+        frontier->nodes.push_back(SweepNode(idx, n, l));
+        return;
+    }
+    nodes.push_back(SweepNode(idx, n, l));
+    if (n >= args.actual_max_depth)
+        return;
+
+    IndexPartition ip = create_subtree_partition(ctx, runtime, is, args.layout, n, l, args.max_depth, args.partition_color);
+    bool refined = refine_draw(args.seed, n, l) > 3;
+    coord_t idx_left_sub_tree = left_child_index(args.layout, idx, n, l, args.max_depth);
+    coord_t idx_right_sub_tree = right_child_index(args.layout, idx, n, l, args.max_depth);
+
+    if (levels != NULL) {
+        if ((int) levels->internal.size() <= level) {
+            levels->internal.resize(level + 1);
+            levels->leaves.resize(level + 1);
+        }
+        // the left child only gets a partition of its own when it is above actual_max_depth
+        if (refined && n + 1 < args.actual_max_depth) {
+            levels->internal[level].push_back(idx);
+            levels->internal[level].push_back(idx_left_sub_tree);
+            levels->internal[level].push_back(idx_right_sub_tree);
+        } else {
+            levels->leaves[level].push_back(idx);
+        }
+    }
+    if (!refined)
+        return;
+
+    IndexSpace left_is = runtime->get_index_subspace(ctx, ip, DomainPoint(Point<1>(1LL)));
+    IndexSpace right_is = runtime->get_index_subspace(ctx, ip, DomainPoint(Point<1>(2LL)));
+    refine_subtree_shape(ctx, runtime, left_is, args, n + 1, 2 * l, idx_left_sub_tree, nodes, levels, level + 1, frontier);
+    refine_subtree_shape(ctx, runtime, right_is, args, n + 1, 2 * l + 1, idx_right_sub_tree, nodes, levels, level + 1, frontier);
+}
+
+// Task argument of refine_sweep_task, followed by num_nodes SweepNode entries and, when the
+// sweep compresses too, by the sweep argument buffer of compress_subtree_levels
+struct RefineSweepArgs {
+    long int seed;
+    int max_depth;
+    size_t num_nodes;
+    RefineSweepArgs(long int _seed, int _max_depth, size_t _num_nodes) : seed(_seed), max_depth(_max_depth), num_nodes(_num_nodes) {}
+};
+
+// Launches the refine_sweep_task that sets the nodes refine_subtree_shape recorded in lr and, for COMPRESS,
+// compresses the levels it recorded
+template<typename T, bool COMPRESS>
+void launch_refine_sweep(Context ctx, HighLevelRuntime *runtime, LogicalRegion lr, PrivilegeMode privilege,
+                         const Arguments &args, const vector<SweepNode> &nodes, const SubtreeLevels &levels) {
+    vector<char> compress_args;
+    if (COMPRESS)
+        compress_args = pack_sweep_args(levels, make_coefs(T(0)));
+    vector<char> sweep_args(sizeof(RefineSweepArgs) + nodes.size() * sizeof(SweepNode) + compress_args.size());
+    RefineSweepArgs header(args.seed, args.actual_max_depth, nodes.size());
+    memcpy(&sweep_args[0], &header, sizeof(header));
+    memcpy(&sweep_args[sizeof(header)], &nodes[0], nodes.size() * sizeof(SweepNode));
+    if (COMPRESS)
+        memcpy(&sweep_args[sizeof(header) + nodes.size() * sizeof(SweepNode)], &compress_args[0], compress_args.size());
+
+    TaskLauncher sweep_launcher(task_id<T>(COMPRESS ? REFINE_COMPRESS_SWEEP_TASK_ID : REFINE_SWEEP_TASK_ID),
+                                TaskArgument(&sweep_args[0], sweep_args.size()));
+    sweep_launcher.tag = cost_tag(nodes.size());
+    RegionRequirement req(lr, privilege, EXCLUSIVE, lr);
+    add_coef_fields(req);
+    sweep_launcher.add_region_requirement(req);
+    runtime->execute_task(ctx, sweep_launcher);
+}
+
+TreeLayout parse_layout(const char *name) {
+    if (strcmp(name, "preorder") == 0)
+        return PRE_ORDER_LAYOUT;
+    if (strcmp(name, "level") == 0)
+        return LEVEL_ORDER_LAYOUT;
+    if (strcmp(name, "veb") == 0)
+        return VEB_LAYOUT;
+    fprintf(stderr, "Unknown layout %s, expected preorder, level or veb\n", name);
+    exit(1);
+}
+
+CoefType parse_coef_type(const char *name) {
+    if (strcmp(name, "int") == 0)
+        return INT_COEF;
+    if (strcmp(name, "float") == 0)
+        return FLOAT_COEF;
+    if (strcmp(name, "double") == 0)
+        return DOUBLE_COEF;
+    fprintf(stderr, "Unknown coefficient type %s, expected int, float or double\n", name);
+    exit(1);
+}
+
+CoefStorage parse_coef_storage(const char *name) {
+    if (strcmp(name, "soa") == 0)
+        return SOA_STORAGE;
+    if (strcmp(name, "aos") == 0)
+        return AOS_STORAGE;
+    fprintf(stderr, "Unknown coefficient storage %s, expected soa or aos\n", name);
+    exit(1);
+}
+
+enum InputFormat {
+    SAMPLES_INPUT,
+    RECORDS_INPUT,
+};
+
+InputFormat parse_input_format(const char *name) {
+    if (strcmp(name, "samples") == 0)
+        return SAMPLES_INPUT;
+    if (strcmp(name, "records") == 0)
+        return RECORDS_INPUT;
+    fprintf(stderr, "Unknown input format %s, expected samples or records\n", name);
+    exit(1);
+}
+
+enum Backend {
+    LEGION_BACKEND,
+    NATIVE_BACKEND, // see run_native_operations
+};
+
+Backend parse_backend(const char *name) {
+    if (strcmp(name, "legion") == 0)
+        return LEGION_BACKEND;
+    if (strcmp(name, "native") == 0)
+        return NATIVE_BACKEND;
+    fprintf(stderr, "Unknown backend %s, expected legion or native\n", name);
+    exit(1);
+}
+
+const char *layout_name(TreeLayout layout) {
+    switch (layout) {
+        case PRE_ORDER_LAYOUT: return "preorder";
+        case LEVEL_ORDER_LAYOUT: return "level";
+        case VEB_LAYOUT: return "veb";
+    }
+    return "unknown";
+}
+
+double elapsed_ns(const struct timespec &start, const struct timespec &end) {
+    return (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+}
+
+// Times the two access patterns that care about layout on a plain array of the given depth: a
+// level sweep (level statistics, level-synchronous passes) and a bottom-up parent = left + right pass
+// (compress). Both walk the nodes level by level through a precomputed position table so that the
+// index arithmetic is the same for every layout and only the memory access pattern differs; run
+// under `perf stat -e cache-misses` to see the miss counts behind the timings.
+void benchmark_layouts(int depth) {
+    coord_t num_nodes = (static_cast<coord_t>(1) << (depth + 1)) - 1;
+    TreeLayout layouts[] = {PRE_ORDER_LAYOUT, LEVEL_ORDER_LAYOUT, VEB_LAYOUT};
+
+    for (int i = 0; i < 3; i++) {
+        TreeLayout layout = layouts[i];
+        vector<coord_t> position(num_nodes);
+        for (int n = 0; n <= depth; n++)
+            for (coord_t l = 0; l < (static_cast<coord_t>(1) << n); l++)
+                position[((static_cast<coord_t>(1) << n) - 1) + l] = node_index(layout, n, l, depth);
+
+        vector<int> tree(num_nodes);
+        for (coord_t j = 0; j < num_nodes; j++)
+            tree[position[j]] = static_cast<int>(j % 10);
+
+        struct timespec start, mid, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        long long level_sum = 0;
+        for (coord_t j = 0; j < num_nodes; j++)
+            level_sum += tree[position[j]];
+
+        clock_gettime(CLOCK_MONOTONIC, &mid);
+
+        for (int n = depth - 1; n >= 0; n--) {
+            coord_t first = (static_cast<coord_t>(1) << n) - 1;
+            coord_t first_child = (static_cast<coord_t>(1) << (n + 1)) - 1;
+            for (coord_t l = 0; l < (static_cast<coord_t>(1) << n); l++)
+                tree[position[first + l]] = tree[position[first_child + 2 * l]] + tree[position[first_child + 2 * l + 1]];
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        double sweep_ns = elapsed_ns(start, mid);
+        double compress_ns = elapsed_ns(mid, end);
+        fprintf(stderr, "layout %-8s depth %d: level sweep %.2f ns/node, compress pass %.2f ns/node (checksum %lld, %d)\n",
+                layout_name(layout), depth, sweep_ns / num_nodes, compress_ns / num_nodes, level_sum, tree[position[0]]);
+    }
+}
+
+// Plain array with the same two coefficient storages as CoefAccessor, for benchmark_storage
+template<typename T>
+struct BenchmarkCoefs {
+    vector<T> data;
+    coord_t num_nodes;
+    int order;
+    CoefStorage storage;
+
+    BenchmarkCoefs(coord_t _num_nodes, int _order, CoefStorage _storage)
+        : data(_num_nodes * _order), num_nodes(_num_nodes), order(_order), storage(_storage)
+    {
+        for (coord_t idx = 0; idx < num_nodes; idx++)
+            for (int j = 0; j < order; j++)
+                at(idx, j) = static_cast<T>((idx + j) % 3 + 1);
+    }
+
+    T &at(coord_t idx, int j) {
+        return storage == AOS_STORAGE ? data[idx * order + j] : data[j * num_nodes + idx];
+    }
+
+    void load(coord_t idx, Coefs<T> &coefs) {
+        for (int j = 0; j < order; j++)
+            coefs.c[j] = at(idx, j);
+    }
+
+    void store(coord_t idx, const Coefs<T> &coefs) {
+        for (int j = 0; j < order; j++)
+            at(idx, j) = coefs.c[j];
+    }
+};
+
+// Times the per-node kernels of gaxpy, compress, reconstruct and norm over num_nodes nodes of the
+// current order in both coefficient storages, going through load/store like the leaf tasks do
+template<typename T>
+void benchmark_storage(coord_t num_nodes, int order) {
+    CoefStorage storages[] = {SOA_STORAGE, AOS_STORAGE};
+    const char *names[] = {"soa", "aos"};
+
+    for (int i = 0; i < 2; i++) {
+        BenchmarkCoefs<T> a(num_nodes, order, storages[i]), b(num_nodes, order, storages[i]), out(num_nodes, order, storages[i]);
+        Coefs<T> x, y, z;
+        struct timespec t0, t1, t2, t3, t4;
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (coord_t idx = 0; idx < num_nodes; idx++) {
+            a.load(idx, x);
+            b.load(idx, y);
+            coef_add(z.c, x.c, y.c, order);
+            out.store(idx, z);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        for (coord_t idx = 0; idx < num_nodes / 2; idx++) {
+            a.load(2 * idx, x);
+            a.load(2 * idx + 1, y);
+            coef_add(z.c, x.c, y.c, order);
+            out.store(idx, z);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &t2);
+        for (coord_t idx = 0; idx < num_nodes; idx++) {
+            a.load(idx / 2, x);
+            b.load(idx, y);
+            coef_average(z.c, x.c, y.c, order);
+            out.store(idx, z);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &t3);
+        typename CoefTraits<T>::accum_t norm = 0;
+        for (coord_t idx = 0; idx < num_nodes; idx++) {
+            out.load(idx, x);
+            norm += coef_dot(x.c, x.c, order);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t4);
+
+        fprintf(stderr, "storage %s %s order %d: gaxpy %.2f, compress %.2f, reconstruct %.2f, norm %.2f ns/node (checksum %g)\n",
+                names[i], CoefTraits<T>::name(), order, elapsed_ns(t0, t1) / num_nodes, elapsed_ns(t1, t2) / (num_nodes / 2),
+                elapsed_ns(t2, t3) / num_nodes, elapsed_ns(t3, t4) / num_nodes, static_cast<double>(norm));
+    }
+}
+
+// Name a task was registered under, from its id
+string trace_task_name(unsigned task_id) {
+    static const char *base_names[] = {
+        "top_level", "refine", "set", "print", "read", "compress", "compress_set", "get_coef", "diff", "diff_set",
+        "get_coef_util", "reconstruct_set", "reconstruct", "compress_sweep", "reconstruct_sweep", "refine_sweep",
+        "refine_compress", "refine_compress_sweep", "compress_path", "print_sweep", "eval", "eval_leaf", "integrate",
+        "project", "ingest", "quantize", "wavelet_compress", "wavelet_reconstruct", "wavelet_gaxpy",
+        "wavelet_inner_product", "calibration",
+    };
+    static const char *op_names[] = {
+        "norm", "max_abs", "inner_product", "gaxpy", "multiply", "scale", "abs", "gaxpy_norm", "gaxpy_compress", "gaxpy_compress_norm",
+    };
+    static const char *stage_names[] = {"", "_leaf", "_dense"};
+    static const char *type_names[] = {"int", "float", "double"};
+    static_assert(sizeof(base_names) / sizeof(base_names[0]) == TREE_OP_TASK_ID, "one name per task id");
+    static_assert(sizeof(op_names) / sizeof(op_names[0]) == NUM_TREE_OPS, "one name per tree op");
+
+    unsigned base = task_id % NUM_TASK_IDS, type = task_id / NUM_TASK_IDS;
+    if (type >= NUM_COEF_TYPES)
+        return "unknown";
+    if (base == TOP_LEVEL_TASK_ID || base == GET_COEF_UTIL_TASK_ID || base == CALIBRATION_TASK_ID)
+        return base_names[base];
+    string name;
+    if (base < TREE_OP_TASK_ID)
+        name = base_names[base];
+    else
+        name = string(op_names[(base - TREE_OP_TASK_ID) / NUM_TREE_OP_STAGES]) + stage_names[(base - TREE_OP_TASK_ID) % NUM_TREE_OP_STAGES];
+    return name + "<" + type_names[type] + ">";
+}
+
+// The post-processor of -trace_report. The critical path follows the tree of launches from the top level
+// task, at every step into the child that finished last, which is the one the rest of the run waited on.
+// The level breakdown sums the time of the tasks at every level of the tree; an inner task counts the time
+// it waited on its children too.
+int trace_report(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "Cannot read the trace %s\n", path);
+        return 1;
+    }
+    vector<TraceEvent> events;
+    TraceEvent event;
+    while (fread(&event, sizeof(TraceEvent), 1, file) == 1)
+        events.push_back(event);
+    fclose(file);
+    if (events.empty()) {
+        fprintf(stderr, "No events in %s\n", path);
+        return 1;
+    }
+
+    map<unsigned long long, size_t> by_uid;
+    for (size_t i = 0; i < events.size(); i++)
+        by_uid[events[i].uid] = i;
+    map<unsigned long long, vector<size_t> > children;
+    vector<size_t> roots;
+    long long origin = events[0].start_ns;
+    for (size_t i = 0; i < events.size(); i++) {
+        if (events[i].parent_uid != events[i].uid && by_uid.count(events[i].parent_uid))
+            children[events[i].parent_uid].push_back(i);
+        else
+            roots.push_back(i);
+        origin = min(origin, events[i].start_ns);
+    }
+
+    size_t current = roots[0];
+    for (size_t r = 1; r < roots.size(); r++) {
+        if (events[roots[r]].end_ns > events[current].end_ns)
+            current = roots[r];
+    }
+    vector<size_t> critical(1, current);
+    while (children.count(events[current].uid)) {
+        const vector<size_t> &next = children[events[current].uid];
+        current = next[0];
+        for (size_t c = 1; c < next.size(); c++) {
+            if (events[next[c]].end_ns > events[current].end_ns)
+                current = next[c];
+        }
+        critical.push_back(current);
+    }
+
+    const TraceEvent &root = events[critical[0]];
+    fprintf(stderr, "%zu events, critical path of %zu tasks over %.3f ms:\n", events.size(), critical.size(),
+            (root.end_ns - root.start_ns) / 1e6);
+    for (size_t i = 0; i < critical.size(); i++) {
+        const TraceEvent &e = events[critical[i]];
+        fprintf(stderr, "  %-28s (n: %d, l: %d) proc %llx, starts at %.3f ms, runs %.3f ms\n", trace_task_name(e.task_id).c_str(),
+                e.n, e.l, e.proc, (e.start_ns - origin) / 1e6, (e.end_ns - e.start_ns) / 1e6);
+    }
+
+    map<int, pair<size_t, long long> > levels;
+    for (size_t i = 0; i < events.size(); i++) {
+        pair<size_t, long long> &level = levels[events[i].n];
+        level.first++;
+        level.second += events[i].end_ns - events[i].start_ns;
+    }
+    fprintf(stderr, "time per level (-1 for the tasks over a block of nodes):\n");
+    for (map<int, pair<size_t, long long> >::const_iterator it = levels.begin(); it != levels.end(); ++it) {
+        fprintf(stderr, "  level %3d: %8zu tasks, %10.3f ms, %8.2f us per task\n", it->first, it->second.first,
+                it->second.second / 1e6, it->second.second / 1e3 / it->second.first);
+    }
+    return 0;
+}
+
+// Checks the driver runs on the Legion backend after the diff of the 1st tree, one flag each, every one of
+// them comparing numbers that have to agree (see check_close)
+enum DriverCheck {
+    CHECK_EVAL = 1 << 0,       // -eval
+    CHECK_INTEGRATE = 1 << 1,  // -integrate
+    CHECK_PROJECT = 1 << 2,    // -project
+    CHECK_WAVELETS = 1 << 3,   // -wavelets
+    CHECK_RECOMPRESS = 1 << 4, // -recompress
+};
+
+struct DriverOptions {
+    int overall_max_depth;
+    int actual_left_depth;
+    long int seed;
+    TreeLayout layout;
+    coord_t storage_benchmark_nodes;
+    /* file the 1st tree is built from instead of refine, see tree_ingest */
+    const char *input_path;
+    InputFormat input_format;
+    /* DriverCheck bits */
+    unsigned checks;
+
+    DriverOptions(int _overall_max_depth, int _actual_left_depth, long int _seed, TreeLayout _layout, coord_t _storage_benchmark_nodes,
+                  const char *_input_path = NULL, InputFormat _input_format = SAMPLES_INPUT, unsigned _checks = 0)
+        : overall_max_depth(_overall_max_depth), actual_left_depth(_actual_left_depth), seed(_seed), layout(_layout),
+        storage_benchmark_nodes(_storage_benchmark_nodes), input_path(_input_path), input_format(_input_format), checks(_checks)
+    {}
+};
+
+// Points at which -eval and -wavelets sample the 1st tree: order-point Gauss-Legendre quadrature on every box of
+// the last level, which integrates f and f^2 over [0, 1] exactly. More than this many is refused.
+#define MAX_CHECK_POINTS (size_t(1) << 24)
+
+// Relative tolerance of the driver checks on trees of T, what compress and the transforms lose to rounding.
+// Int trees are exact at order 1 and truncate every filter past it, so top_level_task refuses them there.
+template<typename T>
+double check_tolerance() {
+    return CoefTraits<T>::type == FLOAT_COEF ? 1e-4 : 1e-9;
+}
+
+// Prints a driver check, and fails the run with exit status 1 when value is off expected by more than
+// tolerance times the larger of |expected| and 1
+void check_close(const char *check, const char *what, double value, double expected, double tolerance) {
+    bool ok = fabs(value - expected) <= tolerance * max(fabs(expected), 1.0);
+    fprintf(stderr, "%s: %s %.9g, expected %.9g, tolerance %g: %s\n", check, what, value, expected, tolerance, ok ? "ok" : "FAILED");
+    if (!ok)
+        exit(1);
+}
+
+// Tree op engine. An op is a compile-time functor over single coefficients, of one of three kinds:
+//   REDUCE_OP folds term(x, y) over the nodes of one tree (with y == x) or the common nodes of two trees
+//   ZIP_OP    writes apply(x, y, alpha) into a result tree over the union of two trees, a missing node reading as 0
+//   MAP_OP    rewrites every node of one tree in place with apply(x, x, alpha)
+// A ZIP_OP with reduces_output also folds term(out, out) over the result it writes, in the same pass, and
+// one with compresses_output leaves the result compressed: every block refilters its internal nodes from its
+// leaves right after it wrote them, and the walk refilters the nodes above the blocks once their children are done.
+// All of them share one traversal: tree_op_task walks the partitions and hands every subtree of at most
+// the serial cutoff to one tree_op_leaf_task, and tree_op_dense_task replaces the walk by a single pass
+// over the regions whenever the shapes of the trees are known to line up.
+enum TreeOpKind {
+    REDUCE_OP,
+    ZIP_OP,
+    MAP_OP,
+};
+
+// Defaults every op inherits, so that the engine can name all members whatever the kind
+template<typename T>
+struct TreeOp {
+    typedef typename CoefTraits<T>::accum_t result_t;
+    static const bool leaves_only = false;
+    static const bool reduces_output = false;
+    static const bool compresses_output = false;
+    static result_t identity() { return 0; }
+    static result_t term(T x, T y) { return 0; }
+    static result_t combine(result_t a, result_t b) { return a + b; }
+    static T apply(T x, T y, double alpha) { return x; }
+};
+
+template<typename T>
+inline T coef_abs(T x) { return x < 0 ? -x : x; }
+
+// Sum of squares over the leaves, the square of the norm
+template<typename T>
+struct NormOp : TreeOp<T> {
+    typedef typename TreeOp<T>::result_t result_t;
+    static const TreeOpIDs id = NORM_OP;
+    static const TreeOpKind kind = REDUCE_OP;
+    static const int arity = 1;
+    static const bool leaves_only = true;
+    static result_t term(T x, T) { return static_cast<result_t>(x) * x; }
+};
+
+template<typename T>
+struct MaxAbsOp : TreeOp<T> {
+    typedef typename TreeOp<T>::result_t result_t;
+    static const TreeOpIDs id = MAX_ABS_OP;
+    static const TreeOpKind kind = REDUCE_OP;
+    static const int arity = 1;
+    static result_t term(T x, T) { return coef_abs(static_cast<result_t>(x)); }
+    static result_t combine(result_t a, result_t b) { return a < b ? b : a; }
+};
+
+template<typename T>
+struct InnerProductOp : TreeOp<T> {
+    typedef typename TreeOp<T>::result_t result_t;
+    static const TreeOpIDs id = INNER_PRODUCT_OP;
+    static const TreeOpKind kind = REDUCE_OP;
+    static const int arity = 2;
+    static result_t term(T x, T y) { return static_cast<result_t>(x) * y; }
+};
+
+// x + alpha * y
+template<typename T>
+struct GaxpyOp : TreeOp<T> {
+    static const TreeOpIDs id = GAXPY_OP;
+    static const TreeOpKind kind = ZIP_OP;
+    static const int arity = 2;
+    static T apply(T x, T y, double alpha) { return static_cast<T>(x + alpha * y); }
+};
+
+template<typename T>
+struct MultiplyOp : TreeOp<T> {
+    static const TreeOpIDs id = MULTIPLY_OP;
+    static const TreeOpKind kind = ZIP_OP;
+    static const int arity = 2;
+    static T apply(T x, T y, double) { return x * y; }
+};
+
+template<typename T>
+struct ScaleOp : TreeOp<T> {
+    static const TreeOpIDs id = SCALE_OP;
+    static const TreeOpKind kind = MAP_OP;
+    static const int arity = 1;
+    static T apply(T x, T, double alpha) { return static_cast<T>(alpha * x); }
+};
+
+template<typename T>
+struct AbsOp : TreeOp<T> {
+    static const TreeOpIDs id = ABS_OP;
+    static const TreeOpKind kind = MAP_OP;
+    static const int arity = 1;
+    static T apply(T x, T, double) { return coef_abs(x); }
+};
+
+// Zip followed by a reduction of its result, fused into one op so that the result is reduced while it is
+// written instead of by a second traversal
+template<typename T, typename Zip, typename Reduce>
+struct FusedZipReduce : Zip {
+    typedef typename Reduce::result_t result_t;
+    static const bool leaves_only = Reduce::leaves_only;
+    static const bool reduces_output = true;
+    static result_t identity() { return Reduce::identity(); }
+    static result_t term(T x, T y) { return Reduce::term(x, y); }
+    static result_t combine(result_t a, result_t b) { return Reduce::combine(a, b); }
+};
+
+// The result of a gaxpy and the square of its norm
+template<typename T>
+struct GaxpyNormOp : FusedZipReduce<T, GaxpyOp<T>, NormOp<T> > {
+    static const TreeOpIDs id = GAXPY_NORM_OP;
+};
+
+// The result of a gaxpy, compressed. The zip values of the internal nodes are overwritten by the filter.
+template<typename T>
+struct GaxpyCompressOp : GaxpyOp<T> {
+    static const TreeOpIDs id = GAXPY_COMPRESS_OP;
+    static const bool compresses_output = true;
+};
+
+// The compressed result of a gaxpy and the square of its norm, which only reads the leaves compress leaves as
+// the zip wrote them
+template<typename T>
+struct GaxpyCompressNormOp : FusedZipReduce<T, GaxpyOp<T>, NormOp<T> > {
+    static const TreeOpIDs id = GAXPY_COMPRESS_NORM_OP;
+    static const bool compresses_output = true;
+    static_assert(NormOp<T>::leaves_only, "the norm has to be the same before and after compress");
+};
+
+template<typename T, typename Op>
+TaskID tree_op_task_id(TreeOpStage stage) {
+    return task_id<T>(TASK_IDs(TREE_OP_TASK_ID + Op::id * NUM_TREE_OP_STAGES + stage));
+}
+
+struct TreeOpArguments {
+    int n, l, max_depth;
+    TreeLayout layout;
+    coord_t idx;
+    /* subtree rooted at this node in each input, NO_REGION where that input has no node */
+    LogicalRegion trees[2];
+    Color partition_colors[2];
+    /* color of the partitions ZIP_OP builds on the result tree */
+    Color result_color;
+    double alpha;
+
+    TreeOpArguments(int _n, int _l, int _max_depth, TreeLayout _layout, coord_t _idx, LogicalRegion _tree1, Color _partition_color1,
+                    LogicalRegion _tree2, Color _partition_color2, Color _result_color, double _alpha)
+        : n(_n), l(_l), max_depth(_max_depth), layout(_layout), idx(_idx), result_color(_result_color), alpha(_alpha)
+    {
+        trees[0] = _tree1;
+        trees[1] = _tree2;
+        partition_colors[0] = _partition_color1;
+        partition_colors[1] = _partition_color2;
+    }
+};
+
+// A tree the driver hands to the engine, with its shape when it is known (trees refine grew, and the
+// results of zips over trees of the same shape)
+struct TreeOperand {
+    LogicalRegion lr;
+    Color partition_color;
+    TreeShape shape;
+    bool shape_known;
+    bool quantized; // FID_QUANT holds the coefficients as they are now, read-mostly tasks read it instead
+
+    TreeOperand(LogicalRegion _lr, Color _partition_color, const TreeShape &_shape, bool _shape_known = true)
+        : lr(_lr), partition_color(_partition_color), shape(_shape), shape_known(_shape_known), quantized(false) {}
+};
+
+struct TreeOpDenseArgs {
+    TreeShape shape;
+    double alpha;
+    TreeOpDenseArgs(const TreeShape &_shape, double _alpha) : shape(_shape), alpha(_alpha) {}
+    // the dense pass covers every index of the tree, the cost its launch is tagged with
+    size_t num_nodes() const { return static_cast<size_t>(pow(2, shape.max_depth + 1)) - 1; }
+};
+
+// Adds the regions of a tree op task: the whole input trees for REDUCE_OP and ZIP_OP, which only read them,
+// then the subtree it writes for ZIP_OP (the result) and MAP_OP (the tree itself)
+template<typename Op>
+void add_tree_op_regions(TaskLauncher &launcher, LogicalRegion lr1, LogicalRegion lr2, LogicalRegion write_lr, LogicalRegion write_parent) {
+    unsigned region_idx = 0;
+    if (Op::kind != MAP_OP) {
+        launcher.add_region_requirement(RegionRequirement(lr1, READ_ONLY, EXCLUSIVE, lr1));
+        add_coef_fields(launcher, region_idx++);
+        if (Op::arity == 2) {
+            launcher.add_region_requirement(RegionRequirement(lr2, READ_ONLY, EXCLUSIVE, lr2));
+            add_coef_fields(launcher, region_idx++);
+        }
+    }
+    if (Op::kind == ZIP_OP) {
+        launcher.add_region_requirement(RegionRequirement(write_lr, WRITE_DISCARD, EXCLUSIVE, write_parent));
+        add_coef_fields(launcher, region_idx++);
+    } else if (Op::kind == MAP_OP) {
+        launcher.add_region_requirement(RegionRequirement(write_lr, READ_WRITE, EXCLUSIVE, write_parent));
+        add_coef_fields(launcher, region_idx++);
+    }
+}
+
+// Index launch form of add_tree_op_regions for the two children of a walk node, launched over colors 1..2.
+// Every point reads the same whole input trees; the subtree a child writes is projected out of write_lp by
+// its color with the identity functor.
+template<typename Op>
+void add_tree_op_child_regions(IndexTaskLauncher &launcher, LogicalRegion lr1, LogicalRegion lr2, LogicalPartition write_lp, LogicalRegion write_parent) {
+    unsigned region_idx = 0;
+    if (Op::kind != MAP_OP) {
+        launcher.add_region_requirement(RegionRequirement(lr1, 0, READ_ONLY, EXCLUSIVE, lr1));
+        add_coef_fields(launcher, region_idx++);
+        if (Op::arity == 2) {
+            launcher.add_region_requirement(RegionRequirement(lr2, 0, READ_ONLY, EXCLUSIVE, lr2));
+            add_coef_fields(launcher, region_idx++);
+        }
+    }
+    if (Op::kind == ZIP_OP) {
+        launcher.add_region_requirement(RegionRequirement(write_lp, 0, WRITE_DISCARD, EXCLUSIVE, write_parent));
+        add_coef_fields(launcher, region_idx++);
+    } else if (Op::kind == MAP_OP) {
+        launcher.add_region_requirement(RegionRequirement(write_lp, 0, READ_WRITE, EXCLUSIVE, write_parent));
+        add_coef_fields(launcher, region_idx++);
+    }
+}
+
+// Runs a REDUCE_OP over one tree, or over the common nodes of two
+template<typename T, typename Op>
+Future tree_reduce(Context ctx, HighLevelRuntime *runtime, const TreeOperand &a, const TreeOperand &b) {
+    if (a.shape_known && (Op::arity == 1 || (b.shape_known && a.shape.signature == b.shape.signature))) {
+        TreeOpDenseArgs args(a.shape, 0);
+        TaskLauncher launcher(tree_op_task_id<T, Op>(TREE_OP_DENSE), TaskArgument(&args, sizeof(TreeOpDenseArgs)));
+        launcher.tag = cost_tag(args.num_nodes());
+        add_tree_op_regions<Op>(launcher, a.lr, b.lr, LogicalRegion::NO_REGION, LogicalRegion::NO_REGION);
+        return runtime->execute_task(ctx, launcher);
+    }
+
+    TreeOpArguments args(0, 0, a.shape.max_depth, a.shape.layout, 0, a.lr, a.partition_color, b.lr, b.partition_color, 0, 0);
+    TaskLauncher launcher(tree_op_task_id<T, Op>(TREE_OP_WALK), TaskArgument(&args, sizeof(TreeOpArguments)));
+    add_tree_op_regions<Op>(launcher, a.lr, b.lr, LogicalRegion::NO_REGION, LogicalRegion::NO_REGION);
+    return runtime->execute_task(ctx, launcher);
+}
+
+template<typename T, typename Op>
+Future tree_reduce(Context ctx, HighLevelRuntime *runtime, const TreeOperand &a) {
+    return tree_reduce<T, Op>(ctx, runtime, a, a);
+}
+
+// Runs a ZIP_OP over two trees into the tree in result, which gets its partitions from the walk,
+// and returns the result as an operand. The reduction of an op with reduces_output lands in reduced.
+template<typename T, typename Op>
+TreeOperand tree_zip(Context ctx, HighLevelRuntime *runtime, const TreeOperand &a, const TreeOperand &b,
+                     LogicalRegion result, Color result_color, double alpha = 1, Future *reduced = NULL) {
+    if (a.shape_known && b.shape_known && a.shape.signature == b.shape.signature) {
+        mirror_tree_partitions(ctx, runtime, a.lr.get_index_space(), a.partition_color, result.get_index_space(), result_color,
+                               a.shape.layout, 0, 0, a.shape.max_depth);
+        TreeOpDenseArgs args(a.shape, alpha);
+        TaskLauncher launcher(tree_op_task_id<T, Op>(TREE_OP_DENSE), TaskArgument(&args, sizeof(TreeOpDenseArgs)));
+        launcher.tag = cost_tag(args.num_nodes());
+        add_tree_op_regions<Op>(launcher, a.lr, b.lr, result, result);
+        Future f = runtime->execute_task(ctx, launcher);
+        if (reduced != NULL)
+            *reduced = f;
+        return TreeOperand(result, result_color, a.shape);
+    }
+
+    TreeOpArguments args(0, 0, a.shape.max_depth, a.shape.layout, 0, a.lr, a.partition_color, b.lr, b.partition_color, result_color, alpha);
+    TaskLauncher launcher(tree_op_task_id<T, Op>(TREE_OP_WALK), TaskArgument(&args, sizeof(TreeOpArguments)));
+    add_tree_op_regions<Op>(launcher, a.lr, b.lr, result, result);
+    Future f = runtime->execute_task(ctx, launcher);
+    if (reduced != NULL)
+        *reduced = f;
+    return TreeOperand(result, result_color, a.shape, false);
+}
+
+// Runs a MAP_OP over one tree in place
+template<typename T, typename Op>
+void tree_map(Context ctx, HighLevelRuntime *runtime, const TreeOperand &a, double alpha = 1) {
+    if (a.shape_known) {
+        TreeOpDenseArgs args(a.shape, alpha);
+        TaskLauncher launcher(tree_op_task_id<T, Op>(TREE_OP_DENSE), TaskArgument(&args, sizeof(TreeOpDenseArgs)));
+        launcher.tag = cost_tag(args.num_nodes());
+        add_tree_op_regions<Op>(launcher, a.lr, a.lr, a.lr, a.lr);
+        runtime->execute_task(ctx, launcher);
+        return;
+    }
+
+    TreeOpArguments args(0, 0, a.shape.max_depth, a.shape.layout, 0, a.lr, a.partition_color, a.lr, a.partition_color, 0, alpha);
+    TaskLauncher launcher(tree_op_task_id<T, Op>(TREE_OP_WALK), TaskArgument(&args, sizeof(TreeOpArguments)));
+    add_tree_op_regions<Op>(launcher, a.lr, a.lr, a.lr, a.lr);
+    runtime->execute_task(ctx, launcher);
+}
+
+// Runs a MAP_OP in place over the subtree of node (n, l) of a, whose region sub_lr and index idx come from
+// the partitions of a
+template<typename T, typename Op>
+void tree_map_subtree(Context ctx, HighLevelRuntime *runtime, const TreeOperand &a, LogicalRegion sub_lr, int n, int l, coord_t idx,
+                      double alpha = 1) {
+    TreeOpArguments args(n, l, a.shape.max_depth, a.shape.layout, idx, sub_lr, a.partition_color, sub_lr, a.partition_color, 0, alpha);
+    TaskLauncher launcher(tree_op_task_id<T, Op>(TREE_OP_WALK), TaskArgument(&args, sizeof(TreeOpArguments)));
+    add_tree_op_regions<Op>(launcher, sub_lr, sub_lr, sub_lr, a.lr);
+    runtime->execute_task(ctx, launcher);
+}
+
+// Task argument of quantize_task, followed by the indices of the num_nodes nodes of the tree
+struct QuantizeArgs {
+    coord_t num_nodes;
+    QuantizeArgs(coord_t _num_nodes) : num_nodes(_num_nodes) {}
+};
+
+// Encodes the nodes of the tree, regions[0], into FID_QUANT of the same tree, regions[1]. The indices
+// outside the shape were never written, they are left out.
+template<typename T>
+void quantize_task(const Task *task, const std::vector<PhysicalRegion> &regions, Context ctx, HighLevelRuntime *runtime) {
+    TaskTrace trace(task);
+    const QuantizeArgs *args = (const QuantizeArgs *) task->args;
+    const coord_t *nodes = (const coord_t *) (args + 1);
+    const CoefAccessor<READ_ONLY, T> read_acc(regions[0]);
+    const FieldAccessor<WRITE_DISCARD, char, 1> quant_acc(regions[1], FID_QUANT, quant_field_size());
+    for (coord_t i = 0; i < args->num_nodes; i++) {
+        Coefs<T> coefs;
+        read_acc.load(nodes[i], coefs);
+        quantize_coefs(coefs.c, quant_acc.ptr(nodes[i]));
+    }
+}
+
+// Quantizes a float or double tree into its FID_QUANT field. The bound of -quant_rel_error is relative: every
+// coefficient is within it times the largest coefficient of its node. The coefficient fields stay as they are
+// for the operations that write the tree; until the next write, the tasks that only read it (diff of the
+// tree, eval, integrate) read the quantized field, 1 + k or 1 + 2k bytes a node instead of 4k or 8k. The
+// field comes on top of the coefficient fields, in the same instance, so the tree takes more memory, not
+// less: what shrinks is the data those tasks stream.
+template<typename T>
+TreeOperand tree_quantize(Context ctx, HighLevelRuntime *runtime, const TreeOperand &tree) {
+    assert(coef_format.quant_bits > 0 && CoefTraits<T>::type != INT_COEF);
+    if (!runtime->has_logical_partition_by_color(ctx, tree.lr, tree.partition_color))
+        return tree;
+
+    // every node of the shape is listed once, as an internal node or as a leaf
+    SubtreeLevels levels;
+    collect_subtree_levels(ctx, runtime, tree.lr, tree.partition_color, tree.shape.layout, 0, 0, 0, tree.shape.max_depth, 0, levels);
+    vector<coord_t> nodes;
+    for (size_t level = 0; level < levels.internal.size(); level++) {
+        for (size_t i = 0; i < levels.internal[level].size(); i += 3)
+            nodes.push_back(levels.internal[level][i]);
+        nodes.insert(nodes.end(), levels.leaves[level].begin(), levels.leaves[level].end());
+    }
+
+    vector<char> args(sizeof(QuantizeArgs) + nodes.size() * sizeof(coord_t));
+    QuantizeArgs header(nodes.size());
+    memcpy(&args[0], &header, sizeof(header));
+    memcpy(&args[sizeof(header)], &nodes[0], nodes.size() * sizeof(coord_t));
+    TaskLauncher launcher(task_id<T>(QUANTIZE_TASK_ID), TaskArgument(&args[0], args.size()));
+    launcher.tag = cost_tag(nodes.size());
+    launcher.add_region_requirement(RegionRequirement(tree.lr, READ_ONLY, EXCLUSIVE, tree.lr));
+    add_coef_fields(launcher, 0);
+    launcher.add_region_requirement(RegionRequirement(tree.lr, WRITE_DISCARD, EXCLUSIVE, tree.lr));
+    add_coef_fields(launcher, 1, true);
+    runtime->execute_task(ctx, launcher);
+
+    TreeOperand result = tree;
+    result.quantized = true;
+    return result;
+}
+
+// Subtree launches of the replicated top levels. SUBTREE_PROJECTION_ID + levels - 1 projects point l of a
+// launch over the nodes at depth levels onto the subtree of node (levels, l).
+enum {
+    SUBTREE_PROJECTION_ID = 1,
+    SUBTREE_SHARDING_ID = 1,
+};
+
+// The upper bound is the partition of the root, every level below goes through the partition of the same color
+class SubtreeProjectionFunctor : public ProjectionFunctor {
+public:
+    SubtreeProjectionFunctor(int _levels) : levels(_levels) {}
+
+    virtual LogicalRegion project(LogicalPartition upper_bound, const DomainPoint &point, const Domain &launch_domain) {
+        Color partition_color = runtime->get_logical_partition_color(upper_bound);
+        coord_t l = point[0];
+        LogicalPartition lp = upper_bound;
+        LogicalRegion lr = runtime->get_logical_subregion_by_color(lp, DomainPoint(Point<1>(1 + ((l >> (levels - 1)) & 1))));
+        for (int n = 2; n <= levels; n++) {
+            lp = runtime->get_logical_partition_by_color(lr, partition_color);
+            lr = runtime->get_logical_subregion_by_color(lp, DomainPoint(Point<1>(1 + ((l >> (levels - n)) & 1))));
+        }
+        return lr;
+    }
+
+    virtual bool is_functional() const { return true; }
+    virtual unsigned get_depth() const { return levels - 1; }
+
+private:
+    int levels;
+};
+
+// Hands each shard a contiguous block of the positions of a subtree launch, so that the subtrees a shard
+// analyzes and launches are neighbours in the tree
+class SubtreeShardingFunctor : public ShardingFunctor {
+public:
+    virtual ShardID shard(const DomainPoint &point, const Domain &full_space, const size_t total_shards) {
+        Rect<1> bounds = full_space;
+        coord_t positions = bounds.hi[0] - bounds.lo[0] + 1;
+        return (point[0] - bounds.lo[0]) * total_shards / positions;
+    }
+};
+
+inline bool is_subtree_projection(ProjectionID id) {
+    return id >= SUBTREE_PROJECTION_ID && id < SUBTREE_PROJECTION_ID + MAX_SHARD_LEVELS;
+}
+
+// Deferred driver API. Operations on trees are only recorded, and the plan launches them when a result is
+// asked for, fusing a pass into the one before it where the two can share a traversal:
+//   refine + compress      refine_task<T, true> compresses every block right after it set it
+//   gaxpy + norm           GaxpyNormOp reduces the result while the zip writes it
+//   gaxpy + compress       GaxpyCompressOp compresses every block of the result right after the zip wrote it,
+//                          and the walk refilters the nodes above the blocks, so the uncompressed result only
+//                          ever exists a block at a time
+//   gaxpy + compress + norm
+//                          GaxpyCompressNormOp does both, the norm of the leaves being the same either side of
+//                          compress, whichever order the two were recorded in
+// Writes to part of a compressed tree are marked dirty on the plan, and recompress then only redoes the
+// dirty subtrees and the paths from them to the root instead of the whole tree. The plan marks the trees its
+// own steps write itself, and recompresses a tree whose marks it cannot know, one it did not compress, in full.
+enum PlanStepKind {
+    PLAN_REFINE,
+    PLAN_COMPRESS,
+    PLAN_RECOMPRESS,
+    PLAN_RECONSTRUCT,
+    PLAN_GAXPY,
+    PLAN_NORM,
+    PLAN_DIFF,
+    PLAN_QUANTIZE,
+    PLAN_SCALE,
+};
+
+struct PlanStep {
+    PlanStepKind kind;
+    /* operand trees */
+    int a, b;
+    /* tree or future the step produces */
+    int result;
+    double alpha;
+    /* region diff hands to the nodes it has no subtree for */
+    LogicalRegion dummy_lr;
+    /* node whose subtree PLAN_SCALE writes */
+    int n, l;
+    /* (n, l) of the nodes written since the last compress, for recompress */
+    set<pair<int, int> > dirty;
+
+    PlanStep(PlanStepKind _kind, int _a, int _b, int _result, double _alpha = 0, LogicalRegion _dummy_lr = LogicalRegion::NO_REGION)
+        : kind(_kind), a(_a), b(_b), result(_result), alpha(_alpha), dummy_lr(_dummy_lr), n(0), l(0) {}
+};
+
+template<typename T>
+class TreePlan {
+public:
+    TreePlan(Context _ctx, HighLevelRuntime *_runtime) : ctx(_ctx), runtime(_runtime) {}
+
+    // Each of these records one step and returns the handle of the tree or the future it produces
+    int refine(LogicalRegion lr, Color partition_color, const TreeShape &shape) {
+        trees.push_back(TreeOperand(lr, partition_color, shape));
+        steps.push_back(PlanStep(PLAN_REFINE, -1, -1, trees.size() - 1));
+        return trees.size() - 1;
+    }
+
+    // A tree already in place, such as the state a time step starts from or a tree read from an input file
+    int existing(LogicalRegion lr, Color partition_color, const TreeShape &shape, bool shape_known = true) {
+        trees.push_back(TreeOperand(lr, partition_color, shape, shape_known));
+        return trees.size() - 1;
+    }
+
+    void compress(int tree) {
+        steps.push_back(PlanStep(PLAN_COMPRESS, tree, -1, tree));
+        dirty[tree].clear();
+    }
+
+    // Records that node (n, l) of a compressed tree, or the subtree below it, was written. The steps that
+    // write part of a tree mark it themselves; the driver marks writes it makes behind the plan's back. A
+    // tree the plan did not compress has no marks to add to, it is compressed in full anyway, and neither
+    // do the results of gaxpy and diff, which are new trees every time.
+    void mark_dirty(int tree, int n, int l) {
+        map<int, set<pair<int, int> > >::iterator it = dirty.find(tree);
+        if (it != dirty.end())
+            it->second.insert(make_pair(n, l));
+    }
+
+    // Compresses again what the writes marked since the last compress have touched, or the whole tree when
+    // the marks are unknown or cover the root
+    void recompress(int tree) {
+        map<int, set<pair<int, int> > >::iterator it = dirty.find(tree);
+        if (it == dirty.end() || it->second.count(make_pair(0, 0))) {
+            compress(tree);
+            return;
+        }
+        steps.push_back(PlanStep(PLAN_RECOMPRESS, tree, -1, tree));
+        steps.back().dirty.swap(it->second);
+    }
+
+    void reconstruct(int tree) {
+        steps.push_back(PlanStep(PLAN_RECONSTRUCT, tree, -1, tree));
+        mark_dirty(tree, 0, 0);
+    }
+
+    int gaxpy(int a, int b, LogicalRegion result, Color result_color, double alpha = 1) {
+        trees.push_back(TreeOperand(result, result_color, trees[a].shape, false));
+        steps.push_back(PlanStep(PLAN_GAXPY, a, b, trees.size() - 1, alpha));
+        return trees.size() - 1;
+    }
+
+    // Scales f on the box of node (n, l) by alpha: every node of its subtree, or of the leaf above it where the
+    // tree stops higher (see node). Only that subtree and its ancestors go stale, which the mark records.
+    void scale(int tree, int n, int l, double alpha) {
+        steps.push_back(PlanStep(PLAN_SCALE, tree, -1, tree, alpha));
+        steps.back().n = n;
+        steps.back().l = l;
+        mark_dirty(tree, n, l);
+    }
+
+    // The square of the norm
+    int norm(int tree) {
+        futures.push_back(Future());
+        steps.push_back(PlanStep(PLAN_NORM, tree, -1, futures.size() - 1));
+        return futures.size() - 1;
+    }
+
+    int diff(int tree, LogicalRegion result, Color result_color, LogicalRegion dummy_lr) {
+        trees.push_back(TreeOperand(result, result_color, trees[tree].shape, false));
+        steps.push_back(PlanStep(PLAN_DIFF, tree, -1, trees.size() - 1, 0, dummy_lr));
+        return trees.size() - 1;
+    }
+
+    // Reads of the tree go to its quantized field from here until a step writes it (see tree_quantize)
+    void quantize(int tree) {
+        steps.push_back(PlanStep(PLAN_QUANTIZE, tree, -1, tree));
+    }
+
+    Future future(int handle) {
+        flush();
+        return futures[handle];
+    }
+
+    // A copy, as later steps grow trees
+    TreeOperand tree(int handle) {
+        flush();
+        return trees[handle];
+    }
+
+    // Moves (n, l) up to the node of the tree that holds its box: itself, or the leaf above it
+    void node(int tree, int &n, int &l) {
+        flush();
+        coord_t idx;
+        find_node(trees[tree], n, l, idx);
+    }
+
+    // Launches every recorded step
+    void flush() {
+        for (size_t i = 0; i < steps.size(); i++) {
+            const PlanStep &step = steps[i];
+            const PlanStep *next = i + 1 < steps.size() ? &steps[i + 1] : NULL;
+            switch (step.kind) {
+            case PLAN_REFINE: {
+                bool fuse = next != NULL && next->kind == PLAN_COMPRESS && next->a == step.result;
+                launch_refine(trees[step.result], fuse);
+                if (fuse)
+                    i++;
+                break;
+            }
+            case PLAN_COMPRESS:
+                launch_compress(trees[step.a]);
+                trees[step.a].quantized = false;
+                break;
+            case PLAN_RECOMPRESS:
+                launch_recompress(trees[step.a], step.dirty);
+                trees[step.a].quantized = false;
+                break;
+            case PLAN_RECONSTRUCT:
+                launch_reconstruct(trees[step.a]);
+                trees[step.a].quantized = false;
+                break;
+            case PLAN_GAXPY: {
+                // the steps right after it on its result it takes in: a compress and a norm, in either order
+                const PlanStep *compress = NULL, *norm = NULL;
+                for (size_t j = i + 1; j < steps.size() && j <= i + 2 && steps[j].a == step.result; j++) {
+                    if (steps[j].kind == PLAN_COMPRESS && compress == NULL)
+                        compress = &steps[j];
+                    else if (steps[j].kind == PLAN_NORM && norm == NULL)
+                        norm = &steps[j];
+                    else
+                        break;
+                }
+                i += (compress != NULL) + (norm != NULL);
+                const TreeOperand &result = trees[step.result];
+                if (compress != NULL && norm != NULL) {
+                    trees[step.result] = tree_zip<T, GaxpyCompressNormOp<T> >(ctx, runtime, trees[step.a], trees[step.b], result.lr,
+                                                                              result.partition_color, step.alpha, &futures[norm->result]);
+                } else if (compress != NULL) {
+                    trees[step.result] = tree_zip<T, GaxpyCompressOp<T> >(ctx, runtime, trees[step.a], trees[step.b], result.lr,
+                                                                          result.partition_color, step.alpha);
+                } else if (norm != NULL) {
+                    trees[step.result] = tree_zip<T, GaxpyNormOp<T> >(ctx, runtime, trees[step.a], trees[step.b], result.lr,
+                                                                      result.partition_color, step.alpha, &futures[norm->result]);
+                } else {
+                    trees[step.result] = tree_zip<T, GaxpyOp<T> >(ctx, runtime, trees[step.a], trees[step.b], result.lr,
+                                                                  result.partition_color, step.alpha);
+                }
+                break;
+            }
+            case PLAN_NORM:
+                futures[step.result] = tree_reduce<T, NormOp<T> >(ctx, runtime, trees[step.a]);
+                break;
+            case PLAN_DIFF:
+                launch_diff(trees[step.a], trees[step.result], step.dummy_lr);
+                break;
+            case PLAN_QUANTIZE:
+                trees[step.a] = tree_quantize<T>(ctx, runtime, trees[step.a]);
+                break;
+            case PLAN_SCALE: {
+                int n = step.n, l = step.l;
+                coord_t idx;
+                LogicalRegion lr = find_node(trees[step.a], n, l, idx);
+                tree_map_subtree<T, ScaleOp<T> >(ctx, runtime, trees[step.a], lr, n, l, idx, step.alpha);
+                trees[step.a].quantized = false;
+                break;
+            }
+            }
+        }
+        steps.clear();
+    }
+
+private:
+    void launch_refine(const TreeOperand &tree, bool compress) {
+        record_subtree_costs(tree.partition_color, tree.shape);
+        Arguments args(0, 0, tree.shape.max_depth, tree.shape.layout, 0, tree.partition_color, tree.shape.depth, tree.shape.seed);
+        int levels = min(shard_levels, tree.shape.depth);
+        if (levels > 0) {
+            // the top levels are refined here, their sweep runs last as compressing them needs the subtrees
+            vector<SweepNode> nodes;
+            SubtreeLevels top;
+            ShapeFrontier frontier(levels);
+            refine_subtree_shape(ctx, runtime, tree.lr.get_index_space(), args, 0, 0, 0, nodes, compress ? &top : NULL, 0, &frontier);
+            launch_subtrees(task_id<T>(compress ? REFINE_COMPRESS_TASK_ID : REFINE_TASK_ID), tree, WRITE_DISCARD, frontier);
+            if (compress)
+                launch_refine_sweep<T, true>(ctx, runtime, tree.lr, READ_WRITE, args, nodes, top);
+            else
+                launch_refine_sweep<T, false>(ctx, runtime, tree.lr, READ_WRITE, args, nodes, top);
+            return;
+        }
+        TaskLauncher launcher(task_id<T>(compress ? REFINE_COMPRESS_TASK_ID : REFINE_TASK_ID), TaskArgument(&args, sizeof(Arguments)));
+        launcher.add_region_requirement(RegionRequirement(tree.lr, WRITE_DISCARD, EXCLUSIVE, tree.lr));
+        add_coef_fields(launcher, 0);
+        runtime->execute_task(ctx, launcher);
+    }
+
+    void launch_compress(const TreeOperand &tree) {
+        Arguments args(0, 0, tree.shape.max_depth, tree.shape.layout, 0, tree.partition_color, tree.shape.depth, tree.shape.seed);
+        int levels = min(shard_levels, tree.shape.depth);
+        if (levels > 0 && runtime->has_logical_partition_by_color(ctx, tree.lr, tree.partition_color)) {
+            SubtreeLevels top;
+            ShapeFrontier frontier(levels);
+            collect_subtree_levels(ctx, runtime, tree.lr, tree.partition_color, tree.shape.layout, 0, 0, 0, tree.shape.max_depth, 0, top, &frontier);
+            launch_subtrees(task_id<T>(COMPRESS_TASK_ID), tree, READ_WRITE, frontier);
+            vector<char> sweep_args = pack_sweep_args(top, make_coefs(T(0)));
+            TaskLauncher launcher(task_id<T>(COMPRESS_SWEEP_TASK_ID), TaskArgument(&sweep_args[0], sweep_args.size()));
+            launcher.add_region_requirement(RegionRequirement(tree.lr, READ_WRITE, EXCLUSIVE, tree.lr));
+            add_coef_fields(launcher, 0);
+            runtime->execute_task(ctx, launcher);
+            return;
+        }
+        TaskLauncher launcher(task_id<T>(COMPRESS_TASK_ID), TaskArgument(&args, sizeof(Arguments)));
+        launcher.add_region_requirement(RegionRequirement(tree.lr, READ_WRITE, EXCLUSIVE, tree.lr));
+        add_coef_fields(launcher, 0);
+        runtime->execute_task(ctx, launcher);
+    }
+
+    // Launches task_id on the subtree of every frontier node in one index launch, projected out of the
+    // partition of the root by SubtreeProjectionFunctor, so that under control replication each shard
+    // analyzes the launches of its own block of subtrees
+    void launch_subtrees(TaskID task_id, const TreeOperand &tree, PrivilegeMode privilege, const ShapeFrontier &frontier) {
+        if (frontier.nodes.empty())
+            return;
+        vector<DomainPoint> points;
+        ArgumentMap arg_map;
+        for (size_t i = 0; i < frontier.nodes.size(); i++) {
+            const SweepNode &node = frontier.nodes[i];
+            Arguments args(node.n, node.l, tree.shape.max_depth, tree.shape.layout, node.idx, tree.partition_color,
+                           tree.shape.depth, tree.shape.seed);
+            points.push_back(DomainPoint(Point<1>(node.l)));
+            arg_map.set_point(points.back(), TaskArgument(&args, sizeof(Arguments)));
+        }
+        IndexSpace launch_space = runtime->create_index_space(ctx, points);
+        IndexTaskLauncher launcher(task_id, launch_space, TaskArgument(NULL, 0), arg_map);
+        LogicalPartition lp = runtime->get_logical_partition_by_color(ctx, tree.lr, tree.partition_color);
+        launcher.add_region_requirement(RegionRequirement(lp, SUBTREE_PROJECTION_ID + frontier.depth - 1, privilege, EXCLUSIVE, tree.lr));
+        add_coef_fields(launcher, 0);
+        runtime->execute_index_space(ctx, launcher);
+        runtime->destroy_index_space(ctx, launch_space);
+    }
+
+    // Finds the subtree of the nearest node at or above (n, l) that the tree has: an existing node is partitioned
+    LogicalRegion find_node(const TreeOperand &tree, int &n, int &l, coord_t &idx) {
+        LogicalRegion lr = tree.lr;
+        int target_n = n, target_l = l;
+        n = l = 0;
+        idx = 0;
+        while (n < target_n) {
+            LogicalPartition lp = runtime->get_logical_partition_by_color(ctx, lr, tree.partition_color);
+            int child_l = target_l >> (target_n - n - 1);
+            LogicalRegion child_lr = runtime->get_logical_subregion_by_color(ctx, lp, DomainPoint(Point<1>(1LL + (child_l & 1))));
+            if (!runtime->has_logical_partition_by_color(ctx, child_lr, tree.partition_color))
+                break;
+            idx = (child_l & 1) ? right_child_index(tree.shape.layout, idx, n, l, tree.shape.max_depth)
+                                : left_child_index(tree.shape.layout, idx, n, l, tree.shape.max_depth);
+            lr = child_lr;
+            n++;
+            l = child_l;
+        }
+        return lr;
+    }
+
+    // Recompresses the subtree of every dirty node, then every ancestor of one, deepest level first. The
+    // ancestors of an existing node are all internal, so each of them is refiltered from its two children.
+    void launch_recompress(const TreeOperand &tree, const set<pair<int, int> > &dirty_nodes) {
+        if (!runtime->has_logical_partition_by_color(ctx, tree.lr, tree.partition_color))
+            return;
+
+        set<pair<int, int> > nodes;
+        for (set<pair<int, int> >::const_iterator it = dirty_nodes.begin(); it != dirty_nodes.end(); ++it) {
+            int n = it->first, l = it->second;
+            coord_t idx;
+            find_node(tree, n, l, idx);
+            nodes.insert(make_pair(n, l));
+        }
+
+        // a dirty node below another one is recompressed with it, the set visits shallower nodes first
+        vector<pair<int, int> > roots;
+        for (set<pair<int, int> >::const_iterator it = nodes.begin(); it != nodes.end(); ++it) {
+            int n = it->first, l = it->second;
+            coord_t idx;
+            LogicalRegion lr = find_node(tree, n, l, idx);
+            bool covered = false;
+            for (size_t r = 0; r < roots.size() && !covered; r++)
+                covered = n >= roots[r].first && (l >> (n - roots[r].first)) == roots[r].second;
+            if (covered)
+                continue;
+            roots.push_back(make_pair(n, l));
+
+            Arguments args(n, l, tree.shape.max_depth, tree.shape.layout, idx, tree.partition_color);
+            TaskLauncher launcher(task_id<T>(COMPRESS_TASK_ID), TaskArgument(&args, sizeof(Arguments)));
+            launcher.add_region_requirement(RegionRequirement(lr, READ_WRITE, EXCLUSIVE, tree.lr));
+            add_coef_fields(launcher, 0);
+            runtime->execute_task(ctx, launcher);
+        }
+
+        set<pair<int, int> > ancestors;
+        for (size_t r = 0; r < roots.size(); r++) {
+            for (int n = roots[r].first - 1; n >= 0; n--)
+                ancestors.insert(make_pair(n, roots[r].second >> (roots[r].first - n)));
+        }
+        if (ancestors.empty())
+            return;
+
+        vector<CompressPathNode> path;
+        for (set<pair<int, int> >::const_reverse_iterator it = ancestors.rbegin(); it != ancestors.rend(); ++it) {
+            int n = it->first, l = it->second;
+            coord_t idx = node_index(tree.shape.layout, n, l, tree.shape.max_depth);
+            path.push_back(CompressPathNode(idx, left_child_index(tree.shape.layout, idx, n, l, tree.shape.max_depth),
+                                            right_child_index(tree.shape.layout, idx, n, l, tree.shape.max_depth), n));
+        }
+        TaskLauncher launcher(task_id<T>(COMPRESS_PATH_TASK_ID), TaskArgument(&path[0], path.size() * sizeof(CompressPathNode)));
+        launcher.add_region_requirement(RegionRequirement(tree.lr, READ_WRITE, EXCLUSIVE, tree.lr));
+        add_coef_fields(launcher, 0);
+        runtime->execute_task(ctx, launcher);
+    }
+
+    void launch_reconstruct(const TreeOperand &tree) {
+        ReConstructArguments<T> args(0, 0, tree.shape.max_depth, tree.shape.layout, 0, tree.partition_color, make_coefs(T(0)));
+        TaskLauncher launcher(task_id<T>(RECONSTRUCT_TASK_ID), TaskArgument(&args, sizeof(ReConstructArguments<T>)));
+        launcher.add_region_requirement(RegionRequirement(tree.lr, READ_WRITE, EXCLUSIVE, tree.lr));
+        add_coef_fields(launcher, 0);
+        runtime->execute_task(ctx, launcher);
+    }
+
+    void launch_diff(const TreeOperand &tree, const TreeOperand &result, LogicalRegion dummy_lr) {
+        DiffArguments<T> args(0, 0, tree.shape.max_depth, tree.shape.layout, 0, tree.partition_color, result.partition_color,
+                              tree.shape.depth, make_coefs(T(100)), false);
+        TaskLauncher launcher(task_id<T>(DIFF_TASK_ID), TaskArgument(&args, sizeof(DiffArguments<T>)));
+        launcher.add_region_requirement(RegionRequirement(tree.lr, READ_ONLY, EXCLUSIVE, tree.lr));
+        launcher.add_region_requirement(RegionRequirement(result.lr, WRITE_DISCARD, EXCLUSIVE, result.lr));
+        launcher.add_region_requirement(RegionRequirement(tree.lr, READ_ONLY, EXCLUSIVE, tree.lr));
+        launcher.add_region_requirement(RegionRequirement(dummy_lr, READ_ONLY, EXCLUSIVE, dummy_lr));
+        // the tree is only read, through its quantized field when it has one
+        for (unsigned r = 0; r < 4; r++)
+            add_coef_fields(launcher, r, tree.quantized && (r == 0 || r == 2));
+        runtime->execute_task(ctx, launcher);
+    }
+
+    Context ctx;
+    HighLevelRuntime *runtime;
+    vector<TreeOperand> trees;
+    vector<Future> futures;
+    vector<PlanStep> steps;
+    /* nodes marked since the last compress or recompress of each tree the plan compressed */
+    map<int, set<pair<int, int> > > dirty;
+};
+
+// A region from TreePool and the partition color its hierarchy for the requested key is built with
+struct PooledTree {
+    LogicalRegion lr;
+    Color partition_color;
+    PooledTree(LogicalRegion _lr, Color _partition_color) : lr(_lr), partition_color(_partition_color) {}
+};
+
+// Partition hierarchies a pooled region keeps, the least recently used one is destroyed beyond that
+#define MAX_POOL_HIERARCHIES 4
+#define POOL_PARTITION_COLOR 100
+// Semantic tag TreePool attaches to the regions it owns, which the mapper keeps the instances of
+#define POOL_SEMANTIC_TAG 100
+
+// What builds the tree a region of TreePool is asked for, the first half of its key
+enum PoolKind {
+    POOL_REFINED,   // refine, keyed by the signature of the shape
+    POOL_DERIVED,   // the result of a plan step, keyed by derived_key of its operands
+    POOL_INGESTED,  // tree_ingest, keyed by input_key of the file
+    POOL_PROJECTED, // tree_project, keyed by projection_key of the function and tolerance
+    POOL_SCRATCH,   // never partitioned, such as the dummy region of diff
+};
+
+typedef pair<PoolKind, unsigned long long> PoolKey;
+
+// Recycles the regions of trees between the iterations of a solver, together with the partitions built
+// in them. Every region has an index space of its own, since the partitions live on the index space, and
+// a hierarchy of each color per key, the kind of tree and a signature of its shape. A tree asked for with a
+// key some free region already holds a hierarchy for gets that region and color, and refine, gaxpy or diff
+// then find every partition they need, so an iteration that repeats the shapes of the one before creates
+// nothing in the runtime.
+template<typename T>
+class TreePool {
+public:
+    TreePool(Context _ctx, HighLevelRuntime *_runtime, int _max_depth)
+        : ctx(_ctx), runtime(_runtime), max_depth(_max_depth)
+    {
+        fs = runtime->create_field_space(ctx);
+        FieldAllocator allocator = runtime->create_field_allocator(ctx, fs);
+        allocate_coef_fields<T>(allocator);
+    }
+
+    // Signature of the result of an operation of kind on trees with signatures a and b
+    static unsigned long long derived_key(PlanStepKind kind, unsigned long long a, unsigned long long b = 0) {
+        return splitmix64(splitmix64(a ^ kind) ^ b);
+    }
+
+    // Signature of the tree built from the input file at path
+    static unsigned long long input_key(const char *path) {
+        unsigned long long key = 0;
+        for (const char *c = path; *c; c++)
+            key = splitmix64(key ^ static_cast<unsigned char>(*c));
+        return key;
+    }
+
+    // Signature of the tree tree_project builds from the function called name to tolerance
+    static unsigned long long projection_key(const char *name, double tolerance) {
+        unsigned long long bits;
+        memcpy(&bits, &tolerance, sizeof(bits));
+        return splitmix64(input_key(name) ^ bits);
+    }
+
+    PooledTree acquire(const PoolKey &key) {
+        return acquire(key.first, key.second);
+    }
+
+    PooledTree acquire(PoolKind kind, unsigned long long signature) {
+        PoolKey key(kind, signature);
+        int best = -1;
+        for (size_t i = 0; i < entries.size(); i++) {
+            if (entries[i].in_use)
+                continue;
+            if (find_hierarchy(entries[i], key) >= 0) {
+                best = i;
+                break;
+            }
+            if (best < 0 || entries[i].hierarchies.size() < entries[best].hierarchies.size())
+                best = i;
+        }
+        if (best < 0) {
+            PoolEntry entry;
+            Rect<1> tree_rect(0LL, static_cast<coord_t>(pow(2, max_depth + 1)) - 2);
+            entry.is = runtime->create_index_space(ctx, tree_rect);
+            entry.lr = runtime->create_logical_region(ctx, entry.is, fs);
+            bool owned = true;
+            runtime->attach_semantic_information(entry.lr, POOL_SEMANTIC_TAG, &owned, sizeof(owned));
+            entries.push_back(entry);
+            best = entries.size() - 1;
+        }
+
+        PoolEntry &entry = entries[best];
+        entry.in_use = true;
+        if (kind == POOL_SCRATCH)
+            return PooledTree(entry.lr, 0);
+        int h = find_hierarchy(entry, key);
+        pair<PoolKey, Color> hierarchy;
+        if (h >= 0) {
+            hierarchy = entry.hierarchies[h];
+            entry.hierarchies.erase(entry.hierarchies.begin() + h);
+        } else if (entry.hierarchies.size() < MAX_POOL_HIERARCHIES) {
+            hierarchy = make_pair(key, POOL_PARTITION_COLOR + (Color) entry.hierarchies.size());
+        } else {
+            // the root partition takes every partition below it along
+            hierarchy = make_pair(key, entry.hierarchies.front().second);
+            if (runtime->has_index_partition(ctx, entry.is, hierarchy.second))
+                runtime->destroy_index_partition(ctx, runtime->get_index_partition(ctx, entry.is, hierarchy.second));
+            entry.hierarchies.erase(entry.hierarchies.begin());
+        }
+        entry.hierarchies.push_back(hierarchy);
+        return PooledTree(entry.lr, hierarchy.second);
+    }
+
+    void release(LogicalRegion lr) {
+        for (size_t i = 0; i < entries.size(); i++) {
+            if (entries[i].lr == lr)
+                entries[i].in_use = false;
+        }
+    }
+
+    FieldSpace field_space() const { return fs; }
+
+    void destroy() {
+        for (size_t i = 0; i < entries.size(); i++) {
+            runtime->destroy_logical_region(ctx, entries[i].lr);
+            runtime->destroy_index_space(ctx, entries[i].is);
+        }
+        entries.clear();
+        runtime->destroy_field_space(ctx, fs);
+    }
+
+private:
+    struct PoolEntry {
+        IndexSpace is;
+        LogicalRegion lr;
+        bool in_use;
+        /* key and color of every hierarchy built in the region, least recently used first */
+        vector<pair<PoolKey, Color> > hierarchies;
+        PoolEntry() : in_use(false) {}
+    };
+
+    static int find_hierarchy(const PoolEntry &entry, const PoolKey &key) {
+        for (size_t h = 0; h < entry.hierarchies.size(); h++) {
+            if (entry.hierarchies[h].first == key)
+                return h;
+        }
+        return -1;
+    }
+
+    Context ctx;
+    HighLevelRuntime *runtime;
+    int max_depth;
+    FieldSpace fs;
+    vector<PoolEntry> entries;
+};
+
+// The input and output tree of a time stepping loop. Each step writes its result to back(), asked for with
+// the key of its shape, and swap() makes it the input of the next step and hands the old input back to the
+// pool; in steady state the two regions alternate with their hierarchies in place.
+template<typename T>
+class TreeDoubleBuffer {
+public:
+    TreeDoubleBuffer(TreePool<T> &_pool, const PoolKey &key)
+        : pool(_pool), current(_pool.acquire(key)), next(LogicalRegion::NO_REGION, 0), has_next(false) {}
+
+    const PooledTree &front() const { return current; }
+
+    const PooledTree &back(const PoolKey &key) {
+        if (!has_next) {
+            next = pool.acquire(key);
+            has_next = true;
+        }
+        return next;
+    }
+
+    void swap() {
+        assert(has_next);
+        pool.release(current.lr);
+        current = next;
+        has_next = false;
+    }
+
+private:
+    TreePool<T> &pool;
+    PooledTree current, next;
+    bool has_next;
+};
+
+template<typename T>
+TreeOperand tree_ingest(Context ctx, HighLevelRuntime *runtime, const char *path, InputFormat format,
+                        LogicalRegion lr, Color partition_color, TreeLayout layout, int max_depth);
+
+template<typename T>
+vector<double> tree_eval(Context ctx, HighLevelRuntime *runtime, const TreeOperand &tree, const vector<double> &points);
+
+template<typename T>
+vector<double> tree_integrate(Context ctx, HighLevelRuntime *runtime, const TreeOperand &tree, const vector<pair<double, double> > &intervals);
+
+template<typename T>
+double tree_root_sum(Context ctx, HighLevelRuntime *runtime, const TreeOperand &tree);
+
+int parse_projected_function(const char *name);
+
+template<typename T>
+TreeOperand tree_project(Context ctx, HighLevelRuntime *runtime, LogicalRegion lr, Color partition_color, TreeLayout layout,
+                         int max_depth, int function, double tolerance, int max_level, size_t *unresolved);
+
+template<typename T>
+Future tree_wavelet_round_trip(Context ctx, HighLevelRuntime *runtime, FieldSpace fs, const TreeOperand &tree);
+
+// Creates the trees and runs the operations on them with coefficients of type T
+template<typename T>
+void run_operations(Context ctx, HighLevelRuntime *runtime, const DriverOptions &options) {
+
+    int overall_max_depth = options.overall_max_depth;
+    int actual_left_depth = options.actual_left_depth;
+    long int seed = options.seed;
+    TreeLayout layout = options.layout;
+
+    if (options.storage_benchmark_nodes > 0) {
+        benchmark_storage<T>(options.storage_benchmark_nodes, coef_format.order);
+        return;
+    }
+
+    // Every tree comes from the pool, which owns the regions and the field space
+    TreePool<T> pool(ctx, runtime, overall_max_depth);
+
+    // For 1st logical region
+    TreeShape shape1(seed, actual_left_depth, overall_max_depth, layout);
+    PoolKey key1 = options.input_path != NULL ? PoolKey(POOL_INGESTED, TreePool<T>::input_key(options.input_path))
+                                              : PoolKey(POOL_REFINED, shape1.signature);
+    PooledTree tree_lr1 = pool.acquire(key1);
+    LogicalRegion lr1 = tree_lr1.lr;
+    Color partition_color1 = tree_lr1.partition_color;
+
+    Arguments args1(0, 0, overall_max_depth, layout, 0, partition_color1, actual_left_depth, seed);
+
+    // Operations are recorded on the plan and launched, fused where possible, when a result is needed
+    TreePlan<T> plan(ctx, runtime);
+
+    // Recording the refine task, or building the tree from the input file right away
+    int tree1;
+    if (options.input_path != NULL) {
+        TreeOperand input = tree_ingest<T>(ctx, runtime, options.input_path, options.input_format, lr1, partition_color1,
+                                           layout, overall_max_depth);
+        tree1 = plan.existing(input.lr, input.partition_color, input.shape, input.shape_known);
+    } else {
+        tree1 = plan.refine(lr1, partition_color1, shape1);
+    }
 
     // // Launching another task to print the values of the binary tree nodes
-    // TaskLauncher print_launcher(PRINT_TASK_ID, TaskArgument(&args1, sizeof(Arguments)));
+    // TaskLauncher print_launcher(task_id<T>(PRINT_TASK_ID), TaskArgument(&args1, sizeof(Arguments)));
     // print_launcher.add_region_requirement(RegionRequirement(lr1, READ_ONLY, EXCLUSIVE, lr1));
-    // print_launcher.add_field(0, FID_X);
+    // add_coef_fields(print_launcher, 0);
     // runtime->execute_task(ctx, print_launcher);
 
-    // Launching another task to print the values of the binary tree nodes
-    // TaskLauncher compress_launcher(COMPRESS_TASK_ID, TaskArgument(&args1, sizeof(Arguments)));
-    // compress_launcher.add_region_requirement(RegionRequirement(lr1, READ_WRITE, EXCLUSIVE, lr1));
-    // compress_launcher.add_field(0, FID_X);
-    // runtime->execute_task(ctx, compress_launcher);
+    // Recording the compress task, which the plan fuses into the refine before it
+    // plan.compress(tree1);
 
     // Launching another task to print the values of the binary tree nodes
-    // TaskLauncher print_launcher1(PRINT_TASK_ID, TaskArgument(&args1, sizeof(Arguments)));
+    // TaskLauncher print_launcher1(task_id<T>(PRINT_TASK_ID), TaskArgument(&args1, sizeof(Arguments)));
     // print_launcher1.add_region_requirement(RegionRequirement(lr1, READ_ONLY, EXCLUSIVE, lr1));
-    // print_launcher1.add_field(0, FID_X);
+    // add_coef_fields(print_launcher1, 0);
     // runtime->execute_task(ctx, print_launcher1);
 
-    // TaskLauncher norm_launcher(NORM_TASK_ID, TaskArgument(&args1, sizeof(Arguments)));
-    // norm_launcher.add_region_requirement(RegionRequirement(lr1, READ_ONLY, EXCLUSIVE, lr1));
-    // norm_launcher.add_field(0, FID_X);
-    // Future f1 = runtime->execute_task(ctx, norm_launcher);
-    // float norm_value = sqrt(f1.get_result<int>());
+    // Future f1 = plan.future(plan.norm(tree1));
+    // double norm_value = sqrt(static_cast<double>(f1.get_result<typename CoefTraits<T>::accum_t>()));
     // fprintf(stderr, "norm result %fm\n", norm_value);
 
-    // For 2nd logical region
+    // For 2nd logical region, which holds the diff of the 1st
     int actual_right_depth = 6;
-    Rect<1> tree_rect2(0LL, static_cast<coord_t>(pow(2, overall_max_depth + 1)) - 2);
-    IndexSpace is2 = runtime->create_index_space(ctx, tree_rect2);
-
-    LogicalRegion lr2 = runtime->create_logical_region(ctx, is2, fs);
-    // Any random value will work
-    Color partition_color2 = 20;
+    PooledTree tree_lr2 = pool.acquire(POOL_DERIVED, TreePool<T>::derived_key(PLAN_DIFF, key1.second));
+    LogicalRegion lr2 = tree_lr2.lr;
+    Color partition_color2 = tree_lr2.partition_color;
 
-    // Arguments args2(0, 0, overall_max_depth, 0, partition_color2, actual_right_depth);
-    // srand48_r(seed, &args2.gen);
+    // Arguments args2(0, 0, overall_max_depth, layout, 0, partition_color2, actual_right_depth, seed);
 
     // // Launching the refine task
-    // TaskLauncher refine_launcher2(REFINE_TASK_ID, TaskArgument(&args2, sizeof(Arguments)));
+    // TaskLauncher refine_launcher2(task_id<T>(REFINE_TASK_ID), TaskArgument(&args2, sizeof(Arguments)));
     // refine_launcher2.add_region_requirement(RegionRequirement(lr2, WRITE_DISCARD, EXCLUSIVE, lr2));
-    // refine_launcher2.add_field(0, FID_X);
+    // add_coef_fields(refine_launcher2, 0);
     // runtime->execute_task(ctx, refine_launcher2);
+    // TreeShape shape2(seed, actual_right_depth, overall_max_depth, layout);
 
     // // Launching another task to print the values of the binary tree nodes
-    // TaskLauncher print_launcher2_1(PRINT_TASK_ID, TaskArgument(&args2, sizeof(Arguments)));
+    // TaskLauncher print_launcher2_1(task_id<T>(PRINT_TASK_ID), TaskArgument(&args2, sizeof(Arguments)));
     // print_launcher2_1.add_region_requirement(RegionRequirement(lr2, READ_ONLY, EXCLUSIVE, lr2));
-    // print_launcher2_1.add_field(0, FID_X);
+    // add_coef_fields(print_launcher2_1, 0);
     // runtime->execute_task(ctx, print_launcher2_1);
 
     // Launching another task to print the values of the binary tree nodes
-    // TaskLauncher compress_launcher2(COMPRESS_TASK_ID, TaskArgument(&args2, sizeof(Arguments)));
+    // TaskLauncher compress_launcher2(task_id<T>(COMPRESS_TASK_ID), TaskArgument(&args2, sizeof(Arguments)));
     // compress_launcher2.add_region_requirement(RegionRequirement(lr2, READ_WRITE, EXCLUSIVE, lr2));
-    // compress_launcher2.add_field(0, FID_X);
+    // add_coef_fields(compress_launcher2, 0);
     // runtime->execute_task(ctx, compress_launcher2);
 
     // Launching another task to print the values of the binary tree nodes
-    // TaskLauncher print_launcher2_2(PRINT_TASK_ID, TaskArgument(&args2, sizeof(Arguments)));
+    // TaskLauncher print_launcher2_2(task_id<T>(PRINT_TASK_ID), TaskArgument(&args2, sizeof(Arguments)));
     // print_launcher2_2.add_region_requirement(RegionRequirement(lr2, READ_ONLY, EXCLUSIVE, lr2));
-    // print_launcher2_2.add_field(0, FID_X);
+    // add_coef_fields(print_launcher2_2, 0);
     // runtime->execute_task(ctx, print_launcher2_2);
 
-     Rect<1> dummy_tree_rect(0LL, static_cast<coord_t>(pow(2, overall_max_depth + 1)) - 2);
-    IndexSpace dummy_is = runtime->create_index_space(ctx, dummy_tree_rect);
-    LogicalRegion dummy_lr = runtime->create_logical_region(ctx, dummy_is, fs);
+    LogicalRegion dummy_lr = pool.acquire(POOL_SCRATCH, 0).lr;
 
-    DiffArguments diff_args(0, 0, overall_max_depth, 0, partition_color1, partition_color2, actual_left_depth, 100, false);
+    // With -quant_rel_error, diff reads the 1st tree, at every leaf, through its quantized field
+    if (coef_format.quant_bits > 0 && CoefTraits<T>::type != INT_COEF)
+        plan.quantize(tree1);
 
-    TaskLauncher diff_launcher(DIFF_TASK_ID, TaskArgument(&diff_args, sizeof(DiffArguments)));
-    diff_launcher.add_region_requirement(RegionRequirement(lr1, READ_ONLY, EXCLUSIVE, lr1));
-    diff_launcher.add_region_requirement(RegionRequirement(lr2, WRITE_DISCARD, EXCLUSIVE, lr2));
-    diff_launcher.add_region_requirement(RegionRequirement(lr1, READ_ONLY, EXCLUSIVE, lr1));
-    diff_launcher.add_region_requirement(RegionRequirement(dummy_lr, READ_ONLY, EXCLUSIVE, dummy_lr));
-    diff_launcher.add_field(0, FID_X);
-    diff_launcher.add_field(1, FID_X);
-    diff_launcher.add_field(2, FID_X);
-    diff_launcher.add_field(3, FID_X);
-    runtime->execute_task(ctx, diff_launcher);
+    // Recording the diff task, the print below needs its result
+    plan.diff(tree1, lr2, partition_color2, dummy_lr);
+    plan.flush();
 
-    Arguments args2(0, 0, overall_max_depth, 0, partition_color2, actual_left_depth);
+    Arguments args2(0, 0, overall_max_depth, layout, 0, partition_color2, actual_left_depth);
 
     // Launching another task to print the values of the binary tree nodes
-    TaskLauncher print_launcher12(PRINT_TASK_ID, TaskArgument(&args2, sizeof(Arguments)));
+    TaskLauncher print_launcher12(task_id<T>(PRINT_TASK_ID), TaskArgument(&args2, sizeof(Arguments)));
     print_launcher12.add_region_requirement(RegionRequirement(lr2, READ_ONLY, EXCLUSIVE, lr2));
-    print_launcher12.add_field(0, FID_X);
+    add_coef_fields(print_launcher12, 0);
     runtime->execute_task(ctx, print_launcher12);
 
-    // InnerProductArguments args3_inner_product(0, 0, overall_max_depth, 0, partition_color1, partition_color2, min(actual_left_depth, actual_right_depth));
-
-    // // Launching inner product task
-    // TaskLauncher inner_product_launcher(INNER_PRODUCT_TASK_ID, TaskArgument(&args3_inner_product, sizeof(InnerProductArguments)));
-    // inner_product_launcher.add_region_requirement(RegionRequirement(lr1, READ_ONLY, EXCLUSIVE, lr1));
-    // inner_product_launcher.add_region_requirement(RegionRequirement(lr2, READ_ONLY, EXCLUSIVE, lr2));
-    // inner_product_launcher.add_field(0, FID_X);
-    // inner_product_launcher.add_field(1, FID_X);
+    // The Gauss-Legendre points of every box of the last level, with their weights, at which -eval and
+    // -wavelets sample the 1st tree (see MAX_CHECK_POINTS). The checks read the full coefficient fields of a
+    // quantized tree, the ones compress reads.
+    vector<double> points, weights;
+    if (options.checks & (CHECK_EVAL | CHECK_WAVELETS)) {
+        int k = coef_format.order;
+        double qx[MAX_ORDER], qw[MAX_ORDER];
+        gauss_legendre(k, qx, qw);
+        size_t boxes = size_t(1) << (overall_max_depth - 1);
+        for (size_t b = 0; b < boxes; b++) {
+            for (int q = 0; q < k; q++) {
+                points.push_back((b + qx[q]) / boxes);
+                weights.push_back(qw[q] / boxes);
+            }
+        }
+    }
+    double tolerance = check_tolerance<T>();
+
+    // With -eval, the integral over [0, 1] of the 1st tree, which refine left in reconstructed form, from its
+    // values at the points has to be the root sum of the compressed tree
+    bool compressed1 = false;
+    if (options.checks & CHECK_EVAL) {
+        TreeOperand full = plan.tree(tree1);
+        full.quantized = false;
+        vector<double> values = tree_eval<T>(ctx, runtime, full, points);
+        double integral = 0;
+        for (size_t i = 0; i < values.size(); i++)
+            integral += weights[i] * values[i];
+        plan.compress(tree1);
+        compressed1 = true;
+        check_close("eval", "integral of f from its values", integral, tree_root_sum<T>(ctx, runtime, plan.tree(tree1)), tolerance);
+    }
 
-    // // inner_product_launcher.add_future(f1);
-    // // inner_product_launcher.add_future(f2);
+    // With -integrate, integrals of the compressed 1st tree over [0, 1], which has to be the root sum, and over
+    // three windows that split [0, 1], each from the largest boxes inside it and the leaves it cuts, which have
+    // to add up to it
+    if (options.checks & CHECK_INTEGRATE) {
+        if (!compressed1)
+            plan.compress(tree1);
+        compressed1 = true;
+        vector<pair<double, double> > windows;
+        windows.push_back(make_pair(0.0, 1.0));
+        windows.push_back(make_pair(0.0, 0.375));
+        windows.push_back(make_pair(0.375, 0.7));
+        windows.push_back(make_pair(0.7, 1.0));
+        TreeOperand compressed = plan.tree(tree1);
+        vector<double> integrals = tree_integrate<T>(ctx, runtime, compressed, windows);
+        double root_sum = tree_root_sum<T>(ctx, runtime, compressed);
+        check_close("integrate", "over [0, 1]", integrals[0], root_sum, tolerance);
+        check_close("integrate", "over [0, 0.375] + [0.375, 0.7] + [0.7, 1]", integrals[1] + integrals[2] + integrals[3],
+                    root_sum, tolerance);
+    }
 
-    // Future f_result = runtime->execute_task(ctx, inner_product_launcher);
+    // With -project, a Gaussian projected adaptively, to an error of 1e-6 per box, into a tree from the pool:
+    // every box has to get below the error above the last level, and once compressed the root sum is the
+    // integral over [0, 1], sqrt(pi / 500) erf(sqrt(500) / 2). A leaf of width w is off the integral by at most
+    // 1e-6 sqrt(w), and those add up to at most 1e-6 sqrt(leaves), leaves at most 2^(max_depth - 1).
+    if (options.checks & CHECK_PROJECT) {
+        PooledTree projected = pool.acquire(POOL_PROJECTED, TreePool<T>::projection_key("gaussian", 1e-6));
+        size_t unresolved;
+        TreeOperand gaussian = tree_project<T>(ctx, runtime, projected.lr, projected.partition_color, layout, overall_max_depth,
+                                               parse_projected_function("gaussian"), 1e-6, overall_max_depth - 1, &unresolved);
+        if (unresolved > 0) {
+            fprintf(stderr, "project: %zu boxes of level %d are above the error 1e-6, a larger -max_depth or -order has to "
+                    "resolve them: FAILED\n", unresolved, overall_max_depth - 1);
+            exit(1);
+        }
+        int tree_gaussian = plan.existing(gaussian.lr, gaussian.partition_color, gaussian.shape, gaussian.shape_known);
+        plan.compress(tree_gaussian);
+        check_close("project", "root sum", tree_root_sum<T>(ctx, runtime, plan.tree(tree_gaussian)),
+                    sqrt(M_PI / 500) * erf(sqrt(500.0) / 2), max(tolerance, 1e-6 * sqrt(ldexp(1.0, overall_max_depth - 1))));
+    }
 
-    // fprintf(stderr, "inner product result %d\n", f_result.get_result<int>());
+    // With -wavelets, the compressed 1st tree in wavelet form and back. The inner product in wavelet form is the
+    // square of the L2 norm of f, which the integral of f^2 from the values of the tree it comes back as has to
+    // match; the tree op norm sums the leaves, which the round trip has to leave as they were.
+    if (options.checks & CHECK_WAVELETS) {
+        if (!compressed1)
+            plan.compress(tree1);
+        Future f_leaf_norm = plan.future(plan.norm(tree1));
+        Future f_wavelet_norm = tree_wavelet_round_trip<T>(ctx, runtime, pool.field_space(), plan.tree(tree1));
+        // the tree is in reconstructed form again, a recompress has to compress all of it
+        plan.mark_dirty(tree1, 0, 0);
+        compressed1 = false;
+        Future f_round_trip_norm = plan.future(plan.norm(tree1));
+        vector<double> values = tree_eval<T>(ctx, runtime, plan.tree(tree1), points);
+        double square_integral = 0;
+        for (size_t i = 0; i < values.size(); i++)
+            square_integral += weights[i] * values[i] * values[i];
+        typedef typename CoefTraits<T>::accum_t accum_t;
+        check_close("wavelets", "L2 norm", sqrt(static_cast<double>(f_wavelet_norm.get_result<accum_t>())), sqrt(square_integral),
+                    tolerance);
+        check_close("wavelets", "leaf norm after the round trip", sqrt(static_cast<double>(f_round_trip_norm.get_result<accum_t>())),
+                    sqrt(static_cast<double>(f_leaf_norm.get_result<accum_t>())), tolerance);
+    }
 
-    // For 3rd logical region
-    // int actual_new_tree_depth = max(actual_left_depth, actual_right_depth);
+    // With -recompress, the compressed 1st tree is scaled by 2 on the box of node (2, 1), or of the leaf above it,
+    // which marks that node: recompress compresses its subtree and refilters the ancestors, and has to give
+    // back the integrals of the tree outside the box, twice the one over the box, and their sum at the root
+    if (options.checks & CHECK_RECOMPRESS) {
+        if (!compressed1)
+            plan.compress(tree1);
+        compressed1 = true;
+        int n = 2, l = 1;
+        plan.node(tree1, n, l);
+        double lo = ldexp(double(l), -n), hi = ldexp(double(l + 1), -n);
+        vector<pair<double, double> > windows;
+        windows.push_back(make_pair(0.0, lo));
+        windows.push_back(make_pair(lo, hi));
+        windows.push_back(make_pair(hi, 1.0));
+        vector<double> integrals = tree_integrate<T>(ctx, runtime, plan.tree(tree1), windows);
+
+        plan.scale(tree1, n, l, 2);
+        plan.recompress(tree1);
+
+        TreeOperand recompressed = plan.tree(tree1);
+        vector<double> recompressed_integrals = tree_integrate<T>(ctx, runtime, recompressed, windows);
+        check_close("recompress", "root sum", tree_root_sum<T>(ctx, runtime, recompressed), integrals[0] + 2 * integrals[1] + integrals[2],
+                    tolerance);
+        check_close("recompress", "left of the box", recompressed_integrals[0], integrals[0], tolerance);
+        check_close("recompress", "over the box", recompressed_integrals[1], 2 * integrals[1], tolerance);
+        check_close("recompress", "right of the box", recompressed_integrals[2], integrals[2], tolerance);
+    }
 
-    // Rect<1> tree_rect3(0LL, static_cast<coord_t>(pow(2, overall_max_depth + 1)) - 2);
-    // IndexSpace is3 = runtime->create_index_space(ctx, tree_rect3);
-    // LogicalRegion lr3 = runtime->create_logical_region(ctx, is3, fs);
+    // // Launching inner product task
+    // Future f_result = tree_reduce<T, InnerProductOp<T> >(ctx, runtime, TreeOperand(lr1, partition_color1, shape1),
+    //                                                     TreeOperand(lr2, partition_color2, shape2));
 
-    // Color partition_color3 = 30;
+    // fprintf(stderr, "inner product result %g\n", static_cast<double>(f_result.get_result<typename CoefTraits<T>::accum_t>()));
 
-    // Rect<1> dummy_tree_rect_gaxpy(0LL, static_cast<coord_t>(pow(2, overall_max_depth + 1)) - 2);
-    // IndexSpace dummy_is_gaxpy = runtime->create_index_space(ctx, dummy_tree_rect_gaxpy);
-    // LogicalRegion dummy_lr_gaxpy = runtime->create_logical_region(ctx, dummy_is_gaxpy, fs);
+    // For 3rd logical region
+    // int actual_new_tree_depth = max(actual_left_depth, actual_right_depth);
 
-    // GaxpyArguments args3(0, 0, overall_max_depth, 0, partition_color1, partition_color2, partition_color3, actual_new_tree_depth, actual_left_depth, actual_right_depth);
+    // PooledTree tree_lr3 = pool.acquire(POOL_DERIVED, TreePool<T>::derived_key(PLAN_GAXPY, shape1.signature, shape2.signature));
+    // LogicalRegion lr3 = tree_lr3.lr;
+    // Color partition_color3 = tree_lr3.partition_color;
 
     // // Launching gaxpy task 
-    // TaskLauncher gaxpy_launcher(GAXPY_TASK_ID, TaskArgument(&args3, sizeof(GaxpyArguments)));
-    // gaxpy_launcher.add_region_requirement(RegionRequirement(lr1, READ_ONLY, EXCLUSIVE, lr1));
-    // gaxpy_launcher.add_region_requirement(RegionRequirement(lr2, READ_ONLY, EXCLUSIVE, lr2));
-    // gaxpy_launcher.add_region_requirement(RegionRequirement(lr3, WRITE_DISCARD, EXCLUSIVE, lr3));
-    // gaxpy_launcher.add_region_requirement(RegionRequirement(dummy_lr_gaxpy, READ_ONLY, EXCLUSIVE, dummy_lr_gaxpy));
-    // gaxpy_launcher.add_field(0, FID_X);
-    // gaxpy_launcher.add_field(1, FID_X);
-    // gaxpy_launcher.add_field(2, FID_X);
-    // gaxpy_launcher.add_field(3, FID_X);
-    // runtime->execute_task(ctx, gaxpy_launcher);
-
-    // Arguments args4(0, 0, overall_max_depth, 0, partition_color3, actual_new_tree_depth);
+    // tree_zip<T, GaxpyOp<T> >(ctx, runtime, TreeOperand(lr1, partition_color1, shape1), TreeOperand(lr2, partition_color2, shape2),
+    //                         lr3, partition_color3);
+
+    // Arguments args4(0, 0, overall_max_depth, layout, 0, partition_color3, actual_new_tree_depth);
 
     // // Launching another task to print the values of the binary tree nodes
-    // TaskLauncher print_launcher3_1(PRINT_TASK_ID, TaskArgument(&args4, sizeof(Arguments)));
+    // TaskLauncher print_launcher3_1(task_id<T>(PRINT_TASK_ID), TaskArgument(&args4, sizeof(Arguments)));
     // print_launcher3_1.add_region_requirement(RegionRequirement(lr3, READ_ONLY, EXCLUSIVE, lr3));
-    // print_launcher3_1.add_field(0, FID_X);
+    // add_coef_fields(print_launcher3_1, 0);
     // runtime->execute_task(ctx, print_launcher3_1);
 
-    // ReConstructArguments reconstruct_args(0, 0, overall_max_depth, 0, partition_color1, 0);
+    // ReConstructArguments<T> reconstruct_args(0, 0, overall_max_depth, layout, 0, partition_color1, 0);
 
     // // Launching another task to print the values of the binary tree nodes
-    // TaskLauncher reconstruct_launcher(RECONSTRUCT_TASK_ID, TaskArgument(&reconstruct_args, sizeof(ReConstructArguments)));
+    // TaskLauncher reconstruct_launcher(task_id<T>(RECONSTRUCT_TASK_ID), TaskArgument(&reconstruct_args, sizeof(ReConstructArguments<T>)));
     // reconstruct_launcher.add_region_requirement(RegionRequirement(lr1, READ_WRITE, EXCLUSIVE, lr1));
-    // reconstruct_launcher.add_field(0, FID_X);
+    // add_coef_fields(reconstruct_launcher, 0);
     // runtime->execute_task(ctx, reconstruct_launcher);
 
     // // Launching another task to print the values of the binary tree nodes
-    // TaskLauncher print_launcher2(PRINT_TASK_ID, TaskArgument(&args1, sizeof(Arguments)));
+    // TaskLauncher print_launcher2(task_id<T>(PRINT_TASK_ID), TaskArgument(&args1, sizeof(Arguments)));
     // print_launcher2.add_region_requirement(RegionRequirement(lr1, READ_ONLY, EXCLUSIVE, lr1));
-    // print_launcher2.add_field(0, FID_X);
+    // add_coef_fields(print_launcher2, 0);
     // runtime->execute_task(ctx, print_launcher2);
 
+    // // Time stepping: each step writes the next state into the back buffer and swaps. A gaxpy of two trees
+    // // of one shape has that shape, so from the second step on the steps allocate neither regions nor partitions.
+    // TreeDoubleBuffer<T> state(pool, PoolKey(POOL_REFINED, shape1.signature));
+    // TreePlan<T> init_plan(ctx, runtime);
+    // init_plan.refine(state.front().lr, state.front().partition_color, shape1);
+    // init_plan.flush();
+    // for (int step = 0; step < 10; step++) {
+    //     TreePlan<T> step_plan(ctx, runtime);
+    //     int current = step_plan.existing(state.front().lr, state.front().partition_color, shape1);
+    //     const PooledTree &next = state.back(PoolKey(POOL_REFINED, shape1.signature));
+    //     step_plan.gaxpy(current, current, next.lr, next.partition_color, 0.5);
+    //     step_plan.flush();
+    //     state.swap();
+    // }
+
     // Destroying allocated memory
-    // runtime->destroy_logical_region(ctx, lr1);
-    // runtime->destroy_logical_region(ctx, lr2);
-    // runtime->destroy_field_space(ctx, fs);
-    // runtime->destroy_index_space(ctx, is);
-    // runtime->destroy_index_space(ctx, is2);
+    pool.destroy();
 }
 
-void set_task(const Task *task,
-              const std::vector<PhysicalRegion> &regions,
-              Context ctx, HighLevelRuntime *runtime) {
+void calibration_task(const Task *task, const std::vector<PhysicalRegion> &regions, Context ctx, HighLevelRuntime *runtime) {
+}
 
-    SetTaskArgs args = *(const SetTaskArgs *) task->args;
-    assert(regions.size() == 1);
-    const FieldAccessor<WRITE_DISCARD, int, 1> write_acc(regions[0], FID_X);
-    if (args.node_value <= 3 || args.n == args.max_depth - 1) {
-        write_acc[args.idx] = args.node_value % 3 + 1;
-    }
-    else {
-        write_acc[args.idx] = 0;
+// Sets the serial cutoff from the cost of a task launch against the work a sweep does per node on this
+// machine: a subtree is swept when its serial work stays below the launch it would otherwise pay for.
+// Only the processes running the top level task, one per shard under control replication, calibrate; the
+// others keep the defaults, which only moves where their walks start sweeping.
+void calibrate_sweep_cutoff(Context ctx, HighLevelRuntime *runtime) {
+    const int num_tasks = 256;
+    const int num_nodes = 1 << 14;
+    struct timespec start, end;
+
+    // one task at a time, each waited for before the next is launched: tasks in flight together would overlap
+    // on the CPUs and give the throughput of the machine rather than what one launch costs. The first one
+    // warms up the mapper and is not counted.
+    runtime->execute_task(ctx, TaskLauncher(CALIBRATION_TASK_ID, TaskArgument(NULL, 0))).get_void_result();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < num_tasks; i++)
+        runtime->execute_task(ctx, TaskLauncher(CALIBRATION_TASK_ID, TaskArgument(NULL, 0))).get_void_result();
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double task_ns = elapsed_ns(start, end) / num_tasks;
+
+    // per node, a sweep draws and sets the node and filters it into its parent
+    vector<double> values(2 * num_nodes * coef_format.order), parents(num_nodes * coef_format.order);
+    Coefs<double> coefs;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < 2 * num_nodes; i++) {
+        set_node_coefs(refine_draw(i, 0, i), 1, 2, coefs);
+        copy(coefs.c, coefs.c + coef_format.order, &values[i * coef_format.order]);
     }
+    two_scale_filter(&values[0], &values[num_nodes * coef_format.order], &parents[0], num_nodes);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    volatile double sink = parents[num_nodes / 2];
+    (void) sink;
+    double node_ns = max(elapsed_ns(start, end) / (2 * num_nodes), 1e-3);
+
+    double break_even = task_ns / node_ns;
+    sweep_nodes = static_cast<size_t>(break_even);
+    sweep_levels = 1;
+    while (sweep_levels < MAX_SWEEP_LEVELS && pow(2, sweep_levels + 2) - 1 <= break_even)
+        sweep_levels++;
+    fprintf(stderr, "serial cutoff: %d levels or %zu nodes (task %.0f ns, node %.1f ns)\n",
+            sweep_levels, sweep_nodes, task_ns, node_ns);
 }
 
-void gaxpy_set_task(const Task *task,
-                    const std::vector<PhysicalRegion> &regions,
-                    Context ctx, HighLevelRuntime *runtime) {
+// The native backend, defined after the kernels it shares with the tasks
+template<typename T>
+void run_native_operations(const DriverOptions &options, int num_workers);
 
-    GaxpySetTaskArgs args = *(const GaxpySetTaskArgs *) task->args;
-    assert(regions.size() == 3);
+void top_level_task(const Task *task, const std::vector<PhysicalRegion> &regions, Context ctx, HighLevelRuntime *runtime) {
+    TaskTrace trace(task);
 
-    const FieldAccessor<WRITE_DISCARD, int, 1> write_acc(regions[2], FID_X);
-    write_acc[args.idx] = 0;
+    int overall_max_depth = 4;
+    int actual_left_depth = 4;
 
-    if (args.is_right == true) {
-        const FieldAccessor<READ_ONLY, int, 1> write_acc2(regions[1], FID_X);
-        write_acc[args.idx] = write_acc[args.idx] + write_acc2[args.idx];
+    long int seed = 12345;
+    TreeLayout layout = PRE_ORDER_LAYOUT;
+    CoefType coef_type = INT_COEF;
+    int layout_benchmark_depth = 0;
+    coord_t storage_benchmark_nodes = 0;
+    Backend backend = LEGION_BACKEND;
+    int native_workers = max(1u, std::thread::hardware_concurrency());
+    const char *input_path = NULL;
+    InputFormat input_format = SAMPLES_INPUT;
+    unsigned checks = 0;
+    {
+        const InputArgs &command_args = HighLevelRuntime::get_input_args();
+        for (int idx = 1; idx < command_args.argc; ++idx)
+        {
+            if (strcmp(command_args.argv[idx], "-max_depth") == 0)
+                overall_max_depth = atoi(command_args.argv[++idx]);
+            else if (strcmp(command_args.argv[idx], "-seed") == 0)
+                seed = atol(command_args.argv[++idx]);
+            else if (strcmp(command_args.argv[idx], "-layout") == 0)
+                layout = parse_layout(command_args.argv[++idx]);
+            else if (strcmp(command_args.argv[idx], "-coef") == 0)
+                coef_type = parse_coef_type(command_args.argv[++idx]);
+            else if (strcmp(command_args.argv[idx], "-layout_benchmark") == 0)
+                layout_benchmark_depth = atoi(command_args.argv[++idx]);
+            else if (strcmp(command_args.argv[idx], "-storage_benchmark") == 0)
+                storage_benchmark_nodes = atoll(command_args.argv[++idx]);
+            else if (strcmp(command_args.argv[idx], "-backend") == 0)
+                backend = parse_backend(command_args.argv[++idx]);
+            else if (strcmp(command_args.argv[idx], "-native_workers") == 0)
+                native_workers = atoi(command_args.argv[++idx]);
+            else if (strcmp(command_args.argv[idx], "-input") == 0)
+                input_path = command_args.argv[++idx];
+            else if (strcmp(command_args.argv[idx], "-input_format") == 0)
+                input_format = parse_input_format(command_args.argv[++idx]);
+            else if (strcmp(command_args.argv[idx], "-eval") == 0)
+                checks |= CHECK_EVAL;
+            else if (strcmp(command_args.argv[idx], "-integrate") == 0)
+                checks |= CHECK_INTEGRATE;
+            else if (strcmp(command_args.argv[idx], "-project") == 0)
+                checks |= CHECK_PROJECT;
+            else if (strcmp(command_args.argv[idx], "-wavelets") == 0)
+                checks |= CHECK_WAVELETS;
+            else if (strcmp(command_args.argv[idx], "-recompress") == 0)
+                checks |= CHECK_RECOMPRESS;
+        }
+    }
+
+    if (layout_benchmark_depth > 0) {
+        benchmark_layouts(layout_benchmark_depth);
+        return;
+    }
+
+    // an int tree truncates its moments, and past order 1 every filter, so the checks could not hold
+    if ((checks & CHECK_PROJECT) && coef_type == INT_COEF) {
+        fprintf(stderr, "-project needs -coef float or double\n");
+        exit(1);
+    }
+    if (checks && coef_type == INT_COEF && coef_format.order > 1) {
+        fprintf(stderr, "-eval, -integrate, -wavelets and -recompress need -coef float or double past -order 1\n");
+        exit(1);
+    }
+    if ((checks & (CHECK_EVAL | CHECK_WAVELETS)) &&
+        (overall_max_depth > 40 || coef_format.order * (size_t(1) << (overall_max_depth - 1)) > MAX_CHECK_POINTS)) {
+        fprintf(stderr, "-eval and -wavelets sample order points in each of the 2^(max_depth - 1) boxes of the last level, "
+                "at most %zu of them\n", MAX_CHECK_POINTS);
+        exit(1);
     }
 
-    if (args.is_left == true) {
-        const FieldAccessor<READ_ONLY, int, 1> write_acc1(regions[0], FID_X);
-        write_acc[args.idx] = write_acc[args.idx] + write_acc1[args.idx];
+    DriverOptions options(overall_max_depth, actual_left_depth, seed, layout, storage_benchmark_nodes, input_path, input_format, checks);
+    if (backend == NATIVE_BACKEND) {
+        // the native trees only come from refine
+        assert(input_path == NULL);
+        assert(native_workers >= 1);
+        switch (coef_type) {
+            case INT_COEF:
+                run_native_operations<int>(options, native_workers);
+                break;
+            case FLOAT_COEF:
+                run_native_operations<float>(options, native_workers);
+                break;
+            case DOUBLE_COEF:
+                run_native_operations<double>(options, native_workers);
+                break;
+            default:
+                assert(false);
+        }
+        return;
+    }
+
+    if (!sweep_cutoff_fixed)
+        calibrate_sweep_cutoff(ctx, runtime);
+
+    switch (coef_type) {
+        case INT_COEF:
+            run_operations<int>(ctx, runtime, options);
+            break;
+        case FLOAT_COEF:
+            run_operations<float>(ctx, runtime, options);
+            break;
+        case DOUBLE_COEF:
+            run_operations<double>(ctx, runtime, options);
+            break;
+        default:
+            assert(false);
     }
+}
+
+template<typename T>
+void set_task(const Task *task,
+              const std::vector<PhysicalRegion> &regions,
+              Context ctx, HighLevelRuntime *runtime) {
 
+    SetTaskArgs args = *(const SetTaskArgs *) task->args;
+    TaskTrace trace(task, args.n);
+    assert(regions.size() == 1);
+    const CoefAccessor<WRITE_DISCARD, T> write_acc(regions[0]);
+    Coefs<T> coefs;
+    set_node_coefs(args.node_value, args.n, args.max_depth, coefs);
+    write_acc.store(args.idx, coefs);
 }
 
-int read_task(const Task *task,
+template<typename T>
+Coefs<T> read_task(const Task *task,
               const std::vector<PhysicalRegion> &regions,
               Context ctx, HighLevelRuntime *runtime) {
+    TaskTrace trace(task);
 
     ReadTaskArgs args = *(const ReadTaskArgs *) task->args;
     assert(regions.size() == 1);
-    const FieldAccessor<READ_ONLY, int, 1> read_acc(regions[0], FID_X);
-    return read_acc[args.idx];
+    const CoefAccessor<READ_ONLY, T> read_acc(regions[0], reads_quantized(task->regions[0]));
+    Coefs<T> coefs = make_coefs(T(0));
+    read_acc.load(args.idx, coefs);
+    return coefs;
 }
 
+template<typename T>
 void compress_set_task(const Task *task,
                        const std::vector<PhysicalRegion> &regions,
                        Context ctx, HighLevelRuntime *runtime) {
+    TaskTrace trace(task);
     CompressSetTaskArgs args = *(const CompressSetTaskArgs *) task->args;
     assert(regions.size() == 3);
-    const FieldAccessor<READ_WRITE, int, 1> write_acc(regions[0], FID_X);
-    const FieldAccessor<READ_WRITE, int, 1> write_acc_left(regions[1], FID_X);
-    const FieldAccessor<READ_WRITE, int, 1> write_acc_right(regions[2], FID_X);
-
-    write_acc[args.idx] = write_acc_left[args.left_idx] + write_acc_right[args.right_idx];
+    const CoefAccessor<READ_WRITE, T> write_acc(regions[0]);
+    const CoefAccessor<READ_WRITE, T> write_acc_left(regions[1]);
+    const CoefAccessor<READ_WRITE, T> write_acc_right(regions[2]);
+
+    Coefs<T> left, right, parent;
+    write_acc_left.load(args.left_idx, left);
+    write_acc_right.load(args.right_idx, right);
+    two_scale_filter(left.c, right.c, parent.c, 1);
+    write_acc.store(args.idx, parent);
 }
 
+template<typename T>
 void diff_set_task(const Task *task, const std::vector<PhysicalRegion> &regions, Context ctx, HighLevelRuntime *runtime) {
+    TaskTrace trace(task);
 
-    DiffSetTaskArgs args = *(const DiffSetTaskArgs *) task->args;
+    DiffSetTaskArgs<T> args = *(const DiffSetTaskArgs<T> *) task->args;
     assert(regions.size() == 1);
 
     LogicalRegion lr = regions[0].get_logical_region();
     assert(lr != LogicalRegion::NO_REGION);
 
-    const FieldAccessor<READ_WRITE, int, 1> write_acc(regions[0], FID_X);
+    const CoefAccessor<READ_WRITE, T> write_acc(regions[0]);
 
-    write_acc[args.idx] = args.node_value;
+    write_acc.store(args.idx, args.node_value);
 }
 
+// Refilters the npairs parents of one level, level holding their (parent, left, right) index triples. The
+// level is gathered into packed sibling pairs and goes through the filter kernel in a single call; left,
+// right and parent are the buffers for it, kept across the levels.
+template<typename T>
+void compress_level(const CoefAccessor<READ_WRITE, T> &acc, const coord_t *level, int npairs, bool parallel,
+                    vector<T> &left, vector<T> &right, vector<T> &parent) {
+    if (npairs == 0)
+        return;
+    int k = coef_format.order;
+    left.resize(npairs * k);
+    right.resize(npairs * k);
+    parent.resize(npairs * k);
+    OMP(parallel for schedule(static) if (parallel))
+    for (int p = 0; p < npairs; p++) {
+        Coefs<T> coefs;
+        acc.load(level[3 * p + 1], coefs);
+        copy(coefs.c, coefs.c + k, &left[p * k]);
+        acc.load(level[3 * p + 2], coefs);
+        copy(coefs.c, coefs.c + k, &right[p * k]);
+    }
+    two_scale_filter_chunks(&left[0], &right[0], &parent[0], npairs, parallel);
+    OMP(parallel for schedule(static) if (parallel))
+    for (int p = 0; p < npairs; p++) {
+        Coefs<T> coefs;
+        copy(&parent[p * k], &parent[p * k] + k, coefs.c);
+        acc.store(level[3 * p], coefs);
+    }
+}
 
-// To be recursive task calling for the left and right subtrees, if necessary !
+// Compresses, deepest level first, the internal nodes of a tree or a subtree given as one vector of
+// (parent, left, right) index triples per level
+template<typename T>
+void compress_internal_levels(const CoefAccessor<READ_WRITE, T> &acc, const vector<vector<coord_t> > &internal, bool parallel) {
+    vector<T> left, right, parent;
+    for (int v = int(internal.size()) - 1; v >= 0; v--) {
+        if (!internal[v].empty())
+            compress_level(acc, &internal[v][0], internal[v].size() / 3, parallel, left, right, parent);
+    }
+}
+
+// Compresses the subtree a sweep argument buffer describes, bottom up, a level at a time
+template<typename T>
+void compress_subtree_levels(const CoefAccessor<READ_WRITE, T> &acc, const SweepTaskArgs<T> *args, bool parallel) {
+    vector<const coord_t *> internal(args->num_levels);
+    const coord_t *nodes = (const coord_t *) (args + 1);
+    for (int v = 0; v < args->num_levels; v++) {
+        internal[v] = nodes;
+        nodes += 3 * args->internal_count[v] + args->leaf_count[v];
+    }
+
+    vector<T> left, right, parent;
+    for (int v = args->num_levels - 1; v >= 0; v--)
+        compress_level(acc, internal[v], args->internal_count[v], parallel, left, right, parent);
+}
+
+// Compresses a whole subtree in one task
+template<typename T>
+void compress_sweep_task(const Task *task,
+                         const std::vector<PhysicalRegion> &regions,
+                         Context ctx, HighLevelRuntime *runtime) {
+    TaskTrace trace(task);
+    assert(regions.size() == 1);
+    const CoefAccessor<READ_WRITE, T> acc(regions[0]);
+    compress_subtree_levels(acc, (const SweepTaskArgs<T> *) task->args, omp_variant(task));
+}
+
+// Sets every node of a subtree refine_subtree_shape recorded and, for COMPRESS, compresses the subtree
+// right away, while its coefficients are still in this task's instance
+template<typename T, bool COMPRESS>
+void refine_sweep_task(const Task *task,
+                       const std::vector<PhysicalRegion> &regions,
+                       Context ctx, HighLevelRuntime *runtime) {
+    TaskTrace trace(task);
+    const RefineSweepArgs *args = (const RefineSweepArgs *) task->args;
+    const SweepNode *nodes = (const SweepNode *) (args + 1);
+    assert(regions.size() == 1);
+    // WRITE_DISCARD grants read-write access, the compress pass reads back what was just set
+    const CoefAccessor<READ_WRITE, T> write_acc(regions[0]);
+
+    bool parallel = omp_variant(task);
+    vector<int> node_values(args->num_nodes);
+    OMP(parallel for schedule(static) if (parallel))
+    for (size_t i = 0; i < args->num_nodes; i++)
+        node_values[i] = refine_draw(args->seed, nodes[i].n, nodes[i].l);
+
+    OMP(parallel for schedule(static) if (parallel))
+    for (size_t i = 0; i < args->num_nodes; i++) {
+        Coefs<T> coefs;
+        set_node_coefs(node_values[i], nodes[i].n, args->max_depth, coefs);
+        write_acc.store(nodes[i].idx, coefs);
+    }
+
+    if (COMPRESS)
+        compress_subtree_levels(write_acc, (const SweepTaskArgs<T> *) (nodes + args->num_nodes), parallel);
+}
+
+// Hands the compress_set of node idx to a leaf task once the children hold their compressed values
+template<typename T>
+void launch_compress_set(Context ctx, HighLevelRuntime *runtime, LogicalRegion lr, LogicalPartition lp,
+                         coord_t idx, coord_t idx_left_sub_tree, coord_t idx_right_sub_tree) {
+    CompressSetTaskArgs args(idx, idx_left_sub_tree, idx_right_sub_tree);
+    TaskLauncher compress_set_task_launcher(task_id<T>(COMPRESS_SET_TASK_ID), TaskArgument(&args, sizeof(CompressSetTaskArgs)));
+    RegionRequirement req(runtime->get_logical_subregion_by_color(ctx, lp, DomainPoint(Point<1>(0LL))), READ_WRITE, EXCLUSIVE, lr);
+    RegionRequirement req_left(runtime->get_logical_subregion_by_color(ctx, lp, DomainPoint(Point<1>(1LL))), READ_WRITE, EXCLUSIVE, lr);
+    RegionRequirement req_right(runtime->get_logical_subregion_by_color(ctx, lp, DomainPoint(Point<1>(2LL))), READ_WRITE, EXCLUSIVE, lr);
+    add_coef_fields(req);
+    add_coef_fields(req_left);
+    add_coef_fields(req_right);
+    compress_set_task_launcher.add_region_requirement(req);
+    compress_set_task_launcher.add_region_requirement(req_left);
+    compress_set_task_launcher.add_region_requirement(req_right);
+    runtime->execute_task(ctx, compress_set_task_launcher);
+}
+
+// Refines the tree. For COMPRESS the same walk compresses it as well: the sweeps compress their subtree
+// in place and every internal node above them queues its compress_set behind its children, which
+// saves the second traversal compress_task would make.
+template<typename T, bool COMPRESS>
 void refine_task(const Task *task, const std::vector<PhysicalRegion> &regions, Context ctx, HighLevelRuntime *runtime) {
 
     Arguments args = task->is_index_space ? *(const Arguments *) task->local_args
     : *(const Arguments *) task->args;
+    TaskTrace trace(task, args.n, args.l);
     int n = args.n;
     int l = args.l;
     int max_depth = args.max_depth;
+    TreeLayout layout = args.layout;
     int actual_max_depth = args.actual_max_depth;
 
     DomainPoint my_sub_tree_color(Point<1>(0LL));
@@ -519,34 +3589,22 @@ void refine_task(const Task *task, const std::vector<PhysicalRegion> &regions, C
     coord_t idx_left_sub_tree = 0LL;
     coord_t idx_right_sub_tree = 0LL;
 
+    if (sweep_subtree(actual_max_depth - n, partition_color, idx)) {
+        vector<SweepNode> nodes;
+        SubtreeLevels levels;
+        refine_subtree_shape(ctx, runtime, lr.get_index_space(), args, n, l, idx, nodes, COMPRESS ? &levels : NULL);
+        launch_refine_sweep<T, COMPRESS>(ctx, runtime, lr, WRITE_DISCARD, args, nodes, levels);
+        return;
+    }
 
     if (n < actual_max_depth)
     {
         IndexSpace is = lr.get_index_space();
-        DomainPointColoring coloring;
-
-        idx_left_sub_tree = idx + 1;
-        idx_right_sub_tree = idx + static_cast<coord_t>(pow(2, max_depth - n));
-
-        Rect<1> my_sub_tree_rect(idx, idx);
-        Rect<1> left_sub_tree_rect(idx_left_sub_tree, idx_right_sub_tree - 1);
-        Rect<1> right_sub_tree_rect(idx_right_sub_tree,
-        idx_right_sub_tree + static_cast<coord_t>(pow(2, max_depth - n)) - 2);
-        /*
-        fprintf(stderr, "(n: %d, l: %d) - idx: [%lld, %lld] (max_depth: %d)\n"
-        "  |-- (n: %d, l: %d) - idx: [%lld, %lld] (max_depth: %d)\n"
-        "  |-- (n: %d, l: %d) - idx: [%lld, %lld] (max_depth: %d)\n",
-        n, l, idx, idx, max_depth,
-        n + 1, 2 * l,     left_sub_tree_rect.lo[0],  left_sub_tree_rect.hi[0],  max_depth,
-        n + 1, 2 * l + 1, right_sub_tree_rect.lo[0], right_sub_tree_rect.hi[0], max_depth); */
-
-        coloring[my_sub_tree_color] = my_sub_tree_rect;
-        coloring[left_sub_tree_color] = left_sub_tree_rect;
-        coloring[right_sub_tree_color] = right_sub_tree_rect;
-
-        Rect<1> color_space = Rect<1>(my_sub_tree_color, right_sub_tree_color);
-
-        IndexPartition ip = runtime->create_index_partition(ctx, is, color_space, coloring, DISJOINT_KIND, partition_color);
+
+        idx_left_sub_tree = left_child_index(layout, idx, n, l, max_depth);
+        idx_right_sub_tree = right_child_index(layout, idx, n, l, max_depth);
+
+        IndexPartition ip = create_subtree_partition(ctx, runtime, is, layout, n, l, max_depth, partition_color);
         lp = runtime->get_logical_partition(ctx, lr, ip);
         my_sub_tree_lr = runtime->get_logical_subregion_by_color(ctx, lp, my_sub_tree_color);
     }
@@ -554,14 +3612,12 @@ void refine_task(const Task *task, const std::vector<PhysicalRegion> &regions, C
     assert(lr != LogicalRegion::NO_REGION);
     assert(my_sub_tree_lr != LogicalRegion::NO_REGION);
 
-    long int node_value;
-    lrand48_r(&args.gen, &node_value);
-    node_value = node_value % 10 + 1;
+    int node_value = refine_draw(args.seed, n, l);
     {
         SetTaskArgs args(node_value, idx, n, actual_max_depth);
-        TaskLauncher set_task_launcher(SET_TASK_ID, TaskArgument(&args, sizeof(SetTaskArgs)));
+        TaskLauncher set_task_launcher(task_id<T>(SET_TASK_ID), TaskArgument(&args, sizeof(SetTaskArgs)));
         RegionRequirement req(my_sub_tree_lr, WRITE_DISCARD, EXCLUSIVE, lr);
-        req.add_field(FID_X);
+        add_coef_fields(req);
         set_task_launcher.add_region_requirement(req);
         runtime->execute_task(ctx, set_task_launcher);
     }
@@ -572,34 +3628,97 @@ void refine_task(const Task *task, const std::vector<PhysicalRegion> &regions, C
         Rect<1> launch_domain(left_sub_tree_color, right_sub_tree_color);
         ArgumentMap arg_map;
 
-        Arguments for_left_sub_tree (n + 1, l * 2    , max_depth, idx_left_sub_tree, partition_color, actual_max_depth);
-        Arguments for_right_sub_tree(n + 1, l * 2 + 1, max_depth, idx_right_sub_tree, partition_color, actual_max_depth);
-
-        // Make sure two subtrees use different random number generators
-        long int new_seed = 0L;
-        lrand48_r(&args.gen, &new_seed);
-        for_left_sub_tree.gen = args.gen;
-        srand48_r(new_seed, &for_right_sub_tree.gen);
+        Arguments for_left_sub_tree (n + 1, l * 2    , max_depth, layout, idx_left_sub_tree, partition_color, actual_max_depth, args.seed);
+        Arguments for_right_sub_tree(n + 1, l * 2 + 1, max_depth, layout, idx_right_sub_tree, partition_color, actual_max_depth, args.seed);
 
         arg_map.set_point(left_sub_tree_color, TaskArgument(&for_left_sub_tree, sizeof(Arguments)));
         arg_map.set_point(right_sub_tree_color, TaskArgument(&for_right_sub_tree, sizeof(Arguments)));
 
-        IndexTaskLauncher refine_launcher(REFINE_TASK_ID, launch_domain, TaskArgument(NULL, 0), arg_map);
+        IndexTaskLauncher refine_launcher(task_id<T>(COMPRESS ? REFINE_COMPRESS_TASK_ID : REFINE_TASK_ID), launch_domain, TaskArgument(NULL, 0), arg_map);
+        refine_launcher.tag = cost_tag(subtree_cost(partition_color, idx_left_sub_tree), subtree_cost(partition_color, idx_right_sub_tree));
         RegionRequirement req(lp, 0, WRITE_DISCARD, EXCLUSIVE, lr);
-        req.add_field(FID_X);
+        add_coef_fields(req);
         refine_launcher.add_region_requirement(req);
         runtime->execute_index_space(ctx, refine_launcher);
+
+        // the same test compress_task makes: the left child got a partition of its own
+        if (COMPRESS && n + 1 < actual_max_depth)
+            launch_compress_set<T>(ctx, runtime, lr, lp, idx, idx_left_sub_tree, idx_right_sub_tree);
+    }
+}
+
+// Reconstructs a whole subtree in one task, top down, with the same per-node rule as reconstruct_task.
+// The values handed to the children of one level go through the unfilter kernel in a single call; past
+// order 1 nothing is handed down and the sweep only clears the internal nodes.
+template<typename T>
+void reconstruct_sweep_task(const Task *task,
+                            const std::vector<PhysicalRegion> &regions,
+                            Context ctx, HighLevelRuntime *runtime) {
+    TaskTrace trace(task);
+    const SweepTaskArgs<T> *args = (const SweepTaskArgs<T> *) task->args;
+    assert(regions.size() == 1);
+    const CoefAccessor<READ_WRITE, T> acc(regions[0]);
+    int k = coef_format.order;
+    bool averages = reconstruct_averages();
+
+    bool parallel = omp_variant(task);
+    const coord_t *nodes = (const coord_t *) (args + 1);
+    map<coord_t, Coefs<T> > incoming;
+    incoming[nodes[0]] = args->parent_value;
+
+    vector<T> parent, left, right;
+    Coefs<T> zero = make_coefs(T(0));
+    for (int v = 0; v < args->num_levels; v++) {
+        int npairs = args->internal_count[v];
+        const coord_t *internal = nodes;
+        const coord_t *leaves = nodes + 3 * npairs;
+        nodes = leaves + args->leaf_count[v];
+
+        // incoming already holds every node of the level, the lookups in the parallel loops do not insert
+        OMP(parallel for schedule(static) if (parallel))
+        for (int i = 0; i < (averages ? args->leaf_count[v] : 0); i++) {
+            Coefs<T> value = incoming.find(leaves[i])->second, coefs;
+            acc.load(leaves[i], coefs);
+            coef_average(value.c, value.c, coefs.c, k);
+            acc.store(leaves[i], value);
+        }
+
+        if (npairs == 0)
+            continue;
+        parent.resize(npairs * k);
+        left.resize(npairs * k);
+        right.resize(npairs * k);
+        OMP(parallel for schedule(static) if (parallel))
+        for (int p = 0; p < npairs; p++) {
+            if (averages) {
+                const Coefs<T> &value = incoming.find(internal[3 * p])->second;
+                Coefs<T> coefs;
+                acc.load(internal[3 * p], coefs);
+                coef_average(&parent[p * k], value.c, coefs.c, k);
+            }
+            acc.store(internal[3 * p], zero);
+        }
+        if (!averages)
+            continue;
+        two_scale_unfilter_chunks(&parent[0], &left[0], &right[0], npairs, parallel);
+        for (int p = 0; p < npairs; p++) {
+            copy(&left[p * k], &left[p * k] + k, incoming[internal[3 * p + 1]].c);
+            copy(&right[p * k], &right[p * k] + k, incoming[internal[3 * p + 2]].c);
+        }
     }
 }
 
+template<typename T>
 void reconstruct_task(const Task *task, const std::vector<PhysicalRegion> &regions, Context ctxt, HighLevelRuntime *runtime) {
-    ReConstructArguments args = task->is_index_space ? *(const ReConstructArguments *) task->local_args
-    : *(const ReConstructArguments *) task->args;
+    ReConstructArguments<T> args = task->is_index_space ? *(const ReConstructArguments<T> *) task->local_args
+    : *(const ReConstructArguments<T> *) task->args;
+    TaskTrace trace(task, args.n, args.l);
 
     int n = args.n;
     int l = args.l;
     int max_depth = args.max_depth;
-    int parent_value = args.parent_value;
+    TreeLayout layout = args.layout;
+    Coefs<T> parent_value = args.parent_value;
 
     DomainPoint my_sub_tree_color(Point<1>(0LL));
     DomainPoint left_sub_tree_color(Point<1>(1LL));
@@ -621,27 +3740,44 @@ void reconstruct_task(const Task *task, const std::vector<PhysicalRegion> &regio
 
     IndexSpace indexspace_left = left_sub_tree_lr.get_index_space();
 
+    if (sweep_subtree(max_depth - n, partition_color, idx)) {
+        SubtreeLevels levels;
+        collect_subtree_levels(ctxt, runtime, lr, partition_color, layout, n, l, idx, max_depth, 0, levels);
+        vector<char> sweep_args = pack_sweep_args(levels, parent_value);
+        TaskLauncher sweep_launcher(task_id<T>(RECONSTRUCT_SWEEP_TASK_ID), TaskArgument(&sweep_args[0], sweep_args.size()));
+        sweep_launcher.tag = cost_tag(subtree_cost(partition_color, idx));
+        RegionRequirement req(lr, READ_WRITE, EXCLUSIVE, lr);
+        add_coef_fields(req);
+        sweep_launcher.add_region_requirement(req);
+        runtime->execute_task(ctxt, sweep_launcher);
+        return;
+    }
+
     Future f1;
     {
         ReadTaskArgs args(idx);
-        TaskLauncher read_task_launcher(READ_TASK_ID, TaskArgument(&args, sizeof(ReadTaskArgs)));
+        TaskLauncher read_task_launcher(task_id<T>(READ_TASK_ID), TaskArgument(&args, sizeof(ReadTaskArgs)));
         RegionRequirement req(my_sub_tree_lr, READ_ONLY, EXCLUSIVE, lr);
-        req.add_field(FID_X);
+        add_coef_fields(req);
         read_task_launcher.add_region_requirement(req);
         f1 = runtime->execute_task(ctxt, read_task_launcher);
     }
 
-    parent_value = (parent_value + f1.get_result<int>())/2;
+    Coefs<T> node_value = f1.get_result<Coefs<T> >();
+    if (reconstruct_averages())
+        coef_average(parent_value.c, parent_value.c, node_value.c, coef_format.order);
+    else
+        parent_value = node_value;
 
     if (runtime->has_index_partition(ctxt, indexspace_left, partition_color)) {
-        idx_left_sub_tree = idx + 1;
-        idx_right_sub_tree = idx + static_cast<coord_t>(pow(2, max_depth - n));
+        idx_left_sub_tree = left_child_index(layout, idx, n, l, max_depth);
+        idx_right_sub_tree = right_child_index(layout, idx, n, l, max_depth);
 
         {
-            ReConstructSetTaskArgs args(idx, 0);
-            TaskLauncher reconstruct_set_task_launcher(RECONSTRUCT_SET_TASK_ID, TaskArgument(&args, sizeof(ReConstructSetTaskArgs)));
+            ReConstructSetTaskArgs<T> args(idx, make_coefs(T(0)));
+            TaskLauncher reconstruct_set_task_launcher(task_id<T>(RECONSTRUCT_SET_TASK_ID), TaskArgument(&args, sizeof(ReConstructSetTaskArgs<T>)));
             RegionRequirement req(my_sub_tree_lr, READ_WRITE, EXCLUSIVE, lr);
-            req.add_field(FID_X);
+            add_coef_fields(req);
             reconstruct_set_task_launcher.add_region_requirement(req);
             runtime->execute_task(ctxt, reconstruct_set_task_launcher);
         }
@@ -649,37 +3785,47 @@ void reconstruct_task(const Task *task, const std::vector<PhysicalRegion> &regio
         Rect<1> launch_domain(left_sub_tree_color, right_sub_tree_color);
         ArgumentMap arg_map;
 
-        ReConstructArguments for_left_sub_tree(n + 1, 2 * l, max_depth, idx_left_sub_tree, partition_color, parent_value);
-        ReConstructArguments for_right_sub_tree(n + 1, 2 * l + 1, max_depth, idx_right_sub_tree, partition_color, parent_value);
+        // past order 1 the children keep their own sums and nothing is handed down
+        Coefs<T> left_value = make_coefs(T(0)), right_value = make_coefs(T(0));
+        if (reconstruct_averages())
+            two_scale_unfilter(parent_value.c, left_value.c, right_value.c, 1);
 
-        arg_map.set_point(left_sub_tree_color, TaskArgument(&for_left_sub_tree, sizeof(ReConstructArguments)));
-        arg_map.set_point(right_sub_tree_color, TaskArgument(&for_right_sub_tree, sizeof(ReConstructArguments)));
+        ReConstructArguments<T> for_left_sub_tree(n + 1, 2 * l, max_depth, layout, idx_left_sub_tree, partition_color, left_value);
+        ReConstructArguments<T> for_right_sub_tree(n + 1, 2 * l + 1, max_depth, layout, idx_right_sub_tree, partition_color, right_value);
 
-        IndexTaskLauncher reconstruct_launcher(RECONSTRUCT_TASK_ID, launch_domain, TaskArgument(NULL, 0), arg_map);
+        arg_map.set_point(left_sub_tree_color, TaskArgument(&for_left_sub_tree, sizeof(ReConstructArguments<T>)));
+        arg_map.set_point(right_sub_tree_color, TaskArgument(&for_right_sub_tree, sizeof(ReConstructArguments<T>)));
+
+        IndexTaskLauncher reconstruct_launcher(task_id<T>(RECONSTRUCT_TASK_ID), launch_domain, TaskArgument(NULL, 0), arg_map);
+        reconstruct_launcher.tag = cost_tag(subtree_cost(partition_color, idx_left_sub_tree), subtree_cost(partition_color, idx_right_sub_tree));
         RegionRequirement req(lp, 0, READ_WRITE, EXCLUSIVE, lr);
-        req.add_field(FID_X);
+        add_coef_fields(req);
         reconstruct_launcher.add_region_requirement(req);
         runtime->execute_index_space(ctxt, reconstruct_launcher);
 
-    } else {
+    } else if (reconstruct_averages()) {
+        // past order 1 a leaf keeps what it holds
         {
-            ReConstructSetTaskArgs args(idx, parent_value);
-            TaskLauncher reconstruct_set_task_launcher(RECONSTRUCT_SET_TASK_ID, TaskArgument(&args, sizeof(ReConstructSetTaskArgs)));
+            ReConstructSetTaskArgs<T> args(idx, parent_value);
+            TaskLauncher reconstruct_set_task_launcher(task_id<T>(RECONSTRUCT_SET_TASK_ID), TaskArgument(&args, sizeof(ReConstructSetTaskArgs<T>)));
             RegionRequirement req(my_sub_tree_lr, READ_WRITE, EXCLUSIVE, lr);
-            req.add_field(FID_X);
+            add_coef_fields(req);
             reconstruct_set_task_launcher.add_region_requirement(req);
             runtime->execute_task(ctxt, reconstruct_set_task_launcher);
         }
     }
 }
 
+template<typename T>
 void compress_task(const Task *task, const std::vector<PhysicalRegion> &regions, Context ctxt, HighLevelRuntime *runtime) {
     Arguments args = task->is_index_space ? *(const Arguments *) task->local_args
     : *(const Arguments *) task->args;
+    TaskTrace trace(task, args.n, args.l);
 
     int n = args.n;
     int l = args.l;
     int max_depth = args.max_depth;
+    TreeLayout layout = args.layout;
 
     DomainPoint my_sub_tree_color(Point<1>(0LL));
     DomainPoint left_sub_tree_color(Point<1>(1LL));
@@ -696,45 +3842,80 @@ void compress_task(const Task *task, const std::vector<PhysicalRegion> &regions,
     coord_t idx_right_sub_tree = 0LL;
 
     lp = runtime->get_logical_partition_by_color(ctxt, lr, partition_color);
-    LogicalRegion my_sub_tree_lr = runtime->get_logical_subregion_by_color(ctxt, lp, my_sub_tree_color);
     LogicalRegion left_sub_tree_lr = runtime->get_logical_subregion_by_color(ctxt, lp, left_sub_tree_color);
-    LogicalRegion right_sub_tree_lr = runtime->get_logical_subregion_by_color(ctxt, lp, right_sub_tree_color);
 
     IndexSpace indexspace_left = left_sub_tree_lr.get_index_space();
 
     if (runtime->has_index_partition(ctxt, indexspace_left, partition_color)) {
 
-        idx_left_sub_tree = idx + 1;
-        idx_right_sub_tree = idx + static_cast<coord_t>(pow(2, max_depth - n));
+        if (sweep_subtree(max_depth - n, partition_color, idx)) {
+            SubtreeLevels levels;
+            collect_subtree_levels(ctxt, runtime, lr, partition_color, layout, n, l, idx, max_depth, 0, levels);
+            vector<char> sweep_args = pack_sweep_args(levels, make_coefs(T(0)));
+            TaskLauncher sweep_launcher(task_id<T>(COMPRESS_SWEEP_TASK_ID), TaskArgument(&sweep_args[0], sweep_args.size()));
+            sweep_launcher.tag = cost_tag(subtree_cost(partition_color, idx));
+            RegionRequirement req(lr, READ_WRITE, EXCLUSIVE, lr);
+            add_coef_fields(req);
+            sweep_launcher.add_region_requirement(req);
+            runtime->execute_task(ctxt, sweep_launcher);
+            return;
+        }
+
+        idx_left_sub_tree = left_child_index(layout, idx, n, l, max_depth);
+        idx_right_sub_tree = right_child_index(layout, idx, n, l, max_depth);
 
         Rect<1> launch_domain(left_sub_tree_color, right_sub_tree_color);
         ArgumentMap arg_map;
 
-        Arguments for_left_sub_tree(n + 1, 2 * l, max_depth, idx_left_sub_tree, partition_color);
-        Arguments for_right_sub_tree(n + 1, 2 * l + 1, max_depth, idx_right_sub_tree, partition_color);
+        Arguments for_left_sub_tree(n + 1, 2 * l, max_depth, layout, idx_left_sub_tree, partition_color);
+        Arguments for_right_sub_tree(n + 1, 2 * l + 1, max_depth, layout, idx_right_sub_tree, partition_color);
 
         arg_map.set_point(left_sub_tree_color, TaskArgument(&for_left_sub_tree, sizeof(Arguments)));
         arg_map.set_point(right_sub_tree_color, TaskArgument(&for_right_sub_tree, sizeof(Arguments)));
 
-        IndexTaskLauncher compress_launcher(COMPRESS_TASK_ID, launch_domain, TaskArgument(NULL, 0), arg_map);
+        IndexTaskLauncher compress_launcher(task_id<T>(COMPRESS_TASK_ID), launch_domain, TaskArgument(NULL, 0), arg_map);
+        compress_launcher.tag = cost_tag(subtree_cost(partition_color, idx_left_sub_tree), subtree_cost(partition_color, idx_right_sub_tree));
         RegionRequirement req(lp, 0, READ_WRITE, EXCLUSIVE, lr);
-        req.add_field(FID_X);
+        add_coef_fields(req);
         compress_launcher.add_region_requirement(req);
         runtime->execute_index_space(ctxt, compress_launcher);
 
-        {
-            CompressSetTaskArgs args(idx, idx_left_sub_tree, idx_right_sub_tree);
-            TaskLauncher compress_set_task_launcher(COMPRESS_SET_TASK_ID, TaskArgument(&args, sizeof(CompressSetTaskArgs)));
-            RegionRequirement req(my_sub_tree_lr, READ_WRITE, EXCLUSIVE, lr);
-            RegionRequirement req_left(left_sub_tree_lr, READ_WRITE, EXCLUSIVE, lr);
-            RegionRequirement req_right(right_sub_tree_lr, READ_WRITE, EXCLUSIVE, lr);
-            req.add_field(FID_X);
-            req_left.add_field(FID_X);
-            req_right.add_field(FID_X);
-            compress_set_task_launcher.add_region_requirement(req);
-            compress_set_task_launcher.add_region_requirement(req_left);
-            compress_set_task_launcher.add_region_requirement(req_right);
-            runtime->execute_task(ctxt, compress_set_task_launcher);
+        launch_compress_set<T>(ctxt, runtime, lr, lp, idx, idx_left_sub_tree, idx_right_sub_tree);
+    }
+}
+
+// Refilters the parents listed in its argument from their children, deepest level first. The parents of
+// one level go through the filter kernel in a single call.
+template<typename T>
+void compress_path_task(const Task *task,
+                        const std::vector<PhysicalRegion> &regions,
+                        Context ctx, HighLevelRuntime *runtime) {
+    TaskTrace trace(task);
+    const CompressPathNode *path = (const CompressPathNode *) task->args;
+    size_t num_nodes = task->arglen / sizeof(CompressPathNode);
+    assert(regions.size() == 1);
+    const CoefAccessor<READ_WRITE, T> acc(regions[0]);
+    int k = coef_format.order;
+
+    vector<T> left, right, parent;
+    Coefs<T> coefs;
+    for (size_t first = 0, last; first < num_nodes; first = last) {
+        for (last = first; last < num_nodes && path[last].n == path[first].n; last++)
+            ;
+        size_t npairs = last - first;
+        left.resize(npairs * k);
+        right.resize(npairs * k);
+        parent.resize(npairs * k);
+        for (size_t p = 0; p < npairs; p++) {
+            acc.load(path[first + p].left_idx, coefs);
+            copy(coefs.c, coefs.c + k, &left[p * k]);
+            acc.load(path[first + p].right_idx, coefs);
+            copy(coefs.c, coefs.c + k, &right[p * k]);
+        }
+        two_scale_filter(&left[0], &right[0], &parent[0], npairs);
+        for (size_t p = 0; p < npairs; p++) {
+            copy(&parent[p * k], &parent[p * k] + k, coefs.c);
+            acc.store(path[first + p].idx, coefs);
         }
     }
 }
@@ -744,10 +3925,12 @@ vector<ReturnGetCoefArguments> path;
 struct ReturnGetCoefArguments get_coef_util_task(const Task *task, const std::vector<PhysicalRegion> &regions, Context ctxt, HighLevelRuntime *runtime) {
     GetCoefUtilArguments args = task->is_index_space ? *(const GetCoefUtilArguments *) task->local_args
     : *(const GetCoefUtilArguments *) task->args;
+    TaskTrace trace(task, args.n, args.l);
 
     int n = args.n;
     int l = args.l;
     int max_depth = args.max_depth;
+    TreeLayout layout = args.layout;
     int questioned_n = args.questioned_n;
     int questioned_l = args.questioned_l;
 
@@ -760,6 +3943,7 @@ struct ReturnGetCoefArguments get_coef_util_task(const Task *task, const std::ve
     assert(regions.size() == 1);
     LogicalRegion lr = regions[0].get_logical_region();
     LogicalPartition lp = LogicalPartition::NO_PART;
+    bool quantized = reads_quantized(task->regions[0]);
 
     lp = runtime->get_logical_partition_by_color(ctxt, lr, partition_color);
 
@@ -782,40 +3966,42 @@ struct ReturnGetCoefArguments get_coef_util_task(const Task *task, const std::ve
         return get_coef_args;
     }
 
-    Future f_left = Future::from_value(runtime, -1), f_right = Future::from_value(runtime, -1);
+    Future f_left, f_right;
 
     bool left_partition = false, right_partition = false;
 
     if (runtime->has_index_partition(ctxt, indexspace_left, partition_color)) {
-        idx_left_sub_tree = idx + 1;
-        GetCoefUtilArguments for_left_sub_tree(n + 1, l * 2, max_depth, idx_left_sub_tree, partition_color, questioned_n, questioned_l);
+        idx_left_sub_tree = left_child_index(layout, idx, n, l, max_depth);
+        GetCoefUtilArguments for_left_sub_tree(n + 1, l * 2, max_depth, layout, idx_left_sub_tree, partition_color, questioned_n, questioned_l);
 
         TaskLauncher get_coefs_launcher(GET_COEF_UTIL_TASK_ID, TaskArgument(&for_left_sub_tree, sizeof(GetCoefUtilArguments)));
         RegionRequirement req(left_sub_tree_lr, READ_ONLY, EXCLUSIVE, lr);
-        req.add_field(FID_X);
+        add_coef_fields(req, quantized);
         get_coefs_launcher.add_region_requirement(req);
         f_left = runtime->execute_task(ctxt, get_coefs_launcher);
         left_partition = true;
     }
 
     if (runtime->has_index_partition(ctxt, indexspace_right, partition_color)) {
-        idx_right_sub_tree = idx + static_cast<coord_t>(pow(2, max_depth - n));
-        GetCoefUtilArguments for_right_sub_tree(n + 1, l * 2 + 1, max_depth, idx_right_sub_tree, partition_color, questioned_n, questioned_l);
+        idx_right_sub_tree = right_child_index(layout, idx, n, l, max_depth);
+        GetCoefUtilArguments for_right_sub_tree(n + 1, l * 2 + 1, max_depth, layout, idx_right_sub_tree, partition_color, questioned_n, questioned_l);
 
         TaskLauncher get_coefs_launcher(GET_COEF_UTIL_TASK_ID, TaskArgument(&for_right_sub_tree, sizeof(GetCoefUtilArguments)));
         RegionRequirement req(right_sub_tree_lr, READ_ONLY, EXCLUSIVE, lr);
-        req.add_field(FID_X);
+        add_coef_fields(req, quantized);
         get_coefs_launcher.add_region_requirement(req);
         f_right = runtime->execute_task(ctxt, get_coefs_launcher);
         right_partition = true;
     }
 
     if(left_partition || right_partition) {
-        if (f_left.get_result<ReturnGetCoefArguments>().lr != LogicalRegion::NO_REGION) {
-            return f_left.get_result<ReturnGetCoefArguments>();
-        } else {
-            return f_right.get_result<ReturnGetCoefArguments>();
+        // only the futures of the subtrees searched hold an answer
+        if (left_partition) {
+            ReturnGetCoefArguments left_result = f_left.get_result<ReturnGetCoefArguments>();
+            if (left_result.lr != LogicalRegion::NO_REGION || !right_partition)
+                return left_result;
         }
+        return f_right.get_result<ReturnGetCoefArguments>();
     } else if(n == max_depth - 1){
         while(questioned_n >= 0) {
             for (int i = path.size() - 1; i >= 0; i--) {
@@ -833,12 +4019,15 @@ struct ReturnGetCoefArguments get_coef_util_task(const Task *task, const std::ve
     return get_coef_args1; 
 }
 
-int get_coef_task(const Task *task, const std::vector<PhysicalRegion> &regions, Context ctxt, HighLevelRuntime *runtime) {
+template<typename T>
+Coefs<T> get_coef_task(const Task *task, const std::vector<PhysicalRegion> &regions, Context ctxt, HighLevelRuntime *runtime) {
     GetCoefArguments args = task->is_index_space ? *(const GetCoefArguments *) task->local_args
     : *(const GetCoefArguments *) task->args;
+    TaskTrace trace(task, args.n, args.l);
 
     int n = args.n;
     int max_depth = args.max_depth;
+    TreeLayout layout = args.layout;
     int questioned_n = args.questioned_n;
     int questioned_l = args.questioned_l;
     Color partition_color = args.partition_color;
@@ -848,23 +4037,24 @@ int get_coef_task(const Task *task, const std::vector<PhysicalRegion> &regions,
 
     assert(regions.size() == 1);
     LogicalRegion lr = regions[0].get_logical_region();
+    bool quantized = reads_quantized(task->regions[0]);
 
     int val = pow(2, n);
 
     if(questioned_l < 0 || questioned_l >= val) {
-        return 0;
+        return make_coefs(T(0));
     }
 
-    GetCoefUtilArguments get_coef_args(0, 0, max_depth, 0, partition_color, questioned_n, questioned_l);
+    GetCoefUtilArguments get_coef_args(0, 0, max_depth, layout, 0, partition_color, questioned_n, questioned_l);
     TaskLauncher get_coefs_util_launcher(GET_COEF_UTIL_TASK_ID, TaskArgument(&get_coef_args, sizeof(GetCoefUtilArguments)));
     get_coefs_util_launcher.add_region_requirement(RegionRequirement(lr, READ_ONLY, EXCLUSIVE, lr));
-    get_coefs_util_launcher.add_field(0, FID_X);
+    add_coef_fields(get_coefs_util_launcher, 0, quantized);
     Future return_coeficient = runtime->execute_task(ctxt, get_coefs_util_launcher);
 
     ReturnGetCoefArguments return_coef = return_coeficient.get_result<ReturnGetCoefArguments>();
 
     if (return_coef.n == -1) {
-        return 0;
+        return make_coefs(T(0));
     }
 
     LogicalPartition lp = runtime->get_logical_partition_by_color(ctxt, return_coef.lr, partition_color);
@@ -877,7 +4067,7 @@ int get_coef_task(const Task *task, const std::vector<PhysicalRegion> &regions,
 
     if (runtime->has_index_partition(ctxt, indexspace_left, partition_color) == true &&
         runtime->has_index_partition(ctxt, indexspace_right, partition_color) == true && return_coef.exists == true) {
-        return -1;
+        return make_coefs(T(-1));
     }
 
     Future f1;
@@ -885,36 +4075,72 @@ int get_coef_task(const Task *task, const std::vector<PhysicalRegion> &regions,
         int index = return_coef.idx;
         {
             ReadTaskArgs args(index);
-            TaskLauncher read_task_launcher(READ_TASK_ID, TaskArgument(&args, sizeof(ReadTaskArgs)));
+            TaskLauncher read_task_launcher(task_id<T>(READ_TASK_ID), TaskArgument(&args, sizeof(ReadTaskArgs)));
             RegionRequirement req(return_coef.lr, READ_ONLY, EXCLUSIVE, lr);
-            req.add_field(FID_X);
+            add_coef_fields(req, quantized);
             read_task_launcher.add_region_requirement(req);
             f1 = runtime->execute_task(ctxt, read_task_launcher);
         }
+        Coefs<T> coefs = f1.get_result<Coefs<T> >();
         if(return_coef.exists == false) {
-            return f1.get_result<int>() +  (2 * (n - return_coef.n));
-        } else{
-            return f1.get_result<int>();
+            coef_shift(coefs.c, coefs.c, T(2 * (n - return_coef.n)), coef_format.order);
         }
+        return coefs;
         
     }
 
     fprintf(stderr, "Somthings wrong\n");
-    return -1;
+    return make_coefs(T(-1));
 }
 
+// Launches diff_task on the children of a node that have an argument, as one index launch over their
+// colors. Tree 1 is projected out of lp; where it has no children at this node (lp is NO_PART) every point
+// reads dummy_lr instead. The result subtrees are projected out of lp2. With quantized, tree 1 is read
+// through its quantized field.
+template<typename T>
+void launch_diff_children(Context ctx, HighLevelRuntime *runtime, const DiffArguments<T> *left, const DiffArguments<T> *right,
+                          LogicalRegion lr, LogicalPartition lp, LogicalRegion lr2, LogicalPartition lp2,
+                          LogicalRegion lr_whole, LogicalRegion dummy_lr, bool quantized) {
+    DomainPoint left_color(Point<1>(1LL)), right_color(Point<1>(2LL));
+    ArgumentMap arg_map;
+    if (left != NULL)
+        arg_map.set_point(left_color, TaskArgument(left, sizeof(DiffArguments<T>)));
+    if (right != NULL)
+        arg_map.set_point(right_color, TaskArgument(right, sizeof(DiffArguments<T>)));
+    Rect<1> launch_domain(left != NULL ? left_color : right_color, right != NULL ? right_color : left_color);
+
+    IndexTaskLauncher diff_launcher(task_id<T>(DIFF_TASK_ID), launch_domain, TaskArgument(NULL, 0), arg_map);
+    RegionRequirement req = lp != LogicalPartition::NO_PART ? RegionRequirement(lp, 0, READ_ONLY, EXCLUSIVE, lr)
+    : RegionRequirement(dummy_lr, 0, READ_ONLY, EXCLUSIVE, dummy_lr);
+    RegionRequirement req2(lp2, 0, WRITE_DISCARD, EXCLUSIVE, lr2);
+    RegionRequirement req3(lr_whole, 0, READ_ONLY, EXCLUSIVE, lr_whole);
+    RegionRequirement req4(dummy_lr, 0, READ_ONLY, EXCLUSIVE, dummy_lr);
+    add_coef_fields(req, quantized);
+    add_coef_fields(req2);
+    add_coef_fields(req3, quantized);
+    add_coef_fields(req4);
+    diff_launcher.add_region_requirement(req);
+    diff_launcher.add_region_requirement(req2);
+    diff_launcher.add_region_requirement(req3);
+    diff_launcher.add_region_requirement(req4);
+    runtime->execute_index_space(ctx, diff_launcher);
+}
+
+template<typename T>
 void diff_task(const Task *task, const std::vector<PhysicalRegion> &regions, Context ctx, HighLevelRuntime *runtime) {
-    DiffArguments args = task->is_index_space ? *(const DiffArguments *) task->local_args
-    : *(const DiffArguments *) task->args;
+    DiffArguments<T> args = task->is_index_space ? *(const DiffArguments<T> *) task->local_args
+    : *(const DiffArguments<T> *) task->args;
+    TaskTrace trace(task, args.n, args.l);
 
     int n = args.n;
     int l = args.l;
     int max_depth = args.max_depth;
+    TreeLayout layout = args.layout;
     int actual_max_depth = args.actual_max_depth;
-    int s0 = args.s0;
+    Coefs<T> s0 = args.s0;
     int is_s0_valid = args.is_s0_valid;
-    int RANDOM = 100;
-    int sm, sp, r;
+    Coefs<T> RANDOM = make_coefs(T(100));
+    Coefs<T> sm, sp, r;
 
     DomainPoint my_sub_tree_color(Point<1>(0LL));
     DomainPoint left_sub_tree_color(Point<1>(1LL));
@@ -930,6 +4156,7 @@ void diff_task(const Task *task, const std::vector<PhysicalRegion> &regions, Con
     LogicalRegion lr_whole = regions[2].get_logical_region();
     LogicalRegion dummy_lr = regions[3].get_logical_region();
     LogicalPartition lp = LogicalPartition::NO_PART, lp2 = LogicalPartition::NO_PART, lp11, lp21;
+    bool quantized = reads_quantized(task->regions[2]);
 
     IndexSpace indexspace_left = IndexSpace::NO_SPACE, indexspace_right = IndexSpace::NO_SPACE;
     LogicalRegion my_sub_tree_lr = dummy_lr;
@@ -951,25 +4178,12 @@ void diff_task(const Task *task, const std::vector<PhysicalRegion> &regions, Con
         assert(lp != LogicalPartition::NO_PART);
     }
 
-    coord_t idx_left_sub_tree = idx + 1;
-    coord_t idx_right_sub_tree = idx + static_cast<coord_t>(pow(2, max_depth - n));
+    coord_t idx_left_sub_tree = left_child_index(layout, idx, n, l, max_depth);
+    coord_t idx_right_sub_tree = right_child_index(layout, idx, n, l, max_depth);
 
     if (n < actual_max_depth) {
         IndexSpace is = lr2.get_index_space();
-        DomainPointColoring coloring;
-
-        Rect<1> my_sub_tree_rect(idx, idx);
-        Rect<1> left_sub_tree_rect(idx_left_sub_tree, idx_right_sub_tree - 1);
-        Rect<1> right_sub_tree_rect(idx_right_sub_tree,
-        idx_right_sub_tree + static_cast<coord_t>(pow(2, max_depth - n)) - 2);
-
-        coloring[my_sub_tree_color] = my_sub_tree_rect;
-        coloring[left_sub_tree_color] = left_sub_tree_rect;
-        coloring[right_sub_tree_color] = right_sub_tree_rect;
-
-        Rect<1> color_space = Rect<1>(my_sub_tree_color, right_sub_tree_color);
-
-        IndexPartition ip = runtime->create_index_partition(ctx, is, color_space, coloring, DISJOINT_KIND, partition_color2);
+        IndexPartition ip = create_subtree_partition(ctx, runtime, is, layout, n, l, max_depth, partition_color2);
         lp2 = runtime->get_logical_partition(ctx, lr2, ip);
         my_sub_tree_lr2 = runtime->get_logical_subregion_by_color(ctx, lp2, my_sub_tree_color);
         left_sub_tree_lr2 = runtime->get_logical_subregion_by_color(ctx, lp2, left_sub_tree_color);
@@ -998,149 +4212,83 @@ void diff_task(const Task *task, const std::vector<PhysicalRegion> &regions, Con
         assert(lp2 != LogicalPartition::NO_PART);
 
 
-        if (indexspace_left != IndexSpace::NO_SPACE && runtime->has_index_partition(ctx, indexspace_left, partition_color1)) {
+        left_subtree = indexspace_left != IndexSpace::NO_SPACE && runtime->has_index_partition(ctx, indexspace_left, partition_color1);
+        right_subtree = indexspace_right != IndexSpace::NO_SPACE && runtime->has_index_partition(ctx, indexspace_right, partition_color1);
 
+        if (left_subtree || right_subtree) {
             {
-                DiffSetTaskArgs args(idx, 0);
-                TaskLauncher diff_set_task_launcher(DIFF_SET_TASK_ID, TaskArgument(&args, sizeof(DiffSetTaskArgs)));
-                RegionRequirement req(my_sub_tree_lr2, WRITE_DISCARD, EXCLUSIVE, lr2);
-                req.add_field(FID_X);
-                diff_set_task_launcher.add_region_requirement(req);
-                runtime->execute_task(ctx, diff_set_task_launcher);
-            }
-            DiffArguments for_left_sub_tree (n + 1, l * 2, max_depth, idx_left_sub_tree, partition_color1, partition_color2, actual_max_depth, RANDOM, false);
-
-            TaskLauncher diff_launcher(DIFF_TASK_ID, TaskArgument(&for_left_sub_tree, sizeof(DiffArguments)));
-            RegionRequirement req(left_sub_tree_lr, READ_ONLY, EXCLUSIVE, lr);
-            RegionRequirement req2(left_sub_tree_lr2, WRITE_DISCARD, EXCLUSIVE, lr2);
-            RegionRequirement req3(lr_whole, READ_ONLY, EXCLUSIVE, lr_whole);
-            RegionRequirement req4(dummy_lr, READ_ONLY, EXCLUSIVE, dummy_lr);
-            req.add_field(FID_X);
-            req2.add_field(FID_X);
-            req3.add_field(FID_X);
-            req4.add_field(FID_X);
-            diff_launcher.add_region_requirement(req);
-            diff_launcher.add_region_requirement(req2);
-            diff_launcher.add_region_requirement(req3);
-            diff_launcher.add_region_requirement(req4);
-            runtime->execute_task(ctx, diff_launcher);
-
-            left_subtree = true;
-        }
-        if (indexspace_right != IndexSpace::NO_SPACE && runtime->has_index_partition(ctx, indexspace_right, partition_color1)) {
-            {
-                DiffSetTaskArgs args(idx, 0);
-                TaskLauncher diff_set_task_launcher(DIFF_SET_TASK_ID, TaskArgument(&args, sizeof(DiffSetTaskArgs)));
+                DiffSetTaskArgs<T> args(idx, make_coefs(T(0)));
+                TaskLauncher diff_set_task_launcher(task_id<T>(DIFF_SET_TASK_ID), TaskArgument(&args, sizeof(DiffSetTaskArgs<T>)));
                 RegionRequirement req(my_sub_tree_lr2, WRITE_DISCARD, EXCLUSIVE, lr2);
-                req.add_field(FID_X);
+                add_coef_fields(req);
                 diff_set_task_launcher.add_region_requirement(req);
                 runtime->execute_task(ctx, diff_set_task_launcher);
             }
-
-            DiffArguments for_right_sub_tree(n + 1, l * 2 + 1, max_depth, idx_right_sub_tree, partition_color1, partition_color2, actual_max_depth, RANDOM, false);
-
-            TaskLauncher diff_launcher(DIFF_TASK_ID, TaskArgument(&for_right_sub_tree, sizeof(DiffArguments)));
-            RegionRequirement req(right_sub_tree_lr, READ_ONLY, EXCLUSIVE, lr);
-            RegionRequirement req2(right_sub_tree_lr2, WRITE_DISCARD, EXCLUSIVE, lr2);
-            RegionRequirement req3(lr_whole, READ_ONLY, EXCLUSIVE, lr_whole);
-            RegionRequirement req4(dummy_lr, READ_ONLY, EXCLUSIVE, dummy_lr);
-            req.add_field(FID_X);
-            req2.add_field(FID_X);
-            req3.add_field(FID_X);
-            req4.add_field(FID_X);
-            diff_launcher.add_region_requirement(req);
-            diff_launcher.add_region_requirement(req2);
-            diff_launcher.add_region_requirement(req3);
-            diff_launcher.add_region_requirement(req4);
-            runtime->execute_task(ctx, diff_launcher);
-
-            right_subtree = true;
+            DiffArguments<T> for_left_sub_tree (n + 1, l * 2, max_depth, layout, idx_left_sub_tree, partition_color1, partition_color2, actual_max_depth, RANDOM, false);
+            DiffArguments<T> for_right_sub_tree(n + 1, l * 2 + 1, max_depth, layout, idx_right_sub_tree, partition_color1, partition_color2, actual_max_depth, RANDOM, false);
+            launch_diff_children<T>(ctx, runtime, left_subtree ? &for_left_sub_tree : NULL, right_subtree ? &for_right_sub_tree : NULL,
+                                    lr, lp, lr2, lp2, lr_whole, dummy_lr, quantized);
         }
 
         if (!left_subtree && !right_subtree) {
             Future f_s0;
             {
                 ReadTaskArgs args(idx);
-                TaskLauncher read_task_launcher(READ_TASK_ID, TaskArgument(&args, sizeof(ReadTaskArgs)));
+                TaskLauncher read_task_launcher(task_id<T>(READ_TASK_ID), TaskArgument(&args, sizeof(ReadTaskArgs)));
                 RegionRequirement req(my_sub_tree_lr, READ_ONLY, EXCLUSIVE, lr);
-                req.add_field(FID_X);
+                add_coef_fields(req, quantized);
                 read_task_launcher.add_region_requirement(req);
                 f_s0 = runtime->execute_task(ctx, read_task_launcher);
             }
 
-            s0 = f_s0.get_result<int>();
+            s0 = f_s0.get_result<Coefs<T> >();
 
-            GetCoefArguments get_coef_args_sm(n, l, max_depth, 0, partition_color1, n, l - 1);
+            GetCoefArguments get_coef_args_sm(n, l, max_depth, layout, 0, partition_color1, n, l - 1);
             Future f_sm;
             {
-                TaskLauncher get_coefs_launcher(GET_COEF_TASK_ID, TaskArgument(&get_coef_args_sm, sizeof(GetCoefArguments)));
+                TaskLauncher get_coefs_launcher(task_id<T>(GET_COEF_TASK_ID), TaskArgument(&get_coef_args_sm, sizeof(GetCoefArguments)));
                 get_coefs_launcher.add_region_requirement(RegionRequirement(lr_whole, READ_ONLY, EXCLUSIVE, lr_whole));
-                get_coefs_launcher.add_field(0, FID_X);
+                add_coef_fields(get_coefs_launcher, 0, quantized);
                 f_sm = runtime->execute_task(ctx, get_coefs_launcher);
             }
-            sm = f_sm.get_result<int>();
+            sm = f_sm.get_result<Coefs<T> >();
 
-            GetCoefArguments get_coef_args_sp(n, l, max_depth, 0, partition_color1, n, l + 1);
+            GetCoefArguments get_coef_args_sp(n, l, max_depth, layout, 0, partition_color1, n, l + 1);
             
             Future f_sp;
             {
-                TaskLauncher get_coefs_launcher(GET_COEF_TASK_ID, TaskArgument(&get_coef_args_sp, sizeof(GetCoefArguments)));
+                TaskLauncher get_coefs_launcher(task_id<T>(GET_COEF_TASK_ID), TaskArgument(&get_coef_args_sp, sizeof(GetCoefArguments)));
                 get_coefs_launcher.add_region_requirement(RegionRequirement(lr_whole, READ_ONLY, EXCLUSIVE, lr_whole));
-                get_coefs_launcher.add_field(0, FID_X);
+                add_coef_fields(get_coefs_launcher, 0, quantized);
                 f_sp = runtime->execute_task(ctx, get_coefs_launcher);
             }
-            sp = f_sp.get_result<int>();
+            sp = f_sp.get_result<Coefs<T> >();
 
-            r = 0;
+            r = make_coefs(T(0));
             bool if_is_true = false;
 
-            if (sm >= 0 && sp >= 0 && s0 >= 0) {
-                r = sm + sp + s0;
+            if (sm.c[0] >= 0 && sp.c[0] >= 0 && s0.c[0] >= 0) {
+                coef_add(r.c, sm.c, sp.c, coef_format.order);
+                coef_add(r.c, r.c, s0.c, coef_format.order);
                 if_is_true = true;
             }
 
             {
-                DiffSetTaskArgs args(idx, r);
-                TaskLauncher diff_set_task_launcher(DIFF_SET_TASK_ID, TaskArgument(&args, sizeof(DiffSetTaskArgs)));
+                DiffSetTaskArgs<T> args(idx, r);
+                TaskLauncher diff_set_task_launcher(task_id<T>(DIFF_SET_TASK_ID), TaskArgument(&args, sizeof(DiffSetTaskArgs<T>)));
                 RegionRequirement req(my_sub_tree_lr2, WRITE_DISCARD, EXCLUSIVE, lr2);
-                req.add_field(FID_X);
+                add_coef_fields(req);
                 diff_set_task_launcher.add_region_requirement(req);
                 runtime->execute_task(ctx, diff_set_task_launcher);
             }
 
             if (if_is_true == false) {
-                DiffArguments for_left_sub_tree (n + 1, l * 2, max_depth, idx_left_sub_tree, partition_color1, partition_color2, actual_max_depth, ceil(s0/float(2)), true);
-                DiffArguments for_right_sub_tree(n + 1, l * 2 + 1, max_depth, idx_right_sub_tree, partition_color1, partition_color2, actual_max_depth, ceil(s0/float(2)), true);
-
-                TaskLauncher diff_launcher_left(DIFF_TASK_ID, TaskArgument(&for_left_sub_tree, sizeof(DiffArguments)));
-                RegionRequirement req_left(dummy_lr, READ_ONLY, EXCLUSIVE, dummy_lr);
-                RegionRequirement req_left2(left_sub_tree_lr2, WRITE_DISCARD, EXCLUSIVE, lr2);
-                RegionRequirement req_left3(lr_whole, READ_ONLY, EXCLUSIVE, lr_whole);
-                RegionRequirement req_left4(dummy_lr, READ_ONLY, EXCLUSIVE, dummy_lr);
-                req_left.add_field(FID_X);
-                req_left2.add_field(FID_X);
-                req_left3.add_field(FID_X);
-                req_left4.add_field(FID_X);
-                diff_launcher_left.add_region_requirement(req_left);
-                diff_launcher_left.add_region_requirement(req_left2);
-                diff_launcher_left.add_region_requirement(req_left3);
-                diff_launcher_left.add_region_requirement(req_left4);
-                runtime->execute_task(ctx, diff_launcher_left);
-
-                TaskLauncher diff_launcher_right(DIFF_TASK_ID, TaskArgument(&for_right_sub_tree, sizeof(DiffArguments)));
-                RegionRequirement req_right(dummy_lr, READ_ONLY, EXCLUSIVE, dummy_lr);
-                RegionRequirement req_right2(right_sub_tree_lr2, WRITE_DISCARD, EXCLUSIVE, lr2);
-                RegionRequirement req_right3(lr_whole, READ_ONLY, EXCLUSIVE, lr_whole);
-                RegionRequirement req_right4(dummy_lr, READ_ONLY, EXCLUSIVE, dummy_lr);
-                req_right.add_field(FID_X);
-                req_right2.add_field(FID_X);
-                req_right3.add_field(FID_X);
-                req_right4.add_field(FID_X);
-                diff_launcher_right.add_region_requirement(req_right);
-                diff_launcher_right.add_region_requirement(req_right2);
-                diff_launcher_right.add_region_requirement(req_right3);
-                diff_launcher_right.add_region_requirement(req_right4);
-                runtime->execute_task(ctx, diff_launcher_right);
+                Coefs<T> half_s0;
+                coef_half(half_s0.c, s0.c, coef_format.order);
+                DiffArguments<T> for_left_sub_tree (n + 1, l * 2, max_depth, layout, idx_left_sub_tree, partition_color1, partition_color2, actual_max_depth, half_s0, true);
+                DiffArguments<T> for_right_sub_tree(n + 1, l * 2 + 1, max_depth, layout, idx_right_sub_tree, partition_color1, partition_color2, actual_max_depth, half_s0, true);
+
+                launch_diff_children<T>(ctx, runtime, &for_left_sub_tree, &for_right_sub_tree, lr, LogicalPartition::NO_PART, lr2, lp2, lr_whole, dummy_lr, quantized);
 
             }
         }
@@ -1149,785 +4297,2985 @@ void diff_task(const Task *task, const std::vector<PhysicalRegion> &regions, Con
 
             
             sp = s0;
-            GetCoefArguments get_coef_args_sm(n, l, max_depth, 0, partition_color1, n, l - 1);
+            GetCoefArguments get_coef_args_sm(n, l, max_depth, layout, 0, partition_color1, n, l - 1);
             Future f_sm;
             {
-                TaskLauncher get_coefs_launcher(GET_COEF_TASK_ID, TaskArgument(&get_coef_args_sm, sizeof(GetCoefArguments)));
+                TaskLauncher get_coefs_launcher(task_id<T>(GET_COEF_TASK_ID), TaskArgument(&get_coef_args_sm, sizeof(GetCoefArguments)));
                 get_coefs_launcher.add_region_requirement(RegionRequirement(lr_whole, READ_ONLY, EXCLUSIVE, lr_whole));
-                get_coefs_launcher.add_field(0, FID_X);
+                add_coef_fields(get_coefs_launcher, 0, quantized);
                 f_sm = runtime->execute_task(ctx, get_coefs_launcher);
             }
-            sm = f_sm.get_result<int>();
+            sm = f_sm.get_result<Coefs<T> >();
         } else {
             sm = s0;
-            GetCoefArguments get_coef_args_sp(n, l, max_depth, 0, partition_color1, n, l + 1);
+            GetCoefArguments get_coef_args_sp(n, l, max_depth, layout, 0, partition_color1, n, l + 1);
             Future f_sp;
             {
-                TaskLauncher get_coefs_launcher(GET_COEF_TASK_ID, TaskArgument(&get_coef_args_sp, sizeof(GetCoefArguments)));
+                TaskLauncher get_coefs_launcher(task_id<T>(GET_COEF_TASK_ID), TaskArgument(&get_coef_args_sp, sizeof(GetCoefArguments)));
                 get_coefs_launcher.add_region_requirement(RegionRequirement(lr_whole, READ_ONLY, EXCLUSIVE, lr_whole));
-                get_coefs_launcher.add_field(0, FID_X);
+                add_coef_fields(get_coefs_launcher, 0, quantized);
                 f_sp = runtime->execute_task(ctx, get_coefs_launcher);
             }
-            sp = f_sp.get_result<int>();
+            sp = f_sp.get_result<Coefs<T> >();
         }
 
-        r = 0;
+        r = make_coefs(T(0));
 
         bool if_is_true = false;
-        if (sm >= 0 && sp >= 0 && s0 >= 0) {
-            r = sm + sp + s0;
+        if (sm.c[0] >= 0 && sp.c[0] >= 0 && s0.c[0] >= 0) {
+            coef_add(r.c, sm.c, sp.c, coef_format.order);
+            coef_add(r.c, r.c, s0.c, coef_format.order);
             if_is_true = true;
         }
 
         {
-            DiffSetTaskArgs args(idx, r);
-            TaskLauncher diff_set_task_launcher(DIFF_SET_TASK_ID, TaskArgument(&args, sizeof(DiffSetTaskArgs)));
+            DiffSetTaskArgs<T> args(idx, r);
+            TaskLauncher diff_set_task_launcher(task_id<T>(DIFF_SET_TASK_ID), TaskArgument(&args, sizeof(DiffSetTaskArgs<T>)));
             RegionRequirement req(my_sub_tree_lr2, WRITE_DISCARD, EXCLUSIVE, lr2);
-            req.add_field(FID_X);
+            add_coef_fields(req);
             diff_set_task_launcher.add_region_requirement(req);
             runtime->execute_task(ctx, diff_set_task_launcher);
         }
 
 
-        if (if_is_true == false) {
-            DiffArguments for_left_sub_tree (n + 1, l * 2    , max_depth, idx_left_sub_tree, partition_color1, partition_color2, actual_max_depth, ceil(s0/float(2)), true);
-            DiffArguments for_right_sub_tree(n + 1, l * 2 + 1, max_depth, idx_right_sub_tree, partition_color1, partition_color2, actual_max_depth, ceil(s0/float(2)), true);
-
-            TaskLauncher diff_launcher_left(DIFF_TASK_ID, TaskArgument(&for_left_sub_tree, sizeof(DiffArguments)));
-            RegionRequirement req_left(left_sub_tree_lr, READ_ONLY, EXCLUSIVE, lr);
-            RegionRequirement req_left2(left_sub_tree_lr2, WRITE_DISCARD, EXCLUSIVE, lr2);
-            RegionRequirement req_left3(lr_whole, READ_ONLY, EXCLUSIVE, lr_whole);
-            RegionRequirement req_left4(dummy_lr, READ_ONLY, EXCLUSIVE, dummy_lr);
-            req_left.add_field(FID_X);
-            req_left2.add_field(FID_X);
-            req_left3.add_field(FID_X);
-            req_left4.add_field(FID_X);
-            diff_launcher_left.add_region_requirement(req_left);
-            diff_launcher_left.add_region_requirement(req_left2);
-            diff_launcher_left.add_region_requirement(req_left3);
-            diff_launcher_left.add_region_requirement(req_left4);
-            runtime->execute_task(ctx, diff_launcher_left);
-
-            TaskLauncher diff_launcher_right(DIFF_TASK_ID, TaskArgument(&for_right_sub_tree, sizeof(DiffArguments)));
-            RegionRequirement req_right(right_sub_tree_lr, READ_ONLY, EXCLUSIVE, lr);
-            RegionRequirement req_right2(right_sub_tree_lr2, WRITE_DISCARD, EXCLUSIVE, lr2);
-            RegionRequirement req_right3(lr_whole, READ_ONLY, EXCLUSIVE, lr_whole);
-            RegionRequirement req_right4(dummy_lr, READ_ONLY, EXCLUSIVE, dummy_lr);
-            req_right.add_field(FID_X);
-            req_right2.add_field(FID_X);
-            req_right3.add_field(FID_X);
-            req_right4.add_field(FID_X);
-            diff_launcher_right.add_region_requirement(req_right);
-            diff_launcher_right.add_region_requirement(req_right2);
-            diff_launcher_right.add_region_requirement(req_right3);
-            diff_launcher_right.add_region_requirement(req_right4);
-            runtime->execute_task(ctx, diff_launcher_right);
-        }
-
-    }
-}
-
-int inner_product_task(const Task *task, const std::vector<PhysicalRegion> &regions, Context ctx, HighLevelRuntime *runtime) {
-    InnerProductArguments args = task->is_index_space ? *(const InnerProductArguments *) task->local_args
-    : *(const InnerProductArguments *) task->args;
+        if (if_is_true == false) {
+            Coefs<T> half_s0;
+            coef_half(half_s0.c, s0.c, coef_format.order);
+            DiffArguments<T> for_left_sub_tree (n + 1, l * 2    , max_depth, layout, idx_left_sub_tree, partition_color1, partition_color2, actual_max_depth, half_s0, true);
+            DiffArguments<T> for_right_sub_tree(n + 1, l * 2 + 1, max_depth, layout, idx_right_sub_tree, partition_color1, partition_color2, actual_max_depth, half_s0, true);
+
+            launch_diff_children<T>(ctx, runtime, &for_left_sub_tree, &for_right_sub_tree, lr, lp, lr2, lp2, lr_whole, dummy_lr, quantized);
+        }
+
+    }
+}
+
+enum TreeOpNodeFlags {
+    IN_TREE1 = 1,
+    IN_TREE2 = 2,
+    LEAF_NODE = 4, // no child of the node is visited
+};
+
+struct TreeOpNode {
+    coord_t idx;
+    int flags;
+    TreeOpNode(coord_t _idx, int _flags) : idx(_idx), flags(_flags) {}
+};
+
+// Task argument of tree_op_leaf_task, followed by num_nodes TreeOpNode entries
+struct TreeOpLeafArgs {
+    double alpha;
+    size_t num_nodes;
+    TreeOpLeafArgs(double _alpha, size_t _num_nodes) : alpha(_alpha), num_nodes(_num_nodes) {}
+};
+
+// Whether an op visits a node that the inputs flagged in flags have
+template<typename Op>
+bool tree_op_visits(int flags) {
+    if (Op::kind == ZIP_OP)
+        return (flags & (IN_TREE1 | IN_TREE2)) != 0;
+    if (Op::arity == 2)
+        return (flags & (IN_TREE1 | IN_TREE2)) == (IN_TREE1 | IN_TREE2);
+    return (flags & IN_TREE1) != 0;
+}
+
+// Looks node (n, l) of args up in each input: refine partitions every node it reaches, so an input has the
+// node when its subtree here is partitioned. Also fills in the arguments of the two children.
+template<typename Op>
+int tree_op_node_flags(Context ctx, HighLevelRuntime *runtime, const TreeOpArguments &args,
+                       TreeOpArguments &left, TreeOpArguments &right) {
+    DomainPoint left_sub_tree_color(Point<1>(1LL));
+    DomainPoint right_sub_tree_color(Point<1>(2LL));
+
+    left = right = args;
+    left.n = right.n = args.n + 1;
+    left.l = 2 * args.l;
+    right.l = 2 * args.l + 1;
+    left.idx = left_child_index(args.layout, args.idx, args.n, args.l, args.max_depth);
+    right.idx = right_child_index(args.layout, args.idx, args.n, args.l, args.max_depth);
+
+    int flags = 0;
+    for (int t = 0; t < Op::arity; t++) {
+        left.trees[t] = right.trees[t] = LogicalRegion::NO_REGION;
+        LogicalRegion lr = args.trees[t];
+        if (lr == LogicalRegion::NO_REGION || !runtime->has_logical_partition_by_color(ctx, lr, args.partition_colors[t]))
+            continue;
+        flags |= t == 0 ? IN_TREE1 : IN_TREE2;
+        LogicalPartition lp = runtime->get_logical_partition_by_color(ctx, lr, args.partition_colors[t]);
+        left.trees[t] = runtime->get_logical_subregion_by_color(ctx, lp, left_sub_tree_color);
+        right.trees[t] = runtime->get_logical_subregion_by_color(ctx, lp, right_sub_tree_color);
+    }
+
+    // a child is visited exactly when the inputs have it, which is when its subtree is partitioned too
+    int left_flags = 0;
+    for (int t = 0; t < Op::arity; t++) {
+        if (left.trees[t] != LogicalRegion::NO_REGION && runtime->has_logical_partition_by_color(ctx, left.trees[t], args.partition_colors[t]))
+            left_flags |= t == 0 ? IN_TREE1 : IN_TREE2;
+    }
+    if (!tree_op_visits<Op>(left_flags))
+        flags |= LEAF_NODE;
+    return flags;
+}
+
+// Splits the region written at node (n, l): for ZIP_OP a fresh partition of the result, for MAP_OP the
+// partition refine left on the tree
+template<typename Op>
+LogicalPartition tree_op_write_partition(Context ctx, HighLevelRuntime *runtime, const TreeOpArguments &args, LogicalRegion write_lr) {
+    if (Op::kind == ZIP_OP) {
+        IndexPartition ip = create_subtree_partition(ctx, runtime, write_lr.get_index_space(), args.layout, args.n, args.l, args.max_depth, args.result_color);
+        return runtime->get_logical_partition(ctx, write_lr, ip);
+    }
+    return runtime->get_logical_partition_by_color(ctx, write_lr, args.partition_colors[0]);
+}
+
+// Collects every node the op visits below args, creating the result partitions on the way for ZIP_OP.
+// Only metadata is touched, so inner tasks can call it.
+template<typename Op>
+void collect_tree_op_nodes(Context ctx, HighLevelRuntime *runtime, const TreeOpArguments &args, LogicalRegion write_lr,
+                           vector<TreeOpNode> &nodes) {
+    TreeOpArguments left = args, right = args;
+    int flags = tree_op_node_flags<Op>(ctx, runtime, args, left, right);
+    if (!tree_op_visits<Op>(flags))
+        return;
+    nodes.push_back(TreeOpNode(args.idx, flags));
+
+    // every result node is partitioned, leaves included, so that later walks find it
+    LogicalRegion left_write_lr = LogicalRegion::NO_REGION, right_write_lr = LogicalRegion::NO_REGION;
+    if (Op::kind == ZIP_OP) {
+        LogicalPartition lp = tree_op_write_partition<Op>(ctx, runtime, args, write_lr);
+        left_write_lr = runtime->get_logical_subregion_by_color(ctx, lp, DomainPoint(Point<1>(1LL)));
+        right_write_lr = runtime->get_logical_subregion_by_color(ctx, lp, DomainPoint(Point<1>(2LL)));
+    }
+    if (flags & LEAF_NODE)
+        return;
+    collect_tree_op_nodes<Op>(ctx, runtime, left, left_write_lr, nodes);
+    collect_tree_op_nodes<Op>(ctx, runtime, right, right_write_lr, nodes);
+}
+
+template<typename T, typename Op>
+Future launch_tree_op_leaf(Context ctx, HighLevelRuntime *runtime, const TreeOpArguments &args, LogicalRegion write_lr,
+                           LogicalRegion write_parent, const vector<TreeOpNode> &nodes) {
+    vector<char> leaf_args(sizeof(TreeOpLeafArgs) + nodes.size() * sizeof(TreeOpNode));
+    TreeOpLeafArgs header(args.alpha, nodes.size());
+    memcpy(&leaf_args[0], &header, sizeof(header));
+    memcpy(&leaf_args[sizeof(header)], &nodes[0], nodes.size() * sizeof(TreeOpNode));
+
+    TaskLauncher launcher(tree_op_task_id<T, Op>(TREE_OP_LEAF), TaskArgument(&leaf_args[0], leaf_args.size()));
+    launcher.tag = cost_tag(nodes.size());
+    add_tree_op_regions<Op>(launcher, args.trees[0], args.trees[1], write_lr, write_parent);
+    return runtime->execute_task(ctx, launcher);
+}
+
+// The recursive walk. Its regions are those of add_tree_op_regions: the whole input trees it reads, then
+// the subtree rooted at this node that it writes.
+template<typename T, typename Op>
+typename Op::result_t tree_op_task(const Task *task, const std::vector<PhysicalRegion> &regions, Context ctx, HighLevelRuntime *runtime) {
+    typedef typename Op::result_t result_t;
+    TreeOpArguments args = task->is_index_space ? *(const TreeOpArguments *) task->local_args
+    : *(const TreeOpArguments *) task->args;
+    TaskTrace trace(task, args.n, args.l);
+
+    LogicalRegion write_lr = Op::kind == REDUCE_OP ? LogicalRegion::NO_REGION : regions.back().get_logical_region();
+    // the inputs are read through the whole regions, the walk only follows their subtrees
+    TreeOpArguments node_args = args;
+    if (Op::kind != MAP_OP) {
+        node_args.trees[0] = regions[0].get_logical_region();
+        if (Op::arity == 2)
+            node_args.trees[1] = regions[1].get_logical_region();
+    }
+
+    if (sweep_subtree(args.max_depth - args.n, args.partition_colors[0], args.idx)) {
+        vector<TreeOpNode> nodes;
+        collect_tree_op_nodes<Op>(ctx, runtime, args, write_lr, nodes);
+        if (nodes.empty())
+            return Op::identity();
+        return launch_tree_op_leaf<T, Op>(ctx, runtime, node_args, write_lr, write_lr, nodes).template get_result<result_t>();
+    }
+
+    TreeOpArguments left = args, right = args;
+    int flags = tree_op_node_flags<Op>(ctx, runtime, args, left, right);
+    if (!tree_op_visits<Op>(flags))
+        return Op::identity();
+
+    LogicalPartition write_lp = LogicalPartition::NO_PART;
+    LogicalRegion my_write_lr = LogicalRegion::NO_REGION;
+    if (Op::kind != REDUCE_OP) {
+        write_lp = tree_op_write_partition<Op>(ctx, runtime, args, write_lr);
+        my_write_lr = runtime->get_logical_subregion_by_color(ctx, write_lp, DomainPoint(Point<1>(0LL)));
+    }
+
+    // an internal node of a compressed result is refiltered from its children below instead of zipped
+    bool refilter = Op::compresses_output && !(flags & LEAF_NODE);
+    Future f_self;
+    if (!refilter) {
+        vector<TreeOpNode> self(1, TreeOpNode(args.idx, flags));
+        f_self = launch_tree_op_leaf<T, Op>(ctx, runtime, node_args, my_write_lr, write_lr, self);
+    }
+    if (flags & LEAF_NODE)
+        return f_self.get_result<result_t>();
+
+    // both children in one index launch; a child missing from a tree only shows in its arguments, the
+    // regions are the same for every point
+    DomainPoint left_color(Point<1>(1LL)), right_color(Point<1>(2LL));
+    ArgumentMap arg_map;
+    arg_map.set_point(left_color, TaskArgument(&left, sizeof(TreeOpArguments)));
+    arg_map.set_point(right_color, TaskArgument(&right, sizeof(TreeOpArguments)));
+    Rect<1> launch_domain(left_color, right_color);
+    IndexTaskLauncher launcher(tree_op_task_id<T, Op>(TREE_OP_WALK), launch_domain, TaskArgument(NULL, 0), arg_map);
+    launcher.tag = cost_tag(subtree_cost(args.partition_colors[0], left.idx), subtree_cost(args.partition_colors[0], right.idx));
+    add_tree_op_child_regions<Op>(launcher, node_args.trees[0], node_args.trees[1], write_lp, write_lr);
+    FutureMap f_children = runtime->execute_index_space(ctx, launcher);
+
+    if (refilter) {
+        CompressPathNode node(args.idx, left.idx, right.idx, args.n);
+        TaskLauncher compress_launcher(task_id<T>(COMPRESS_PATH_TASK_ID), TaskArgument(&node, sizeof(CompressPathNode)));
+        compress_launcher.add_region_requirement(RegionRequirement(write_lr, READ_WRITE, EXCLUSIVE, write_lr));
+        add_coef_fields(compress_launcher, 0);
+        runtime->execute_task(ctx, compress_launcher);
+    }
+    return Op::combine(refilter ? Op::identity() : f_self.get_result<result_t>(),
+                       Op::combine(f_children.get_result<result_t>(left_color), f_children.get_result<result_t>(right_color)));
+}
+
+// The internal nodes of a batch the walk collected, as (parent, left, right) index triples per level below
+// the first node. The batch is in pre-order and every internal node has both children in it, so the open
+// internal nodes form a stack: a node is the next child of the one on top, and a leaf closes every node
+// whose right child it ends.
+void tree_op_internal_levels(const TreeOpNode *nodes, size_t num_nodes, vector<vector<coord_t> > &internal) {
+    vector<pair<int, size_t> > open; // level and position in internal[level] of every open node
+    vector<int> children;            // children of every open node seen so far
+    for (size_t i = 0; i < num_nodes; i++) {
+        int level = open.size();
+        if (!open.empty())
+            internal[open.back().first][open.back().second + 1 + children.back()++] = nodes[i].idx;
+        if (!(nodes[i].flags & LEAF_NODE)) {
+            if ((int) internal.size() <= level)
+                internal.resize(level + 1);
+            open.push_back(make_pair(level, internal[level].size()));
+            children.push_back(0);
+            internal[level].push_back(nodes[i].idx);
+            internal[level].push_back(-1);
+            internal[level].push_back(-1);
+            continue;
+        }
+        while (!open.empty() && children.back() == 2) {
+            open.pop_back();
+            children.pop_back();
+        }
+    }
+    assert(open.empty());
+}
+
+// The internal nodes of a tree of known shape below (n, l), as (parent, left, right) index triples per level
+void bitmap_internal_levels(const vector<unsigned char> &bitmap, TreeLayout layout, int n, int l, coord_t idx, int max_depth,
+                            vector<vector<coord_t> > &internal) {
+    if (bitmap[idx] & BITMAP_LEAF)
+        return;
+    if ((int) internal.size() <= n)
+        internal.resize(n + 1);
+    coord_t left = left_child_index(layout, idx, n, l, max_depth), right = right_child_index(layout, idx, n, l, max_depth);
+    internal[n].push_back(idx);
+    internal[n].push_back(left);
+    internal[n].push_back(right);
+    bitmap_internal_levels(bitmap, layout, n + 1, 2 * l, left, max_depth, internal);
+    bitmap_internal_levels(bitmap, layout, n + 1, 2 * l + 1, right, max_depth, internal);
+}
+
+// Applies the op to a batch of nodes collected by the walk
+template<typename T, typename Op>
+typename Op::result_t tree_op_leaf_task(const Task *task, const std::vector<PhysicalRegion> &regions, Context ctx, HighLevelRuntime *runtime) {
+    TaskTrace trace(task);
+    typedef typename Op::result_t result_t;
+    const TreeOpLeafArgs *args = (const TreeOpLeafArgs *) task->args;
+    const TreeOpNode *nodes = (const TreeOpNode *) (args + 1);
+    int k = coef_format.order;
+    result_t result = Op::identity();
+
+    // the reducing loops combine a partial result per thread
+    if (Op::kind == REDUCE_OP) {
+        const CoefAccessor<READ_ONLY, T> read_acc1(regions[0]);
+        const CoefAccessor<READ_ONLY, T> read_acc2(regions[Op::arity - 1]);
+        OMP(parallel if (omp_variant(task)))
+        {
+            result_t partial = Op::identity();
+            Coefs<T> x, y;
+            OMP(for schedule(static) nowait)
+            for (size_t i = 0; i < args->num_nodes; i++) {
+                if (Op::leaves_only && !(nodes[i].flags & LEAF_NODE))
+                    continue;
+                read_acc1.load(nodes[i].idx, x);
+                read_acc2.load(nodes[i].idx, y);
+                for (int j = 0; j < k; j++)
+                    partial = Op::combine(partial, Op::term(x.c[j], y.c[j]));
+            }
+            OMP(critical)
+            result = Op::combine(result, partial);
+        }
+    } else if (Op::kind == ZIP_OP) {
+        const CoefAccessor<READ_ONLY, T> read_acc1(regions[0]);
+        const CoefAccessor<READ_ONLY, T> read_acc2(regions[1]);
+        const CoefAccessor<WRITE_DISCARD, T> write_acc(regions[2]);
+        Coefs<T> zero = make_coefs(T(0));
+        OMP(parallel if (omp_variant(task)))
+        {
+            result_t partial = Op::identity();
+            Coefs<T> x, y, out;
+            OMP(for schedule(static) nowait)
+            for (size_t i = 0; i < args->num_nodes; i++) {
+                x = zero;
+                y = zero;
+                if (nodes[i].flags & IN_TREE1)
+                    read_acc1.load(nodes[i].idx, x);
+                if (nodes[i].flags & IN_TREE2)
+                    read_acc2.load(nodes[i].idx, y);
+                for (int j = 0; j < k; j++)
+                    out.c[j] = Op::apply(x.c[j], y.c[j], args->alpha);
+                write_acc.store(nodes[i].idx, out);
+                if (Op::reduces_output && (!Op::leaves_only || (nodes[i].flags & LEAF_NODE))) {
+                    for (int j = 0; j < k; j++)
+                        partial = Op::combine(partial, Op::term(out.c[j], out.c[j]));
+                }
+            }
+            OMP(critical)
+            result = Op::combine(result, partial);
+        }
+        // the batch is the whole subtree of its first node, compressed while it is still in cache
+        if (Op::compresses_output) {
+            vector<vector<coord_t> > internal;
+            tree_op_internal_levels(nodes, args->num_nodes, internal);
+            compress_internal_levels(CoefAccessor<READ_WRITE, T>(regions[2]), internal, omp_variant(task));
+        }
+    } else {
+        const CoefAccessor<READ_WRITE, T> acc(regions[0]);
+        OMP(parallel for schedule(static) if (omp_variant(task)))
+        for (size_t i = 0; i < args->num_nodes; i++) {
+            Coefs<T> x;
+            acc.load(nodes[i].idx, x);
+            for (int j = 0; j < k; j++)
+                x.c[j] = Op::apply(x.c[j], x.c[j], args->alpha);
+            acc.store(nodes[i].idx, x);
+        }
+    }
+    return result;
+}
+
+// The op as one pass over every index of the whole regions, for trees whose shape is known and shared.
+// The refinement bitmap says which indices are nodes (and leaves), the loops themselves are contiguous.
+template<typename T, typename Op>
+typename Op::result_t tree_op_dense_task(const Task *task, const std::vector<PhysicalRegion> &regions, Context ctx, HighLevelRuntime *runtime) {
+    TaskTrace trace(task);
+    typedef typename Op::result_t result_t;
+    TreeOpDenseArgs args = *(const TreeOpDenseArgs *) task->args;
+
+    vector<unsigned char> bitmap;
+    refinement_bitmap(args.shape.seed, args.shape.depth, args.shape.max_depth, args.shape.layout, bitmap);
+    unsigned char mask = Op::leaves_only ? BITMAP_LEAF : BITMAP_NODE;
+    const unsigned char *nodes = &bitmap[0];
+    size_t num_nodes = bitmap.size();
+    result_t result = Op::identity();
+
+    for (int j = 0; j < coef_format.order; j++) {
+        if (Op::kind == REDUCE_OP) {
+            const CoefAccessor<READ_ONLY, T> read_acc1(regions[0]);
+            const CoefAccessor<READ_ONLY, T> read_acc2(regions[Op::arity - 1]);
+            size_t stride1, stride2;
+            const T *__restrict x = read_acc1.read_run(0, j, stride1);
+            const T *__restrict y = read_acc2.read_run(0, j, stride2);
+            OMP(parallel if (omp_variant(task)))
+            {
+                result_t partial = Op::identity();
+                OMP(for schedule(static) nowait)
+                for (size_t i = 0; i < num_nodes; i++) {
+                    if (nodes[i] & mask)
+                        partial = Op::combine(partial, Op::term(x[i * stride1], y[i * stride2]));
+                }
+                OMP(critical)
+                result = Op::combine(result, partial);
+            }
+        } else if (Op::kind == ZIP_OP) {
+            const CoefAccessor<READ_ONLY, T> read_acc1(regions[0]);
+            const CoefAccessor<READ_ONLY, T> read_acc2(regions[1]);
+            const CoefAccessor<WRITE_DISCARD, T> write_acc(regions[2]);
+            size_t stride1, stride2, stride3;
+            const T *__restrict x = read_acc1.read_run(0, j, stride1);
+            const T *__restrict y = read_acc2.read_run(0, j, stride2);
+            T *__restrict out = write_acc.write_run(0, j, stride3);
+            OMP(parallel if (omp_variant(task)))
+            {
+                result_t partial = Op::identity();
+                OMP(for schedule(static) nowait)
+                for (size_t i = 0; i < num_nodes; i++) {
+                    out[i * stride3] = (nodes[i] & BITMAP_NODE) ? Op::apply(x[i * stride1], y[i * stride2], args.alpha) : T(0);
+                    if (Op::reduces_output && (nodes[i] & mask))
+                        partial = Op::combine(partial, Op::term(out[i * stride3], out[i * stride3]));
+                }
+                OMP(critical)
+                result = Op::combine(result, partial);
+            }
+        } else {
+            const CoefAccessor<READ_WRITE, T> acc(regions[0]);
+            size_t stride;
+            T *__restrict x = acc.write_run(0, j, stride);
+            OMP(parallel for schedule(static) if (omp_variant(task)))
+            for (size_t i = 0; i < num_nodes; i++) {
+                if (nodes[i] & mask)
+                    x[i * stride] = Op::apply(x[i * stride], x[i * stride], args.alpha);
+            }
+        }
+    }
+    if (Op::compresses_output) {
+        vector<vector<coord_t> > internal;
+        bitmap_internal_levels(bitmap, args.shape.layout, 0, 0, 0, args.shape.max_depth, internal);
+        compress_internal_levels(CoefAccessor<READ_WRITE, T>(regions[2]), internal, omp_variant(task));
+    }
+    return result;
+}
+
+template<typename T>
+void print_node(int n, int l, coord_t idx, const Coefs<T> &node_value) {
+    string values;
+    for (int j = 0; j < coef_format.order; j++) {
+        char value[32];
+        snprintf(value, sizeof(value), j == 0 ? "%g" : " %g", static_cast<double>(node_value.c[j]));
+        values += value;
+    }
+    fprintf(stderr, "(n: %d, l: %d), idx: %lld, node_value: %s\n", n, l, idx, values.c_str());
+}
+
+// Collects, in the order print_task visits them, the nodes below (n, l) that print_task would print
+void collect_print_nodes(Context ctx, HighLevelRuntime *runtime, LogicalRegion lr, Color partition_color,
+                         TreeLayout layout, int n, int l, coord_t idx, int max_depth, vector<SweepNode> &nodes) {
+    nodes.push_back(SweepNode(idx, n, l));
+    LogicalPartition lp = runtime->get_logical_partition_by_color(ctx, lr, partition_color);
+    LogicalRegion left_sub_tree_lr = runtime->get_logical_subregion_by_color(ctx, lp, DomainPoint(Point<1>(1LL)));
+    LogicalRegion right_sub_tree_lr = runtime->get_logical_subregion_by_color(ctx, lp, DomainPoint(Point<1>(2LL)));
+    if (!runtime->has_index_partition(ctx, left_sub_tree_lr.get_index_space(), partition_color) &&
+        !runtime->has_index_partition(ctx, right_sub_tree_lr.get_index_space(), partition_color))
+        return;
+    collect_print_nodes(ctx, runtime, left_sub_tree_lr, partition_color, layout, n + 1, 2 * l,
+                        left_child_index(layout, idx, n, l, max_depth), max_depth, nodes);
+    collect_print_nodes(ctx, runtime, right_sub_tree_lr, partition_color, layout, n + 1, 2 * l + 1,
+                        right_child_index(layout, idx, n, l, max_depth), max_depth, nodes);
+}
+
+// Prints a whole subtree in one task, its argument holding the SweepNode entries collect_print_nodes found
+template<typename T>
+void print_sweep_task(const Task *task,
+                      const std::vector<PhysicalRegion> &regions,
+                      Context ctx, HighLevelRuntime *runtime) {
+    TaskTrace trace(task);
+    const SweepNode *nodes = (const SweepNode *) task->args;
+    size_t num_nodes = task->arglen / sizeof(SweepNode);
+    assert(regions.size() == 1);
+    const CoefAccessor<READ_ONLY, T> read_acc(regions[0]);
+
+    Coefs<T> node_value;
+    for (size_t i = 0; i < num_nodes; i++) {
+        read_acc.load(nodes[i].idx, node_value);
+        print_node(nodes[i].n, nodes[i].l, nodes[i].idx, node_value);
+    }
+}
+
+template<typename T>
+void print_task(const Task *task, const std::vector<PhysicalRegion> &regions, Context ctxt, HighLevelRuntime *runtime) {
+
+    Arguments args = task->is_index_space ? *(const Arguments *) task->local_args
+    : *(const Arguments *) task->args;
+    TaskTrace trace(task, args.n, args.l);
+
+    int n = args.n,
+    l = args.l,
+    max_depth = args.max_depth;
+    TreeLayout layout = args.layout;
+
+    DomainPoint my_sub_tree_color(Point<1>(0LL));
+    DomainPoint left_sub_tree_color(Point<1>(1LL));
+    DomainPoint right_sub_tree_color(Point<1>(2LL));
+    Color partition_color = args.partition_color;
+
+    coord_t idx = args.idx;
+
+    LogicalRegion lr = regions[0].get_logical_region();
+
+    if (sweep_subtree(max_depth - n, partition_color, idx)) {
+        vector<SweepNode> nodes;
+        collect_print_nodes(ctxt, runtime, lr, partition_color, layout, n, l, idx, max_depth, nodes);
+        TaskLauncher sweep_launcher(task_id<T>(PRINT_SWEEP_TASK_ID), TaskArgument(&nodes[0], nodes.size() * sizeof(SweepNode)));
+        RegionRequirement req(lr, READ_ONLY, EXCLUSIVE, lr);
+        add_coef_fields(req);
+        sweep_launcher.add_region_requirement(req);
+        runtime->execute_task(ctxt, sweep_launcher);
+        return;
+    }
+
+    LogicalPartition lp = LogicalPartition::NO_PART;
+    lp = runtime->get_logical_partition_by_color(ctxt, lr, partition_color);
+
+    LogicalRegion my_sub_tree_lr = runtime->get_logical_subregion_by_color(ctxt, lp, my_sub_tree_color);
+    LogicalRegion left_sub_tree_lr = runtime->get_logical_subregion_by_color(ctxt, lp, left_sub_tree_color);
+    LogicalRegion right_sub_tree_lr = runtime->get_logical_subregion_by_color(ctxt, lp, right_sub_tree_color);
+
+    Future f1;
+    {
+        ReadTaskArgs args(idx);
+        TaskLauncher read_task_launcher(task_id<T>(READ_TASK_ID), TaskArgument(&args, sizeof(ReadTaskArgs)));
+        RegionRequirement req(my_sub_tree_lr, READ_ONLY, EXCLUSIVE, lr);
+        add_coef_fields(req);
+        read_task_launcher.add_region_requirement(req);
+        f1 = runtime->execute_task(ctxt, read_task_launcher);
+    }
+
+    Coefs<T> node_value = f1.get_result<Coefs<T> >();
+    print_node(n, l, idx, node_value);
+
+    IndexSpace indexspace_left = left_sub_tree_lr.get_index_space();
+    IndexSpace indexspace_right = right_sub_tree_lr.get_index_space();
+
+
+
+    // These lines will create an instance for the whole region even though we need only the first element
+    // const FieldAccessor<READ_ONLY, T, 1> read_acc(regions[0], FID_X);
+    // Coefs<T> node_value = read_acc[idx];
+
+    // checking if the children of the node have any valid partition. This condition implies that we are checking if we have reached the leaf node or not
+    if (runtime->has_index_partition(ctxt, indexspace_left, partition_color) || runtime->has_index_partition(ctxt, indexspace_right, partition_color)) {
+
+        coord_t idx_left_sub_tree = left_child_index(layout, idx, n, l, max_depth);
+        coord_t idx_right_sub_tree = right_child_index(layout, idx, n, l, max_depth);
+
+        Rect<1> launch_domain(left_sub_tree_color, right_sub_tree_color);
+        ArgumentMap arg_map;
+
+        Arguments for_left_sub_tree(n + 1, 2 * l, max_depth, layout, idx_left_sub_tree, partition_color);
+        Arguments for_right_sub_tree(n + 1, 2 * l + 1, max_depth, layout, idx_right_sub_tree, partition_color);
+
+        arg_map.set_point(left_sub_tree_color, TaskArgument(&for_left_sub_tree, sizeof(Arguments)));
+        arg_map.set_point(right_sub_tree_color, TaskArgument(&for_right_sub_tree, sizeof(Arguments)));
+
+        // It calls print task twice for both the sub lp's lp[1], lp[2]
+        IndexTaskLauncher print_launcher(task_id<T>(PRINT_TASK_ID), launch_domain, TaskArgument(NULL, 0), arg_map);
+
+        // We should not create a new partition, instead just fetch the existing partition, to avoid creating copy of the whole tree again and again
+        // this partition color is the same color that we specified in the refine task while creating the index partition
+        RegionRequirement req(lp, 0, READ_ONLY, EXCLUSIVE, lr);
+        add_coef_fields(req);
+        print_launcher.add_region_requirement(req);
+
+        runtime->execute_index_space(ctxt, print_launcher);
+    } 
+}
+
+// Batched point evaluation. A tree in reconstructed form (as refine leaves it, or after reconstruct) holds at
+// each leaf (n, l) the moments s_i = integral of f(x) phi_i(2^n x - l) over its box [l / 2^n, (l + 1) / 2^n),
+// so that f(x) = 2^n sum_i s_i phi_i(2^n x - l) there. These are the coefficients two_scale_filter combines.
+// tree_eval sorts the points once, which in one dimension puts them in tree order, and hands the sorted batch
+// to eval_task. Every walk level splits its batch at the middle of the box, so each subtree only gets its own
+// points and subtrees without points are not visited; below the serial cutoff eval_leaf_task evaluates the
+// points of every leaf of the block in one pass over them.
+
+// Points one pass of the scaling function recurrence handles at a time
+#define EVAL_CHUNK 64
+
+// Values of a batch of points, integrals of a batch of intervals or projections of a batch of boxes, in the
+// order of the batch. Futures carry it through the legion_serialize protocol, as its size is that of the batch.
+struct EvalValues {
+    vector<double> values;
+
+    size_t legion_buffer_size() const { return sizeof(size_t) + values.size() * sizeof(double); }
+
+    size_t legion_serialize(void *buffer) const {
+        size_t count = values.size();
+        memcpy(buffer, &count, sizeof(size_t));
+        if (count > 0)
+            memcpy((char *) buffer + sizeof(size_t), &values[0], count * sizeof(double));
+        return legion_buffer_size();
+    }
+
+    size_t legion_deserialize(const void *buffer) {
+        size_t count;
+        memcpy(&count, buffer, sizeof(size_t));
+        values.resize(count);
+        if (count > 0)
+            memcpy(&values[0], (const char *) buffer + sizeof(size_t), count * sizeof(double));
+        return legion_buffer_size();
+    }
+};
+
+// Task argument of eval_task, followed by the num_points sorted coordinates that fall in the subtree of (n, l)
+struct EvalArguments {
+    int n, l, max_depth;
+    TreeLayout layout;
+    coord_t idx;
+    Color partition_color;
+    size_t num_points;
+
+    EvalArguments(int _n, int _l, int _max_depth, TreeLayout _layout, coord_t _idx, Color _partition_color, size_t _num_points)
+        : n(_n), l(_l), max_depth(_max_depth), layout(_layout), idx(_idx), partition_color(_partition_color), num_points(_num_points)
+    {}
+};
+
+// A leaf of an eval block and the run of the block's points in its box
+struct EvalLeaf {
+    coord_t idx;
+    int n, l;
+    size_t first, count;
+    EvalLeaf(coord_t _idx, int _n, int _l, size_t _first, size_t _count) : idx(_idx), n(_n), l(_l), first(_first), count(_count) {}
+};
+
+// Task argument of eval_leaf_task, followed by num_leaves EvalLeaf entries and then the num_points coordinates
+struct EvalLeafArgs {
+    size_t num_leaves, num_points;
+    EvalLeafArgs(size_t _num_leaves, size_t _num_points) : num_leaves(_num_leaves), num_points(_num_points) {}
+};
+
+// Serialized EvalArguments header and points
+vector<char> pack_eval_args(const EvalArguments &header, const double *points) {
+    vector<char> buffer(sizeof(EvalArguments) + header.num_points * sizeof(double));
+    memcpy(&buffer[0], &header, sizeof(header));
+    if (header.num_points > 0)
+        memcpy(&buffer[sizeof(header)], points, header.num_points * sizeof(double));
+    return buffer;
+}
+
+// Number of the count sorted points at x that lie in the left half of the box of (n, l)
+inline size_t eval_split(const double *x, size_t count, int n, int l) {
+    double middle = ldexp(2.0 * l + 1, -(n + 1));
+    return lower_bound(x, x + count, middle) - x;
+}
+
+// out[p] = sum_i s_i phi_i(2^n x[p] - l) for count points in the box of (n, l). The Legendre recurrence runs
+// over the order in the outer loop and over a chunk of points in the inner one, which the compiler vectorizes.
+template<typename T>
+void eval_leaf_points(const Coefs<T> &s, int n, int l, const double *x, double *out, size_t count) {
+    int k = coef_format.order;
+    double scale = ldexp(1.0, n);
+    double t[EVAL_CHUNK], p0[EVAL_CHUNK], p1[EVAL_CHUNK], sum[EVAL_CHUNK];
+    for (size_t first = 0; first < count; first += EVAL_CHUNK) {
+        size_t m = min<size_t>(EVAL_CHUNK, count - first);
+        double s0 = s.c[0], s1 = k > 1 ? sqrt(3.0) * s.c[1] : 0;
+        for (size_t p = 0; p < m; p++) {
+            t[p] = 2 * (x[first + p] * scale - l) - 1;
+            p0[p] = 1;
+            p1[p] = t[p];
+            sum[p] = s0 + s1 * t[p];
+        }
+        for (int i = 2; i < k; i++) {
+            double a = (2.0 * i - 1) / i, b = (i - 1.0) / i, c = sqrt(2.0 * i + 1) * s.c[i];
+            for (size_t p = 0; p < m; p++) {
+                double p2 = a * t[p] * p1[p] - b * p0[p];
+                p0[p] = p1[p];
+                p1[p] = p2;
+                sum[p] += c * p2;
+            }
+        }
+        for (size_t p = 0; p < m; p++)
+            out[first + p] = scale * sum[p];
+    }
+}
+
+// Hands the count sorted points at x + first down the subtree of (n, l), whose region is lr, and records the
+// leaf every run of them ends at. A node is a leaf when refine did not partition its left child, the test of
+// collect_subtree_levels. Only metadata is touched, so inner tasks can call it.
+void collect_eval_leaves(Context ctx, HighLevelRuntime *runtime, LogicalRegion lr, Color partition_color, TreeLayout layout,
+                         int n, int l, coord_t idx, int max_depth, const double *x, size_t first, size_t count, vector<EvalLeaf> &leaves) {
+    if (count == 0)
+        return;
+    LogicalPartition lp = runtime->get_logical_partition_by_color(ctx, lr, partition_color);
+    LogicalRegion left_sub_tree_lr = runtime->get_logical_subregion_by_color(ctx, lp, DomainPoint(Point<1>(1LL)));
+    if (!runtime->has_index_partition(ctx, left_sub_tree_lr.get_index_space(), partition_color)) {
+        leaves.push_back(EvalLeaf(idx, n, l, first, count));
+        return;
+    }
+    LogicalRegion right_sub_tree_lr = runtime->get_logical_subregion_by_color(ctx, lp, DomainPoint(Point<1>(2LL)));
+    size_t split = eval_split(x + first, count, n, l);
+    collect_eval_leaves(ctx, runtime, left_sub_tree_lr, partition_color, layout, n + 1, 2 * l,
+                        left_child_index(layout, idx, n, l, max_depth), max_depth, x, first, split, leaves);
+    collect_eval_leaves(ctx, runtime, right_sub_tree_lr, partition_color, layout, n + 1, 2 * l + 1,
+                        right_child_index(layout, idx, n, l, max_depth), max_depth, x, first + split, count - split, leaves);
+}
+
+// The walk. Its region is the subtree of (n, l), which the points of its batch all fall in.
+template<typename T>
+EvalValues eval_task(const Task *task, const std::vector<PhysicalRegion> &regions, Context ctx, HighLevelRuntime *runtime) {
+    const char *buffer = (const char *) (task->is_index_space ? task->local_args : task->args);
+    EvalArguments args = *(const EvalArguments *) buffer;
+    const double *x = (const double *) (buffer + sizeof(EvalArguments));
+    TaskTrace trace(task, args.n, args.l);
+
+    LogicalRegion lr = regions[0].get_logical_region();
+    LogicalPartition lp = runtime->get_logical_partition_by_color(ctx, lr, args.partition_color);
+    LogicalRegion left_sub_tree_lr = runtime->get_logical_subregion_by_color(ctx, lp, DomainPoint(Point<1>(1LL)));
+    bool quantized = reads_quantized(task->regions[0]);
+
+    if (sweep_subtree(args.max_depth - args.n, args.partition_color, args.idx) ||
+        !runtime->has_index_partition(ctx, left_sub_tree_lr.get_index_space(), args.partition_color)) {
+        vector<EvalLeaf> leaves;
+        collect_eval_leaves(ctx, runtime, lr, args.partition_color, args.layout, args.n, args.l, args.idx, args.max_depth,
+                            x, 0, args.num_points, leaves);
+        EvalLeafArgs header(leaves.size(), args.num_points);
+        vector<char> leaf_args(sizeof(EvalLeafArgs) + leaves.size() * sizeof(EvalLeaf) + args.num_points * sizeof(double));
+        memcpy(&leaf_args[0], &header, sizeof(header));
+        memcpy(&leaf_args[sizeof(header)], &leaves[0], leaves.size() * sizeof(EvalLeaf));
+        memcpy(&leaf_args[sizeof(header) + leaves.size() * sizeof(EvalLeaf)], x, args.num_points * sizeof(double));
+
+        // the points are the work of the block, the mapper weighs them like nodes
+        TaskLauncher launcher(task_id<T>(EVAL_LEAF_TASK_ID), TaskArgument(&leaf_args[0], leaf_args.size()));
+        launcher.tag = cost_tag(args.num_points);
+        RegionRequirement req(lr, READ_ONLY, EXCLUSIVE, lr);
+        add_coef_fields(req, quantized);
+        launcher.add_region_requirement(req);
+        return runtime->execute_task(ctx, launcher).get_result<EvalValues>();
+    }
+
+    // only the children that got points are launched, together in one index launch when both did
+    size_t split = eval_split(x, args.num_points, args.n, args.l);
+    EvalArguments left(args.n + 1, 2 * args.l, args.max_depth, args.layout, left_child_index(args.layout, args.idx, args.n, args.l, args.max_depth),
+                       args.partition_color, split);
+    EvalArguments right(args.n + 1, 2 * args.l + 1, args.max_depth, args.layout, right_child_index(args.layout, args.idx, args.n, args.l, args.max_depth),
+                        args.partition_color, args.num_points - split);
+    vector<char> left_args = pack_eval_args(left, x), right_args = pack_eval_args(right, x + split);
+
+    DomainPoint left_color(Point<1>(1LL)), right_color(Point<1>(2LL));
+    ArgumentMap arg_map;
+    arg_map.set_point(left_color, TaskArgument(&left_args[0], left_args.size()));
+    arg_map.set_point(right_color, TaskArgument(&right_args[0], right_args.size()));
+    Rect<1> launch_domain(split > 0 ? left_color : right_color, split < args.num_points ? right_color : left_color);
+    IndexTaskLauncher launcher(task_id<T>(EVAL_TASK_ID), launch_domain, TaskArgument(NULL, 0), arg_map);
+    launcher.tag = cost_tag(split > 0 ? subtree_cost(args.partition_color, left.idx) : subtree_cost(args.partition_color, right.idx),
+                            split > 0 && split < args.num_points ? subtree_cost(args.partition_color, right.idx) : 0);
+    RegionRequirement req(lp, 0, READ_ONLY, EXCLUSIVE, lr);
+    add_coef_fields(req, quantized);
+    launcher.add_region_requirement(req);
+    FutureMap f_children = runtime->execute_index_space(ctx, launcher);
+
+    // the left subtree holds the smaller coordinates, so its values come first
+    EvalValues result;
+    if (split > 0)
+        result = f_children.get_result<EvalValues>(left_color);
+    if (split < args.num_points) {
+        EvalValues right_values = f_children.get_result<EvalValues>(right_color);
+        result.values.insert(result.values.end(), right_values.values.begin(), right_values.values.end());
+    }
+    return result;
+}
+
+// Evaluates the points of a block, leaf by leaf, each leaf loading its coefficients once
+template<typename T>
+EvalValues eval_leaf_task(const Task *task, const std::vector<PhysicalRegion> &regions, Context ctx, HighLevelRuntime *runtime) {
+    TaskTrace trace(task);
+    const EvalLeafArgs *args = (const EvalLeafArgs *) task->args;
+    const EvalLeaf *leaves = (const EvalLeaf *) (args + 1);
+    const double *x = (const double *) (leaves + args->num_leaves);
+    const CoefAccessor<READ_ONLY, T> read_acc(regions[0], reads_quantized(task->regions[0]));
+
+    EvalValues result;
+    result.values.resize(args->num_points);
+    double *out = result.values.empty() ? NULL : &result.values[0];
+    OMP(parallel for schedule(dynamic) if (omp_variant(task)))
+    for (size_t i = 0; i < args->num_leaves; i++) {
+        Coefs<T> s;
+        read_acc.load(leaves[i].idx, s);
+        eval_leaf_points(s, leaves[i].n, leaves[i].l, x + leaves[i].first, out + leaves[i].first, leaves[i].count);
+    }
+    return result;
+}
+
+// f(points[i]) for every point of a tree in reconstructed form, 0 for points outside [0, 1]
+template<typename T>
+vector<double> tree_eval(Context ctx, HighLevelRuntime *runtime, const TreeOperand &tree, const vector<double> &points) {
+    vector<double> values(points.size(), 0);
+    vector<pair<double, size_t> > order;
+    for (size_t i = 0; i < points.size(); i++) {
+        if (points[i] >= 0 && points[i] <= 1)
+            order.push_back(make_pair(points[i], i));
+    }
+    if (order.empty() || !runtime->has_logical_partition_by_color(ctx, tree.lr, tree.partition_color))
+        return values;
+    sort(order.begin(), order.end());
+
+    vector<double> sorted(order.size());
+    for (size_t i = 0; i < order.size(); i++)
+        sorted[i] = order[i].first;
+    EvalArguments header(0, 0, tree.shape.max_depth, tree.shape.layout, 0, tree.partition_color, sorted.size());
+    vector<char> args = pack_eval_args(header, &sorted[0]);
+    TaskLauncher launcher(task_id<T>(EVAL_TASK_ID), TaskArgument(&args[0], args.size()));
+    launcher.add_region_requirement(RegionRequirement(tree.lr, READ_ONLY, EXCLUSIVE, tree.lr));
+    add_coef_fields(launcher, 0, tree.quantized);
+    EvalValues result = runtime->execute_task(ctx, launcher).get_result<EvalValues>();
+
+    assert(result.values.size() == order.size());
+    for (size_t i = 0; i < order.size(); i++)
+        values[order[i].second] = result.values[i];
+    return values;
+}
+
+// Interval integrals. After compress every node holds the moments of f over its box, internal nodes
+// included, so the integral over a whole box is its coefficient 0 and the tree works as a segment tree:
+// integrate splits [a, b] into the O(depth) largest boxes inside it and at most two leaves it cuts, reads
+// coefficient 0 of the former and integrates the polynomial of the latter over the part in [a, b].
+
+// A node an interval query reads: the part [u0, u1] of its box, scaled to [0, 1], counts for query
+struct IntegralNode {
+    coord_t idx;
+    size_t query;
+    double u0, u1;
+    IntegralNode(coord_t _idx, size_t _query, double _u0, double _u1) : idx(_idx), query(_query), u0(_u0), u1(_u1) {}
+};
+
+// Task argument of integrate_task, followed by num_nodes IntegralNode entries
+struct IntegrateArgs {
+    size_t num_queries, num_nodes;
+    IntegrateArgs(size_t _num_queries, size_t _num_nodes) : num_queries(_num_queries), num_nodes(_num_nodes) {}
+};
+
+// Records the nodes of the subtree of (n, l), whose region is lr, that the integral over [a, b] reads. The tree
+// has the node, so lr is partitioned; a node is a leaf when its left child is not, the test of collect_subtree_levels.
+// Only metadata is touched.
+void collect_integral_nodes(Context ctx, HighLevelRuntime *runtime, LogicalRegion lr, Color partition_color, TreeLayout layout,
+                            int n, int l, coord_t idx, int max_depth, double a, double b, size_t query, vector<IntegralNode> &nodes) {
+    double lo = ldexp(double(l), -n), hi = ldexp(l + 1.0, -n);
+    if (b <= lo || a >= hi)
+        return;
+    if (a <= lo && b >= hi) {
+        nodes.push_back(IntegralNode(idx, query, 0, 1));
+        return;
+    }
+    LogicalPartition lp = runtime->get_logical_partition_by_color(ctx, lr, partition_color);
+    LogicalRegion left_sub_tree_lr = runtime->get_logical_subregion_by_color(ctx, lp, DomainPoint(Point<1>(1LL)));
+    if (!runtime->has_index_partition(ctx, left_sub_tree_lr.get_index_space(), partition_color)) {
+        nodes.push_back(IntegralNode(idx, query, ldexp(max(a, lo), n) - l, ldexp(min(b, hi), n) - l));
+        return;
+    }
+    LogicalRegion right_sub_tree_lr = runtime->get_logical_subregion_by_color(ctx, lp, DomainPoint(Point<1>(2LL)));
+    collect_integral_nodes(ctx, runtime, left_sub_tree_lr, partition_color, layout, n + 1, 2 * l,
+                           left_child_index(layout, idx, n, l, max_depth), max_depth, a, b, query, nodes);
+    collect_integral_nodes(ctx, runtime, right_sub_tree_lr, partition_color, layout, n + 1, 2 * l + 1,
+                           right_child_index(layout, idx, n, l, max_depth), max_depth, a, b, query, nodes);
+}
+
+// Sums the nodes collected for every query over the whole tree, which it reads
+template<typename T>
+EvalValues integrate_task(const Task *task, const std::vector<PhysicalRegion> &regions, Context ctx, HighLevelRuntime *runtime) {
+    TaskTrace trace(task);
+    const IntegrateArgs *args = (const IntegrateArgs *) task->args;
+    const IntegralNode *nodes = (const IntegralNode *) (args + 1);
+    const CoefAccessor<READ_ONLY, T> read_acc(regions[0], reads_quantized(task->regions[0]));
+    int k = coef_format.order;
+
+    EvalValues result;
+    result.values.assign(args->num_queries, 0);
+    for (size_t i = 0; i < args->num_nodes; i++) {
+        Coefs<T> s;
+        read_acc.load(nodes[i].idx, s);
+        if (nodes[i].u0 == 0 && nodes[i].u1 == 1) {
+            result.values[nodes[i].query] += s.c[0];
+            continue;
+        }
+        double f0[MAX_ORDER], f1[MAX_ORDER];
+        scaling_primitives(k, nodes[i].u0, f0);
+        scaling_primitives(k, nodes[i].u1, f1);
+        for (int j = 0; j < k; j++)
+            result.values[nodes[i].query] += s.c[j] * (f1[j] - f0[j]);
+    }
+    return result;
+}
+
+// The integral of f over every interval [a, b] of a compressed tree, the part in [0, 1] counting, and
+// negative when b < a
+template<typename T>
+vector<double> tree_integrate(Context ctx, HighLevelRuntime *runtime, const TreeOperand &tree, const vector<pair<double, double> > &intervals) {
+    vector<double> integrals(intervals.size(), 0);
+    if (!runtime->has_logical_partition_by_color(ctx, tree.lr, tree.partition_color))
+        return integrals;
+
+    vector<IntegralNode> nodes;
+    for (size_t q = 0; q < intervals.size(); q++) {
+        double a = min(intervals[q].first, intervals[q].second), b = max(intervals[q].first, intervals[q].second);
+        collect_integral_nodes(ctx, runtime, tree.lr, tree.partition_color, tree.shape.layout, 0, 0, 0, tree.shape.max_depth,
+                               max(a, 0.0), min(b, 1.0), q, nodes);
+    }
+    if (nodes.empty())
+        return integrals;
+
+    vector<char> args(sizeof(IntegrateArgs) + nodes.size() * sizeof(IntegralNode));
+    IntegrateArgs header(intervals.size(), nodes.size());
+    memcpy(&args[0], &header, sizeof(header));
+    memcpy(&args[sizeof(header)], &nodes[0], nodes.size() * sizeof(IntegralNode));
+    TaskLauncher launcher(task_id<T>(INTEGRATE_TASK_ID), TaskArgument(&args[0], args.size()));
+    launcher.add_region_requirement(RegionRequirement(tree.lr, READ_ONLY, EXCLUSIVE, tree.lr));
+    add_coef_fields(launcher, 0, tree.quantized);
+    EvalValues result = runtime->execute_task(ctx, launcher).get_result<EvalValues>();
+
+    for (size_t q = 0; q < intervals.size(); q++)
+        integrals[q] = intervals[q].second < intervals[q].first ? -result.values[q] : result.values[q];
+    return integrals;
+}
+
+template<typename T>
+double tree_integrate(Context ctx, HighLevelRuntime *runtime, const TreeOperand &tree, double a, double b) {
+    return tree_integrate<T>(ctx, runtime, tree, vector<pair<double, double> >(1, make_pair(a, b)))[0];
+}
 
-    int n = args.n;
-    int l = args.l;
-    int max_depth = args.max_depth;
-    int actual_max_depth = args.actual_max_depth;
+// Coefficient 0 of the root of a compressed tree, the integral of f over [0, 1]
+template<typename T>
+double tree_root_sum(Context ctx, HighLevelRuntime *runtime, const TreeOperand &tree) {
+    ReadTaskArgs args(node_index(tree.shape.layout, 0, 0, tree.shape.max_depth));
+    TaskLauncher launcher(task_id<T>(READ_TASK_ID), TaskArgument(&args, sizeof(ReadTaskArgs)));
+    launcher.add_region_requirement(RegionRequirement(tree.lr, READ_ONLY, EXCLUSIVE, tree.lr));
+    add_coef_fields(launcher, 0, tree.quantized);
+    return static_cast<double>(runtime->execute_task(ctx, launcher).get_result<Coefs<T> >().c[0]);
+}
 
-    DomainPoint my_sub_tree_color(Point<1>(0LL));
-    DomainPoint left_sub_tree_color(Point<1>(1LL));
-    DomainPoint right_sub_tree_color(Point<1>(2LL));
-    Color partition_color1 = args.partition_color1;
-    Color partition_color2 = args.partition_color2;
+// Adaptive projection. project builds a tree of a function from projected_functions one level at a time:
+// every box of the level is a candidate, and the candidates go in blocks of PROJECT_BLOCK_BOXES to one
+// index launch of project_task, which evaluates the function at the quadrature points of every box of its
+// block in one batch and stores the boxes. A box whose children's moments differ from what its own polynomial
+// predicts for them by more than the tolerance (in the L2 norm over the box) is refined, and its children are
+// the candidates of the next level; the others are leaves. The tree comes out in reconstructed form, as refine
+// leaves it.
 
-    coord_t idx_left_sub_tree = 0LL;
-    coord_t idx_right_sub_tree = 0LL;
- 
-    coord_t idx = args.idx;
+// Candidate boxes one project_task takes
+#define PROJECT_BLOCK_BOXES 1024
 
-    assert(regions.size() == 2);
+void gaussian_function(const double *x, double *fx, size_t count) {
+    for (size_t i = 0; i < count; i++)
+        fx[i] = exp(-500 * (x[i] - 0.5) * (x[i] - 0.5));
+}
 
-    LogicalRegion lr1 = regions[0].get_logical_region();
-    LogicalRegion lr2 = regions[1].get_logical_region();
+void sine_function(const double *x, double *fx, size_t count) {
+    for (size_t i = 0; i < count; i++)
+        fx[i] = sin(10 * M_PI * x[i]);
+}
 
-    Domain left_tree = runtime->get_index_space_domain(ctx, lr1.get_index_space());
-    Domain right_tree = runtime->get_index_space_domain(ctx, lr2.get_index_space());
+void kink_function(const double *x, double *fx, size_t count) {
+    for (size_t i = 0; i < count; i++)
+        fx[i] = fabs(x[i] - 1.0 / 3);
+}
 
-    // To compare so that both the trees have same layout structure
-    assert(left_tree == right_tree);
-    
-    LogicalPartition lp1 = LogicalPartition::NO_PART, lp2 = LogicalPartition::NO_PART;
+// The functions project knows, by index. Each one maps a batch of points to their values, so that its loop
+// vectorizes; projecting another function means adding it here, which every process then agrees on.
+struct ProjectedFunction {
+    const char *name;
+    void (*eval)(const double *x, double *fx, size_t count);
+};
 
-    LogicalRegion my_sub_tree_lr1 = LogicalRegion::NO_REGION;
-    LogicalRegion left_sub_tree_lr1 = LogicalRegion::NO_REGION;
-    LogicalRegion right_sub_tree_lr1 = LogicalRegion::NO_REGION;
-    LogicalRegion my_sub_tree_lr2 = LogicalRegion::NO_REGION;
-    LogicalRegion left_sub_tree_lr2 = LogicalRegion::NO_REGION;
-    LogicalRegion right_sub_tree_lr2 = LogicalRegion::NO_REGION;
+const ProjectedFunction projected_functions[] = {
+    {"gaussian", gaussian_function},
+    {"sine", sine_function},
+    {"kink", kink_function},
+};
 
-    IndexSpace indexspace_tree_left1 = IndexSpace::NO_SPACE, indexspace_tree_left2 = IndexSpace::NO_SPACE;
-    IndexSpace indexspace_tree_right1 = IndexSpace::NO_SPACE, indexspace_tree_right2 = IndexSpace::NO_SPACE;
+#define NUM_PROJECTED_FUNCTIONS int(sizeof(projected_functions) / sizeof(projected_functions[0]))
 
-    if (n >= actual_max_depth)
-        return 0;
+int parse_projected_function(const char *name) {
+    for (int f = 0; f < NUM_PROJECTED_FUNCTIONS; f++) {
+        if (strcmp(name, projected_functions[f].name) == 0)
+            return f;
+    }
+    fprintf(stderr, "Unknown function %s, expected", name);
+    for (int f = 0; f < NUM_PROJECTED_FUNCTIONS; f++)
+        fprintf(stderr, " %s", projected_functions[f].name);
+    fprintf(stderr, "\n");
+    exit(1);
+}
 
-    lp1 = runtime->get_logical_partition_by_color(ctx, lr1, partition_color1);
-    my_sub_tree_lr1 = runtime->get_logical_subregion_by_color(ctx, lp1, my_sub_tree_color);
-    left_sub_tree_lr1 = runtime->get_logical_subregion_by_color(ctx, lp1, left_sub_tree_color);
-    right_sub_tree_lr1 = runtime->get_logical_subregion_by_color(ctx, lp1, right_sub_tree_color);
+// Task argument of project_task, followed by the num_boxes labels l of its candidates at level n
+struct ProjectArgs {
+    int function, n, max_level, max_depth;
+    TreeLayout layout;
+    double tolerance;
+    size_t num_boxes;
+    ProjectArgs(int _function, int _n, int _max_level, int _max_depth, TreeLayout _layout, double _tolerance, size_t _num_boxes)
+        : function(_function), n(_n), max_level(_max_level), max_depth(_max_depth), layout(_layout), tolerance(_tolerance),
+          num_boxes(_num_boxes) {}
+};
 
-    lp2 = runtime->get_logical_partition_by_color(ctx, lr2, partition_color2);
-    my_sub_tree_lr2 = runtime->get_logical_subregion_by_color(ctx, lp2, my_sub_tree_color);
-    left_sub_tree_lr2 = runtime->get_logical_subregion_by_color(ctx, lp2, left_sub_tree_color);
-    right_sub_tree_lr2 = runtime->get_logical_subregion_by_color(ctx, lp2, right_sub_tree_color);
+// What a project_task block hands back to the host: the positions in the block of the boxes it refined, whose
+// children are candidates of the next level, and how many of its leaves are still above the tolerance because
+// they are at max_level
+struct ProjectFrontier {
+    vector<int> refined;
+    size_t unresolved;
 
-    indexspace_tree_left1 = left_sub_tree_lr1.get_index_space();
-    indexspace_tree_left2 = left_sub_tree_lr2.get_index_space();
+    ProjectFrontier() : unresolved(0) {}
 
-    indexspace_tree_right1 = right_sub_tree_lr1.get_index_space();
-    indexspace_tree_right2 = right_sub_tree_lr2.get_index_space();
+    size_t legion_buffer_size() const { return 2 * sizeof(size_t) + refined.size() * sizeof(int); }
 
-    Future f_left;
-    {
-        ReadTaskArgs args(idx);
-        TaskLauncher read_task_launcher(READ_TASK_ID, TaskArgument(&args, sizeof(ReadTaskArgs)));
-        RegionRequirement req(my_sub_tree_lr1, READ_ONLY, EXCLUSIVE, lr1);
-        req.add_field(FID_X);
-        read_task_launcher.add_region_requirement(req);
-        f_left = runtime->execute_task(ctx, read_task_launcher);
+    size_t legion_serialize(void *buffer) const {
+        size_t count = refined.size();
+        memcpy(buffer, &unresolved, sizeof(size_t));
+        memcpy((char *) buffer + sizeof(size_t), &count, sizeof(size_t));
+        if (count > 0)
+            memcpy((char *) buffer + 2 * sizeof(size_t), &refined[0], count * sizeof(int));
+        return legion_buffer_size();
     }
 
-    Future f_right;
-    {
-        ReadTaskArgs args(idx);
-        TaskLauncher read_task_launcher(READ_TASK_ID, TaskArgument(&args, sizeof(ReadTaskArgs)));
-        RegionRequirement req(my_sub_tree_lr2, READ_ONLY, EXCLUSIVE, lr2);
-        req.add_field(FID_X);
-        read_task_launcher.add_region_requirement(req);
-        f_right = runtime->execute_task(ctx, read_task_launcher);
+    size_t legion_deserialize(const void *buffer) {
+        size_t count;
+        memcpy(&unresolved, buffer, sizeof(size_t));
+        memcpy(&count, (const char *) buffer + sizeof(size_t), sizeof(size_t));
+        refined.resize(count);
+        if (count > 0)
+            memcpy(&refined[0], (const char *) buffer + 2 * sizeof(size_t), count * sizeof(int));
+        return legion_buffer_size();
     }
+};
 
-    Future f_result_left = Future::from_value(runtime, 0), f_result_right = Future::from_value(runtime, 0);
+// Projects the candidates of a block and stores them in its region, which holds exactly their nodes: a box
+// whose error estimate is above the tolerance below max_level is refined and stored as zeros, the others
+// are leaves and get their k moments. The moments of both children come from order-point Gauss-Legendre
+// quadrature, those of the box from two_scale_filter; the function is evaluated in double whatever T is.
+template<typename T>
+ProjectFrontier project_task(const Task *task, const std::vector<PhysicalRegion> &regions, Context ctx, HighLevelRuntime *runtime) {
+    const ProjectArgs *args = (const ProjectArgs *) (task->is_index_space ? task->local_args : task->args);
+    const int *labels = (const int *) (args + 1);
+    TaskTrace trace(task, args->n);
+    const TwoScaleFilter &filter = two_scale_filter_matrices;
+    const CoefAccessor<WRITE_DISCARD, T> write_acc(regions[0]);
+    int k = coef_format.order, n = args->n;
+
+    double qx[MAX_ORDER], qw[MAX_ORDER], phi[MAX_ORDER][MAX_ORDER];
+    gauss_legendre(k, qx, qw);
+    for (int q = 0; q < k; q++) {
+        for (int i = 0; i < k; i++)
+            phi[q][i] = qw[q] * scaling_function(i, qx[q]);
+    }
 
-    if ((indexspace_tree_left1 != IndexSpace::NO_SPACE && runtime->has_index_partition(ctx, indexspace_tree_left1, partition_color1)) && 
-        (indexspace_tree_left2 != IndexSpace::NO_SPACE && runtime->has_index_partition(ctx, indexspace_tree_left2, partition_color2)) ) {
+    // the quadrature points of the left child of every box, then those of its right child
+    size_t num_points = args->num_boxes * 2 * k;
+    vector<double> x(num_points), fx(num_points);
+    for (size_t b = 0; b < args->num_boxes; b++) {
+        for (int c = 0; c < 2; c++) {
+            for (int q = 0; q < k; q++)
+                x[(2 * b + c) * k + q] = ldexp(2.0 * labels[b] + c + qx[q], -(n + 1));
+        }
+    }
+    long num_chunks = (num_points + EVAL_CHUNK - 1) / EVAL_CHUNK;
+    OMP(parallel for schedule(static) if (omp_variant(task)))
+    for (long c = 0; c < num_chunks; c++)
+        projected_functions[args->function].eval(&x[c * EVAL_CHUNK], &fx[c * EVAL_CHUNK], min<size_t>(EVAL_CHUNK, num_points - c * EVAL_CHUNK));
+
+    vector<char> refined(args->num_boxes), unresolved(args->num_boxes);
+    double child_width = ldexp(1.0, -(n + 1));
+    OMP(parallel for schedule(static) if (omp_variant(task)))
+    for (size_t b = 0; b < args->num_boxes; b++) {
+        double left[MAX_ORDER], right[MAX_ORDER];
+        for (int i = 0; i < k; i++) {
+            left[i] = right[i] = 0;
+            for (int q = 0; q < k; q++) {
+                left[i] += fx[2 * b * k + q] * phi[q][i];
+                right[i] += fx[(2 * b + 1) * k + q] * phi[q][i];
+            }
+            left[i] *= child_width;
+            right[i] *= child_width;
+        }
 
-        idx_left_sub_tree = idx + 1;
-        assert(lp2 != LogicalPartition::NO_PART);
-        assert(lp1 != LogicalPartition::NO_PART);
-        InnerProductArguments for_left_sub_tree (n + 1, l * 2, max_depth, idx_left_sub_tree, partition_color1, partition_color2, actual_max_depth);
+        // moments of the box, and the moments its polynomial gives its children: (1/2) H0^T s and (1/2) H1^T s
+        double s[MAX_ORDER];
+        for (int i = 0; i < k; i++) {
+            s[i] = 0;
+            for (int j = 0; j < k; j++)
+                s[i] += filter.h0[i][j] * left[j] + filter.h1[i][j] * right[j];
+        }
+        double error = 0;
+        for (int i = 0; i < k; i++) {
+            double predicted_left = 0, predicted_right = 0;
+            for (int j = 0; j < k; j++) {
+                predicted_left += filter.h0[j][i] * s[j] / 2;
+                predicted_right += filter.h1[j][i] * s[j] / 2;
+            }
+            error += (left[i] - predicted_left) * (left[i] - predicted_left) + (right[i] - predicted_right) * (right[i] - predicted_right);
+        }
+        // f = 2^(n+1) sum_i s_i phi_i on a child, so the squared L2 norm is 2^(n+1) times the squared moments
+        bool above = sqrt(error / child_width) > args->tolerance;
+        refined[b] = above && n < args->max_level;
+        unresolved[b] = above && !refined[b];
+
+        Coefs<T> coefs = make_coefs(T(0));
+        if (!refined[b]) {
+            for (int j = 0; j < k; j++)
+                coefs.c[j] = static_cast<T>(s[j]);
+        }
+        write_acc.store(node_index(args->layout, n, labels[b], args->max_depth), coefs);
+    }
 
-        TaskLauncher inner_product_launcher(INNER_PRODUCT_TASK_ID, TaskArgument(&for_left_sub_tree, sizeof(InnerProductArguments)));
-        RegionRequirement req1(lr1, READ_ONLY, EXCLUSIVE, lr1);
-        RegionRequirement req2(lr2, READ_ONLY, EXCLUSIVE, lr2);
-        req1.add_field(FID_X);
-        req2.add_field(FID_X);
-        inner_product_launcher.add_region_requirement(req1);
-        inner_product_launcher.add_region_requirement(req2);
+    ProjectFrontier frontier;
+    for (size_t b = 0; b < args->num_boxes; b++) {
+        if (refined[b])
+            frontier.refined.push_back(int(b));
+        frontier.unresolved += unresolved[b];
+    }
+    return frontier;
+}
 
-        f_result_left = runtime->execute_task(ctx, inner_product_launcher);
+// Projects function into the tree region lr, refining boxes whose error estimate is above tolerance down to
+// level max_level at most, and partitions the tree with partition_color the way refine would. The shape
+// depends on the function, so the operand does not know it. The blocks of a level write their own boxes
+// through a partition of the level made for the launch; the host keeps only the labels of the next level,
+// and creates the subtree partitions of a level while its blocks run. unresolved, if given, gets the number
+// of leaves at max_level still above the tolerance.
+template<typename T>
+TreeOperand tree_project(Context ctx, HighLevelRuntime *runtime, LogicalRegion lr, Color partition_color, TreeLayout layout,
+                         int max_depth, int function, double tolerance, int max_level, size_t *unresolved) {
+    assert(function >= 0 && function < NUM_PROJECTED_FUNCTIONS);
+    // every node is partitioned, leaves included, which needs its children below max_depth
+    assert(max_level < max_depth);
+    forget_subtree_costs(partition_color);
+
+    size_t num_unresolved = 0;
+    vector<int> labels(1, 0);
+    vector<IndexSpace> spaces(1, lr.get_index_space());
+    for (int n = 0; !labels.empty(); n++) {
+        size_t num_blocks = (labels.size() + PROJECT_BLOCK_BOXES - 1) / PROJECT_BLOCK_BOXES;
+        vector<vector<char> > block_args(num_blocks);
+        ArgumentMap arg_map;
+        MultiDomainPointColoring coloring;
+        for (size_t b = 0; b < num_blocks; b++) {
+            size_t first = b * PROJECT_BLOCK_BOXES, count = min<size_t>(PROJECT_BLOCK_BOXES, labels.size() - first);
+            ProjectArgs header(function, n, max_level, max_depth, layout, tolerance, count);
+            block_args[b].resize(sizeof(ProjectArgs) + count * sizeof(int));
+            memcpy(&block_args[b][0], &header, sizeof(header));
+            memcpy(&block_args[b][sizeof(header)], &labels[first], count * sizeof(int));
+            arg_map.set_point(DomainPoint(Point<1>(coord_t(b))), TaskArgument(&block_args[b][0], block_args[b].size()));
+
+            vector<Rect<1> > rects;
+            for (size_t i = first; i < first + count; i++) {
+                coord_t idx = node_index(layout, n, labels[i], max_depth);
+                rects.push_back(Rect<1>(idx, idx));
+            }
+            merge_rects(rects);
+            coloring[DomainPoint(Point<1>(coord_t(b)))].insert(rects.begin(), rects.end());
+        }
+        Rect<1> launch_domain(0LL, coord_t(num_blocks) - 1);
+        IndexPartition level_ip = runtime->create_index_partition(ctx, lr.get_index_space(), launch_domain, coloring, DISJOINT_KIND);
+        LogicalPartition level_lp = runtime->get_logical_partition(ctx, lr, level_ip);
+        IndexTaskLauncher launcher(task_id<T>(PROJECT_TASK_ID), launch_domain, TaskArgument(NULL, 0), arg_map);
+        launcher.tag = cost_tag(min<size_t>(labels.size(), PROJECT_BLOCK_BOXES));
+        launcher.add_region_requirement(RegionRequirement(level_lp, 0, WRITE_DISCARD, EXCLUSIVE, lr));
+        add_coef_fields(launcher, 0);
+        FutureMap f_blocks = runtime->execute_index_space(ctx, launcher);
+        runtime->destroy_index_partition(ctx, level_ip);
+
+        vector<IndexPartition> partitions(labels.size());
+        for (size_t c = 0; c < labels.size(); c++)
+            partitions[c] = create_subtree_partition(ctx, runtime, spaces[c], layout, n, labels[c], max_depth, partition_color);
+
+        vector<int> next_labels;
+        vector<IndexSpace> next_spaces;
+        for (size_t b = 0; b < num_blocks; b++) {
+            ProjectFrontier frontier = f_blocks.get_result<ProjectFrontier>(DomainPoint(Point<1>(coord_t(b))));
+            num_unresolved += frontier.unresolved;
+            for (size_t i = 0; i < frontier.refined.size(); i++) {
+                size_t c = b * PROJECT_BLOCK_BOXES + frontier.refined[i];
+                for (coord_t child = 1; child <= 2; child++) {
+                    next_labels.push_back(2 * labels[c] + child - 1);
+                    next_spaces.push_back(runtime->get_index_subspace(ctx, partitions[c], DomainPoint(Point<1>(child))));
+                }
+            }
+        }
+        labels.swap(next_labels);
+        spaces.swap(next_spaces);
     }
 
-    if ((indexspace_tree_right1 != IndexSpace::NO_SPACE && runtime->has_index_partition(ctx, indexspace_tree_right1, partition_color1)) && 
-        (indexspace_tree_right2 != IndexSpace::NO_SPACE && runtime->has_index_partition(ctx, indexspace_tree_right2, partition_color2)) ) {
+    if (unresolved)
+        *unresolved = num_unresolved;
+    // refine partitions the nodes above its depth, the leaves here go down to max_level
+    return TreeOperand(lr, partition_color, TreeShape(0, max_level + 1, max_depth, layout), false);
+}
 
-        idx_right_sub_tree = idx + static_cast<coord_t>(pow(2, max_depth - n));
-        assert(lp2 != LogicalPartition::NO_PART);
-        assert(lp1 != LogicalPartition::NO_PART);
-        InnerProductArguments for_right_sub_tree(n + 1, l * 2 + 1, max_depth, idx_right_sub_tree, partition_color1, partition_color2, actual_max_depth);
+// Input files (-input <file> -input_format samples|records). A samples file holds 2^D leaves of depth D, a
+// records file holds InputRecord entries, leaves at any level; both hold the order coefficients of a leaf as
+// doubles. tree_ingest maps the file into memory and attaches the mapping to a region as it is, so the data
+// goes from the page cache straight into ingest_task, which writes the leaves into the tree and compresses
+// it bottom up. The only pass over the file outside that task reads the (n, l) of the records to create the
+// partitions of the tree.
+// A record of a records file, followed by the order coefficients of the leaf
+struct InputRecord {
+    int32_t n, l;
+};
 
-        TaskLauncher inner_product_launcher(INNER_PRODUCT_TASK_ID, TaskArgument(&for_right_sub_tree, sizeof(InnerProductArguments)));
-        RegionRequirement req1(lr1, READ_ONLY, EXCLUSIVE, lr1);
-        RegionRequirement req2(lr2, READ_ONLY, EXCLUSIVE, lr2);
-        req1.add_field(FID_X);
-        req2.add_field(FID_X);
-        inner_product_launcher.add_region_requirement(req1);
-        inner_product_launcher.add_region_requirement(req2);
+// The entries of a mapped input file, in place
+struct InputView {
+    const char *base;
+    size_t count, entry_size;
+    InputFormat format;
+    int sample_depth; // D of a samples file
 
-        f_result_right = runtime->execute_task(ctx, inner_product_launcher);
+    InputView(const char *_base, size_t bytes, InputFormat _format, int order)
+        : base(_base), format(_format), sample_depth(0)
+    {
+        entry_size = (format == RECORDS_INPUT ? sizeof(InputRecord) : 0) + order * sizeof(double);
+        count = bytes / entry_size;
+        while (format == SAMPLES_INPUT && (static_cast<size_t>(1) << sample_depth) < count)
+            sample_depth++;
+    }
+
+    void node(size_t i, int &n, int &l) const {
+        if (format == RECORDS_INPUT) {
+            const InputRecord *record = (const InputRecord *) (base + i * entry_size);
+            n = record->n;
+            l = record->l;
+        } else {
+            n = sample_depth;
+            l = i;
+        }
     }
 
-    TaskLauncher product_task_launcher(PRODUCT_TASK_ID, TaskArgument(NULL, 0));
-    product_task_launcher.add_future(f_left);
-    product_task_launcher.add_future(f_right);
-    product_task_launcher.add_future(f_result_left);
-    product_task_launcher.add_future(f_result_right);
-    Future result = runtime->execute_task(ctx, product_task_launcher);
+    const double *coefs(size_t i) const {
+        return (const double *) (base + i * entry_size + (format == RECORDS_INPUT ? sizeof(InputRecord) : 0));
+    }
+};
 
-    return result.get_result<int>();
+// Every node of the tree an input describes, by level, each level sorted: the leaves of the input, their
+// ancestors, and the siblings the input does not have, which are leaves of 0
+void input_tree_nodes(const InputView &input, vector<vector<int> > &levels) {
+    levels.clear();
+    for (size_t i = 0; i < input.count; i++) {
+        int n, l;
+        input.node(i, n, l);
+        if (n < 0 || n > 62 || l < 0 || l >= (1LL << n)) {
+            fprintf(stderr, "Input record %zu names node (%d, %d), which no tree has\n", i, n, l);
+            exit(1);
+        }
+        if ((int) levels.size() <= n)
+            levels.resize(n + 1);
+        levels[n].push_back(l);
+    }
+    for (int n = levels.size() - 1; n >= 0; n--) {
+        vector<int> &level = levels[n];
+        if (n > 0) {
+            size_t num_nodes = level.size();
+            for (size_t i = 0; i < num_nodes; i++)
+                level.push_back(level[i] ^ 1);
+        }
+        sort(level.begin(), level.end());
+        level.erase(unique(level.begin(), level.end()), level.end());
+        for (size_t i = 0; n > 0 && i < level.size(); i += 2)
+            levels[n - 1].push_back(level[i] >> 1);
+    }
 }
 
-int product_task(const Task *task, const std::vector<PhysicalRegion> &regions, Context ctx, Runtime *runtime) {
-  assert(task->futures.size() == 4);
-  Future f_left = task->futures[0];
-  int r_left = f_left.get_result<int>();
-  Future f_right = task->futures[1];
-  int r_right = f_right.get_result<int>();
-  Future f_result_left = task->futures[2];
-  int r_result_left = f_result_left.get_result<int>();
-  Future f_result_right = task->futures[3];
-  int r_result_right = f_result_right.get_result<int>();
+// Task argument of ingest_task
+struct IngestArgs {
+    InputFormat format;
+    size_t bytes;
+    int max_depth;
+    TreeLayout layout;
+    IngestArgs(InputFormat _format, size_t _bytes, int _max_depth, TreeLayout _layout)
+        : format(_format), bytes(_bytes), max_depth(_max_depth), layout(_layout) {}
+};
 
-  return ((r_left * r_right) + r_result_left + r_result_right);
-}
+// Builds the tree in regions[1] from the input file attached as regions[0]: zeros at every node, the leaves
+// of the input, then every internal node from its children, deepest level first. A record at a node with
+// records below it is overwritten by that compress.
+template<typename T>
+void ingest_task(const Task *task, const std::vector<PhysicalRegion> &regions, Context ctx, HighLevelRuntime *runtime) {
+    TaskTrace trace(task);
+    const IngestArgs *args = (const IngestArgs *) task->args;
+    int k = coef_format.order;
+    const FieldAccessor<READ_ONLY, char, 1> input_acc(regions[0], FID_INPUT,
+                                                      (args->format == RECORDS_INPUT ? sizeof(InputRecord) : 0) + k * sizeof(double));
+    InputView input(input_acc.ptr(0), args->bytes, args->format, k);
+    // WRITE_DISCARD grants read-write access, the compress pass reads back what was just set
+    const CoefAccessor<READ_WRITE, T> acc(regions[1]);
+
+    vector<vector<int> > levels;
+    input_tree_nodes(input, levels);
+    Coefs<T> coefs = make_coefs(T(0));
+    for (int n = 0; n < (int) levels.size(); n++) {
+        for (size_t i = 0; i < levels[n].size(); i++)
+            acc.store(node_index(args->layout, n, levels[n][i], args->max_depth), coefs);
+    }
+    for (size_t i = 0; i < input.count; i++) {
+        int n, l;
+        input.node(i, n, l);
+        const double *c = input.coefs(i);
+        for (int j = 0; j < k; j++)
+            coefs.c[j] = static_cast<T>(c[j]);
+        acc.store(node_index(args->layout, n, l, args->max_depth), coefs);
+    }
 
-void gaxpy_task(const Task *task, const std::vector<PhysicalRegion> &regions, Context ctx, HighLevelRuntime *runtime) {
-    GaxpyArguments args = task->is_index_space ? *(const GaxpyArguments *) task->local_args
-    : *(const GaxpyArguments *) task->args;
+    vector<T> left, right, parent;
+    vector<coord_t> parents;
+    for (int n = levels.size() - 2; n >= 0; n--) {
+        // the children of level n are sorted, so the pairs come in the order of their parents
+        const vector<int> &children = levels[n + 1];
+        size_t npairs = children.size() / 2;
+        left.resize(npairs * k);
+        right.resize(npairs * k);
+        parent.resize(npairs * k);
+        parents.resize(npairs);
+        for (size_t p = 0; p < npairs; p++) {
+            int l = children[2 * p] >> 1;
+            coord_t idx = node_index(args->layout, n, l, args->max_depth);
+            parents[p] = idx;
+            acc.load(left_child_index(args->layout, idx, n, l, args->max_depth), coefs);
+            copy(coefs.c, coefs.c + k, &left[p * k]);
+            acc.load(right_child_index(args->layout, idx, n, l, args->max_depth), coefs);
+            copy(coefs.c, coefs.c + k, &right[p * k]);
+        }
+        two_scale_filter_chunks(&left[0], &right[0], &parent[0], npairs, false);
+        for (size_t p = 0; p < npairs; p++) {
+            copy(&parent[p * k], &parent[p * k] + k, coefs.c);
+            acc.store(parents[p], coefs);
+        }
+    }
+}
 
-    int n = args.n;
-    int l = args.l;
-    int max_depth = args.max_depth;
-    int actual_max_depth = args.actual_max_depth;
+// Builds the tree in lr, partitioned with partition_color, from an input file and returns it in compressed
+// form. The leaves of the input can go down to level max_depth - 1, since every node is partitioned.
+template<typename T>
+TreeOperand tree_ingest(Context ctx, HighLevelRuntime *runtime, const char *path, InputFormat format,
+                        LogicalRegion lr, Color partition_color, TreeLayout layout, int max_depth) {
+    int fd = open(path, O_RDONLY);
+    struct stat file_stat;
+    if (fd < 0 || fstat(fd, &file_stat) != 0) {
+        fprintf(stderr, "Cannot read the input %s\n", path);
+        exit(1);
+    }
+    size_t bytes = file_stat.st_size;
+    // a private mapping, so that the pages stay shared with the page cache unless something writes to them
+    void *base = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "Cannot map the input %s\n", path);
+        exit(1);
+    }
+    close(fd);
+    madvise(base, bytes, MADV_WILLNEED);
+
+    InputView input((const char *) base, bytes, format, coef_format.order);
+    if (input.count == 0 || input.count * input.entry_size != bytes ||
+        (format == SAMPLES_INPUT && (static_cast<size_t>(1) << input.sample_depth) != input.count)) {
+        fprintf(stderr, "The input %s is not a whole number of %s entries of order %d\n", path,
+                format == SAMPLES_INPUT ? "samples, 2^D of them," : "records", coef_format.order);
+        exit(1);
+    }
+    vector<vector<int> > levels;
+    input_tree_nodes(input, levels);
+    if ((int) levels.size() > max_depth) {
+        fprintf(stderr, "The input %s has %d levels, more than -max_depth %d\n", path, (int) levels.size(), max_depth);
+        exit(1);
+    }
+    forget_subtree_costs(partition_color);
+
+    // every node gets its partition, level by level, the way refine would create them
+    vector<IndexSpace> spaces(1, lr.get_index_space()), child_spaces;
+    for (int n = 0; n + 1 < (int) levels.size(); n++) {
+        child_spaces.clear();
+        const vector<int> &children = levels[n + 1];
+        size_t c = 0;
+        for (size_t i = 0; i < levels[n].size(); i++) {
+            int l = levels[n][i];
+            IndexPartition ip = create_subtree_partition(ctx, runtime, spaces[i], layout, n, l, max_depth, partition_color);
+            for (; c < children.size() && (children[c] >> 1) == l; c++)
+                child_spaces.push_back(runtime->get_index_subspace(ctx, ip, DomainPoint(Point<1>(1LL + (children[c] & 1)))));
+        }
+        spaces.swap(child_spaces);
+    }
+    for (size_t i = 0; i < levels.back().size(); i++)
+        create_subtree_partition(ctx, runtime, spaces[i], layout, levels.size() - 1, levels.back()[i], max_depth, partition_color);
 
-    coord_t idx = args.idx;
+    // the file as an array of entries in system memory, one field holding a whole entry
+    IndexSpace input_is = runtime->create_index_space(ctx, Rect<1>(0LL, coord_t(input.count) - 1));
+    FieldSpace input_fs = runtime->create_field_space(ctx);
+    {
+        FieldAllocator allocator = runtime->create_field_allocator(ctx, input_fs);
+        allocator.allocate_field(input.entry_size, FID_INPUT);
+    }
+    LogicalRegion input_lr = runtime->create_logical_region(ctx, input_is, input_fs);
+    AttachLauncher attach_launcher(EXTERNAL_INSTANCE, input_lr, input_lr);
+    Memory sysmem = Machine::MemoryQuery(Machine::get_machine()).only_kind(Memory::SYSTEM_MEM).local_address_space().first();
+    attach_launcher.attach_array_aos(base, false, vector<FieldID>(1, FID_INPUT), sysmem);
+    PhysicalRegion input_pr = runtime->attach_external_resource(ctx, attach_launcher);
+
+    IngestArgs args(format, bytes, max_depth, layout);
+    TaskLauncher launcher(task_id<T>(INGEST_TASK_ID), TaskArgument(&args, sizeof(IngestArgs)));
+    launcher.add_region_requirement(RegionRequirement(input_lr, READ_ONLY, EXCLUSIVE, input_lr));
+    launcher.add_field(0, FID_INPUT);
+    launcher.add_region_requirement(RegionRequirement(lr, WRITE_DISCARD, EXCLUSIVE, lr));
+    add_coef_fields(launcher, 1);
+    runtime->execute_task(ctx, launcher);
+
+    // the mapping has to outlive the task, the detach completes after it
+    runtime->detach_external_resource(ctx, input_pr).get_void_result();
+    munmap(base, bytes);
+    runtime->destroy_logical_region(ctx, input_lr);
+    runtime->destroy_field_space(ctx, input_fs);
+    runtime->destroy_index_space(ctx, input_is);
+    fprintf(stderr, "input: %zu leaves of %s, tree of %d levels\n", input.count, path, (int) levels.size());
+    // refine partitions the nodes above its depth, the leaves here go down to the last level
+    return TreeOperand(lr, partition_color, TreeShape(0, levels.size(), max_depth, layout), false);
+}
 
-    DomainPoint my_sub_tree_color(Point<1>(0LL));
-    DomainPoint left_sub_tree_color(Point<1>(1LL));
-    DomainPoint right_sub_tree_color(Point<1>(2LL));
-    Color partition_color1 = args.partition_color1;
-    Color partition_color2 = args.partition_color2;
-    Color partition_color3 = args.partition_color3;
-    int left_tree_depth = args.left_tree_depth;
-    int right_tree_depth = args.right_tree_depth;
+// Wavelet form. A compressed tree keeps the sum of every node next to the sums of its children, so it takes
+// as much room as the reconstructed one. In wavelet form a tree keeps the sum of the root and, at every
+// internal node, only the difference coefficients d = G0 s_left + G1 s_right of its children, from which
+// reconstruct derives the children's sums on the way down. The leaves hold nothing, so the region covers
+// the levels 0 .. max_depth - 1 in the tree layout, 2^max_depth - 1 indices, plus one index for the root sum:
+// half of a tree region. gaxpy and inner products in wavelet form touch only the internal nodes.
+// The form has no partitions: the internal nodes of the tree it came from, listed by the driver, are its shape.
+
+// Index of the internal node (n, l) in a wavelet region, and of the root sum
+inline coord_t wavelet_index(TreeLayout layout, int n, int l, int max_depth) {
+    return node_index(layout, n, l, max_depth - 1);
+}
 
-    coord_t idx_left_sub_tree = 0LL;
-    coord_t idx_right_sub_tree = 0LL;
+inline coord_t wavelet_root_index(int max_depth) {
+    return (static_cast<coord_t>(1) << max_depth) - 1;
+}
 
-    assert(regions.size() == 4);
+// d = G0 s_left + G1 s_right
+template<typename T>
+void wavelet_difference(const T *left, const T *right, T *d) {
+    const TwoScaleFilter &filter = two_scale_filter_matrices;
+    for (int i = 0; i < filter.order; i++) {
+        double sum = 0;
+        for (int j = 0; j < filter.order; j++)
+            sum += filter.g0[i][j] * left[j] + filter.g1[i][j] * right[j];
+        d[i] = static_cast<T>(sum);
+    }
+}
 
-    bool is_left = true, is_right = true;
+// s_left = (H0^T s + G0^T d) / 2 and s_right = (H1^T s + G1^T d) / 2
+template<typename T>
+void wavelet_unfilter(const T *s, const T *d, T *left, T *right) {
+    const TwoScaleFilter &filter = two_scale_filter_matrices;
+    for (int i = 0; i < filter.order; i++) {
+        double sum_left = 0, sum_right = 0;
+        for (int j = 0; j < filter.order; j++) {
+            sum_left += filter.h0[j][i] * s[j] + filter.g0[j][i] * d[j];
+            sum_right += filter.h1[j][i] * s[j] + filter.g1[j][i] * d[j];
+        }
+        left[i] = static_cast<T>(sum_left / 2);
+        right[i] = static_cast<T>(sum_right / 2);
+    }
+}
 
-    LogicalRegion lr1 = regions[0].get_logical_region();
-    LogicalRegion lr2 = regions[1].get_logical_region();
-    LogicalRegion lr3 = regions[2].get_logical_region();
-    LogicalRegion dummy_lr = regions[3].get_logical_region();
+// A tree in wavelet form: its region, from create_wavelet_region, and the internal nodes of its shape by
+// level, the root first
+struct WaveletOperand {
+    LogicalRegion lr;
+    TreeLayout layout;
+    int max_depth;
+    vector<SweepNode> internal;
 
-    assert(lr1 != LogicalRegion::NO_REGION);
-    assert(lr2 != LogicalRegion::NO_REGION);
-    assert(lr3 != LogicalRegion::NO_REGION);
+    WaveletOperand(LogicalRegion _lr, TreeLayout _layout, int _max_depth, const vector<SweepNode> &_internal)
+        : lr(_lr), layout(_layout), max_depth(_max_depth), internal(_internal) {}
 
-    if (lr1 != dummy_lr && lr2 != dummy_lr) {
-        Domain left_tree = runtime->get_index_space_domain(ctx, lr1.get_index_space());
-        Domain right_tree = runtime->get_index_space_domain(ctx, lr2.get_index_space());
-        // To compare so that both the trees have same layout structure
-        assert(left_tree == right_tree);
+    bool same_shape(const WaveletOperand &other) const {
+        if (layout != other.layout || max_depth != other.max_depth || internal.size() != other.internal.size())
+            return false;
+        for (size_t i = 0; i < internal.size(); i++) {
+            if (internal[i].idx != other.internal[i].idx)
+                return false;
+        }
+        return true;
     }
+};
 
-    LogicalPartition lp1 = LogicalPartition::NO_PART, lp2 = LogicalPartition::NO_PART, lp3 = LogicalPartition::NO_PART, dummy_lp;
+// Task argument of the wavelet tasks, followed by num_nodes SweepNode entries, the internal nodes by level
+struct WaveletArgs {
+    int max_depth;
+    TreeLayout layout;
+    double alpha; // gaxpy only
+    size_t num_nodes;
+    WaveletArgs(int _max_depth, TreeLayout _layout, double _alpha, size_t _num_nodes)
+        : max_depth(_max_depth), layout(_layout), alpha(_alpha), num_nodes(_num_nodes) {}
+};
 
-    idx_left_sub_tree = idx + 1;
-    idx_right_sub_tree = idx + static_cast<coord_t>(pow(2, max_depth - n));
+vector<char> pack_wavelet_args(const WaveletOperand &tree, double alpha = 1) {
+    WaveletArgs header(tree.max_depth, tree.layout, alpha, tree.internal.size());
+    vector<char> args(sizeof(WaveletArgs) + tree.internal.size() * sizeof(SweepNode));
+    memcpy(&args[0], &header, sizeof(header));
+    if (!tree.internal.empty())
+        memcpy(&args[sizeof(header)], &tree.internal[0], tree.internal.size() * sizeof(SweepNode));
+    return args;
+}
 
-    LogicalRegion my_sub_tree_lr1 = LogicalRegion::NO_REGION;
-    LogicalRegion left_sub_tree_lr1 = LogicalRegion::NO_REGION;
-    LogicalRegion right_sub_tree_lr1 = LogicalRegion::NO_REGION;
-    LogicalRegion my_sub_tree_lr2 = LogicalRegion::NO_REGION;
-    LogicalRegion left_sub_tree_lr2 = LogicalRegion::NO_REGION;
-    LogicalRegion right_sub_tree_lr2 = LogicalRegion::NO_REGION;
-    LogicalRegion my_sub_tree_lr3 = lr3, left_sub_tree_lr3, right_sub_tree_lr3;
+// A region for a tree of max_depth in wavelet form, with the fields of fs
+LogicalRegion create_wavelet_region(Context ctx, HighLevelRuntime *runtime, FieldSpace fs, int max_depth) {
+    IndexSpace is = runtime->create_index_space(ctx, Rect<1>(0LL, wavelet_root_index(max_depth)));
+    return runtime->create_logical_region(ctx, is, fs);
+}
 
-    IndexSpace indexspace_tree_left1 = IndexSpace::NO_SPACE, indexspace_tree_left2 = IndexSpace::NO_SPACE;
-    IndexSpace indexspace_tree_right1 = IndexSpace::NO_SPACE, indexspace_tree_right2 = IndexSpace::NO_SPACE;
-    
-    bool left_subtree = false, right_subtree = false;
+void destroy_wavelet_region(Context ctx, HighLevelRuntime *runtime, LogicalRegion lr) {
+    runtime->destroy_logical_region(ctx, lr);
+    runtime->destroy_index_space(ctx, lr.get_index_space());
+}
 
-    if (lr1 != dummy_lr && lr1 != LogicalRegion::NO_REGION && runtime->has_logical_partition_by_color(ctx, lr1, partition_color1)) {
-        lp1 = runtime->get_logical_partition_by_color(ctx, lr1, partition_color1);
-        my_sub_tree_lr1 = runtime->get_logical_subregion_by_color(ctx, lp1, my_sub_tree_color);
-        left_sub_tree_lr1 = runtime->get_logical_subregion_by_color(ctx, lp1, left_sub_tree_color);
-        right_sub_tree_lr1 = runtime->get_logical_subregion_by_color(ctx, lp1, right_sub_tree_color);
-        left_subtree = true;
-    }
-    if(n == left_tree_depth - 1){
-        lp1 = runtime->get_logical_partition_by_color(ctx, lr1, partition_color1);
-        my_sub_tree_lr1 = runtime->get_logical_subregion_by_color(ctx, lp1, my_sub_tree_color);
+// Records the internal nodes of the subtree of (n, l), whose region is lr, by level, with the test of
+// collect_subtree_levels. Only metadata is touched.
+void collect_wavelet_nodes(Context ctx, HighLevelRuntime *runtime, LogicalRegion lr, Color partition_color, TreeLayout layout,
+                           int n, int l, coord_t idx, int max_depth, vector<vector<SweepNode> > &levels) {
+    LogicalPartition lp = runtime->get_logical_partition_by_color(ctx, lr, partition_color);
+    LogicalRegion left_sub_tree_lr = runtime->get_logical_subregion_by_color(ctx, lp, DomainPoint(Point<1>(1LL)));
+    if (!runtime->has_index_partition(ctx, left_sub_tree_lr.get_index_space(), partition_color))
+        return;
+    LogicalRegion right_sub_tree_lr = runtime->get_logical_subregion_by_color(ctx, lp, DomainPoint(Point<1>(2LL)));
+    if ((int) levels.size() <= n)
+        levels.resize(n + 1);
+    levels[n].push_back(SweepNode(idx, n, l));
+    collect_wavelet_nodes(ctx, runtime, left_sub_tree_lr, partition_color, layout, n + 1, 2 * l,
+                          left_child_index(layout, idx, n, l, max_depth), max_depth, levels);
+    collect_wavelet_nodes(ctx, runtime, right_sub_tree_lr, partition_color, layout, n + 1, 2 * l + 1,
+                          right_child_index(layout, idx, n, l, max_depth), max_depth, levels);
+}
+
+// Writes the wavelet form of the compressed tree in regions[0] to regions[1]. The sums of the compressed
+// tree make every node independent of the others.
+template<typename T>
+void wavelet_compress_task(const Task *task, const std::vector<PhysicalRegion> &regions, Context ctx, HighLevelRuntime *runtime) {
+    TaskTrace trace(task);
+    const WaveletArgs *args = (const WaveletArgs *) task->args;
+    const SweepNode *nodes = (const SweepNode *) (args + 1);
+    const CoefAccessor<READ_ONLY, T> read_acc(regions[0]);
+    const CoefAccessor<WRITE_DISCARD, T> write_acc(regions[1]);
+
+    Coefs<T> s;
+    read_acc.load(0, s);
+    write_acc.store(wavelet_root_index(args->max_depth), s);
+    for (size_t i = 0; i < args->num_nodes; i++) {
+        const SweepNode &node = nodes[i];
+        Coefs<T> left, right, d = make_coefs(T(0));
+        read_acc.load(left_child_index(args->layout, node.idx, node.n, node.l, args->max_depth), left);
+        read_acc.load(right_child_index(args->layout, node.idx, node.n, node.l, args->max_depth), right);
+        wavelet_difference(left.c, right.c, d.c);
+        write_acc.store(wavelet_index(args->layout, node.n, node.l, args->max_depth), d);
     }
+}
 
-    if (lr2 != dummy_lr && lr2 != LogicalRegion::NO_REGION && runtime->has_logical_partition_by_color(ctx, lr2, partition_color2)) {
-        lp2 = runtime->get_logical_partition_by_color(ctx, lr2, partition_color2);
-        my_sub_tree_lr2 = runtime->get_logical_subregion_by_color(ctx, lp2, my_sub_tree_color);
-        left_sub_tree_lr2 = runtime->get_logical_subregion_by_color(ctx, lp2, left_sub_tree_color);
-        right_sub_tree_lr2 = runtime->get_logical_subregion_by_color(ctx, lp2, right_sub_tree_color);
-        right_subtree = true;
+// Writes the tree in wavelet form in regions[0] to regions[1] in reconstructed form. Going down level by
+// level, the sum of a node is where its parent put it in regions[1]; it is replaced by 0 once its children
+// have theirs.
+template<typename T>
+void wavelet_reconstruct_task(const Task *task, const std::vector<PhysicalRegion> &regions, Context ctx, HighLevelRuntime *runtime) {
+    TaskTrace trace(task);
+    const WaveletArgs *args = (const WaveletArgs *) task->args;
+    const SweepNode *nodes = (const SweepNode *) (args + 1);
+    const CoefAccessor<READ_ONLY, T> read_acc(regions[0]);
+    // the sums written for a level are read back for the next
+    const CoefAccessor<READ_WRITE, T> acc(regions[1]);
+
+    Coefs<T> s, zero = make_coefs(T(0));
+    read_acc.load(wavelet_root_index(args->max_depth), s);
+    acc.store(0, s);
+    for (size_t i = 0; i < args->num_nodes; i++) {
+        const SweepNode &node = nodes[i];
+        Coefs<T> d, left = zero, right = zero;
+        acc.load(node.idx, s);
+        read_acc.load(wavelet_index(args->layout, node.n, node.l, args->max_depth), d);
+        wavelet_unfilter(s.c, d.c, left.c, right.c);
+        acc.store(left_child_index(args->layout, node.idx, node.n, node.l, args->max_depth), left);
+        acc.store(right_child_index(args->layout, node.idx, node.n, node.l, args->max_depth), right);
+        acc.store(node.idx, zero);
     }
+}
 
-    if(n == right_tree_depth - 1){
-        lp2 = runtime->get_logical_partition_by_color(ctx, lr2, partition_color2);
-        my_sub_tree_lr2 = runtime->get_logical_subregion_by_color(ctx, lp2, my_sub_tree_color);
+// regions[2] = regions[0] + alpha * regions[1] on trees of one shape in wavelet form, which are linear in the tree
+template<typename T>
+void wavelet_gaxpy_task(const Task *task, const std::vector<PhysicalRegion> &regions, Context ctx, HighLevelRuntime *runtime) {
+    TaskTrace trace(task);
+    const WaveletArgs *args = (const WaveletArgs *) task->args;
+    const SweepNode *nodes = (const SweepNode *) (args + 1);
+    const CoefAccessor<READ_ONLY, T> acc1(regions[0]), acc2(regions[1]);
+    const CoefAccessor<WRITE_DISCARD, T> write_acc(regions[2]);
+    int k = coef_format.order;
+
+    for (size_t i = 0; i <= args->num_nodes; i++) {
+        coord_t idx = i == args->num_nodes ? wavelet_root_index(args->max_depth)
+                                           : wavelet_index(args->layout, nodes[i].n, nodes[i].l, args->max_depth);
+        Coefs<T> x, y;
+        acc1.load(idx, x);
+        acc2.load(idx, y);
+        for (int j = 0; j < k; j++)
+            x.c[j] = GaxpyOp<T>::apply(x.c[j], y.c[j], args->alpha);
+        write_acc.store(idx, x);
     }
+}
 
-    if ((left_subtree || right_subtree) && n < actual_max_depth) {
-        IndexSpace is3 = lr3.get_index_space();
-        DomainPointColoring coloring;
+// The L2 inner product of the functions of two trees of one shape in wavelet form. The sibling transform is
+// orthogonal, so it is s . t at the root plus 2^n d . e at every internal node (n, l), and on a tree of depth
+// 0 it is s . t of the root, the inner product of the functions on [0, 1].
+template<typename T>
+typename CoefTraits<T>::accum_t wavelet_inner_product_task(const Task *task, const std::vector<PhysicalRegion> &regions, Context ctx, HighLevelRuntime *runtime) {
+    TaskTrace trace(task);
+    const WaveletArgs *args = (const WaveletArgs *) task->args;
+    const SweepNode *nodes = (const SweepNode *) (args + 1);
+    const CoefAccessor<READ_ONLY, T> acc1(regions[0]), acc2(regions[1]);
+    int k = coef_format.order;
+
+    Coefs<T> x, y;
+    acc1.load(wavelet_root_index(args->max_depth), x);
+    acc2.load(wavelet_root_index(args->max_depth), y);
+    typename CoefTraits<T>::accum_t sum = coef_dot(x.c, y.c, k);
+    for (size_t i = 0; i < args->num_nodes; i++) {
+        coord_t idx = wavelet_index(args->layout, nodes[i].n, nodes[i].l, args->max_depth);
+        acc1.load(idx, x);
+        acc2.load(idx, y);
+        sum += coef_dot(x.c, y.c, k) * static_cast<typename CoefTraits<T>::accum_t>(1LL << nodes[i].n);
+    }
+    return sum;
+}
 
-        Rect<1> my_sub_tree_rect(idx, idx);
-        Rect<1> left_sub_tree_rect(idx_left_sub_tree, idx_right_sub_tree - 1);
-        Rect<1> right_sub_tree_rect(idx_right_sub_tree,
-        idx_right_sub_tree + static_cast<coord_t>(pow(2, max_depth - n)) - 2);
+// Writes the wavelet form of a compressed tree to wavelet_lr, a region of create_wavelet_region with the
+// max_depth of the tree
+template<typename T>
+WaveletOperand tree_to_wavelets(Context ctx, HighLevelRuntime *runtime, const TreeOperand &tree, LogicalRegion wavelet_lr) {
+    assert(runtime->has_logical_partition_by_color(ctx, tree.lr, tree.partition_color));
+    vector<vector<SweepNode> > levels;
+    collect_wavelet_nodes(ctx, runtime, tree.lr, tree.partition_color, tree.shape.layout, 0, 0, 0, tree.shape.max_depth, levels);
+    vector<SweepNode> internal;
+    for (size_t n = 0; n < levels.size(); n++)
+        internal.insert(internal.end(), levels[n].begin(), levels[n].end());
+    WaveletOperand result(wavelet_lr, tree.shape.layout, tree.shape.max_depth, internal);
+
+    vector<char> args = pack_wavelet_args(result);
+    TaskLauncher launcher(task_id<T>(WAVELET_COMPRESS_TASK_ID), TaskArgument(&args[0], args.size()));
+    launcher.add_region_requirement(RegionRequirement(tree.lr, READ_ONLY, EXCLUSIVE, tree.lr));
+    add_coef_fields(launcher, 0);
+    launcher.add_region_requirement(RegionRequirement(wavelet_lr, WRITE_DISCARD, EXCLUSIVE, wavelet_lr));
+    add_coef_fields(launcher, 1);
+    runtime->execute_task(ctx, launcher);
+    return result;
+}
 
-        coloring[my_sub_tree_color] = my_sub_tree_rect;
-        coloring[left_sub_tree_color] = left_sub_tree_rect;
-        coloring[right_sub_tree_color] = right_sub_tree_rect;
+// Writes a tree in wavelet form to the tree region lr in reconstructed form. lr has to hold the partitions of
+// its shape, as the tree it came from does; the indices outside the shape are left as they are, so the
+// region is mapped READ_WRITE rather than WRITE_DISCARD.
+template<typename T>
+void wavelets_to_tree(Context ctx, HighLevelRuntime *runtime, const WaveletOperand &tree, LogicalRegion lr) {
+    vector<char> args = pack_wavelet_args(tree);
+    TaskLauncher launcher(task_id<T>(WAVELET_RECONSTRUCT_TASK_ID), TaskArgument(&args[0], args.size()));
+    launcher.add_region_requirement(RegionRequirement(tree.lr, READ_ONLY, EXCLUSIVE, tree.lr));
+    add_coef_fields(launcher, 0);
+    launcher.add_region_requirement(RegionRequirement(lr, READ_WRITE, EXCLUSIVE, lr));
+    add_coef_fields(launcher, 1);
+    runtime->execute_task(ctx, launcher);
+}
 
-        Rect<1> color_space = Rect<1>(my_sub_tree_color, right_sub_tree_color);
+// a + alpha * b into result_lr, for trees of one shape in wavelet form
+template<typename T>
+WaveletOperand wavelet_gaxpy(Context ctx, HighLevelRuntime *runtime, const WaveletOperand &a, const WaveletOperand &b,
+                             LogicalRegion result_lr, double alpha) {
+    assert(a.same_shape(b));
+    WaveletOperand result(result_lr, a.layout, a.max_depth, a.internal);
+    vector<char> args = pack_wavelet_args(result, alpha);
+    TaskLauncher launcher(task_id<T>(WAVELET_GAXPY_TASK_ID), TaskArgument(&args[0], args.size()));
+    launcher.add_region_requirement(RegionRequirement(a.lr, READ_ONLY, EXCLUSIVE, a.lr));
+    add_coef_fields(launcher, 0);
+    launcher.add_region_requirement(RegionRequirement(b.lr, READ_ONLY, EXCLUSIVE, b.lr));
+    add_coef_fields(launcher, 1);
+    launcher.add_region_requirement(RegionRequirement(result_lr, WRITE_DISCARD, EXCLUSIVE, result_lr));
+    add_coef_fields(launcher, 2);
+    runtime->execute_task(ctx, launcher);
+    return result;
+}
 
-        IndexPartition ip = runtime->create_index_partition(ctx, is3, color_space, coloring, DISJOINT_KIND, partition_color3);
-        lp3 = runtime->get_logical_partition(ctx, lr3, ip);
-        my_sub_tree_lr3 = runtime->get_logical_subregion_by_color(ctx, lp3, my_sub_tree_color);
-        left_sub_tree_lr3 = runtime->get_logical_subregion_by_color(ctx, lp3, left_sub_tree_color);
-        right_sub_tree_lr3 = runtime->get_logical_subregion_by_color(ctx, lp3, right_sub_tree_color);
-    } else {
-        return;
-    }
+// Future of the accum_t inner product of the functions of two trees of one shape in wavelet form
+template<typename T>
+Future wavelet_inner_product(Context ctx, HighLevelRuntime *runtime, const WaveletOperand &a, const WaveletOperand &b) {
+    assert(a.same_shape(b));
+    vector<char> args = pack_wavelet_args(a);
+    TaskLauncher launcher(task_id<T>(WAVELET_INNER_PRODUCT_TASK_ID), TaskArgument(&args[0], args.size()));
+    launcher.add_region_requirement(RegionRequirement(a.lr, READ_ONLY, EXCLUSIVE, a.lr));
+    add_coef_fields(launcher, 0);
+    launcher.add_region_requirement(RegionRequirement(b.lr, READ_ONLY, EXCLUSIVE, b.lr));
+    add_coef_fields(launcher, 1);
+    return runtime->execute_task(ctx, launcher);
+}
 
-    assert(lr3 != LogicalRegion::NO_REGION);
-    assert(my_sub_tree_lr3 != LogicalRegion::NO_REGION);
+// Writes a compressed tree in wavelet form to a region of its own and back to its region in reconstructed
+// form. The future is the inner product of the wavelet form with itself, the square of the L2 norm of f.
+template<typename T>
+Future tree_wavelet_round_trip(Context ctx, HighLevelRuntime *runtime, FieldSpace fs, const TreeOperand &tree) {
+    LogicalRegion wavelet_lr = create_wavelet_region(ctx, runtime, fs, tree.shape.max_depth);
+    WaveletOperand wavelets = tree_to_wavelets<T>(ctx, runtime, tree, wavelet_lr);
+    Future f_norm = wavelet_inner_product<T>(ctx, runtime, wavelets, wavelets);
+    wavelets_to_tree<T>(ctx, runtime, wavelets, tree.lr);
+    destroy_wavelet_region(ctx, runtime, wavelet_lr);
+    return f_norm;
+}
 
-    if (lr1 != LogicalRegion::NO_REGION) {
-        indexspace_tree_left1 = left_sub_tree_lr1.get_index_space();
-        indexspace_tree_right1 = right_sub_tree_lr1.get_index_space();
-    }
-    if (lr2 != LogicalRegion::NO_REGION) {
-        indexspace_tree_left2 = left_sub_tree_lr2.get_index_space();
-        indexspace_tree_right2 = right_sub_tree_lr2.get_index_space();
-    }
+// Native backend (-backend native): the operations of run_operations on trees held in plain memory and run
+// by a pool of threads of this process instead of Legion tasks, for single node runs where the per-task
+// overhead of the Legion path outweighs the work at a node, and as an upper bound to measure that path
+// against. The walks are those of the tasks node for node, down to the layout indices and the lookups of
+// get_coef, so the trees and the output match the Legion path.
 
-    if ((indexspace_tree_left1 != IndexSpace::NO_SPACE && runtime->has_index_partition(ctx, indexspace_tree_left1, partition_color1)) || 
-        (indexspace_tree_left2 != IndexSpace::NO_SPACE && runtime->has_index_partition(ctx, indexspace_tree_left2, partition_color2)) ) {
+// Capacity of the deque of every worker, a power of two. A spawn that finds it full runs the job in place.
+#define NATIVE_DEQUE_CAPACITY 4096
+// Subtrees with at most this many levels below their root are walked by the worker that reaches them
+#define NATIVE_SERIAL_LEVELS 4
 
-        {
-            // when left tree has reached its leaf node
-            if (n != left_tree_depth - 1 && (indexspace_tree_left1 == IndexSpace::NO_SPACE || runtime->has_index_partition(ctx, indexspace_tree_left1, partition_color1) == false)) {
-                is_left = false;
-                is_right = true;
-                my_sub_tree_lr1 = dummy_lr;
-                left_sub_tree_lr1 = dummy_lr;
-            }
+struct NativeGroup;
 
-            // when right tree has reached its leaf node
-            if (n != right_tree_depth - 1 && (indexspace_tree_left2 == IndexSpace::NO_SPACE || runtime->has_index_partition(ctx, indexspace_tree_left2, partition_color2) == false)) {
-                is_left = true;
-                is_right = false;
-                my_sub_tree_lr2 = dummy_lr;
-                left_sub_tree_lr2 = dummy_lr;
-            }
+struct NativeJob {
+    NativeGroup *group;
+    NativeJob(NativeGroup *_group) : group(_group) {}
+    virtual ~NativeJob() {}
+    virtual void run() = 0;
+};
 
-        }
+template<typename F>
+struct FunctorJob : NativeJob {
+    F f;
+    FunctorJob(const F &_f, NativeGroup *_group) : NativeJob(_group), f(_f) {}
+    virtual void run() { f(); }
+};
 
-        assert(left_sub_tree_lr2 != LogicalRegion::NO_REGION);
-        assert(left_sub_tree_lr1 != LogicalRegion::NO_REGION);
-        assert(left_sub_tree_lr3 != LogicalRegion::NO_REGION);
+// Jobs spawned into a group are waited for together
+struct NativeGroup {
+    std::atomic<int> pending;
+    NativeGroup() : pending(0) {}
+};
 
-        GaxpyArguments for_left_sub_tree (n + 1, l * 2, max_depth, idx_left_sub_tree, partition_color1, partition_color2, partition_color3, actual_max_depth, left_tree_depth, right_tree_depth);
+// Lock-free work-stealing deque of fixed capacity (Chase and Lev, with the orderings of Le et al. for weak
+// memory models). The owning worker pushes and pops at the bottom, newest first, and the other workers steal
+// from the top, oldest first, which hands them the largest subtrees of a walk.
+class WorkStealingDeque {
+public:
+    WorkStealingDeque() : top(0), bottom(0) {
+        for (int i = 0; i < NATIVE_DEQUE_CAPACITY; i++)
+            slots[i].store(NULL, std::memory_order_relaxed);
+    }
 
-        TaskLauncher gaxpy_launcher(GAXPY_TASK_ID, TaskArgument(&for_left_sub_tree, sizeof(GaxpyArguments)));
+    // Owner only, false when the deque is full
+    bool push(NativeJob *job) {
+        long long b = bottom.load(std::memory_order_relaxed);
+        long long t = top.load(std::memory_order_acquire);
+        if (b - t >= NATIVE_DEQUE_CAPACITY)
+            return false;
+        slots[b & (NATIVE_DEQUE_CAPACITY - 1)].store(job, std::memory_order_relaxed);
+        bottom.store(b + 1, std::memory_order_release);
+        return true;
+    }
 
-        if (left_sub_tree_lr1 == dummy_lr) {
-            RegionRequirement req1(dummy_lr, READ_ONLY, EXCLUSIVE, dummy_lr);
-            req1.add_field(FID_X);
-            gaxpy_launcher.add_region_requirement(req1);
-        } else {
-            RegionRequirement req1(left_sub_tree_lr1, READ_ONLY, EXCLUSIVE, lr1);
-            req1.add_field(FID_X);
-            gaxpy_launcher.add_region_requirement(req1);
+    // Owner only
+    NativeJob *pop() {
+        long long b = bottom.load(std::memory_order_relaxed) - 1;
+        bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        long long t = top.load(std::memory_order_relaxed);
+        if (t > b) {
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return NULL;
         }
-
-        if (left_sub_tree_lr2 == dummy_lr) {
-            RegionRequirement req2(dummy_lr, READ_ONLY, EXCLUSIVE, dummy_lr);
-            req2.add_field(FID_X);
-            gaxpy_launcher.add_region_requirement(req2);
-        } else {
-            RegionRequirement req2(left_sub_tree_lr2, READ_ONLY, EXCLUSIVE, lr2);
-            req2.add_field(FID_X);
-            gaxpy_launcher.add_region_requirement(req2);
+        NativeJob *job = slots[b & (NATIVE_DEQUE_CAPACITY - 1)].load(std::memory_order_relaxed);
+        if (t == b) {
+            // the last job, a thief may be taking it as well
+            if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+                job = NULL;
+            bottom.store(b + 1, std::memory_order_relaxed);
         }
-        
-        RegionRequirement req3(left_sub_tree_lr3, WRITE_DISCARD, EXCLUSIVE, lr3);
-        RegionRequirement req4(dummy_lr, READ_ONLY, EXCLUSIVE, dummy_lr);
-        req3.add_field(FID_X);
-        req4.add_field(FID_X);
-        gaxpy_launcher.add_region_requirement(req3);
-        gaxpy_launcher.add_region_requirement(req4);
-        runtime->execute_task(ctx, gaxpy_launcher);
+        return job;
+    }
+
+    NativeJob *steal() {
+        long long t = top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        long long b = bottom.load(std::memory_order_acquire);
+        if (t >= b)
+            return NULL;
+        NativeJob *job = slots[t & (NATIVE_DEQUE_CAPACITY - 1)].load(std::memory_order_relaxed);
+        if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+            return NULL;
+        return job;
+    }
+
+    // A snapshot, for a worker deciding whether to park
+    bool empty() const {
+        long long t = top.load(std::memory_order_acquire);
+        return t >= bottom.load(std::memory_order_acquire);
     }
 
+private:
+    alignas(64) std::atomic<long long> top;
+    alignas(64) std::atomic<long long> bottom;
+    std::atomic<NativeJob *> slots[NATIVE_DEQUE_CAPACITY];
+};
 
-    if ((indexspace_tree_right1 != IndexSpace::NO_SPACE && runtime->has_index_partition(ctx, indexspace_tree_right1, partition_color1)) || 
-        (indexspace_tree_right2 != IndexSpace::NO_SPACE && runtime->has_index_partition(ctx, indexspace_tree_right2, partition_color2)) ) {
+// One deque per worker. The thread that creates the scheduler is worker 0 and works while it waits on a
+// group; the others run jobs, their own first, then stolen ones, until the scheduler is destroyed, and
+// sleep on a condition variable while every deque is empty.
+class NativeScheduler {
+public:
+    NativeScheduler(int num_workers) : deques(num_workers), stopping(false), parked(0) {
+        current_worker = 0;
+        for (int w = 1; w < num_workers; w++)
+            threads.push_back(std::thread(&NativeScheduler::worker_loop, this, w));
+    }
 
+    ~NativeScheduler() {
         {
-            // when left tree has reached its leaf node
-            if (n != left_tree_depth - 1 && (indexspace_tree_right1 == IndexSpace::NO_SPACE || runtime->has_index_partition(ctx, indexspace_tree_right1, partition_color1) == false)) {
-                is_left = false;
-                is_right = true;
-                my_sub_tree_lr1 = dummy_lr;
-                right_sub_tree_lr1 = dummy_lr;
-            }
+            std::lock_guard<std::mutex> guard(park_lock);
+            stopping.store(true, std::memory_order_release);
+        }
+        park_cv.notify_all();
+        for (size_t i = 0; i < threads.size(); i++)
+            threads[i].join();
+    }
 
-            // when right tree has reached its leaf node
-            if (n != right_tree_depth - 1 && (indexspace_tree_right2 == IndexSpace::NO_SPACE || runtime->has_index_partition(ctx, indexspace_tree_right2, partition_color2) == false)) {
-                is_left = true;
-                is_right = false;
-                my_sub_tree_lr2 = dummy_lr;
-                right_sub_tree_lr2 = dummy_lr;
-            }
+    int num_workers() const { return deques.size(); }
+
+    template<typename F>
+    void spawn(NativeGroup &group, const F &f) {
+        group.pending.fetch_add(1, std::memory_order_relaxed);
+        NativeJob *job = new FunctorJob<F>(f, &group);
+        if (!deques[current_worker].push(job)) {
+            execute(job);
+            return;
+        }
+        // pairs with the fence of a parking worker: either it sees the job or this sees it parked
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (parked.load(std::memory_order_relaxed) > 0) {
+            std::lock_guard<std::mutex> guard(park_lock);
+            park_cv.notify_one();
         }
+    }
 
-        assert(right_sub_tree_lr2 != LogicalRegion::NO_REGION);
-        assert(right_sub_tree_lr1 != LogicalRegion::NO_REGION);
-        assert(right_sub_tree_lr3 != LogicalRegion::NO_REGION);
+    // Runs jobs, those of the group or any other, until every job of the group is done
+    void wait(NativeGroup &group) {
+        while (group.pending.load(std::memory_order_acquire) != 0) {
+            if (!run_one())
+                std::this_thread::yield();
+        }
+    }
 
-        GaxpyArguments for_right_sub_tree(n + 1, l * 2 + 1, max_depth, idx_right_sub_tree, partition_color1, partition_color2, partition_color3, actual_max_depth, left_tree_depth, right_tree_depth);
+private:
+    bool run_one() {
+        int self = current_worker;
+        NativeJob *job = deques[self].pop();
+        for (size_t i = 1; job == NULL && i < deques.size(); i++)
+            job = deques[(self + i) % deques.size()].steal();
+        if (job == NULL)
+            return false;
+        execute(job);
+        return true;
+    }
 
-        TaskLauncher gaxpy_launcher(GAXPY_TASK_ID, TaskArgument(&for_right_sub_tree, sizeof(GaxpyArguments)));
+    static void execute(NativeJob *job) {
+        NativeGroup *group = job->group;
+        job->run();
+        delete job;
+        group->pending.fetch_sub(1, std::memory_order_release);
+    }
 
-        if (right_sub_tree_lr1 == dummy_lr) {
-            RegionRequirement req1(dummy_lr, READ_ONLY, EXCLUSIVE, dummy_lr);
-            req1.add_field(FID_X);
-            gaxpy_launcher.add_region_requirement(req1);
-        } else {
-            RegionRequirement req1(right_sub_tree_lr1, READ_ONLY, EXCLUSIVE, lr1);
-            req1.add_field(FID_X);
-            gaxpy_launcher.add_region_requirement(req1);
+    bool any_work() const {
+        for (size_t i = 0; i < deques.size(); i++) {
+            if (!deques[i].empty())
+                return true;
         }
+        return false;
+    }
 
-        if (right_sub_tree_lr2 == dummy_lr) {
-            RegionRequirement req2(dummy_lr, READ_ONLY, EXCLUSIVE, dummy_lr);
-            req2.add_field(FID_X);
-            gaxpy_launcher.add_region_requirement(req2);
-        } else {
-            RegionRequirement req2(right_sub_tree_lr2, READ_ONLY, EXCLUSIVE, lr2);
-            req2.add_field(FID_X);
-            gaxpy_launcher.add_region_requirement(req2);
+    void worker_loop(int worker) {
+        current_worker = worker;
+        while (!stopping.load(std::memory_order_acquire)) {
+            if (run_one())
+                continue;
+            std::unique_lock<std::mutex> lock(park_lock);
+            parked.fetch_add(1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (!stopping.load(std::memory_order_acquire) && !any_work())
+                park_cv.wait(lock);
+            parked.fetch_sub(1, std::memory_order_relaxed);
         }
+    }
+
+    vector<WorkStealingDeque> deques;
+    vector<std::thread> threads;
+    std::atomic<bool> stopping;
+    /* workers asleep on park_cv */
+    std::atomic<int> parked;
+    std::mutex park_lock;
+    std::condition_variable park_cv;
+    static thread_local int current_worker;
+};
+
+thread_local int NativeScheduler::current_worker = 0;
 
-        RegionRequirement req3(right_sub_tree_lr3, WRITE_DISCARD, EXCLUSIVE, lr3);
-        RegionRequirement req4(dummy_lr, READ_ONLY, EXCLUSIVE, dummy_lr);
-        req3.add_field(FID_X);
-        req4.add_field(FID_X);
-        gaxpy_launcher.add_region_requirement(req3);
-        gaxpy_launcher.add_region_requirement(req4);
-        runtime->execute_task(ctx, gaxpy_launcher);
+// Runs left and right, left as a job idle workers can steal when levels_left is above the serial cutoff
+template<typename L, typename R>
+void native_fork(NativeScheduler &sched, int levels_left, const L &left, const R &right) {
+    if (levels_left <= NATIVE_SERIAL_LEVELS) {
+        left();
+        right();
+        return;
     }
+    NativeGroup group;
+    sched.spawn(group, left);
+    right();
+    sched.wait(group);
+}
 
+// The node table of a tree: the coefficients of every index of the layout, as in a tree region, and whether
+// the tree has the node, which the Legion path records as a partition of the subtree of the node. A node is
+// written by the one job that visits it and read once that job is joined, so the table takes no locks.
+template<typename T>
+class NativeTree {
+public:
+    NativeTree(int _max_depth, TreeLayout _layout)
+        : max_depth(_max_depth), layout(_layout), num_nodes(static_cast<size_t>(pow(2, _max_depth + 1)) - 1),
+          signature(0), values(num_nodes * coef_format.order, T(0)), present(num_nodes) {}
+
+    bool has(coord_t idx) const { return present[idx].load(std::memory_order_relaxed) != 0; }
+    void add(coord_t idx) { present[idx].store(1, std::memory_order_relaxed); }
+
+    void load(coord_t idx, Coefs<T> &coefs) const {
+        copy(&values[idx * coef_format.order], &values[idx * coef_format.order] + coef_format.order, coefs.c);
+    }
 
-    if(my_sub_tree_lr1 == LogicalRegion::NO_REGION)
-        my_sub_tree_lr1 = dummy_lr;
+    void store(coord_t idx, const Coefs<T> &coefs) {
+        copy(coefs.c, coefs.c + coef_format.order, &values[idx * coef_format.order]);
+    }
 
-    if(my_sub_tree_lr2 == LogicalRegion::NO_REGION)
-        my_sub_tree_lr2 = dummy_lr;
+    const T *coefs(coord_t idx) const { return &values[idx * coef_format.order]; }
+    T *coefs(coord_t idx) { return &values[idx * coef_format.order]; }
 
-    if (my_sub_tree_lr1 == dummy_lr)
-        is_left = false;
-    if (my_sub_tree_lr2 == dummy_lr)
-        is_right = false;
+    // The tree refine grows from shape, whose refinement bitmap and subtree node counts the ops then use
+    // as the Legion path has them for a refined tree (see tree_reduce and sweep_subtree)
+    void set_shape(const TreeShape &shape) {
+        refinement_bitmap(shape.seed, shape.depth, shape.max_depth, shape.layout, bitmap);
+        signature = shape.signature;
+        costs.assign(num_nodes, 0);
+        subtree_node_counts(shape.seed, shape.depth, shape.max_depth, shape.layout, 0, 0, costs);
+    }
 
-    if (is_left || is_right) {
-        assert(my_sub_tree_lr2 != LogicalRegion::NO_REGION);
-        assert(my_sub_tree_lr1 != LogicalRegion::NO_REGION);
-        assert(my_sub_tree_lr3 != LogicalRegion::NO_REGION);
-        assert(lr3 != LogicalRegion::NO_REGION);
-        assert(lr2 != LogicalRegion::NO_REGION);
-        assert(lr1 != LogicalRegion::NO_REGION);
+    // The shape of a result of a dense zip, which the Legion path knows but has no node counts for
+    void share_shape(const NativeTree &other) {
+        bitmap = other.bitmap;
+        signature = other.signature;
+        costs.clear();
+    }
 
-        GaxpySetTaskArgs args(idx, is_left, is_right);
+    bool shape_known() const { return !bitmap.empty(); }
 
-        TaskLauncher gaxpy_set_task_launcher(GAXPY_SET_TASK_ID, TaskArgument(&args, sizeof(GaxpySetTaskArgs)));
+    coord_t left(coord_t idx, int n, int l) const { return left_child_index(layout, idx, n, l, max_depth); }
+    coord_t right(coord_t idx, int n, int l) const { return right_child_index(layout, idx, n, l, max_depth); }
 
-        if (my_sub_tree_lr1 == dummy_lr) {
-            RegionRequirement req1(dummy_lr, READ_ONLY, EXCLUSIVE, dummy_lr);
-            req1.add_field(FID_X);
-            gaxpy_set_task_launcher.add_region_requirement(req1);
-        } else {
-            RegionRequirement req1(my_sub_tree_lr1, READ_ONLY, EXCLUSIVE, lr1);
-            req1.add_field(FID_X);
-            gaxpy_set_task_launcher.add_region_requirement(req1);
-        }
+    const int max_depth;
+    const TreeLayout layout;
+    const size_t num_nodes;
+    /* refinement bitmap and signature when the shape is known, empty otherwise */
+    vector<unsigned char> bitmap;
+    unsigned long long signature;
+    /* subtree node counts of a refined tree, empty otherwise */
+    vector<unsigned> costs;
 
-        if (my_sub_tree_lr2 == dummy_lr) {
-            RegionRequirement req2(dummy_lr, READ_ONLY, EXCLUSIVE, dummy_lr);
-            req2.add_field(FID_X);
-            gaxpy_set_task_launcher.add_region_requirement(req2);
-        } else {
-            RegionRequirement req2(my_sub_tree_lr2, READ_ONLY, EXCLUSIVE, lr2);
-            req2.add_field(FID_X);
-            gaxpy_set_task_launcher.add_region_requirement(req2);
-        }
+private:
+    vector<T> values;
+    vector<std::atomic<unsigned char> > present;
+};
 
-        RegionRequirement req3(my_sub_tree_lr3, WRITE_DISCARD, EXCLUSIVE, lr3);
-        req3.add_field(FID_X);
-        gaxpy_set_task_launcher.add_region_requirement(req3);
-        runtime->execute_task(ctx, gaxpy_set_task_launcher);
-    }     
+template<typename T>
+void native_compress_set(NativeTree<T> &tree, coord_t idx, coord_t left_idx, coord_t right_idx) {
+    Coefs<T> left, right, parent;
+    tree.load(left_idx, left);
+    tree.load(right_idx, right);
+    two_scale_filter(left.c, right.c, parent.c, 1);
+    tree.store(idx, parent);
 }
 
-int norm_task(const Task *task, const std::vector<PhysicalRegion> &regions, Context ctx, HighLevelRuntime *runtime) {
-    Arguments args = task->is_index_space ? *(const Arguments *) task->local_args
-    : *(const Arguments *) task->args;
+// refine_task, and refine_compress for COMPRESS
+template<typename T, bool COMPRESS>
+void native_refine(NativeScheduler &sched, NativeTree<T> &tree, long int seed, int actual_max_depth, int n, int l, coord_t idx) {
+    if (n < actual_max_depth)
+        tree.add(idx);
+    int node_value = refine_draw(seed, n, l);
+    Coefs<T> coefs;
+    set_node_coefs(node_value, n, actual_max_depth, coefs);
+    tree.store(idx, coefs);
+    if (node_value <= 3 || n >= actual_max_depth)
+        return;
 
-    int n = args.n;
-    int l = args.l;
-    int max_depth = args.max_depth;
+    coord_t left_idx = tree.left(idx, n, l), right_idx = tree.right(idx, n, l);
+    native_fork(sched, actual_max_depth - n,
+                [&] { native_refine<T, COMPRESS>(sched, tree, seed, actual_max_depth, n + 1, 2 * l, left_idx); },
+                [&] { native_refine<T, COMPRESS>(sched, tree, seed, actual_max_depth, n + 1, 2 * l + 1, right_idx); });
+    if (COMPRESS && n + 1 < actual_max_depth)
+        native_compress_set(tree, idx, left_idx, right_idx);
+}
 
-    DomainPoint my_sub_tree_color(Point<1>(0LL));
-    DomainPoint left_sub_tree_color(Point<1>(1LL));
-    DomainPoint right_sub_tree_color(Point<1>(2LL));
-    Color partition_color = args.partition_color;
+// compress_task: a node is internal when the tree has its left child
+template<typename T>
+void native_compress(NativeScheduler &sched, NativeTree<T> &tree, int n, int l, coord_t idx) {
+    if (n >= tree.max_depth || !tree.has(tree.left(idx, n, l)))
+        return;
+    coord_t left_idx = tree.left(idx, n, l), right_idx = tree.right(idx, n, l);
+    native_fork(sched, tree.max_depth - n,
+                [&] { native_compress(sched, tree, n + 1, 2 * l, left_idx); },
+                [&] { native_compress(sched, tree, n + 1, 2 * l + 1, right_idx); });
+    native_compress_set(tree, idx, left_idx, right_idx);
+}
 
-    coord_t idx = args.idx;
+// reconstruct_task
+template<typename T>
+void native_reconstruct(NativeScheduler &sched, NativeTree<T> &tree, int n, int l, coord_t idx, const Coefs<T> &parent_value) {
+    Coefs<T> value = parent_value, node_value;
+    tree.load(idx, node_value);
+    if (reconstruct_averages())
+        coef_average(value.c, value.c, node_value.c, coef_format.order);
+    else
+        value = node_value;
+    if (n >= tree.max_depth || !tree.has(tree.left(idx, n, l))) {
+        tree.store(idx, value);
+        return;
+    }
+    tree.store(idx, make_coefs(T(0)));
+    Coefs<T> left_value = make_coefs(T(0)), right_value = make_coefs(T(0));
+    if (reconstruct_averages())
+        two_scale_unfilter(value.c, left_value.c, right_value.c, 1);
+    coord_t left_idx = tree.left(idx, n, l), right_idx = tree.right(idx, n, l);
+    native_fork(sched, tree.max_depth - n,
+                [&] { native_reconstruct(sched, tree, n + 1, 2 * l, left_idx, left_value); },
+                [&] { native_reconstruct(sched, tree, n + 1, 2 * l + 1, right_idx, right_value); });
+}
 
-    assert(regions.size() == 1);
-    LogicalRegion lr = regions[0].get_logical_region();
-    LogicalPartition lp = LogicalPartition::NO_PART, lp1,lp2;
+// The node get_coef_util_task answers with: (qn, ql) itself when the tree has it, or, when the search
+// first ends at a node of level max_depth - 1, the deepest ancestor of (qn, ql) the tree has. n is -1
+// when there is neither.
+struct NativeCoefSource {
+    int n, l;
+    coord_t idx;
+    bool exists;
+    NativeCoefSource(int _n, int _l, coord_t _idx, bool _exists) : n(_n), l(_l), idx(_idx), exists(_exists) {}
+};
 
-    coord_t idx_left_sub_tree = 0LL;
-    coord_t idx_right_sub_tree = 0LL;
+template<typename T>
+NativeCoefSource native_coef_ancestor(const NativeTree<T> &tree, int qn, int ql) {
+    NativeCoefSource source(-1, -1, -1, false);
+    coord_t idx = 0;
+    for (int n = 0; n < qn && tree.has(idx); n++) {
+        int l = ql >> (qn - n);
+        source = NativeCoefSource(n, l, idx, false);
+        idx = ((ql >> (qn - n - 1)) & 1) ? tree.right(idx, n, l) : tree.left(idx, n, l);
+    }
+    return source;
+}
 
-    lp = runtime->get_logical_partition_by_color(ctx, lr, partition_color);
-    LogicalRegion my_sub_tree_lr = runtime->get_logical_subregion_by_color(ctx, lp, my_sub_tree_color);
-    LogicalRegion left_sub_tree_lr = runtime->get_logical_subregion_by_color(ctx, lp, left_sub_tree_color);
+// The search of get_coef_util_task, left subtree first
+template<typename T>
+NativeCoefSource native_coef_source(const NativeTree<T> &tree, int qn, int ql, int n, int l, coord_t idx) {
+    if (n == qn && l == ql)
+        return NativeCoefSource(n, l, idx, true);
+    bool searched = false;
+    if (n < tree.max_depth) {
+        coord_t left_idx = tree.left(idx, n, l), right_idx = tree.right(idx, n, l);
+        if (tree.has(left_idx)) {
+            NativeCoefSource left = native_coef_source(tree, qn, ql, n + 1, 2 * l, left_idx);
+            if (left.n != -1)
+                return left;
+            searched = true;
+        }
+        if (tree.has(right_idx))
+            return native_coef_source(tree, qn, ql, n + 1, 2 * l + 1, right_idx);
+    }
+    if (!searched && n == tree.max_depth - 1)
+        return native_coef_ancestor(tree, qn, ql);
+    return NativeCoefSource(-1, -1, -1, false);
+}
 
-    IndexSpace indexspace_left = left_sub_tree_lr.get_index_space();
-    Future f1;
+// get_coef_task: the coefficients of node (n, l) of the tree, those of its nearest ancestor shifted by
+// 2 per level when the tree does not have it, and -1 for an internal node with two internal children
+template<typename T>
+Coefs<T> native_get_coef(const NativeTree<T> &tree, int n, int l) {
+    if (l < 0 || l >= pow(2, n))
+        return make_coefs(T(0));
+    NativeCoefSource source = native_coef_source(tree, n, l, 0, 0, 0);
+    if (source.n == -1)
+        return make_coefs(T(0));
+    if (source.exists && source.n < tree.max_depth && tree.has(tree.left(source.idx, source.n, source.l)) &&
+        tree.has(tree.right(source.idx, source.n, source.l)))
+        return make_coefs(T(-1));
+    Coefs<T> coefs = make_coefs(T(0));
+    tree.load(source.idx, coefs);
+    if (!source.exists)
+        coef_shift(coefs.c, coefs.c, T(2 * (n - source.n)), coef_format.order);
+    return coefs;
+}
 
-    if (runtime->has_index_partition(ctx, indexspace_left, partition_color)) {
-        idx_left_sub_tree = idx + 1;
-        idx_right_sub_tree = idx + static_cast<coord_t>(pow(2, max_depth - n));
+// diff_task, writing the diff of tree into result
+template<typename T>
+void native_diff(NativeScheduler &sched, const NativeTree<T> &tree, NativeTree<T> &result, int actual_max_depth,
+                 int n, int l, coord_t idx, const Coefs<T> &parent_s0, bool is_s0_valid) {
+    if (n >= actual_max_depth)
+        return;
+    result.add(idx);
+    int k = coef_format.order;
+    coord_t left_idx = tree.left(idx, n, l), right_idx = tree.right(idx, n, l);
+    Coefs<T> s0 = parent_s0, sm, sp;
+
+    if (!is_s0_valid) {
+        bool left_subtree = tree.has(left_idx), right_subtree = tree.has(right_idx);
+        if (left_subtree || right_subtree) {
+            result.store(idx, make_coefs(T(0)));
+            Coefs<T> random = make_coefs(T(100));
+            native_fork(sched, actual_max_depth - n,
+                        [&] {
+                            if (left_subtree)
+                                native_diff(sched, tree, result, actual_max_depth, n + 1, 2 * l, left_idx, random, false);
+                        },
+                        [&] {
+                            if (right_subtree)
+                                native_diff(sched, tree, result, actual_max_depth, n + 1, 2 * l + 1, right_idx, random, false);
+                        });
+            return;
+        }
+        s0 = make_coefs(T(0));
+        tree.load(idx, s0);
+        sm = native_get_coef(tree, n, l - 1);
+        sp = native_get_coef(tree, n, l + 1);
+    } else if (l % 2 == 0) {
+        sp = s0;
+        sm = native_get_coef(tree, n, l - 1);
+    } else {
+        sm = s0;
+        sp = native_get_coef(tree, n, l + 1);
+    }
 
-        assert(lp != LogicalPartition::NO_PART);
-        Rect<1> launch_domain(left_sub_tree_color, right_sub_tree_color);
-        ArgumentMap arg_map;
-        Arguments for_left_sub_tree (n + 1, l * 2    , max_depth, idx_left_sub_tree, partition_color);
-        Arguments for_right_sub_tree(n + 1, l * 2 + 1, max_depth, idx_right_sub_tree, partition_color);
+    Coefs<T> r = make_coefs(T(0));
+    if (sm.c[0] >= 0 && sp.c[0] >= 0 && s0.c[0] >= 0) {
+        coef_add(r.c, sm.c, sp.c, k);
+        coef_add(r.c, r.c, s0.c, k);
+        result.store(idx, r);
+        return;
+    }
+    result.store(idx, r);
 
-        arg_map.set_point(left_sub_tree_color, TaskArgument(&for_left_sub_tree, sizeof(Arguments)));
-        arg_map.set_point(right_sub_tree_color, TaskArgument(&for_right_sub_tree, sizeof(Arguments)));
+    Coefs<T> half_s0;
+    coef_half(half_s0.c, s0.c, k);
+    native_fork(sched, actual_max_depth - n,
+                [&] { native_diff(sched, tree, result, actual_max_depth, n + 1, 2 * l, left_idx, half_s0, true); },
+                [&] { native_diff(sched, tree, result, actual_max_depth, n + 1, 2 * l + 1, right_idx, half_s0, true); });
+}
 
-        IndexTaskLauncher norm_launcher(NORM_TASK_ID, launch_domain, TaskArgument(NULL, 0), arg_map);
-        RegionRequirement req(lp, 0, READ_ONLY, EXCLUSIVE, lr);
-        req.add_field(FID_X);
-        norm_launcher.add_region_requirement(req);
-        FutureMap f_result = runtime->execute_index_space(ctx, norm_launcher);
-        return f_result.get_result<int>(left_sub_tree_color) + f_result.get_result<int>(right_sub_tree_color);
-    } else {
-        {
-            ReadTaskArgs args(idx);
-            TaskLauncher read_task_launcher(READ_TASK_ID, TaskArgument(&args, sizeof(ReadTaskArgs)));
-            RegionRequirement req(my_sub_tree_lr, READ_ONLY, EXCLUSIVE, lr);
-            req.add_field(FID_X);
-            read_task_launcher.add_region_requirement(req);
-            f1 = runtime->execute_task(ctx, read_task_launcher);
-        }
+// Flags of node (n, l) as tree_op_node_flags has them
+template<typename T, typename Op>
+int native_tree_op_flags(const NativeTree<T> &a, const NativeTree<T> &b, int n, int l, coord_t idx) {
+    int flags = (a.has(idx) ? IN_TREE1 : 0) | (Op::arity == 2 && b.has(idx) ? IN_TREE2 : 0);
+    if (!tree_op_visits<Op>(flags))
+        return flags;
+    int left_flags = 0;
+    if (n < a.max_depth) {
+        coord_t left_idx = a.left(idx, n, l);
+        left_flags = (a.has(left_idx) ? IN_TREE1 : 0) | (Op::arity == 2 && b.has(left_idx) ? IN_TREE2 : 0);
+    }
+    if (!tree_op_visits<Op>(left_flags))
+        flags |= LEAF_NODE;
+    return flags;
+}
 
-        return (f1.get_result<int>() * f1.get_result<int>());
+// The node kernel of tree_op_leaf_task, folding the terms of the node into partial
+template<typename T, typename Op>
+void native_tree_op_node(const NativeTree<T> &a, const NativeTree<T> &b, NativeTree<T> &out, double alpha, coord_t idx,
+                         int flags, typename Op::result_t &partial) {
+    int k = coef_format.order;
+    Coefs<T> x = make_coefs(T(0)), y = make_coefs(T(0)), value;
+    if (flags & IN_TREE1)
+        a.load(idx, x);
+    if (flags & IN_TREE2)
+        b.load(idx, y);
+    if (Op::kind == REDUCE_OP) {
+        if (!Op::leaves_only || (flags & LEAF_NODE)) {
+            for (int j = 0; j < k; j++)
+                partial = Op::combine(partial, Op::term(x.c[j], Op::arity == 2 ? y.c[j] : x.c[j]));
+        }
+        return;
+    }
+    for (int j = 0; j < k; j++)
+        value.c[j] = Op::apply(x.c[j], Op::kind == ZIP_OP ? y.c[j] : x.c[j], alpha);
+    out.add(idx);
+    out.store(idx, value);
+    if (Op::reduces_output && (!Op::leaves_only || (flags & LEAF_NODE))) {
+        for (int j = 0; j < k; j++)
+            partial = Op::combine(partial, Op::term(value.c[j], value.c[j]));
     }
 }
 
-void print_task(const Task *task, const std::vector<PhysicalRegion> &regions, Context ctxt, HighLevelRuntime *runtime) {
-
-    Arguments args = task->is_index_space ? *(const Arguments *) task->local_args
-    : *(const Arguments *) task->args;
+// A subtree below the serial cutoff: the nodes in the order collect_tree_op_nodes lists them, folded into
+// one partial result as the LOC_PROC variant of tree_op_leaf_task folds them
+template<typename T, typename Op>
+void native_tree_op_sweep(const NativeTree<T> &a, const NativeTree<T> &b, NativeTree<T> &out, double alpha,
+                          int n, int l, coord_t idx, typename Op::result_t &partial) {
+    int flags = native_tree_op_flags<T, Op>(a, b, n, l, idx);
+    if (!tree_op_visits<Op>(flags))
+        return;
+    native_tree_op_node<T, Op>(a, b, out, alpha, idx, flags, partial);
+    if (flags & LEAF_NODE)
+        return;
+    native_tree_op_sweep<T, Op>(a, b, out, alpha, n + 1, 2 * l, a.left(idx, n, l), partial);
+    native_tree_op_sweep<T, Op>(a, b, out, alpha, n + 1, 2 * l + 1, a.right(idx, n, l), partial);
+}
 
-    int n = args.n,
-    l = args.l,
-    max_depth = args.max_depth;
+// The tree op walk of tree_op_task over trees a and b into out, with the cutoff of sweep_subtree and the
+// combine order of the walk and leaf tasks, so that a reduction comes out as the Legion path has it.
+// a and b are the same tree for ops of arity 1, out is a for MAP_OP and unused for REDUCE_OP.
+template<typename T, typename Op>
+typename Op::result_t native_tree_op(NativeScheduler &sched, const NativeTree<T> &a, const NativeTree<T> &b, NativeTree<T> &out,
+                                     double alpha, int n, int l, coord_t idx) {
+    typedef typename Op::result_t result_t;
+    if (sweep_subtree_cost(a.max_depth - n, idx < (coord_t) a.costs.size() ? a.costs[idx] : 0)) {
+        result_t partial = Op::identity();
+        native_tree_op_sweep<T, Op>(a, b, out, alpha, n, l, idx, partial);
+        return Op::combine(Op::identity(), partial);
+    }
 
-    DomainPoint my_sub_tree_color(Point<1>(0LL));
-    DomainPoint left_sub_tree_color(Point<1>(1LL));
-    DomainPoint right_sub_tree_color(Point<1>(2LL));
-    Color partition_color = args.partition_color;
+    int flags = native_tree_op_flags<T, Op>(a, b, n, l, idx);
+    if (!tree_op_visits<Op>(flags))
+        return Op::identity();
+    result_t self = Op::identity();
+    native_tree_op_node<T, Op>(a, b, out, alpha, idx, flags, self);
+    self = Op::combine(Op::identity(), self);
+    if (flags & LEAF_NODE)
+        return self;
+
+    result_t left_result, right_result;
+    coord_t left_idx = a.left(idx, n, l), right_idx = a.right(idx, n, l);
+    native_fork(sched, a.max_depth - n,
+                [&] { left_result = native_tree_op<T, Op>(sched, a, b, out, alpha, n + 1, 2 * l, left_idx); },
+                [&] { right_result = native_tree_op<T, Op>(sched, a, b, out, alpha, n + 1, 2 * l + 1, right_idx); });
+    return Op::combine(self, Op::combine(left_result, right_result));
+}
 
-    coord_t idx = args.idx;
+// tree_op_dense_task: one pass per coefficient over every index of the trees, in index order
+template<typename T, typename Op>
+typename Op::result_t native_tree_op_dense(const NativeTree<T> &a, const NativeTree<T> &b, NativeTree<T> &out, double alpha) {
+    typedef typename Op::result_t result_t;
+    unsigned char mask = Op::leaves_only ? BITMAP_LEAF : BITMAP_NODE;
+    const vector<unsigned char> &nodes = a.bitmap;
+    result_t result = Op::identity();
+    for (int j = 0; j < coef_format.order; j++) {
+        result_t partial = Op::identity();
+        for (size_t i = 0; i < nodes.size(); i++) {
+            if (Op::kind == REDUCE_OP) {
+                if (nodes[i] & mask)
+                    partial = Op::combine(partial, Op::term(a.coefs(i)[j], b.coefs(i)[j]));
+            } else if (Op::kind == ZIP_OP) {
+                T value = (nodes[i] & BITMAP_NODE) ? Op::apply(a.coefs(i)[j], b.coefs(i)[j], alpha) : T(0);
+                out.coefs(i)[j] = value;
+                if (Op::reduces_output && (nodes[i] & mask))
+                    partial = Op::combine(partial, Op::term(value, value));
+            } else if (nodes[i] & mask) {
+                out.coefs(i)[j] = Op::apply(a.coefs(i)[j], a.coefs(i)[j], alpha);
+            }
+        }
+        if (Op::kind != MAP_OP)
+            result = Op::combine(result, partial);
+    }
+    if (Op::kind == ZIP_OP) {
+        for (size_t i = 0; i < nodes.size(); i++) {
+            if (nodes[i] & BITMAP_NODE)
+                out.add(i);
+        }
+        out.share_shape(a);
+    }
+    return result;
+}
 
-    LogicalRegion lr = regions[0].get_logical_region();
-    LogicalPartition lp = LogicalPartition::NO_PART;
-    lp = runtime->get_logical_partition_by_color(ctxt, lr, partition_color);
+// tree_reduce: the dense pass for trees of one known shape, the walk otherwise
+template<typename T, typename Op>
+typename Op::result_t native_tree_reduce(NativeScheduler &sched, const NativeTree<T> &a, const NativeTree<T> &b) {
+    NativeTree<T> &unused = const_cast<NativeTree<T> &>(a);
+    if (a.shape_known() && (Op::arity == 1 || (b.shape_known() && a.signature == b.signature)))
+        return native_tree_op_dense<T, Op>(a, b, unused, 0);
+    return native_tree_op<T, Op>(sched, a, b, unused, 0, 0, 0, 0);
+}
 
-    LogicalRegion my_sub_tree_lr = runtime->get_logical_subregion_by_color(ctxt, lp, my_sub_tree_color);
-    LogicalRegion left_sub_tree_lr = runtime->get_logical_subregion_by_color(ctxt, lp, left_sub_tree_color);
-    LogicalRegion right_sub_tree_lr = runtime->get_logical_subregion_by_color(ctxt, lp, right_sub_tree_color);
+// tree_zip into out, the reduction of an op with reduces_output returned
+template<typename T, typename Op>
+typename Op::result_t native_tree_zip(NativeScheduler &sched, const NativeTree<T> &a, const NativeTree<T> &b, NativeTree<T> &out,
+                                      double alpha = 1) {
+    if (a.shape_known() && b.shape_known() && a.signature == b.signature)
+        return native_tree_op_dense<T, Op>(a, b, out, alpha);
+    return native_tree_op<T, Op>(sched, a, b, out, alpha, 0, 0, 0);
+}
 
-    Future f1;
-    {
-        ReadTaskArgs args(idx);
-        TaskLauncher read_task_launcher(READ_TASK_ID, TaskArgument(&args, sizeof(ReadTaskArgs)));
-        RegionRequirement req(my_sub_tree_lr, READ_ONLY, EXCLUSIVE, lr);
-        req.add_field(FID_X);
-        read_task_launcher.add_region_requirement(req);
-        f1 = runtime->execute_task(ctxt, read_task_launcher);
-    }
+// tree_map over a in place
+template<typename T, typename Op>
+void native_tree_map(NativeScheduler &sched, NativeTree<T> &a, double alpha = 1) {
+    if (a.shape_known())
+        native_tree_op_dense<T, Op>(a, a, a, alpha);
+    else
+        native_tree_op<T, Op>(sched, a, a, a, alpha, 0, 0, 0);
+}
 
-    int node_value = f1.get_result<int>();
+// print_task, in the order of print_sweep_task
+template<typename T>
+void native_print(const NativeTree<T> &tree, int n, int l, coord_t idx) {
+    Coefs<T> node_value;
+    tree.load(idx, node_value);
+    print_node(n, l, idx, node_value);
+    if (n >= tree.max_depth)
+        return;
+    coord_t left_idx = tree.left(idx, n, l), right_idx = tree.right(idx, n, l);
+    if (!tree.has(left_idx) && !tree.has(right_idx))
+        return;
+    native_print(tree, n + 1, 2 * l, left_idx);
+    native_print(tree, n + 1, 2 * l + 1, right_idx);
+}
 
-    fprintf(stderr, "(n: %d, l: %d), idx: %lld, node_value: %d\n", n, l, idx, node_value);
+// The operations run_operations runs, on the native backend
+template<typename T>
+void run_native_operations(const DriverOptions &options, int num_workers) {
+    if (options.storage_benchmark_nodes > 0) {
+        benchmark_storage<T>(options.storage_benchmark_nodes, coef_format.order);
+        return;
+    }
 
-    IndexSpace indexspace_left = left_sub_tree_lr.get_index_space();
-    IndexSpace indexspace_right = right_sub_tree_lr.get_index_space();
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    NativeScheduler sched(num_workers);
 
+    NativeTree<T> tree1(options.overall_max_depth, options.layout);
+    native_refine<T, false>(sched, tree1, options.seed, options.actual_left_depth, 0, 0, 0);
+    tree1.set_shape(TreeShape(options.seed, options.actual_left_depth, options.overall_max_depth, options.layout));
 
+    // native_compress(sched, tree1, 0, 0, 0);
+    // typename CoefTraits<T>::accum_t norm = native_tree_reduce<T, NormOp<T> >(sched, tree1, tree1);
+    // fprintf(stderr, "norm result %fm\n", sqrt(static_cast<double>(norm)));
 
-    // These lines will create an instance for the whole region even though we need only the first element
-    // const FieldAccessor<READ_ONLY, int, 1> read_acc(regions[0], FID_X);
-    // int node_value = read_acc[idx];
+    NativeTree<T> tree2(options.overall_max_depth, options.layout);
+    native_diff(sched, tree1, tree2, options.actual_left_depth, 0, 0, 0, make_coefs(T(100)), false);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    native_print(tree2, 0, 0, 0);
 
-    // checking if the children of the node have any valid partition. This condition implies that we are checking if we have reached the leaf node or not
-    if (runtime->has_index_partition(ctxt, indexspace_left, partition_color) || runtime->has_index_partition(ctxt, indexspace_right, partition_color)) {
+    // NativeTree<T> tree3(options.overall_max_depth, options.layout);
+    // native_tree_zip<T, GaxpyOp<T> >(sched, tree1, tree2, tree3);
+    // native_reconstruct(sched, tree1, 0, 0, 0, make_coefs(T(0)));
+    // native_print(tree1, 0, 0, 0);
 
-        coord_t idx_left_sub_tree = idx + 1;
-        coord_t idx_right_sub_tree = idx + static_cast<coord_t>(pow(2, max_depth - n));
+    fprintf(stderr, "native backend: %d workers, %.3f ms\n", sched.num_workers(), elapsed_ns(start, end) / 1e6);
+}
 
-        Rect<1> launch_domain(left_sub_tree_color, right_sub_tree_color);
-        ArgumentMap arg_map;
+// Task names must outlive the preregistration calls, the runtime only reads them when it starts
+template<typename T>
+const char *typed_name(const char *base) {
+    string name = string(base) + "<" + CoefTraits<T>::name() + ">";
+    return strdup(name.c_str());
+}
 
-        Arguments for_left_sub_tree(n + 1, 2 * l, max_depth, idx_left_sub_tree, partition_color);
-        Arguments for_right_sub_tree(n + 1, 2 * l + 1, max_depth, idx_right_sub_tree, partition_color);
+// Registers one variant of every task that touches coefficients, under the ids for type T
+template<typename T, typename Op>
+void register_tree_op(const string &name)
+{
+    {
+        TaskVariantRegistrar registrar(tree_op_task_id<T, Op>(TREE_OP_WALK), typed_name<T>(name.c_str()));
+        registrar.add_constraint(ProcessorConstraint(Processor::LOC_PROC));
+        registrar.set_inner(true);
+        Runtime::preregister_task_variant<typename Op::result_t, tree_op_task<T, Op> >(registrar, typed_name<T>(name.c_str()));
+    }
 
-        arg_map.set_point(left_sub_tree_color, TaskArgument(&for_left_sub_tree, sizeof(Arguments)));
-        arg_map.set_point(right_sub_tree_color, TaskArgument(&for_right_sub_tree, sizeof(Arguments)));
+    {
+        TaskVariantRegistrar registrar(tree_op_task_id<T, Op>(TREE_OP_LEAF), typed_name<T>((name + "_leaf").c_str()));
+        registrar.add_constraint(ProcessorConstraint(Processor::LOC_PROC));
+        registrar.set_leaf(true);
+        Runtime::preregister_task_variant<typename Op::result_t, tree_op_leaf_task<T, Op> >(registrar, typed_name<T>((name + "_leaf").c_str()));
+    }
 
-        // It calls print task twice for both the sub lp's lp[1], lp[2]
-        IndexTaskLauncher print_launcher(PRINT_TASK_ID, launch_domain, TaskArgument(NULL, 0), arg_map);
+    {
+        TaskVariantRegistrar registrar(tree_op_task_id<T, Op>(TREE_OP_DENSE), typed_name<T>((name + "_dense").c_str()));
+        registrar.add_constraint(ProcessorConstraint(Processor::LOC_PROC));
+        registrar.set_leaf(true);
+        Runtime::preregister_task_variant<typename Op::result_t, tree_op_dense_task<T, Op> >(registrar, typed_name<T>((name + "_dense").c_str()));
+    }
 
-        // We should not create a new partition, instead just fetch the existing partition, to avoid creating copy of the whole tree again and again
-        // this partition color is the same color that we specified in the refine task while creating the index partition
-        RegionRequirement req(lp, 0, READ_ONLY, EXCLUSIVE, lr);
-        req.add_field(FID_X);
-        print_launcher.add_region_requirement(req);
+#ifdef REALM_USE_OPENMP
+    {
+        TaskVariantRegistrar registrar(tree_op_task_id<T, Op>(TREE_OP_LEAF), typed_name<T>((name + "_leaf").c_str()));
+        registrar.add_constraint(ProcessorConstraint(Processor::OMP_PROC));
+        registrar.set_leaf(true);
+        Runtime::preregister_task_variant<typename Op::result_t, tree_op_leaf_task<T, Op> >(registrar, typed_name<T>((name + "_leaf_omp").c_str()));
+    }
 
-        runtime->execute_index_space(ctxt, print_launcher);
-    } 
+    {
+        TaskVariantRegistrar registrar(tree_op_task_id<T, Op>(TREE_OP_DENSE), typed_name<T>((name + "_dense").c_str()));
+        registrar.add_constraint(ProcessorConstraint(Processor::OMP_PROC));
+        registrar.set_leaf(true);
+        Runtime::preregister_task_variant<typename Op::result_t, tree_op_dense_task<T, Op> >(registrar, typed_name<T>((name + "_dense_omp").c_str()));
+    }
+#endif
 }
 
-int main(int argc, char **argv)
+template<typename T>
+void register_coefficient_tasks()
 {
-    Runtime::set_top_level_task_id(TOP_LEVEL_TASK_ID);
-
     {
-        TaskVariantRegistrar registrar(TOP_LEVEL_TASK_ID, "top_level");
+        TaskVariantRegistrar registrar(task_id<T>(REFINE_TASK_ID), typed_name<T>("refine"));
         registrar.add_constraint(ProcessorConstraint(Processor::LOC_PROC));
-        Runtime::preregister_task_variant<top_level_task>(registrar, "top_level");
+        registrar.set_inner(true);
+        Runtime::preregister_task_variant<refine_task<T, false> >(registrar, typed_name<T>("refine"));
     }
 
     {
-        TaskVariantRegistrar registrar(REFINE_TASK_ID, "refine");
+        TaskVariantRegistrar registrar(task_id<T>(REFINE_COMPRESS_TASK_ID), typed_name<T>("refine_compress"));
         registrar.add_constraint(ProcessorConstraint(Processor::LOC_PROC));
         registrar.set_inner(true);
-        Runtime::preregister_task_variant<refine_task>(registrar, "refine");
+        Runtime::preregister_task_variant<refine_task<T, true> >(registrar, typed_name<T>("refine_compress"));
     }
 
     {
-        TaskVariantRegistrar registrar(SET_TASK_ID, "set");
+        TaskVariantRegistrar registrar(task_id<T>(SET_TASK_ID), typed_name<T>("set"));
         registrar.add_constraint(ProcessorConstraint(Processor::LOC_PROC));
         registrar.set_leaf(true);
-        Runtime::preregister_task_variant<set_task>(registrar, "set");
+        Runtime::preregister_task_variant<set_task<T> >(registrar, typed_name<T>("set"));
     }
 
     {
-        TaskVariantRegistrar registrar(PRINT_TASK_ID, "print");
+        TaskVariantRegistrar registrar(task_id<T>(REFINE_SWEEP_TASK_ID), typed_name<T>("refine_sweep"));
         registrar.add_constraint(ProcessorConstraint(Processor::LOC_PROC));
-        Runtime::preregister_task_variant<print_task>(registrar, "print");
+        registrar.set_leaf(true);
+        Runtime::preregister_task_variant<refine_sweep_task<T, false> >(registrar, typed_name<T>("refine_sweep"));
     }
 
     {
-        TaskVariantRegistrar registrar(READ_TASK_ID, "read");
+        TaskVariantRegistrar registrar(task_id<T>(REFINE_COMPRESS_SWEEP_TASK_ID), typed_name<T>("refine_compress_sweep"));
         registrar.add_constraint(ProcessorConstraint(Processor::LOC_PROC));
         registrar.set_leaf(true);
-        Runtime::preregister_task_variant<int, read_task>(registrar, "read");
+        Runtime::preregister_task_variant<refine_sweep_task<T, true> >(registrar, typed_name<T>("refine_compress_sweep"));
     }
 
     {
-        TaskVariantRegistrar registrar(COMPRESS_TASK_ID, "compress");
+        TaskVariantRegistrar registrar(task_id<T>(PRINT_TASK_ID), typed_name<T>("print"));
         registrar.add_constraint(ProcessorConstraint(Processor::LOC_PROC));
-        registrar.set_inner(true);
-        Runtime::preregister_task_variant<compress_task>(registrar, "compress");
+        Runtime::preregister_task_variant<print_task<T> >(registrar, typed_name<T>("print"));
+    }
+
+    {
+        TaskVariantRegistrar registrar(task_id<T>(PRINT_SWEEP_TASK_ID), typed_name<T>("print_sweep"));
+        registrar.add_constraint(ProcessorConstraint(Processor::LOC_PROC));
+        registrar.set_leaf(true);
+        Runtime::preregister_task_variant<print_sweep_task<T> >(registrar, typed_name<T>("print_sweep"));
     }
 
     {
-        TaskVariantRegistrar registrar(COMPRESS_SET_TASK_ID, "compress_set");
+        TaskVariantRegistrar registrar(task_id<T>(READ_TASK_ID), typed_name<T>("read"));
         registrar.add_constraint(ProcessorConstraint(Processor::LOC_PROC));
         registrar.set_leaf(true);
-        Runtime::preregister_task_variant<compress_set_task>(registrar, "compress_set");
+        Runtime::preregister_task_variant<Coefs<T>, read_task<T> >(registrar, typed_name<T>("read"));
     }
 
     {
-        TaskVariantRegistrar registrar(GET_COEF_TASK_ID, "get_coef");
+        TaskVariantRegistrar registrar(task_id<T>(COMPRESS_TASK_ID), typed_name<T>("compress"));
         registrar.add_constraint(ProcessorConstraint(Processor::LOC_PROC));
         registrar.set_inner(true);
-        Runtime::preregister_task_variant<int, get_coef_task>(registrar, "get_coef");
+        Runtime::preregister_task_variant<compress_task<T> >(registrar, typed_name<T>("compress"));
     }
 
     {
-        TaskVariantRegistrar registrar(GET_COEF_UTIL_TASK_ID, "get_coef_util");
+        TaskVariantRegistrar registrar(task_id<T>(COMPRESS_SET_TASK_ID), typed_name<T>("compress_set"));
+        registrar.add_constraint(ProcessorConstraint(Processor::LOC_PROC));
+        registrar.set_leaf(true);
+        Runtime::preregister_task_variant<compress_set_task<T> >(registrar, typed_name<T>("compress_set"));
+    }
+
+    {
+        TaskVariantRegistrar registrar(task_id<T>(COMPRESS_SWEEP_TASK_ID), typed_name<T>("compress_sweep"));
+        registrar.add_constraint(ProcessorConstraint(Processor::LOC_PROC));
+        registrar.set_leaf(true);
+        Runtime::preregister_task_variant<compress_sweep_task<T> >(registrar, typed_name<T>("compress_sweep"));
+    }
+
+    {
+        TaskVariantRegistrar registrar(task_id<T>(COMPRESS_PATH_TASK_ID), typed_name<T>("compress_path"));
+        registrar.add_constraint(ProcessorConstraint(Processor::LOC_PROC));
+        registrar.set_leaf(true);
+        Runtime::preregister_task_variant<compress_path_task<T> >(registrar, typed_name<T>("compress_path"));
+    }
+
+    {
+        TaskVariantRegistrar registrar(task_id<T>(GET_COEF_TASK_ID), typed_name<T>("get_coef"));
         registrar.add_constraint(ProcessorConstraint(Processor::LOC_PROC));
         registrar.set_inner(true);
-        Runtime::preregister_task_variant<ReturnGetCoefArguments, get_coef_util_task>(registrar, "get_coef_util");
+        Runtime::preregister_task_variant<Coefs<T>, get_coef_task<T> >(registrar, typed_name<T>("get_coef"));
     }
 
     {
-        TaskVariantRegistrar registrar(DIFF_TASK_ID, "diff");
+        TaskVariantRegistrar registrar(task_id<T>(DIFF_TASK_ID), typed_name<T>("diff"));
         registrar.add_constraint(ProcessorConstraint(Processor::LOC_PROC));
         registrar.set_inner(true);
-        Runtime::preregister_task_variant<diff_task>(registrar, "diff");
+        Runtime::preregister_task_variant<diff_task<T> >(registrar, typed_name<T>("diff"));
     }
 
     {
-        TaskVariantRegistrar registrar(DIFF_SET_TASK_ID, "diff_set");
+        TaskVariantRegistrar registrar(task_id<T>(DIFF_SET_TASK_ID), typed_name<T>("diff_set"));
         registrar.add_constraint(ProcessorConstraint(Processor::LOC_PROC));
         registrar.set_leaf(true);
-        Runtime::preregister_task_variant<diff_set_task>(registrar, "diff_set");
+        Runtime::preregister_task_variant<diff_set_task<T> >(registrar, typed_name<T>("diff_set"));
     }
 
     {
-        TaskVariantRegistrar registrar(INNER_PRODUCT_TASK_ID, "inner_product");
+        TaskVariantRegistrar registrar(task_id<T>(RECONSTRUCT_TASK_ID), typed_name<T>("reconstruct"));
         registrar.add_constraint(ProcessorConstraint(Processor::LOC_PROC));
         registrar.set_inner(true);
-        Runtime::preregister_task_variant<int, inner_product_task>(registrar, "inner_product");
+        Runtime::preregister_task_variant<reconstruct_task<T> >(registrar, typed_name<T>("reconstruct"));
     }
 
+    {
+        TaskVariantRegistrar registrar(task_id<T>(RECONSTRUCT_SET_TASK_ID), typed_name<T>("reconstruct_set"));
+        registrar.add_constraint(ProcessorConstraint(Processor::LOC_PROC));
+        registrar.set_leaf(true);
+        Runtime::preregister_task_variant<reconstruct_set_task<T> >(registrar, typed_name<T>("reconstruct_set"));
+    }
 
     {
-        TaskVariantRegistrar registrar(PRODUCT_TASK_ID, "product");
+        TaskVariantRegistrar registrar(task_id<T>(RECONSTRUCT_SWEEP_TASK_ID), typed_name<T>("reconstruct_sweep"));
         registrar.add_constraint(ProcessorConstraint(Processor::LOC_PROC));
         registrar.set_leaf(true);
-        Runtime::preregister_task_variant<int, product_task>(registrar, "product");
+        Runtime::preregister_task_variant<reconstruct_sweep_task<T> >(registrar, typed_name<T>("reconstruct_sweep"));
     }
+
     {
-        TaskVariantRegistrar registrar(NORM_TASK_ID, "norm");
+        TaskVariantRegistrar registrar(task_id<T>(EVAL_TASK_ID), typed_name<T>("eval"));
         registrar.add_constraint(ProcessorConstraint(Processor::LOC_PROC));
         registrar.set_inner(true);
-        Runtime::preregister_task_variant<int, norm_task>(registrar, "norm");
+        Runtime::preregister_task_variant<EvalValues, eval_task<T> >(registrar, typed_name<T>("eval"));
     }
 
     {
-        TaskVariantRegistrar registrar(GAXPY_SET_TASK_ID, "gaxpy_set");
+        TaskVariantRegistrar registrar(task_id<T>(EVAL_LEAF_TASK_ID), typed_name<T>("eval_leaf"));
         registrar.add_constraint(ProcessorConstraint(Processor::LOC_PROC));
         registrar.set_leaf(true);
-        Runtime::preregister_task_variant<gaxpy_set_task>(registrar, "gaxpy_set");
+        Runtime::preregister_task_variant<EvalValues, eval_leaf_task<T> >(registrar, typed_name<T>("eval_leaf"));
     }
 
     {
-        TaskVariantRegistrar registrar(GAXPY_TASK_ID, "gaxpy");
+        TaskVariantRegistrar registrar(task_id<T>(INTEGRATE_TASK_ID), typed_name<T>("integrate"));
         registrar.add_constraint(ProcessorConstraint(Processor::LOC_PROC));
-        registrar.set_inner(true);
-        Runtime::preregister_task_variant<gaxpy_task>(registrar, "gaxpy");
+        registrar.set_leaf(true);
+        Runtime::preregister_task_variant<EvalValues, integrate_task<T> >(registrar, typed_name<T>("integrate"));
     }
 
     {
-        TaskVariantRegistrar registrar(RECONSTRUCT_TASK_ID, "reconstruct");
+        TaskVariantRegistrar registrar(task_id<T>(PROJECT_TASK_ID), typed_name<T>("project"));
         registrar.add_constraint(ProcessorConstraint(Processor::LOC_PROC));
-        registrar.set_inner(true);
-        Runtime::preregister_task_variant<reconstruct_task>(registrar, "reconstruct");
+        registrar.set_leaf(true);
+        Runtime::preregister_task_variant<ProjectFrontier, project_task<T> >(registrar, typed_name<T>("project"));
+    }
+
+    {
+        TaskVariantRegistrar registrar(task_id<T>(INGEST_TASK_ID), typed_name<T>("ingest"));
+        registrar.add_constraint(ProcessorConstraint(Processor::LOC_PROC));
+        registrar.set_leaf(true);
+        Runtime::preregister_task_variant<ingest_task<T> >(registrar, typed_name<T>("ingest"));
     }
 
     {
-        TaskVariantRegistrar registrar(RECONSTRUCT_SET_TASK_ID, "reconstruct_set");
+        TaskVariantRegistrar registrar(task_id<T>(QUANTIZE_TASK_ID), typed_name<T>("quantize"));
         registrar.add_constraint(ProcessorConstraint(Processor::LOC_PROC));
         registrar.set_leaf(true);
-        Runtime::preregister_task_variant<reconstruct_set_task>(registrar, "reconstruct_set");
+        Runtime::preregister_task_variant<quantize_task<T> >(registrar, typed_name<T>("quantize"));
     }
 
-    return Runtime::start(argc, argv);
-}
\ No newline at end of file
+    {
+        TaskVariantRegistrar registrar(task_id<T>(WAVELET_COMPRESS_TASK_ID), typed_name<T>("wavelet_compress"));
+        registrar.add_constraint(ProcessorConstraint(Processor::LOC_PROC));
+        registrar.set_leaf(true);
+        Runtime::preregister_task_variant<wavelet_compress_task<T> >(registrar, typed_name<T>("wavelet_compress"));
+    }
+
+    {
+        TaskVariantRegistrar registrar(task_id<T>(WAVELET_RECONSTRUCT_TASK_ID), typed_name<T>("wavelet_reconstruct"));
+        registrar.add_constraint(ProcessorConstraint(Processor::LOC_PROC));
+        registrar.set_leaf(true);
+        Runtime::preregister_task_variant<wavelet_reconstruct_task<T> >(registrar, typed_name<T>("wavelet_reconstruct"));
+    }
+
+    {
+        TaskVariantRegistrar registrar(task_id<T>(WAVELET_GAXPY_TASK_ID), typed_name<T>("wavelet_gaxpy"));
+        registrar.add_constraint(ProcessorConstraint(Processor::LOC_PROC));
+        registrar.set_leaf(true);
+        Runtime::preregister_task_variant<wavelet_gaxpy_task<T> >(registrar, typed_name<T>("wavelet_gaxpy"));
+    }
+
+    {
+        TaskVariantRegistrar registrar(task_id<T>(WAVELET_INNER_PRODUCT_TASK_ID), typed_name<T>("wavelet_inner_product"));
+        registrar.add_constraint(ProcessorConstraint(Processor::LOC_PROC));
+        registrar.set_leaf(true);
+        Runtime::preregister_task_variant<typename CoefTraits<T>::accum_t, wavelet_inner_product_task<T> >(registrar, typed_name<T>("wavelet_inner_product"));
+    }
+
+#ifdef REALM_USE_OPENMP
+    // the same kernels on OpenMP processors, which CostMapper picks for large blocks
+    {
+        TaskVariantRegistrar registrar(task_id<T>(REFINE_SWEEP_TASK_ID), typed_name<T>("refine_sweep"));
+        registrar.add_constraint(ProcessorConstraint(Processor::OMP_PROC));
+        registrar.set_leaf(true);
+        Runtime::preregister_task_variant<refine_sweep_task<T, false> >(registrar, typed_name<T>("refine_sweep_omp"));
+    }
+
+    {
+        TaskVariantRegistrar registrar(task_id<T>(REFINE_COMPRESS_SWEEP_TASK_ID), typed_name<T>("refine_compress_sweep"));
+        registrar.add_constraint(ProcessorConstraint(Processor::OMP_PROC));
+        registrar.set_leaf(true);
+        Runtime::preregister_task_variant<refine_sweep_task<T, true> >(registrar, typed_name<T>("refine_compress_sweep_omp"));
+    }
+
+    {
+        TaskVariantRegistrar registrar(task_id<T>(COMPRESS_SWEEP_TASK_ID), typed_name<T>("compress_sweep"));
+        registrar.add_constraint(ProcessorConstraint(Processor::OMP_PROC));
+        registrar.set_leaf(true);
+        Runtime::preregister_task_variant<compress_sweep_task<T> >(registrar, typed_name<T>("compress_sweep_omp"));
+    }
+
+    {
+        TaskVariantRegistrar registrar(task_id<T>(RECONSTRUCT_SWEEP_TASK_ID), typed_name<T>("reconstruct_sweep"));
+        registrar.add_constraint(ProcessorConstraint(Processor::OMP_PROC));
+        registrar.set_leaf(true);
+        Runtime::preregister_task_variant<reconstruct_sweep_task<T> >(registrar, typed_name<T>("reconstruct_sweep_omp"));
+    }
+
+    {
+        TaskVariantRegistrar registrar(task_id<T>(EVAL_LEAF_TASK_ID), typed_name<T>("eval_leaf"));
+        registrar.add_constraint(ProcessorConstraint(Processor::OMP_PROC));
+        registrar.set_leaf(true);
+        Runtime::preregister_task_variant<EvalValues, eval_leaf_task<T> >(registrar, typed_name<T>("eval_leaf_omp"));
+    }
+
+    {
+        TaskVariantRegistrar registrar(task_id<T>(PROJECT_TASK_ID), typed_name<T>("project"));
+        registrar.add_constraint(ProcessorConstraint(Processor::OMP_PROC));
+        registrar.set_leaf(true);
+        Runtime::preregister_task_variant<ProjectFrontier, project_task<T> >(registrar, typed_name<T>("project_omp"));
+    }
+#endif
+
+    register_tree_op<T, NormOp<T> >("norm");
+    register_tree_op<T, MaxAbsOp<T> >("max_abs");
+    register_tree_op<T, InnerProductOp<T> >("inner_product");
+    register_tree_op<T, GaxpyOp<T> >("gaxpy");
+    register_tree_op<T, MultiplyOp<T> >("multiply");
+    register_tree_op<T, ScaleOp<T> >("scale");
+    register_tree_op<T, AbsOp<T> >("abs");
+    register_tree_op<T, GaxpyNormOp<T> >("gaxpy_norm");
+    register_tree_op<T, GaxpyCompressOp<T> >("gaxpy_compress");
+    register_tree_op<T, GaxpyCompressNormOp<T> >("gaxpy_compress_norm");
+}
+
+// Whether a task is one of the batched leaf tasks that do the work of a whole block of nodes
+bool is_leaf_block_task(TaskID id) {
+    if (id == GET_COEF_UTIL_TASK_ID)
+        return false;
+    int base = id % NUM_TASK_IDS;
+    if (base >= TREE_OP_TASK_ID)
+        return (base - TREE_OP_TASK_ID) % NUM_TREE_OP_STAGES != TREE_OP_WALK;
+    return base == REFINE_SWEEP_TASK_ID || base == REFINE_COMPRESS_SWEEP_TASK_ID || base == COMPRESS_SWEEP_TASK_ID ||
+           base == RECONSTRUCT_SWEEP_TASK_ID || base == COMPRESS_PATH_TASK_ID || base == EVAL_LEAF_TASK_ID ||
+           base == PROJECT_TASK_ID;
+}
+
+// Priorities CostMapper gives tasks by how much waits behind them. The get_coef chains of diff block on a
+// future at every step, and every walk level gates all the levels below it, so both run ahead of the wide,
+// independent leaf work (sets and leaf blocks), and upper walk levels run ahead of lower ones.
+enum TaskPriorities {
+    LEAF_WORK_PRIORITY = 0,
+    WALK_PRIORITY = 1, // plus MAX_PRIORITY_DEPTH minus the depth of the walk task
+    CHAIN_PRIORITY = 256,
+};
+
+#define MAX_PRIORITY_DEPTH 128
+
+// Whether a leaf block task also has an OMP_PROC variant (all but compress_path, whose block is one path)
+bool has_omp_variant(TaskID id) {
+    return is_leaf_block_task(id) && id % NUM_TASK_IDS != COMPRESS_PATH_TASK_ID;
+}
+
+bool is_walk_task(TaskID id) {
+    int base = id % NUM_TASK_IDS;
+    if (base >= TREE_OP_TASK_ID)
+        return (base - TREE_OP_TASK_ID) % NUM_TREE_OP_STAGES == TREE_OP_WALK;
+    return base == REFINE_TASK_ID || base == REFINE_COMPRESS_TASK_ID || base == COMPRESS_TASK_ID ||
+           base == RECONSTRUCT_TASK_ID || base == DIFF_TASK_ID || base == EVAL_TASK_ID;
+}
+
+bool is_chain_task(TaskID id) {
+    if (id == GET_COEF_UTIL_TASK_ID)
+        return true;
+    int base = id % NUM_TASK_IDS;
+    return base == READ_TASK_ID || base == GET_COEF_TASK_ID;
+}
+
+// Places tasks by the node counts their mapping tags carry (see cost_tag). Every tagged task goes to the
+// local CPU with the least work outstanding, the heavier child of an index launch first, so that a deep
+// branch and a shallow one do not share a core while another idles; the work a task was handed in is given
+// back when its profiling response reports it done. Leaf blocks can also be stolen by idle CPUs from the
+// most loaded one. Untagged tasks are left to the default mapper. Every task gets its priority
+// from TaskPriorities. Instances in system memory cover a whole tree and live as long as it does, so the
+// set, read, diff_set and compress_set tasks of every operation on a tree reuse the instance the first one
+// made instead of each allocating a tiny one for its node. Leaf blocks of at least omp_block_nodes nodes go
+// round robin to the local OpenMP processors when there are any, and smaller ones never do.
+class CostMapper : public Mapping::DefaultMapper {
+public:
+    CostMapper(Mapping::MapperRuntime *rt, Machine machine, Processor local)
+        : DefaultMapper(rt, machine, local, "cost_mapper") {}
+
+    virtual void select_task_options(const Mapping::MapperContext ctx, const Task &task, TaskOptions &output) {
+        DefaultMapper::select_task_options(ctx, task, output);
+        size_t cost = tag_cost(task.tag, 0);
+        if (!local_omps.empty() && has_omp_variant(task.task_id)) {
+            if (cost >= omp_block_nodes) {
+                std::lock_guard<std::mutex> guard(cpu_work_lock);
+                output.initial_proc = local_omps[next_omp++ % local_omps.size()];
+                return;
+            }
+            if (output.initial_proc.kind() == Processor::OMP_PROC)
+                output.initial_proc = default_get_next_local_cpu();
+        }
+        if (cost == 0 || local_cpus.size() < 2 || output.initial_proc.kind() != Processor::LOC_PROC)
+            return;
+        // the points of an index launch claim their CPUs in slice_task
+        if (task.is_index_space) {
+            output.initial_proc = claim_cpu(0);
+        } else {
+            output.initial_proc = claim_cpu(cost);
+            std::lock_guard<std::mutex> guard(cpu_work_lock);
+            single_claims[task.get_unique_id()] = cost;
+        }
+        output.stealable = is_leaf_block_task(task.task_id);
+    }
+
+    virtual void slice_task(const Mapping::MapperContext ctx, const Task &task, const SliceTaskInput &input, SliceTaskOutput &output) {
+        Rect<1> rect = input.domain;
+        size_t costs[2] = {tag_cost(task.tag, 0), tag_cost(task.tag, 1)};
+        if (rect.volume() != 2 || (costs[0] == 0 && costs[1] == 0) || local_cpus.size() < 2) {
+            DefaultMapper::slice_task(ctx, task, input, output);
+            return;
+        }
+        int heavier = costs[1] > costs[0] ? 1 : 0;
+        for (int i = 0; i < 2; i++) {
+            int side = i == 0 ? heavier : 1 - heavier;
+            coord_t point = rect.lo[0] + side;
+            output.slices.push_back(TaskSlice(Domain(Rect<1>(point, point)), claim_cpu(costs[side]), false, false));
+        }
+    }
+
+    // An idle CPU asks the one with the most work handed to it
+    virtual void select_steal_targets(const Mapping::MapperContext ctx, const SelectStealingInput &input, SelectStealingOutput &output) {
+        std::lock_guard<std::mutex> guard(cpu_work_lock);
+        Processor target = Processor::NO_PROC;
+        size_t most = 0;
+        for (size_t i = 0; i < local_cpus.size(); i++) {
+            Processor cpu = local_cpus[i];
+            if (cpu == local_proc || input.blacklist.count(cpu))
+                continue;
+            if (cpu_work[cpu] > most) {
+                most = cpu_work[cpu];
+                target = cpu;
+            }
+        }
+        if (target.exists())
+            output.targets.insert(target);
+    }
+
+    // Gives away up to half of the stealable leaf blocks, and their cost with them
+    virtual void permit_steal_request(const Mapping::MapperContext ctx, const StealRequestInput &input, StealRequestOutput &output) {
+        std::lock_guard<std::mutex> guard(cpu_work_lock);
+        size_t limit = (input.stealable_tasks.size() + 1) / 2;
+        for (size_t i = 0; i < input.stealable_tasks.size() && output.stolen_tasks.size() < limit; i++) {
+            const Task *task = input.stealable_tasks[i];
+            if (!is_leaf_block_task(task->task_id))
+                continue;
+            size_t cost = claimed_cost(*task);
+            cpu_work[local_proc] -= min(cpu_work[local_proc], cost);
+            cpu_work[input.thief_proc] += cost;
+            output.stolen_tasks.insert(task);
+        }
+    }
+
+    // The subtree launches of the replicated top levels go to the shards by position
+    virtual void select_sharding_functor(const Mapping::MapperContext ctx, const Task &task,
+                                         const SelectShardingFunctorInput &input, SelectShardingFunctorOutput &output) {
+        if (task.is_index_space && !task.regions.empty() && is_subtree_projection(task.regions[0].projection)) {
+            output.chosen_functor = SUBTREE_SHARDING_ID;
+            output.slice_recurse = false;
+            return;
+        }
+        DefaultMapper::select_sharding_functor(ctx, task, input, output);
+    }
+
+    // The region of an instance is the root of the tree the requirement is in, which the default mapper then
+    // finds for every later requirement on the tree
+    virtual LogicalRegion default_policy_select_instance_region(Mapping::MapperContext ctx, Memory target_memory,
+                                                                const RegionRequirement &req,
+                                                                const Mapping::LayoutConstraintSet &constraints,
+                                                                bool force_new_instances, bool meets_constraints) {
+        if (req.privilege == REDUCE || target_memory.kind() != Memory::SYSTEM_MEM)
+            return DefaultMapper::default_policy_select_instance_region(ctx, target_memory, req, constraints,
+                                                                        force_new_instances, meets_constraints);
+        LogicalRegion root = req.region;
+        while (runtime->has_parent_logical_partition(ctx, root))
+            root = runtime->get_parent_logical_region(ctx, runtime->get_parent_logical_partition(ctx, root));
+        const void *owned;
+        size_t owned_size;
+        if (runtime->retrieve_semantic_information(ctx, root, POOL_SEMANTIC_TAG, owned, owned_size, true, true)) {
+            std::lock_guard<std::mutex> guard(pool_trees_lock);
+            pool_trees.insert(root.get_tree_id());
+        }
+        return root;
+    }
+
+    // Instances of the trees TreePool owns are never collected while the tree is alive, destroying the tree
+    // region when the pool goes takes them along. Every other instance is collected as the default mapper has it.
+    virtual GCPriority default_policy_select_garbage_collection_priority(Mapping::MapperContext ctx, MappingKind kind,
+                                                                         Memory memory, const Mapping::PhysicalInstance &instance,
+                                                                         bool meets_fill_constraints, bool reduction) {
+        if (!reduction && memory.kind() == Memory::SYSTEM_MEM) {
+            std::lock_guard<std::mutex> guard(pool_trees_lock);
+            if (pool_trees.count(instance.get_tree_id()))
+                return LEGION_GC_NEVER_PRIORITY;
+        }
+        return DefaultMapper::default_policy_select_garbage_collection_priority(ctx, kind, memory, instance,
+                                                                               meets_fill_constraints, reduction);
+    }
+
+    // Asks to hear when a task that claimed work is done
+    virtual void map_task(const Mapping::MapperContext ctx, const Task &task, const MapTaskInput &input, MapTaskOutput &output) {
+        DefaultMapper::map_task(ctx, task, input, output);
+        std::lock_guard<std::mutex> guard(cpu_work_lock);
+        if (claimed_cost(task) > 0)
+            output.task_prof_requests.add_measurement<ProfilingMeasurements::OperationStatus>();
+    }
+
+    // The task is done: the CPU it ran on, which a steal may have changed, gets its work back
+    virtual void report_profiling(const Mapping::MapperContext ctx, const Task &task, const TaskProfilingInfo &input) {
+        std::lock_guard<std::mutex> guard(cpu_work_lock);
+        size_t cost = claimed_cost(task);
+        map<Processor, size_t>::iterator it = cpu_work.find(task.target_proc);
+        if (it != cpu_work.end())
+            it->second -= min(it->second, cost);
+        single_claims.erase(task.get_unique_id());
+    }
+
+    // Picked up by DefaultMapper::map_task. The walks recurse one task per level, so the task depth is the
+    // level of the node the walk is at.
+    virtual TaskPriority default_policy_select_task_priority(Mapping::MapperContext ctx, const Task &task) {
+        if (is_chain_task(task.task_id))
+            return CHAIN_PRIORITY;
+        if (is_walk_task(task.task_id))
+            return WALK_PRIORITY + (MAX_PRIORITY_DEPTH - min<int>(task.get_depth(), MAX_PRIORITY_DEPTH));
+        return LEAF_WORK_PRIORITY;
+    }
+
+private:
+    // The work a task was handed in with, under cpu_work_lock: slice_task hands each of the two points of a
+    // tagged launch its own cost, select_task_options a single task the cost of its tag
+    size_t claimed_cost(const Task &task) const {
+        if (task.is_index_space) {
+            Rect<1> rect = task.index_domain;
+            size_t costs[2] = {tag_cost(task.tag, 0), tag_cost(task.tag, 1)};
+            if (rect.volume() != 2 || (costs[0] == 0 && costs[1] == 0) || local_cpus.size() < 2)
+                return 0;
+            return costs[task.index_point[0] - rect.lo[0]];
+        }
+        map<UniqueID, size_t>::const_iterator it = single_claims.find(task.get_unique_id());
+        return it == single_claims.end() ? 0 : it->second;
+    }
+
+    Processor claim_cpu(size_t cost) {
+        std::lock_guard<std::mutex> guard(cpu_work_lock);
+        Processor best = local_cpus[0];
+        for (size_t i = 1; i < local_cpus.size(); i++) {
+            if (cpu_work[local_cpus[i]] < cpu_work[best])
+                best = local_cpus[i];
+        }
+        cpu_work[best] += cost;
+        return best;
+    }
+
+    /* work handed to every local CPU and not done yet, shared by the mappers of all of them */
+    static map<Processor, size_t> cpu_work;
+    static std::mutex cpu_work_lock;
+    /* cost claimed by every single task not done yet, under cpu_work_lock */
+    static map<UniqueID, size_t> single_claims;
+    /* round robin position over the local OpenMP processors, under cpu_work_lock */
+    static size_t next_omp;
+    /* region trees of the regions TreePool owns, found by default_policy_select_instance_region */
+    static set<RegionTreeID> pool_trees;
+    static std::mutex pool_trees_lock;
+};
+
+map<Processor, size_t> CostMapper::cpu_work;
+std::mutex CostMapper::cpu_work_lock;
+map<UniqueID, size_t> CostMapper::single_claims;
+size_t CostMapper::next_omp = 0;
+set<RegionTreeID> CostMapper::pool_trees;
+std::mutex CostMapper::pool_trees_lock;
+
+void register_mappers(Machine machine, Runtime *runtime, const std::set<Processor> &local_procs) {
+    for (std::set<Processor>::const_iterator it = local_procs.begin(); it != local_procs.end(); ++it)
+        runtime->replace_default_mapper(new CostMapper(runtime->get_mapper_runtime(), machine, *it), *it);
+}
+
+int main(int argc, char **argv)
+{
+    // The coefficient format shapes the field space and every accessor, so it is fixed here, on every process,
+    // before any task can run
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-order") == 0)
+            coef_format.order = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-coef_storage") == 0)
+            coef_format.storage = parse_coef_storage(argv[++i]);
+        else if (strcmp(argv[i], "-quant_rel_error") == 0) {
+            double bound = atof(argv[++i]);
+            coef_format.quant_bits = quant_bits_for_error(bound);
+            if (coef_format.quant_bits == 0) {
+                fprintf(stderr, "Relative quantization error %g is below %g, the bound of 16 bit mantissas\n", bound, 1.0 / 32767);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-sweep_levels") == 0) {
+            sweep_levels = atoi(argv[++i]);
+            sweep_cutoff_fixed = true;
+        } else if (strcmp(argv[i], "-sweep_nodes") == 0) {
+            sweep_nodes = atoll(argv[++i]);
+            sweep_cutoff_fixed = true;
+        } else if (strcmp(argv[i], "-shard_levels") == 0)
+            shard_levels = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-omp_block_nodes") == 0)
+            omp_block_nodes = atoll(argv[++i]);
+        else if (strcmp(argv[i], "-trace") == 0)
+            trace_path = argv[++i];
+        else if (strcmp(argv[i], "-trace_report") == 0)
+            return trace_report(argv[++i]);
+    }
+    assert(coef_format.order >= 1 && coef_format.order <= MAX_ORDER);
+    assert(sweep_levels >= 0 && sweep_levels <= MAX_SWEEP_LEVELS);
+    assert(shard_levels >= 0 && shard_levels <= MAX_SHARD_LEVELS);
+    build_two_scale_filter(coef_format.order, two_scale_filter_matrices);
+
+    Runtime::set_top_level_task_id(TOP_LEVEL_TASK_ID);
+
+    {
+        TaskVariantRegistrar registrar(TOP_LEVEL_TASK_ID, "top_level");
+        registrar.add_constraint(ProcessorConstraint(Processor::LOC_PROC));
+        registrar.set_replicable(true);
+        Runtime::preregister_task_variant<top_level_task>(registrar, "top_level");
+    }
+
+    Runtime::preregister_sharding_functor(SUBTREE_SHARDING_ID, new SubtreeShardingFunctor());
+    for (int levels = 1; levels <= MAX_SHARD_LEVELS; levels++)
+        Runtime::preregister_projection_functor(SUBTREE_PROJECTION_ID + levels - 1, new SubtreeProjectionFunctor(levels));
+
+    {
+        TaskVariantRegistrar registrar(CALIBRATION_TASK_ID, "calibration");
+        registrar.add_constraint(ProcessorConstraint(Processor::LOC_PROC));
+        registrar.set_leaf(true);
+        Runtime::preregister_task_variant<calibration_task>(registrar, "calibration");
+    }
+
+    {
+        TaskVariantRegistrar registrar(GET_COEF_UTIL_TASK_ID, "get_coef_util");
+        registrar.add_constraint(ProcessorConstraint(Processor::LOC_PROC));
+        registrar.set_inner(true);
+        Runtime::preregister_task_variant<ReturnGetCoefArguments, get_coef_util_task>(registrar, "get_coef_util");
+    }
+
+    register_coefficient_tasks<int>();
+    register_coefficient_tasks<float>();
+    register_coefficient_tasks<double>();
+
+    Runtime::add_registration_callback(register_mappers);
+
+    int result = Runtime::start(argc, argv);
+    if (trace_path != NULL)
+        flush_trace();
+    return result;
+}